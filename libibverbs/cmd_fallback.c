@@ -230,10 +230,10 @@ static int ioctl_write(struct ibv_context *ctx, unsigned int write_method,
 	return execute_ioctl(ctx, cmdb);
 }
 
-int _execute_cmd_write(struct ibv_context *ctx, unsigned int write_method,
-		       struct ib_uverbs_cmd_hdr *req, size_t core_req_size,
-		       size_t req_size, void *resp, size_t core_resp_size,
-		       size_t resp_size)
+static int execute_write(struct ibv_context *ctx, unsigned int write_method,
+			 struct ib_uverbs_cmd_hdr *req, size_t core_req_size,
+			 size_t req_size, void *resp, size_t core_resp_size,
+			 size_t resp_size)
 {
 	struct verbs_ex_private *priv = get_priv(ctx);
 
@@ -259,10 +259,10 @@ int _execute_cmd_write(struct ibv_context *ctx, unsigned int write_method,
  * req_size is the total length of the ex_hdr, core payload and driver data.
  * core_req_size is the total length of the ex_hdr and core_payload.
  */
-int _execute_cmd_write_ex(struct ibv_context *ctx, unsigned int write_method,
-		       struct ex_hdr *req, size_t core_req_size,
-		       size_t req_size, void *resp, size_t core_resp_size,
-		       size_t resp_size)
+static int execute_write_ex(struct ibv_context *ctx, unsigned int write_method,
+			    struct ex_hdr *req, size_t core_req_size,
+			    size_t req_size, void *resp, size_t core_resp_size,
+			    size_t resp_size)
 {
 	struct verbs_ex_private *priv = get_priv(ctx);
 
@@ -299,3 +299,29 @@ int _execute_cmd_write_ex(struct ibv_context *ctx, unsigned int write_method,
 		VALGRIND_MAKE_MEM_DEFINED(resp, resp_size);
 	return 0;
 }
+
+int _execute_cmd_write(struct ibv_context *ctx, unsigned int write_method,
+		       struct ib_uverbs_cmd_hdr *req, size_t core_req_size,
+		       size_t req_size, void *resp, size_t core_resp_size,
+		       size_t resp_size)
+{
+	uint64_t start = cmd_trace_start();
+
+	return cmd_trace_end(IBV_CMD_TRACE_WRITE, 0, write_method, start,
+			     execute_write(ctx, write_method, req,
+					   core_req_size, req_size, resp,
+					   core_resp_size, resp_size));
+}
+
+int _execute_cmd_write_ex(struct ibv_context *ctx, unsigned int write_method,
+		       struct ex_hdr *req, size_t core_req_size,
+		       size_t req_size, void *resp, size_t core_resp_size,
+		       size_t resp_size)
+{
+	uint64_t start = cmd_trace_start();
+
+	return cmd_trace_end(IBV_CMD_TRACE_WRITE_EX, 0, write_method, start,
+			     execute_write_ex(ctx, write_method, req,
+					      core_req_size, req_size, resp,
+					      core_resp_size, resp_size));
+}
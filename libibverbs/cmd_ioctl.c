@@ -128,6 +128,8 @@ static void finalize_attrs(struct ibv_command_buffer *cmd)
 int execute_ioctl(struct ibv_context *context, struct ibv_command_buffer *cmd)
 {
 	struct verbs_context *vctx = verbs_get_ctx(context);
+	uint64_t start;
+	int ret;
 
 	/*
 	 * One of the fill functions was given input that cannot be marshaled
@@ -144,8 +146,14 @@ int execute_ioctl(struct ibv_context *context, struct ibv_command_buffer *cmd)
 	cmd->hdr.reserved2 = 0;
 	cmd->hdr.driver_id = vctx->priv->driver_id;
 
-	if (ioctl(context->cmd_fd, RDMA_VERBS_IOCTL, &cmd->hdr))
-		return errno;
+	start = cmd_trace_start();
+	ret = ioctl(context->cmd_fd, RDMA_VERBS_IOCTL, &cmd->hdr) ? errno : 0;
+	cmd_trace_end(IBV_CMD_TRACE_IOCTL, cmd->hdr.object_id,
+		      cmd->hdr.method_id, start, ret);
+	if (ret) {
+		errno = ret;
+		return ret;
+	}
 
 	finalize_attrs(cmd);
 
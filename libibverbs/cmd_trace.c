@@ -0,0 +1,399 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <rdma/ib_user_ioctl_cmds.h>
+#include <rdma/ib_user_verbs.h>
+#include <ccan/array_size.h>
+#include <ccan/minmax.h>
+#include "ibverbs.h"
+
+/*
+ * Command tracing
+ *
+ * When RDMAV_CMD_TRACE is set every uverbs command sent to the kernel is
+ * timed.  The number of calls, the errors returned and a histogram of the
+ * latency are kept per command: ioctl commands are told apart by their
+ * object and method, write commands by their command number.  The totals are
+ * printed when the process exits, to the file named by RDMAV_CMD_TRACE or to
+ * stderr if it is empty, and can be read at any time with
+ * ibv_query_cmd_trace().
+ *
+ * Only the test of verbs_cmd_trace is left in the command path when tracing
+ * is off.
+ */
+#define CMD_TRACE_TABLE_SIZE	256
+
+bool verbs_cmd_trace;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ibv_cmd_trace_entry *trace_table;
+static const char *trace_path;
+
+static const char *const object_names[] = {
+	[UVERBS_OBJECT_DEVICE] = "DEVICE",
+	[UVERBS_OBJECT_PD] = "PD",
+	[UVERBS_OBJECT_COMP_CHANNEL] = "COMP_CHANNEL",
+	[UVERBS_OBJECT_CQ] = "CQ",
+	[UVERBS_OBJECT_QP] = "QP",
+	[UVERBS_OBJECT_SRQ] = "SRQ",
+	[UVERBS_OBJECT_AH] = "AH",
+	[UVERBS_OBJECT_MR] = "MR",
+	[UVERBS_OBJECT_MW] = "MW",
+	[UVERBS_OBJECT_FLOW] = "FLOW",
+	[UVERBS_OBJECT_XRCD] = "XRCD",
+	[UVERBS_OBJECT_RWQ_IND_TBL] = "RWQ_IND_TBL",
+	[UVERBS_OBJECT_WQ] = "WQ",
+	[UVERBS_OBJECT_FLOW_ACTION] = "FLOW_ACTION",
+	[UVERBS_OBJECT_DM] = "DM",
+	[UVERBS_OBJECT_COUNTERS] = "COUNTERS",
+	[UVERBS_OBJECT_ASYNC_EVENT] = "ASYNC_EVENT",
+};
+
+struct write_cmd {
+	const char *name;
+	uint32_t object_id;
+};
+
+#define WRITE_CMD(_cmd, _object)                                               \
+	[IB_USER_VERBS_CMD_##_cmd] = { #_cmd, UVERBS_OBJECT_##_object }
+
+static const struct write_cmd write_cmds[] = {
+	WRITE_CMD(GET_CONTEXT, DEVICE),
+	WRITE_CMD(QUERY_DEVICE, DEVICE),
+	WRITE_CMD(QUERY_PORT, DEVICE),
+	WRITE_CMD(ALLOC_PD, PD),
+	WRITE_CMD(DEALLOC_PD, PD),
+	WRITE_CMD(CREATE_AH, AH),
+	WRITE_CMD(MODIFY_AH, AH),
+	WRITE_CMD(QUERY_AH, AH),
+	WRITE_CMD(DESTROY_AH, AH),
+	WRITE_CMD(REG_MR, MR),
+	WRITE_CMD(REG_SMR, MR),
+	WRITE_CMD(REREG_MR, MR),
+	WRITE_CMD(QUERY_MR, MR),
+	WRITE_CMD(DEREG_MR, MR),
+	WRITE_CMD(ALLOC_MW, MW),
+	WRITE_CMD(BIND_MW, MW),
+	WRITE_CMD(DEALLOC_MW, MW),
+	WRITE_CMD(CREATE_COMP_CHANNEL, COMP_CHANNEL),
+	WRITE_CMD(CREATE_CQ, CQ),
+	WRITE_CMD(RESIZE_CQ, CQ),
+	WRITE_CMD(DESTROY_CQ, CQ),
+	WRITE_CMD(POLL_CQ, CQ),
+	WRITE_CMD(PEEK_CQ, CQ),
+	WRITE_CMD(REQ_NOTIFY_CQ, CQ),
+	WRITE_CMD(CREATE_QP, QP),
+	WRITE_CMD(QUERY_QP, QP),
+	WRITE_CMD(MODIFY_QP, QP),
+	WRITE_CMD(DESTROY_QP, QP),
+	WRITE_CMD(POST_SEND, QP),
+	WRITE_CMD(POST_RECV, QP),
+	WRITE_CMD(ATTACH_MCAST, QP),
+	WRITE_CMD(DETACH_MCAST, QP),
+	WRITE_CMD(CREATE_SRQ, SRQ),
+	WRITE_CMD(MODIFY_SRQ, SRQ),
+	WRITE_CMD(QUERY_SRQ, SRQ),
+	WRITE_CMD(DESTROY_SRQ, SRQ),
+	WRITE_CMD(POST_SRQ_RECV, SRQ),
+	WRITE_CMD(OPEN_XRCD, XRCD),
+	WRITE_CMD(CLOSE_XRCD, XRCD),
+	WRITE_CMD(CREATE_XSRQ, SRQ),
+	WRITE_CMD(OPEN_QP, QP),
+};
+
+#define WRITE_EX_CMD(_cmd, _object)                                            \
+	[IB_USER_VERBS_EX_CMD_##_cmd] = { #_cmd, UVERBS_OBJECT_##_object }
+
+static const struct write_cmd write_ex_cmds[] = {
+	WRITE_EX_CMD(QUERY_DEVICE, DEVICE),
+	WRITE_EX_CMD(CREATE_CQ, CQ),
+	WRITE_EX_CMD(CREATE_QP, QP),
+	WRITE_EX_CMD(MODIFY_QP, QP),
+	WRITE_EX_CMD(CREATE_FLOW, FLOW),
+	WRITE_EX_CMD(DESTROY_FLOW, FLOW),
+	WRITE_EX_CMD(CREATE_WQ, WQ),
+	WRITE_EX_CMD(MODIFY_WQ, WQ),
+	WRITE_EX_CMD(DESTROY_WQ, WQ),
+	WRITE_EX_CMD(CREATE_RWQ_IND_TBL, RWQ_IND_TBL),
+	WRITE_EX_CMD(DESTROY_RWQ_IND_TBL, RWQ_IND_TBL),
+	WRITE_EX_CMD(MODIFY_CQ, CQ),
+};
+
+static const struct write_cmd *find_write_cmd(uint32_t type,
+					      uint32_t write_method)
+{
+	const struct write_cmd *cmds = write_cmds;
+	size_t num = ARRAY_SIZE(write_cmds);
+
+	if (type == IBV_CMD_TRACE_WRITE_EX) {
+		cmds = write_ex_cmds;
+		num = ARRAY_SIZE(write_ex_cmds);
+	}
+
+	if (write_method >= num || !cmds[write_method].name)
+		return NULL;
+	return &cmds[write_method];
+}
+
+uint64_t cmd_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct ibv_cmd_trace_entry *get_entry(uint32_t type,
+					     uint32_t object_id,
+					     uint32_t method_id)
+{
+	struct ibv_cmd_trace_entry *entry;
+	unsigned int i, idx;
+
+	idx = (type * 31 + object_id * 17 + method_id) % CMD_TRACE_TABLE_SIZE;
+	for (i = 0; i < CMD_TRACE_TABLE_SIZE; i++) {
+		entry = &trace_table[(idx + i) % CMD_TRACE_TABLE_SIZE];
+		if (!entry->count) {
+			entry->type = type;
+			entry->object_id = object_id;
+			entry->method_id = method_id;
+			entry->min_ns = UINT64_MAX;
+			return entry;
+		}
+		if (entry->type == type && entry->object_id == object_id &&
+		    entry->method_id == method_id)
+			return entry;
+	}
+	return NULL;
+}
+
+static void record_errno(struct ibv_cmd_trace_entry *entry, int ret)
+{
+	unsigned int i;
+
+	entry->errors++;
+	for (i = 0; i < IBV_CMD_TRACE_ERRNOS; i++) {
+		if (!entry->errnos[i].count)
+			entry->errnos[i].err = ret;
+		if (entry->errnos[i].err == ret) {
+			entry->errnos[i].count++;
+			return;
+		}
+	}
+}
+
+void __cmd_trace_record(uint32_t type, uint32_t object_id, uint32_t method_id,
+			uint64_t start, int ret)
+{
+	uint64_t ns = cmd_trace_now() - start;
+	struct ibv_cmd_trace_entry *entry;
+	const struct write_cmd *cmd;
+	unsigned int bucket;
+
+	/* Commands sent with UVERBS_METHOD_INVOKE_WRITE are traced as writes */
+	if (type == IBV_CMD_TRACE_IOCTL &&
+	    object_id == UVERBS_OBJECT_DEVICE &&
+	    method_id == UVERBS_METHOD_INVOKE_WRITE)
+		return;
+
+	if (type != IBV_CMD_TRACE_IOCTL) {
+		cmd = find_write_cmd(type, method_id);
+		object_id = cmd ? cmd->object_id : UVERBS_OBJECT_DEVICE;
+	}
+
+	bucket = min_t(unsigned int, 63 - __builtin_clzll(ns | 1),
+		       IBV_CMD_TRACE_BUCKETS - 1);
+
+	pthread_mutex_lock(&trace_lock);
+	entry = get_entry(type, object_id, method_id);
+	if (entry) {
+		entry->count++;
+		entry->total_ns += ns;
+		entry->min_ns = min(entry->min_ns, ns);
+		entry->max_ns = max(entry->max_ns, ns);
+		entry->hist[bucket]++;
+		if (ret)
+			record_errno(entry, ret);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+int ibv_query_cmd_trace(struct ibv_cmd_trace_entry *entries,
+			size_t *num_entries)
+{
+	size_t i, cnt = 0;
+
+	if (!verbs_cmd_trace)
+		return EOPNOTSUPP;
+
+	pthread_mutex_lock(&trace_lock);
+	for (i = 0; i < CMD_TRACE_TABLE_SIZE; i++) {
+		if (!trace_table[i].count)
+			continue;
+		if (cnt < *num_entries)
+			entries[cnt] = trace_table[i];
+		cnt++;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	*num_entries = cnt;
+	return 0;
+}
+
+/* The upper bound of the histogram bucket holding the given fraction */
+static double percentile_us(const struct ibv_cmd_trace_entry *entry,
+			    double fraction)
+{
+	uint64_t target = entry->count * fraction;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < IBV_CMD_TRACE_BUCKETS; i++) {
+		seen += entry->hist[i];
+		if (seen > target)
+			break;
+	}
+	return min((double) (2ULL << i), (double) entry->max_ns) / 1000;
+}
+
+static void print_object(FILE *fp, uint32_t object_id)
+{
+	if (object_id < ARRAY_SIZE(object_names) && object_names[object_id])
+		fprintf(fp, "%-12s ", object_names[object_id]);
+	else
+		fprintf(fp, "0x%-10x ", object_id);
+}
+
+static void print_entry(FILE *fp, const struct ibv_cmd_trace_entry *entry)
+{
+	static const char *const types[] = {
+		[IBV_CMD_TRACE_IOCTL] = "ioctl",
+		[IBV_CMD_TRACE_WRITE] = "write",
+		[IBV_CMD_TRACE_WRITE_EX] = "write_ex",
+	};
+	const struct write_cmd *cmd;
+	char name[32];
+	unsigned int i;
+
+	if (entry->type == IBV_CMD_TRACE_IOCTL) {
+		snprintf(name, sizeof(name), "method %u", entry->method_id);
+	} else {
+		cmd = find_write_cmd(entry->type, entry->method_id);
+		if (cmd)
+			snprintf(name, sizeof(name), "%s", cmd->name);
+		else
+			snprintf(name, sizeof(name), "cmd %u",
+				 entry->method_id);
+	}
+
+	fprintf(fp, "%-8s ", types[entry->type]);
+	print_object(fp, entry->object_id);
+	fprintf(fp, "%-20s %8" PRIu64 " %8" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f",
+		name, entry->count, entry->errors,
+		(double) entry->total_ns / entry->count / 1000,
+		(double) entry->min_ns / 1000, percentile_us(entry, 0.5),
+		percentile_us(entry, 0.99), (double) entry->max_ns / 1000);
+
+	for (i = 0; i < IBV_CMD_TRACE_ERRNOS && entry->errnos[i].count; i++)
+		fprintf(fp, " %s:%u", strerror(entry->errnos[i].err),
+			entry->errnos[i].count);
+	fprintf(fp, "\n");
+}
+
+/* Per object totals reuse the entry layout, so percentiles come out alike */
+static void add_object(struct ibv_cmd_trace_entry *object,
+		       const struct ibv_cmd_trace_entry *entry)
+{
+	unsigned int i;
+
+	object->count += entry->count;
+	object->errors += entry->errors;
+	object->total_ns += entry->total_ns;
+	object->max_ns = max(object->max_ns, entry->max_ns);
+	for (i = 0; i < IBV_CMD_TRACE_BUCKETS; i++)
+		object->hist[i] += entry->hist[i];
+}
+
+static void print_trace(FILE *fp)
+{
+	struct ibv_cmd_trace_entry objects[ARRAY_SIZE(object_names)] = {};
+	struct ibv_cmd_trace_entry *entry;
+	unsigned int i;
+
+	fprintf(fp, PFX "uverbs command latency of process %d, in usec\n",
+		getpid());
+	fprintf(fp, "%-8s %-12s %-20s %8s %8s %10s %10s %10s %10s %10s\n",
+		"type", "object", "command", "count", "errors", "avg", "min",
+		"p50", "p99", "max");
+
+	pthread_mutex_lock(&trace_lock);
+	for (i = 0; i < CMD_TRACE_TABLE_SIZE; i++) {
+		entry = &trace_table[i];
+		if (!entry->count)
+			continue;
+
+		print_entry(fp, entry);
+		if (entry->object_id < ARRAY_SIZE(objects))
+			add_object(&objects[entry->object_id], entry);
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	fprintf(fp, "%-12s %8s %8s %12s %10s %10s %10s\n", "object", "count",
+		"errors", "total_ms", "p50", "p99", "max");
+	for (i = 0; i < ARRAY_SIZE(objects); i++) {
+		if (!objects[i].count)
+			continue;
+		print_object(fp, i);
+		fprintf(fp, "%8" PRIu64 " %8" PRIu64 " %12.3f %10.1f %10.1f %10.1f\n",
+			objects[i].count, objects[i].errors,
+			(double) objects[i].total_ns / 1000000,
+			percentile_us(&objects[i], 0.5),
+			percentile_us(&objects[i], 0.99),
+			(double) objects[i].max_ns / 1000);
+	}
+}
+
+static void cmd_trace_exit(void)
+{
+	FILE *fp = stderr;
+
+	if (*trace_path) {
+		fp = fopen(trace_path, "a");
+		if (!fp) {
+			fprintf(stderr, PFX "Warning: couldn't open %s: %m\n",
+				trace_path);
+			return;
+		}
+	}
+
+	print_trace(fp);
+	if (fp != stderr)
+		fclose(fp);
+}
+
+void cmd_trace_init(void)
+{
+	trace_path = getenv("RDMAV_CMD_TRACE");
+	if (!trace_path || verbs_cmd_trace)
+		return;
+
+	trace_table = calloc(CMD_TRACE_TABLE_SIZE, sizeof(*trace_table));
+	if (!trace_table)
+		return;
+
+	if (atexit(cmd_trace_exit)) {
+		free(trace_table);
+		return;
+	}
+	verbs_cmd_trace = true;
+}
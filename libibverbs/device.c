@@ -216,6 +216,8 @@ static bool has_ioctl_write(struct ibv_context *ctx)
 	DECLARE_COMMAND_BUFFER(cmdb, UVERBS_OBJECT_DEVICE,
 			       UVERBS_METHOD_INVOKE_WRITE, 1);
 
+	if (ctx->cmd_fd < 0)
+		return false;
 	if (VERBS_IOCTL_ONLY)
 		return true;
 	if (VERBS_WRITE_ONLY)
@@ -264,6 +266,7 @@ int verbs_init_context(struct verbs_context *context_ex,
 	}
 
 	context_ex->priv->driver_id = driver_id;
+	pthread_mutex_init(&context_ex->priv->cache_lock, NULL);
 	verbs_set_ops(context_ex, &verbs_dummy_ops);
 	context_ex->priv->use_ioctl_write = has_ioctl_write(context);
 
@@ -340,12 +343,17 @@ struct ibv_context *verbs_open_device(struct ibv_device *device, void *private_d
 
 	/*
 	 * We'll only be doing writes, but we need O_RDWR in case the
-	 * provider needs to mmap() the file.
+	 * provider needs to mmap() the file.  Software devices have no
+	 * character device, and so no command channel.
 	 */
-	cmd_fd = open_cdev(verbs_device->sysfs->sysfs_name,
-			   verbs_device->sysfs->sysfs_cdev);
-	if (cmd_fd < 0)
-		return NULL;
+	if (verbs_device->sysfs->flags & VSYSFS_SOFT_DEVICE) {
+		cmd_fd = -1;
+	} else {
+		cmd_fd = open_cdev(verbs_device->sysfs->sysfs_name,
+				   verbs_device->sysfs->sysfs_cdev);
+		if (cmd_fd < 0)
+			return NULL;
+	}
 
 	/*
 	 * cmd_fd ownership is transferred into alloc_context, if it fails
@@ -369,8 +377,11 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 
 void verbs_uninit_context(struct verbs_context *context_ex)
 {
+	port_cache_free(context_ex->priv);
+	pthread_mutex_destroy(&context_ex->priv->cache_lock);
 	free(context_ex->priv);
-	close(context_ex->context.cmd_fd);
+	if (context_ex->context.cmd_fd != -1)
+		close(context_ex->context.cmd_fd);
 	if (context_ex->context.async_fd != -1)
 		close(context_ex->context.async_fd);
 	ibverbs_device_put(context_ex->context.device);
@@ -393,6 +404,7 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 {
 	struct ib_uverbs_async_event_desc ev;
 
+	port_cache_async_reader(context);
 	if (read(context->async_fd, &ev, sizeof ev) != sizeof ev)
 		return -1;
 
@@ -424,6 +436,7 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 		break;
 	default:
 		event->element.port_num = ev.element;
+		port_cache_event(context, event);
 		break;
 	}
 
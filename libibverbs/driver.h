@@ -183,6 +183,8 @@ enum {
 	VSYSFS_READ_MODALIAS = 1 << 0,
 	VSYSFS_READ_NODE_GUID = 1 << 1,
 	VSYSFS_READ_FW_VER = 1 << 2,
+	/* Implemented in userspace, there is no kernel device behind it */
+	VSYSFS_SOFT_DEVICE = 1 << 3,
 };
 
 /* A rdma device detected in sysfs */
@@ -41,6 +41,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <ccan/array_size.h>
 #include <ccan/list.h>
 
 #include "ibverbs.h"
@@ -51,6 +52,30 @@ struct ibv_driver_name {
 };
 
 static LIST_HEAD(driver_name_list);
+static bool config_read;
+static bool env_drivers_loaded;
+
+/*
+ * The provider of each kernel driver, for drivers that report their id.
+ * This lets only the providers of the devices present be loaded.
+ */
+static const char *const provider_names[] = {
+	[RDMA_DRIVER_MLX5] = "mlx5",
+	[RDMA_DRIVER_MLX4] = "mlx4",
+	[RDMA_DRIVER_CXGB4] = "cxgb4",
+	[RDMA_DRIVER_MTHCA] = "mthca",
+	[RDMA_DRIVER_BNXT_RE] = "bnxt_re",
+	[RDMA_DRIVER_OCRDMA] = "ocrdma",
+	[RDMA_DRIVER_I40IW] = "i40iw",
+	[RDMA_DRIVER_VMW_PVRDMA] = "vmw_pvrdma",
+	[RDMA_DRIVER_QEDR] = "qedr",
+	[RDMA_DRIVER_HNS] = "hns",
+	[RDMA_DRIVER_RXE] = "rxe",
+	[RDMA_DRIVER_HFI1] = "hfi1verbs",
+	[RDMA_DRIVER_QIB] = "ipathverbs",
+	[RDMA_DRIVER_EFA] = "efa",
+	[RDMA_DRIVER_SIW] = "siw",
+};
 
 static void read_config_file(const char *path)
 {
@@ -209,13 +234,19 @@ out_dlopen:
 	free(so_name);
 }
 
-void load_drivers(void)
+static void load_env_drivers(void)
 {
-	struct ibv_driver_name *name, *next_name;
 	const char *env;
 	char *list, *env_name;
 
-	read_config();
+	if (!config_read) {
+		read_config();
+		config_read = true;
+	}
+
+	if (env_drivers_loaded)
+		return;
+	env_drivers_loaded = true;
 
 	/* Only use drivers passed in through the calling user's environment
 	 * if we're not running setuid.
@@ -231,11 +262,74 @@ void load_drivers(void)
 				load_driver(env_name);
 		}
 	}
+}
 
-	list_for_each_safe (&driver_name_list, name, next_name, entry) {
-		load_driver(name->name);
-		free(name->name);
-		free(name);
+/* A configured name is either a provider name or the path of its library */
+static bool is_provider(const char *name, const char *provider)
+{
+	const char *base = strrchr(name, '/');
+
+	if (base) {
+		base++;
+		if (!strncmp(base, "lib", 3))
+			base += 3;
+	} else {
+		base = name;
+	}
+	return !strcmp(base, provider);
+}
+
+static void load_driver_name(struct ibv_driver_name *name)
+{
+	load_driver(name->name);
+	list_del(&name->entry);
+	free(name->name);
+	free(name);
+}
+
+void load_drivers(void)
+{
+	struct ibv_driver_name *name, *next_name;
+
+	load_env_drivers();
+
+	list_for_each_safe (&driver_name_list, name, next_name, entry)
+		load_driver_name(name);
+}
+
+static const char *sysfs_dev_provider(struct verbs_sysfs_dev *sysfs_dev)
+{
+	/* Software devices have no kernel driver */
+	if (sysfs_dev->flags & VSYSFS_SOFT_DEVICE)
+		return "softverbs";
+
+	if (sysfs_dev->driver_id >= ARRAY_SIZE(provider_names))
+		return NULL;
+	return provider_names[sysfs_dev->driver_id];
+}
+
+/*
+ * Load the configured providers of the kernel drivers of the devices in
+ * sysfs_list, leaving the others unloaded.  Devices whose driver does not
+ * report its id are matched once every provider is loaded.
+ */
+void load_drivers_for(struct list_head *sysfs_list)
+{
+	struct ibv_driver_name *name, *next_name;
+	struct verbs_sysfs_dev *sysfs_dev;
+	const char *provider;
+
+	load_env_drivers();
+
+	list_for_each(sysfs_list, sysfs_dev, entry) {
+		provider = sysfs_dev_provider(sysfs_dev);
+		if (!provider)
+			continue;
+
+		list_for_each_safe (&driver_name_list, name, next_name, entry) {
+			if (is_provider(name->name, provider))
+				load_driver_name(name);
+		}
 	}
 }
 #endif
@@ -0,0 +1,622 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <infiniband/verbs.h>
+
+#include <ccan/minmax.h>
+
+/*
+ * Measures the cost of the data path verbs themselves: a QP sends to a
+ * second QP of the same device, and the time spent in ibv_post_send,
+ * ibv_poll_cq and ibv_post_recv is reported per call and per work request.
+ */
+#define BENCH_MAX_BATCH	256
+
+enum bench_op {
+	BENCH_SEND,
+	BENCH_WRITE,
+	BENCH_READ,
+};
+
+static const char *const op_names[] = {
+	[BENCH_SEND] = "send",
+	[BENCH_WRITE] = "write",
+	[BENCH_READ] = "read",
+};
+
+struct bench_context {
+	struct ibv_context	*context;
+	struct ibv_pd		*pd;
+	struct ibv_mr		*mr;
+	struct ibv_cq		*scq;
+	struct ibv_cq		*rcq;
+	/* qp[0] posts the requests, qp[1] receives them */
+	struct ibv_qp		*qp[2];
+	struct ibv_qp_ex	*qpx;
+	char			*buf;
+	unsigned int		 size;
+	unsigned int		 batch;
+	unsigned int		 depth;
+	enum bench_op		 op;
+	int			 use_wr_api;
+	struct ibv_send_wr	 wr[BENCH_MAX_BATCH];
+	struct ibv_recv_wr	 rwr[BENCH_MAX_BATCH];
+	struct ibv_sge		 sge;
+	struct ibv_sge		 rsge;
+};
+
+struct bench_stats {
+	uint64_t		 post_ns;
+	uint64_t		 post_calls;
+	uint64_t		 posted;
+	uint64_t		 poll_ns;
+	uint64_t		 poll_calls;
+	uint64_t		 polled;
+	uint64_t		 recv_ns;
+	uint64_t		 recv_posted;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_qps(struct bench_context *ctx, int ib_port, int gidx)
+{
+	struct ibv_port_attr port_attr;
+	union ibv_gid gid;
+	int i;
+
+	if (ibv_query_port(ctx->context, ib_port, &port_attr)) {
+		fprintf(stderr, "Couldn't get port info\n");
+		return 1;
+	}
+	if (gidx >= 0 && ibv_query_gid(ctx->context, ib_port, gidx, &gid)) {
+		fprintf(stderr, "Can't read sgid of index %d\n", gidx);
+		return 1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct ibv_qp_attr attr = {
+			.qp_state		= IBV_QPS_INIT,
+			.pkey_index		= 0,
+			.port_num		= ib_port,
+			.qp_access_flags	= IBV_ACCESS_REMOTE_WRITE |
+						  IBV_ACCESS_REMOTE_READ,
+		};
+
+		if (ibv_modify_qp(ctx->qp[i], &attr,
+				  IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+				  IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+			fprintf(stderr, "Failed to modify QP to INIT\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct ibv_qp_attr attr = {
+			.qp_state		= IBV_QPS_RTR,
+			.path_mtu		= port_attr.active_mtu,
+			.dest_qp_num		= ctx->qp[!i]->qp_num,
+			.rq_psn			= 0,
+			.max_dest_rd_atomic	= 1,
+			.min_rnr_timer		= 12,
+			.ah_attr		= {
+				.dlid		= port_attr.lid,
+				.port_num	= ib_port,
+			},
+		};
+
+		if (gidx >= 0) {
+			attr.ah_attr.is_global = 1;
+			attr.ah_attr.grh.hop_limit = 1;
+			attr.ah_attr.grh.dgid = gid;
+			attr.ah_attr.grh.sgid_index = gidx;
+		}
+
+		if (ibv_modify_qp(ctx->qp[i], &attr,
+				  IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+				  IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+				  IBV_QP_MAX_DEST_RD_ATOMIC |
+				  IBV_QP_MIN_RNR_TIMER)) {
+			fprintf(stderr, "Failed to modify QP to RTR\n");
+			return 1;
+		}
+
+		attr.qp_state = IBV_QPS_RTS;
+		attr.timeout = 14;
+		attr.retry_cnt = 7;
+		attr.rnr_retry = 7;
+		attr.sq_psn = 0;
+		attr.max_rd_atomic = 1;
+		if (ibv_modify_qp(ctx->qp[i], &attr,
+				  IBV_QP_STATE | IBV_QP_TIMEOUT |
+				  IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+				  IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC)) {
+			fprintf(stderr, "Failed to modify QP to RTS\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static struct bench_context *init_ctx(struct ibv_device *ib_dev,
+				      unsigned int size, unsigned int batch,
+				      enum bench_op op, int use_wr_api)
+{
+	struct bench_context *ctx;
+	unsigned int i;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->size = size;
+	ctx->batch = batch;
+	ctx->depth = 2 * batch;
+	ctx->op = op;
+	ctx->use_wr_api = use_wr_api;
+
+	ctx->buf = memalign(sysconf(_SC_PAGESIZE), 2 * size);
+	if (!ctx->buf) {
+		fprintf(stderr, "Couldn't allocate work buf.\n");
+		goto clean_ctx;
+	}
+	memset(ctx->buf, 0x7b, 2 * size);
+
+	ctx->context = ibv_open_device(ib_dev);
+	if (!ctx->context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(ib_dev));
+		goto clean_buffer;
+	}
+
+	ctx->pd = ibv_alloc_pd(ctx->context);
+	if (!ctx->pd) {
+		fprintf(stderr, "Couldn't allocate PD\n");
+		goto clean_device;
+	}
+
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, 2 * size,
+			     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+			     IBV_ACCESS_REMOTE_READ);
+	if (!ctx->mr) {
+		fprintf(stderr, "Couldn't register MR\n");
+		goto clean_pd;
+	}
+
+	ctx->scq = ibv_create_cq(ctx->context, ctx->depth, NULL, NULL, 0);
+	ctx->rcq = ibv_create_cq(ctx->context, ctx->depth, NULL, NULL, 0);
+	if (!ctx->scq || !ctx->rcq) {
+		fprintf(stderr, "Couldn't create CQ\n");
+		goto clean_cq;
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct ibv_qp_init_attr_ex attr = {
+			.send_cq = i ? ctx->rcq : ctx->scq,
+			.recv_cq = i ? ctx->rcq : ctx->scq,
+			.cap	 = {
+				.max_send_wr  = ctx->depth,
+				.max_recv_wr  = ctx->depth,
+				.max_send_sge = 1,
+				.max_recv_sge = 1,
+			},
+			.qp_type = IBV_QPT_RC,
+			.comp_mask = IBV_QP_INIT_ATTR_PD,
+			.pd = ctx->pd,
+		};
+
+		if (!i && use_wr_api) {
+			attr.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+			attr.send_ops_flags = IBV_QP_EX_WITH_SEND |
+					      IBV_QP_EX_WITH_RDMA_WRITE |
+					      IBV_QP_EX_WITH_RDMA_READ;
+		}
+
+		ctx->qp[i] = ibv_create_qp_ex(ctx->context, &attr);
+		if (!ctx->qp[i]) {
+			fprintf(stderr, "Couldn't create QP\n");
+			goto clean_qp;
+		}
+	}
+
+	if (use_wr_api)
+		ctx->qpx = ibv_qp_to_qp_ex(ctx->qp[0]);
+
+	/* Sends and WRITEs go from the first half of the buffer to the second */
+	ctx->sge.addr = (uintptr_t) (op == BENCH_READ ? ctx->buf + size :
+							ctx->buf);
+	ctx->sge.length = size;
+	ctx->sge.lkey = ctx->mr->lkey;
+	for (i = 0; i < batch; i++) {
+		struct ibv_send_wr *wr = &ctx->wr[i];
+
+		wr->wr_id = i;
+		wr->sg_list = &ctx->sge;
+		wr->num_sge = 1;
+		wr->send_flags = IBV_SEND_SIGNALED;
+		wr->next = i + 1 < batch ? &ctx->wr[i + 1] : NULL;
+		if (op == BENCH_SEND) {
+			wr->opcode = IBV_WR_SEND;
+			continue;
+		}
+		wr->opcode = op == BENCH_WRITE ? IBV_WR_RDMA_WRITE :
+						 IBV_WR_RDMA_READ;
+		wr->wr.rdma.rkey = ctx->mr->rkey;
+		wr->wr.rdma.remote_addr = (uintptr_t) (op == BENCH_READ ?
+						       ctx->buf :
+						       ctx->buf + size);
+	}
+
+	ctx->rsge.addr = (uintptr_t) (ctx->buf + size);
+	ctx->rsge.length = size;
+	ctx->rsge.lkey = ctx->mr->lkey;
+	for (i = 0; i < batch; i++) {
+		ctx->rwr[i].wr_id = i;
+		ctx->rwr[i].sg_list = &ctx->rsge;
+		ctx->rwr[i].num_sge = 1;
+		ctx->rwr[i].next = i + 1 < batch ? &ctx->rwr[i + 1] : NULL;
+	}
+
+	return ctx;
+
+clean_qp:
+	for (i = 0; i < 2; i++)
+		if (ctx->qp[i])
+			ibv_destroy_qp(ctx->qp[i]);
+clean_cq:
+	if (ctx->rcq)
+		ibv_destroy_cq(ctx->rcq);
+	if (ctx->scq)
+		ibv_destroy_cq(ctx->scq);
+	ibv_dereg_mr(ctx->mr);
+clean_pd:
+	ibv_dealloc_pd(ctx->pd);
+clean_device:
+	ibv_close_device(ctx->context);
+clean_buffer:
+	free(ctx->buf);
+clean_ctx:
+	free(ctx);
+	return NULL;
+}
+
+static void close_ctx(struct bench_context *ctx)
+{
+	ibv_destroy_qp(ctx->qp[1]);
+	ibv_destroy_qp(ctx->qp[0]);
+	ibv_destroy_cq(ctx->rcq);
+	ibv_destroy_cq(ctx->scq);
+	ibv_dereg_mr(ctx->mr);
+	ibv_dealloc_pd(ctx->pd);
+	ibv_close_device(ctx->context);
+	free(ctx->buf);
+	free(ctx);
+}
+
+static int post_recv(struct bench_context *ctx, unsigned int n,
+		     struct bench_stats *st)
+{
+	struct ibv_recv_wr *bad_wr;
+	uint64_t start;
+	int ret;
+
+	ctx->rwr[n - 1].next = NULL;
+	start = now_ns();
+	ret = ibv_post_recv(ctx->qp[1], &ctx->rwr[0], &bad_wr);
+	st->recv_ns += now_ns() - start;
+	ctx->rwr[n - 1].next = n < ctx->batch ? &ctx->rwr[n] : NULL;
+
+	if (ret) {
+		fprintf(stderr, "Couldn't post receive (%d)\n", ret);
+		return 1;
+	}
+	st->recv_posted += n;
+	return 0;
+}
+
+static int post_wr_api(struct bench_context *ctx, unsigned int n)
+{
+	struct ibv_qp_ex *qpx = ctx->qpx;
+	uint64_t raddr = ctx->wr[0].wr.rdma.remote_addr;
+	uint32_t rkey = ctx->mr->rkey;
+	unsigned int i;
+
+	ibv_wr_start(qpx);
+	for (i = 0; i < n; i++) {
+		qpx->wr_id = i;
+		qpx->wr_flags = IBV_SEND_SIGNALED;
+		switch (ctx->op) {
+		case BENCH_SEND:
+			ibv_wr_send(qpx);
+			break;
+		case BENCH_WRITE:
+			ibv_wr_rdma_write(qpx, rkey, raddr);
+			break;
+		case BENCH_READ:
+			ibv_wr_rdma_read(qpx, rkey, raddr);
+			break;
+		}
+		ibv_wr_set_sge(qpx, ctx->sge.lkey, ctx->sge.addr,
+			       ctx->sge.length);
+	}
+	return ibv_wr_complete(qpx);
+}
+
+static int post_send(struct bench_context *ctx, unsigned int n,
+		     struct bench_stats *st)
+{
+	struct ibv_send_wr *bad_wr;
+	uint64_t start;
+	int ret;
+
+	start = now_ns();
+	if (ctx->use_wr_api) {
+		ret = post_wr_api(ctx, n);
+	} else {
+		ctx->wr[n - 1].next = NULL;
+		ret = ibv_post_send(ctx->qp[0], &ctx->wr[0], &bad_wr);
+		ctx->wr[n - 1].next = n < ctx->batch ? &ctx->wr[n] : NULL;
+	}
+	st->post_ns += now_ns() - start;
+
+	if (ret) {
+		fprintf(stderr, "Couldn't post send (%d)\n", ret);
+		return 1;
+	}
+	st->post_calls++;
+	st->posted += n;
+	return 0;
+}
+
+static int poll_one(struct bench_context *ctx, struct ibv_cq *cq,
+		struct bench_stats *st)
+{
+	struct ibv_wc wc[BENCH_MAX_BATCH];
+	uint64_t start;
+	int i, ne;
+
+	start = now_ns();
+	ne = ibv_poll_cq(cq, ctx->batch, wc);
+	st->poll_ns += now_ns() - start;
+	st->poll_calls++;
+
+	if (ne < 0) {
+		fprintf(stderr, "poll CQ failed %d\n", ne);
+		return -1;
+	}
+
+	for (i = 0; i < ne; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+				ibv_wc_status_str(wc[i].status),
+				wc[i].status, (int) wc[i].wr_id);
+			return -1;
+		}
+	}
+	st->polled += ne;
+	return ne;
+}
+
+static int run(struct bench_context *ctx, unsigned int iters,
+	       struct bench_stats *st)
+{
+	unsigned int recv_target = ctx->op == BENCH_SEND ? iters : 0;
+	unsigned int posted = 0, scomp = 0, rcomp = 0;
+	int ne;
+
+	if (recv_target && post_recv(ctx, min(ctx->batch, iters), st))
+		return 1;
+	if (recv_target && iters > ctx->batch &&
+	    post_recv(ctx, min(ctx->batch, iters - ctx->batch), st))
+		return 1;
+
+	while (scomp < iters || rcomp < recv_target) {
+		if (posted < iters && posted - scomp + ctx->batch <= ctx->depth &&
+		    post_send(ctx, min(ctx->batch, iters - posted), st))
+			return 1;
+		posted = st->posted;
+
+		ne = poll_one(ctx, ctx->scq, st);
+		if (ne < 0)
+			return 1;
+		scomp += ne;
+
+		/* The receiving QP is polled even without receives, so that
+		 * devices that rely on the CQ for progress make progress.
+		 */
+		ne = poll_one(ctx, ctx->rcq, st);
+		if (ne < 0)
+			return 1;
+		rcomp += ne;
+		if (ne && st->recv_posted < recv_target &&
+		    post_recv(ctx, min_t(unsigned int, ne,
+					 recv_target - st->recv_posted), st))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            measure the data path verbs of a device\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+	printf("  -g, --gid-idx=<gid index> local port gid index\n");
+	printf("  -n, --iters=<iters>    number of work requests to post (default 100000)\n");
+	printf("  -s, --size=<size>      size of each work request (default 64)\n");
+	printf("  -t, --type=<op>        send, write or read (default send)\n");
+	printf("  -b, --batch=<num>      work requests per post call (default 16)\n");
+	printf("  -w, --wr-api           post with the ibv_wr_* interface\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device      **dev_list;
+	struct ibv_device	*ib_dev;
+	struct bench_context	*ctx;
+	struct bench_stats	 st = {};
+	char                    *ib_devname = NULL;
+	int                      ib_port = 1;
+	int			 gidx = -1;
+	unsigned int             iters = 100000;
+	unsigned int             size = 64;
+	unsigned int             batch = 16;
+	enum bench_op		 op = BENCH_SEND;
+	int			 use_wr_api = 0;
+	uint64_t		 start, elapsed;
+	unsigned int		 i;
+
+	while (1) {
+		int c;
+
+		static struct option long_options[] = {
+			{ .name = "ib-dev",   .has_arg = 1, .val = 'd' },
+			{ .name = "ib-port",  .has_arg = 1, .val = 'i' },
+			{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
+			{ .name = "iters",    .has_arg = 1, .val = 'n' },
+			{ .name = "size",     .has_arg = 1, .val = 's' },
+			{ .name = "type",     .has_arg = 1, .val = 't' },
+			{ .name = "batch",    .has_arg = 1, .val = 'b' },
+			{ .name = "wr-api",   .has_arg = 0, .val = 'w' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "d:i:g:n:s:t:b:w", long_options,
+				NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			ib_devname = strdupa(optarg);
+			break;
+
+		case 'i':
+			ib_port = strtol(optarg, NULL, 0);
+			if (ib_port < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'g':
+			gidx = strtol(optarg, NULL, 0);
+			break;
+
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			for (i = 0; i < 3; i++)
+				if (!strcmp(optarg, op_names[i]))
+					break;
+			if (i == 3) {
+				usage(argv[0]);
+				return 1;
+			}
+			op = i;
+			break;
+
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'w':
+			use_wr_api = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc || !iters || !size || !batch ||
+	    batch > BENCH_MAX_BATCH) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+
+	if (!ib_devname) {
+		ib_dev = *dev_list;
+		if (!ib_dev) {
+			fprintf(stderr, "No IB devices found\n");
+			return 1;
+		}
+	} else {
+		for (i = 0; dev_list[i]; ++i)
+			if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
+				break;
+		ib_dev = dev_list[i];
+		if (!ib_dev) {
+			fprintf(stderr, "IB device %s not found\n", ib_devname);
+			return 1;
+		}
+	}
+
+	ctx = init_ctx(ib_dev, size, batch, op, use_wr_api);
+	if (!ctx)
+		return 1;
+
+	if (connect_qps(ctx, ib_port, gidx))
+		return 1;
+
+	start = now_ns();
+	if (run(ctx, iters, &st))
+		return 1;
+	elapsed = now_ns() - start;
+
+	printf("%s: %u %s of %u bytes, %u per call, %s\n",
+	       ibv_get_device_name(ib_dev), iters, op_names[op], size, batch,
+	       use_wr_api ? "ibv_wr_*" : "ibv_post_send");
+	printf("  post_send  %10.1f ns/call %10.1f ns/WR\n",
+	       (double) st.post_ns / st.post_calls,
+	       (double) st.post_ns / st.posted);
+	printf("  poll_cq    %10.1f ns/call %10.2f calls/completion\n",
+	       (double) st.poll_ns / st.poll_calls,
+	       (double) st.poll_calls / st.polled);
+	if (st.recv_posted)
+		printf("  post_recv  %10.1f ns/WR\n",
+		       (double) st.recv_ns / st.recv_posted);
+	printf("  total      %10.3f Mops/sec %8.2f Gbit/sec\n",
+	       (double) iters * 1000 / elapsed,
+	       (double) iters * size * 8 / elapsed);
+
+	close_ctx(ctx);
+	ibv_free_device_list(dev_list);
+
+	return 0;
+}
@@ -38,6 +38,7 @@
 
 #include <infiniband/driver.h>
 #include <ccan/bitmap.h>
+#include <util/compiler.h>
 
 #define INIT		__attribute__((constructor))
 
@@ -58,6 +59,12 @@ void ibverbs_device_put(struct ibv_device *dev);
 void ibverbs_device_hold(struct ibv_device *dev);
 int __lib_query_port(struct ibv_context *context, uint8_t port_num,
 		     struct ibv_port_attr *port_attr, size_t port_attr_len);
+int __lib_query_gid(struct ibv_context *context, uint8_t port_num,
+		    int index, union ibv_gid *gid);
+int __lib_query_gid_type(struct ibv_context *context, uint8_t port_num,
+			 unsigned int index, enum ibv_gid_type *type);
+int __lib_query_pkey(struct ibv_context *context, uint8_t port_num,
+		     int index, __be16 *pkey);
 int setup_sysfs_uverbs(int uv_dirfd, const char *uverbs,
 		       struct verbs_sysfs_dev *sysfs_dev);
 
@@ -65,15 +72,27 @@ int setup_sysfs_uverbs(int uv_dirfd, const char *uverbs,
 static inline void load_drivers(void)
 {
 }
+static inline void load_drivers_for(struct list_head *sysfs_list)
+{
+}
 #else
 void load_drivers(void);
+void load_drivers_for(struct list_head *sysfs_list);
 #endif
 
+struct port_cache;
+
 struct verbs_ex_private {
 	BITMAP_DECLARE(unsupported_ioctls, VERBS_OPS_NUM);
 	uint32_t driver_id;
 	bool use_ioctl_write;
 	struct verbs_context_ops ops;
+	pthread_mutex_t cache_lock;
+	/* Indexed by port number, grown as ports are queried */
+	struct port_cache **port_cache;
+	unsigned int port_cache_cnt;
+	/* Set once the application reads async events */
+	bool async_reader;
 };
 
 static inline struct verbs_ex_private *get_priv(struct ibv_context *ctx)
@@ -88,8 +107,47 @@ static inline const struct verbs_context_ops *get_ops(struct ibv_context *ctx)
 
 enum ibv_node_type decode_knode_type(unsigned int knode_type);
 
+int port_cache_query_gid(struct ibv_context *context, uint8_t port_num,
+			 int index, union ibv_gid *gid);
+int port_cache_query_gid_type(struct ibv_context *context, uint8_t port_num,
+			      unsigned int index, enum ibv_gid_type *type);
+int port_cache_find_gid(struct ibv_context *context, uint8_t port_num,
+			const union ibv_gid *gid, enum ibv_gid_type type);
+int port_cache_query_pkey(struct ibv_context *context, uint8_t port_num,
+			  int index, __be16 *pkey);
+int port_cache_find_pkey(struct ibv_context *context, uint8_t port_num,
+			 __be16 pkey);
+void port_cache_async_reader(struct ibv_context *context);
+void port_cache_event(struct ibv_context *context,
+		      const struct ibv_async_event *event);
+void port_cache_free(struct verbs_ex_private *priv);
+
 int find_sysfs_devs_nl(struct list_head *tmp_sysfs_dev_list);
 
 int try_access_device(const struct verbs_sysfs_dev *sysfs_dev);
 
+extern bool verbs_cmd_trace;
+
+void cmd_trace_init(void);
+uint64_t cmd_trace_now(void);
+void __cmd_trace_record(uint32_t type, uint32_t object_id, uint32_t method_id,
+			uint64_t start, int ret);
+
+/* Both are a single test of verbs_cmd_trace unless RDMAV_CMD_TRACE is set */
+static inline uint64_t cmd_trace_start(void)
+{
+	if (unlikely(verbs_cmd_trace))
+		return cmd_trace_now();
+	return 0;
+}
+
+static inline int cmd_trace_end(enum ibv_cmd_trace_type type,
+				uint32_t object_id, uint32_t method_id,
+				uint64_t start, int ret)
+{
+	if (unlikely(verbs_cmd_trace))
+		__cmd_trace_record(type, object_id, method_id, start, ret);
+	return ret;
+}
+
 #endif /* IB_VERBS_H */
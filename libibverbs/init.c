@@ -47,7 +47,9 @@
 #include <errno.h>
 #include <assert.h>
 #include <fnmatch.h>
+#include <sys/socket.h>
 #include <sys/sysmacros.h>
+#include <linux/netlink.h>
 
 #include <rdma/rdma_netlink.h>
 
@@ -444,6 +446,44 @@ static struct verbs_device *try_drivers(struct verbs_sysfs_dev *sysfs_dev)
 	return NULL;
 }
 
+/*
+ * Software devices are implemented entirely by a userspace provider.  They
+ * are requested with RDMAV_SOFTVERBS, which holds the number of devices to
+ * create, or is empty for a single device.
+ */
+static int find_soft_devs(struct list_head *tmp_sysfs_dev_list)
+{
+	struct verbs_sysfs_dev *sysfs_dev;
+	unsigned int i, cnt;
+	char *env;
+
+	env = getenv("RDMAV_SOFTVERBS");
+	if (!env)
+		return 0;
+
+	cnt = strtoul(env, NULL, 0);
+	if (!cnt)
+		cnt = 1;
+
+	for (i = 0; i < cnt; i++) {
+		sysfs_dev = calloc(1, sizeof(*sysfs_dev));
+		if (!sysfs_dev)
+			return ENOMEM;
+
+		snprintf(sysfs_dev->sysfs_name, sizeof(sysfs_dev->sysfs_name),
+			 "softverbs%u", i);
+		strcpy(sysfs_dev->ibdev_name, sysfs_dev->sysfs_name);
+		sysfs_dev->ibdev_idx = -1;
+		sysfs_dev->node_type = IBV_NODE_CA;
+		sysfs_dev->node_guid = 0x0200000000000000ULL | (i + 1);
+		strcpy(sysfs_dev->fw_ver, "1.0.0");
+		sysfs_dev->flags = VSYSFS_SOFT_DEVICE | VSYSFS_READ_MODALIAS |
+				   VSYSFS_READ_NODE_GUID | VSYSFS_READ_FW_VER;
+		list_add_tail(tmp_sysfs_dev_list, &sysfs_dev->entry);
+	}
+	return 0;
+}
+
 static int check_abi_version(void)
 {
 	char value[8];
@@ -505,6 +545,122 @@ static int same_sysfs_dev(struct verbs_sysfs_dev *sysfs1,
 	return 1;
 }
 
+/*
+ * The device list is only scanned again once the kernel has announced a
+ * change to an RDMA device.  Device announcements (uevents) are collected
+ * through a netlink socket that is opened before the first scan, so no
+ * change can be missed between the scan and the first check.  Without the
+ * socket, every call scans again.
+ *
+ * Uevents are not delivered outside the initial network and user
+ * namespaces, so the entries of the RDMA device classes in sysfs, which
+ * show the devices visible to the process in any namespace, are also
+ * compared with those seen before the last scan.  A device that is added
+ * again gets a new inode, and a renamed one a new name.
+ */
+static int uevent_fd = -1;
+static bool uevent_opened;
+static bool device_list_scanned;
+static uint64_t sysfs_class_hash;
+
+static uint64_t hash_sysfs_class(uint64_t hash, const char *class)
+{
+	char class_path[IBV_SYSFS_PATH_MAX];
+	struct dirent *dent;
+	DIR *class_dir;
+	const char *c;
+
+	if (!check_snprintf(class_path, sizeof(class_path), "%s/class/%s",
+			    ibv_get_sysfs_path(), class))
+		return hash;
+
+	class_dir = opendir(class_path);
+	if (!class_dir)
+		return hash;
+
+	/* FNV-1a over the name and inode of each entry */
+	while ((dent = readdir(class_dir))) {
+		for (c = dent->d_name; *c; c++)
+			hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+		hash = (hash ^ dent->d_ino) * 0x100000001b3ULL;
+	}
+	closedir(class_dir);
+	return hash;
+}
+
+static bool sysfs_class_changed(void)
+{
+	uint64_t hash;
+
+	hash = hash_sysfs_class(0xcbf29ce484222325ULL, "infiniband");
+	hash = hash_sysfs_class(hash, "infiniband_verbs");
+	if (hash == sysfs_class_hash)
+		return false;
+
+	sysfs_class_hash = hash;
+	return true;
+}
+
+static void open_uevent_socket(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		/* Kernel uevents, as opposed to those relayed by udev */
+		.nl_groups = 1,
+	};
+
+	uevent_opened = true;
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd < 0)
+		return;
+
+	if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(uevent_fd);
+		uevent_fd = -1;
+	}
+}
+
+/* Uevents are a header followed by NUL terminated KEY=value strings */
+static bool is_rdma_uevent(const char *buf, size_t len)
+{
+	const char *str;
+
+	for (str = buf; str < buf + len; str += strlen(str) + 1) {
+		if (!strncmp(str, "SUBSYSTEM=infiniband", 20))
+			return true;
+	}
+	return false;
+}
+
+static bool device_list_changed(void)
+{
+	char buf[4096];
+	bool changed;
+	ssize_t len;
+
+	if (!uevent_opened)
+		open_uevent_socket();
+	changed = sysfs_class_changed();
+	if (uevent_fd < 0 || !device_list_scanned)
+		return true;
+
+	for (;;) {
+		len = recv(uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			/* Events were lost, so assume any of them was ours */
+			if (errno != ENOBUFS)
+				break;
+			changed = true;
+			continue;
+		}
+		buf[len] = 0;
+		if (is_rdma_uevent(buf, len))
+			changed = true;
+	}
+	return changed;
+}
+
 /* Match every ibv_sysfs_dev in the sysfs_list to a driver and add a new entry
  * to device_list. Once matched to a driver the entry in sysfs_list is
  * removed.
@@ -537,10 +693,17 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	unsigned int num_devices = 0;
 	int ret;
 
+	if (!device_list_changed()) {
+		list_for_each(device_list, vdev, entry)
+			num_devices++;
+		return num_devices;
+	}
+
 	ret = find_sysfs_devs_nl(&sysfs_list);
 	if (ret) {
 		ret = find_sysfs_devs(&sysfs_list);
-		if (ret)
+		/* Software devices do not need kernel support */
+		if (ret && !getenv("RDMAV_SOFTVERBS"))
 			return -ret;
 	}
 
@@ -550,6 +713,10 @@ int ibverbs_get_device_list(struct list_head *device_list)
 			return -ret;
 	}
 
+	ret = find_soft_devs(&sysfs_list);
+	if (ret)
+		return -ret;
+
 	/* Remove entries from the sysfs_list that are already preset in the
 	 * device_list, and remove entries from the device_list that are not
 	 * present in the sysfs_list.
@@ -579,6 +746,13 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	if (list_empty(&sysfs_list) || drivers_loaded)
 		goto out;
 
+	/* Try the providers of the devices present before all the others */
+	load_drivers_for(&sysfs_list);
+	try_all_drivers(&sysfs_list, device_list, &num_devices);
+
+	if (list_empty(&sysfs_list))
+		goto out;
+
 	load_drivers();
 	drivers_loaded = 1;
 
@@ -597,6 +771,7 @@ out:
 		free(sysfs_dev);
 	}
 
+	device_list_scanned = true;
 	return num_devices;
 }
 
@@ -617,6 +792,8 @@ int ibverbs_init(void)
 	if (getenv("RDMAV_ALLOW_DISASSOC_DESTROY"))
 		verbs_allow_disassociate_destroy = true;
 
+	cmd_trace_init();
+
 	if (!ibv_get_sysfs_path())
 		return -errno;
 
@@ -26,6 +26,8 @@
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <assert.h>
+#include <pthread.h>
+#include <linux/neighbour.h>
 
 #if !HAVE_WORKING_IF_H
 /* We need this decl from net/if.h but old systems do not let use co-include
@@ -35,6 +37,7 @@ extern unsigned int if_nametoindex(__const char *__ifname) __THROW;
 
 /* for PFX */
 #include "ibverbs.h"
+#include <ccan/list.h>
 #include <ccan/minmax.h>
 
 #include "neigh.h"
@@ -835,3 +838,261 @@ nla_put_failure:
 	nlmsg_free(m);
 	return -ENOMEM;
 }
+
+/*
+ * Resolution cache
+ *
+ * A resolution takes a netlink socket, dumps of the link, route and
+ * neighbour tables, and possibly a probe, so resolved addresses are kept for
+ * the life of the process, keyed by source and destination GID.  A netlink
+ * socket subscribed to neighbour, route, address and link changes is
+ * drained before each lookup and after each insertion.
+ *
+ * An entry is valid while the neighbour that it was resolved through has the
+ * same link layer address.  Neighbour notifications are applied in order, so
+ * an entry added after a probe survives the probe's own notifications.  Any
+ * other change, or lost notifications, drops every entry.
+ */
+#define NEIGH_CACHE_BUCKETS	1024
+#define NEIGH_CACHE_MAX		16384
+#define NEIGH_CACHE_NUD_VALID	(NUD_PERMANENT | NUD_NOARP | NUD_REACHABLE | \
+				 NUD_PROBE | NUD_STALE | NUD_DELAY)
+
+struct neigh_entry {
+	struct list_node	hash_entry;
+	struct list_node	lru_entry;
+	uint8_t			sgid[16];
+	uint8_t			dgid[16];
+	int			oif;
+	int			nh_family;
+	unsigned int		nh_len;
+	uint8_t			nh_addr[16];
+	uint8_t			ll_addr[ETHERNET_LL_SIZE];
+	uint16_t		vid;
+	bool			valid;
+};
+
+static pthread_once_t neigh_cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t neigh_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int neigh_cache_fd = -1;
+static struct list_head neigh_cache_hash[NEIGH_CACHE_BUCKETS];
+static LIST_HEAD(neigh_cache_lru);
+static unsigned int neigh_cache_cnt;
+
+static void neigh_cache_init(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_NEIGH | RTMGRP_LINK |
+			     RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+			     RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE,
+	};
+	int i;
+
+	if (getenv("RDMAV_DISABLE_NEIGH_CACHE"))
+		return;
+
+	for (i = 0; i < NEIGH_CACHE_BUCKETS; i++)
+		list_head_init(&neigh_cache_hash[i]);
+
+	neigh_cache_fd = socket(AF_NETLINK,
+				SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				NETLINK_ROUTE);
+	if (neigh_cache_fd < 0)
+		return;
+
+	if (bind(neigh_cache_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(neigh_cache_fd);
+		neigh_cache_fd = -1;
+	}
+}
+
+static struct list_head *neigh_cache_bucket(const uint8_t *sgid,
+					    const uint8_t *dgid)
+{
+	uint32_t words[8], val = 0;
+	int i;
+
+	memcpy(words, sgid, 16);
+	memcpy(words + 4, dgid, 16);
+	for (i = 0; i < 8; i++)
+		val = (val ^ words[i]) * 0x9e3779b1;
+	return &neigh_cache_hash[(val >> 16) % NEIGH_CACHE_BUCKETS];
+}
+
+static void neigh_cache_remove(struct neigh_entry *entry)
+{
+	list_del(&entry->hash_entry);
+	list_del(&entry->lru_entry);
+	neigh_cache_cnt--;
+	free(entry);
+}
+
+static void neigh_cache_flush(void)
+{
+	struct neigh_entry *entry, *next;
+
+	list_for_each_safe(&neigh_cache_lru, entry, next, lru_entry)
+		neigh_cache_remove(entry);
+}
+
+static void neigh_cache_neigh_event(struct nlmsghdr *nlh)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nlh);
+	struct neigh_entry *entry;
+	void *dst = NULL, *ll_addr = NULL;
+	unsigned int dst_len = 0, ll_len = 0;
+	struct rtattr *rta;
+	int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+	bool valid;
+
+	rta = (struct rtattr *)((char *)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST) {
+			dst = RTA_DATA(rta);
+			dst_len = RTA_PAYLOAD(rta);
+		} else if (rta->rta_type == NDA_LLADDR) {
+			ll_addr = RTA_DATA(rta);
+			ll_len = RTA_PAYLOAD(rta);
+		}
+	}
+	if (!dst)
+		return;
+
+	valid = nlh->nlmsg_type == RTM_NEWNEIGH &&
+		(ndm->ndm_state & NEIGH_CACHE_NUD_VALID) &&
+		ll_len == ETHERNET_LL_SIZE;
+
+	list_for_each(&neigh_cache_lru, entry, lru_entry) {
+		if (entry->oif != ndm->ndm_ifindex ||
+		    entry->nh_family != ndm->ndm_family ||
+		    entry->nh_len != dst_len ||
+		    memcmp(entry->nh_addr, dst, dst_len))
+			continue;
+
+		entry->valid = valid &&
+			       !memcmp(entry->ll_addr, ll_addr, ll_len);
+	}
+}
+
+/* Called with neigh_cache_lock held */
+static void neigh_cache_drain(void)
+{
+	struct neigh_entry *entry, *next;
+	struct nlmsghdr *nlh;
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	int len;
+
+	for (;;) {
+		len = recv(neigh_cache_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno != ENOBUFS)
+				break;
+			neigh_cache_flush();
+			continue;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			switch (nlh->nlmsg_type) {
+			case RTM_NEWNEIGH:
+			case RTM_DELNEIGH:
+				neigh_cache_neigh_event(nlh);
+				break;
+			case NLMSG_NOOP:
+			case NLMSG_DONE:
+				break;
+			default:
+				neigh_cache_flush();
+				break;
+			}
+		}
+	}
+
+	list_for_each_safe(&neigh_cache_lru, entry, next, lru_entry) {
+		if (!entry->valid)
+			neigh_cache_remove(entry);
+	}
+}
+
+static struct neigh_entry *neigh_cache_find(const uint8_t *sgid,
+					    const uint8_t *dgid)
+{
+	struct neigh_entry *entry;
+
+	list_for_each(neigh_cache_bucket(sgid, dgid), entry, hash_entry) {
+		if (!memcmp(entry->sgid, sgid, 16) &&
+		    !memcmp(entry->dgid, dgid, 16))
+			return entry;
+	}
+	return NULL;
+}
+
+int neigh_cache_lookup(const uint8_t *sgid, const uint8_t *dgid,
+		       uint8_t *ll_addr, uint16_t *vid)
+{
+	struct neigh_entry *entry;
+	int errsv = errno;
+
+	pthread_once(&neigh_cache_once, neigh_cache_init);
+	if (neigh_cache_fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&neigh_cache_lock);
+	neigh_cache_drain();
+	entry = neigh_cache_find(sgid, dgid);
+	if (entry) {
+		memcpy(ll_addr, entry->ll_addr, ETHERNET_LL_SIZE);
+		*vid = entry->vid;
+		list_del(&entry->lru_entry);
+		list_add_tail(&neigh_cache_lru, &entry->lru_entry);
+	}
+	pthread_mutex_unlock(&neigh_cache_lock);
+
+	errno = errsv;
+	return entry ? 0 : -1;
+}
+
+void neigh_cache_add(struct get_neigh_handler *neigh_handler,
+		     const uint8_t *sgid, const uint8_t *dgid,
+		     const uint8_t *ll_addr, uint16_t vid)
+{
+	struct neigh_entry *entry, *old;
+	int errsv = errno;
+
+	if (neigh_cache_fd < 0 || !neigh_handler->dst ||
+	    nl_addr_get_len(neigh_handler->dst) > sizeof(entry->nh_addr))
+		return;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return;
+
+	memcpy(entry->sgid, sgid, 16);
+	memcpy(entry->dgid, dgid, 16);
+	entry->oif = neigh_handler->oif;
+	entry->nh_family = nl_addr_get_family(neigh_handler->dst);
+	entry->nh_len = nl_addr_get_len(neigh_handler->dst);
+	memcpy(entry->nh_addr, nl_addr_get_binary_addr(neigh_handler->dst),
+	       entry->nh_len);
+	memcpy(entry->ll_addr, ll_addr, ETHERNET_LL_SIZE);
+	entry->vid = vid;
+	entry->valid = true;
+
+	pthread_mutex_lock(&neigh_cache_lock);
+	old = neigh_cache_find(sgid, dgid);
+	if (old)
+		neigh_cache_remove(old);
+
+	list_add(neigh_cache_bucket(sgid, dgid), &entry->hash_entry);
+	list_add_tail(&neigh_cache_lru, &entry->lru_entry);
+	if (++neigh_cache_cnt > NEIGH_CACHE_MAX)
+		neigh_cache_remove(list_top(&neigh_cache_lru,
+					    struct neigh_entry, lru_entry));
+
+	/* Apply whatever changed while the address was being resolved */
+	neigh_cache_drain();
+	pthread_mutex_unlock(&neigh_cache_lock);
+
+	errno = errsv;
+}
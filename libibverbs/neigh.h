@@ -38,4 +38,10 @@ int neigh_get_oif_from_src(struct get_neigh_handler *neigh_handler);
 int neigh_get_ll(struct get_neigh_handler *neigh_handler, void *addr_buf,
 		 int addr_size);
 
+int neigh_cache_lookup(const uint8_t *sgid, const uint8_t *dgid,
+		       uint8_t *ll_addr, uint16_t *vid);
+void neigh_cache_add(struct get_neigh_handler *neigh_handler,
+		     const uint8_t *sgid, const uint8_t *dgid,
+		     const uint8_t *ll_addr, uint16_t vid);
+
 #endif
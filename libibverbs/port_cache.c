@@ -0,0 +1,530 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "ibverbs.h"
+
+/*
+ * Port table cache
+ *
+ * Reading a GID, GID type or P_Key from sysfs costs a file open per entry,
+ * so each context caches the tables of the ports that it queries.  Entries
+ * are read on first use.  Searching the GID table reads all of it once and
+ * hashes the entries by GID and type, so that later searches are a single
+ * lookup.
+ *
+ * A port's tables are dropped when ibv_get_async_event() returns one of the
+ * events on which the kernel refreshes its own copy of them.  Nothing else
+ * reports changes to the tables of an InfiniBand port, so they are only
+ * cached once the application has started reading async events.  The GIDs
+ * of a RoCE port follow the IP addresses of its net device, which may change
+ * without the application reading any event, so address and link changes
+ * are also watched through a netlink socket shared by all contexts.  The
+ * kernel updates its GID table shortly after such a change, so RoCE tables
+ * are read through, without caching, until it has had time to settle.
+ *
+ * Setting RDMAV_DISABLE_PORT_CACHE disables the cache.
+ */
+#define PORT_CACHE_SETTLE_MS	1000
+
+enum {
+	GID_ENTRY_GID	= 1 << 0,
+	GID_ENTRY_TYPE	= 1 << 1,
+};
+
+struct gid_entry {
+	union ibv_gid		gid;
+	enum ibv_gid_type	type;
+	int			next;
+	uint8_t			flags;
+};
+
+struct port_cache {
+	bool			roce;
+	unsigned int		nl_gen;
+	int			gid_tbl_len;
+	struct gid_entry	*gids;
+	int			*gid_hash;
+	unsigned int		hash_mask;
+	bool			gids_hashed;
+	int			pkey_tbl_len;
+	__be16			*pkeys;
+	bitmap			*pkey_map;
+	bool			pkeys_loaded;
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static bool cache_disabled;
+
+static pthread_once_t nl_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t nl_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nl_fd = -1;
+static unsigned int nl_gen;
+static bool nl_changed;
+static struct timespec nl_change_time;
+
+static void cache_init(void)
+{
+	cache_disabled = getenv("RDMAV_DISABLE_PORT_CACHE") != NULL;
+}
+
+static void nl_init(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR |
+			     RTMGRP_IPV6_IFADDR,
+	};
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		       NETLINK_ROUTE);
+	if (nl_fd < 0)
+		return;
+
+	if (bind(nl_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(nl_fd);
+		nl_fd = -1;
+	}
+}
+
+static void drop_gids(struct port_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->gid_tbl_len; i++)
+		cache->gids[i].flags = 0;
+	cache->gids_hashed = false;
+}
+
+static void drop_pkeys(struct port_cache *cache)
+{
+	bitmap_zero(cache->pkey_map, cache->pkey_tbl_len);
+	cache->pkeys_loaded = false;
+}
+
+/*
+ * Drains any pending address or link notifications, and drops the GIDs of a
+ * RoCE port if there were any since they were read.  Returns false if the
+ * kernel may still be updating its GID table.
+ */
+static bool nl_check(struct port_cache *cache)
+{
+	struct timespec now;
+	char buf[4096];
+	bool settled;
+	int errsv = errno;
+
+	pthread_once(&nl_once, nl_init);
+	if (nl_fd < 0)
+		return false;
+
+	pthread_mutex_lock(&nl_lock);
+	for (;;) {
+		/* ENOBUFS means notifications were lost, so treat it as one */
+		if (recv(nl_fd, buf, sizeof(buf), MSG_DONTWAIT) < 0 &&
+		    errno != ENOBUFS)
+			break;
+
+		nl_gen++;
+		nl_changed = true;
+		clock_gettime(CLOCK_MONOTONIC, &nl_change_time);
+	}
+
+	settled = true;
+	if (nl_changed) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		settled = (now.tv_sec - nl_change_time.tv_sec) * 1000 +
+			  (now.tv_nsec - nl_change_time.tv_nsec) / 1000000 >=
+			  PORT_CACHE_SETTLE_MS;
+	}
+
+	if (cache->nl_gen != nl_gen) {
+		cache->nl_gen = nl_gen;
+		drop_gids(cache);
+	}
+	pthread_mutex_unlock(&nl_lock);
+
+	errno = errsv;
+	return settled;
+}
+
+static void free_port_cache(struct port_cache *cache)
+{
+	free(cache->pkey_map);
+	free(cache->pkeys);
+	free(cache->gid_hash);
+	free(cache->gids);
+	free(cache);
+}
+
+static struct port_cache *alloc_port_cache(struct ibv_context *context,
+					   uint8_t port_num)
+{
+	struct ibv_port_attr attr;
+	struct port_cache *cache;
+	unsigned int size;
+
+	if (__lib_query_port(context, port_num, &attr, sizeof(attr)))
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->roce = attr.link_layer == IBV_LINK_LAYER_ETHERNET;
+	cache->gid_tbl_len = attr.gid_tbl_len;
+	cache->pkey_tbl_len = attr.pkey_tbl_len;
+
+	/* Keep the hash at most half full */
+	for (size = 1; size < 2 * (unsigned int) cache->gid_tbl_len; size <<= 1)
+		;
+	cache->hash_mask = size - 1;
+
+	cache->gids = calloc(cache->gid_tbl_len, sizeof(*cache->gids));
+	cache->gid_hash = calloc(size, sizeof(*cache->gid_hash));
+	cache->pkeys = calloc(cache->pkey_tbl_len, sizeof(*cache->pkeys));
+	cache->pkey_map = bitmap_alloc0(cache->pkey_tbl_len);
+	if ((cache->gid_tbl_len && !cache->gids) || !cache->gid_hash ||
+	    (cache->pkey_tbl_len && (!cache->pkeys || !cache->pkey_map))) {
+		free_port_cache(cache);
+		return NULL;
+	}
+
+	if (cache->roce) {
+		pthread_mutex_lock(&nl_lock);
+		cache->nl_gen = nl_gen;
+		pthread_mutex_unlock(&nl_lock);
+	}
+	return cache;
+}
+
+/*
+ * Returns the cache of a port, or NULL if its tables must be read directly.
+ * Called with the context's cache_lock held.
+ */
+static struct port_cache *get_port_cache(struct ibv_context *context,
+					 uint8_t port_num)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache **port_cache, *cache;
+
+	pthread_once(&cache_once, cache_init);
+	if (cache_disabled || !port_num)
+		return NULL;
+
+	if (port_num >= priv->port_cache_cnt) {
+		port_cache = realloc(priv->port_cache,
+				     (port_num + 1) * sizeof(*port_cache));
+		if (!port_cache)
+			return NULL;
+
+		memset(port_cache + priv->port_cache_cnt, 0,
+		       (port_num + 1 - priv->port_cache_cnt) *
+		       sizeof(*port_cache));
+		priv->port_cache = port_cache;
+		priv->port_cache_cnt = port_num + 1;
+	}
+
+	cache = priv->port_cache[port_num];
+	if (!cache) {
+		cache = alloc_port_cache(context, port_num);
+		if (!cache)
+			return NULL;
+		priv->port_cache[port_num] = cache;
+	}
+
+	if (cache->roce ? !nl_check(cache) : !priv->async_reader)
+		return NULL;
+	return cache;
+}
+
+static int load_gid(struct ibv_context *context, uint8_t port_num,
+		    struct port_cache *cache, int index, uint8_t flags)
+{
+	struct gid_entry *entry = &cache->gids[index];
+
+	if ((flags & GID_ENTRY_GID) && !(entry->flags & GID_ENTRY_GID)) {
+		if (__lib_query_gid(context, port_num, index, &entry->gid))
+			return -1;
+		entry->flags |= GID_ENTRY_GID;
+	}
+
+	if ((flags & GID_ENTRY_TYPE) && !(entry->flags & GID_ENTRY_TYPE)) {
+		if (__lib_query_gid_type(context, port_num, index, &entry->type))
+			return -1;
+		entry->flags |= GID_ENTRY_TYPE;
+	}
+
+	return 0;
+}
+
+static unsigned int hash_gid(struct port_cache *cache,
+			     const union ibv_gid *gid, enum ibv_gid_type type)
+{
+	uint32_t words[4], val;
+
+	memcpy(words, gid->raw, sizeof(words));
+	val = words[0] ^ words[1] ^ words[2] ^ words[3] ^ type;
+	return ((val * 0x9e3779b1) >> 16) & cache->hash_mask;
+}
+
+/*
+ * Entries are linked in reverse order, so that each chain finds the lowest
+ * matching index first, as a linear search would.  Entries that cannot be
+ * read are left out.
+ */
+static void hash_gids(struct ibv_context *context, uint8_t port_num,
+		      struct port_cache *cache)
+{
+	struct gid_entry *entry;
+	unsigned int bucket;
+	int i;
+
+	memset(cache->gid_hash, 0xff,
+	       (cache->hash_mask + 1) * sizeof(*cache->gid_hash));
+
+	for (i = cache->gid_tbl_len - 1; i >= 0; i--) {
+		if (load_gid(context, port_num, cache, i,
+			     GID_ENTRY_GID | GID_ENTRY_TYPE))
+			continue;
+
+		entry = &cache->gids[i];
+		bucket = hash_gid(cache, &entry->gid, entry->type);
+		entry->next = cache->gid_hash[bucket];
+		cache->gid_hash[bucket] = i;
+	}
+	cache->gids_hashed = true;
+}
+
+int port_cache_query_gid(struct ibv_context *context, uint8_t port_num,
+			 int index, union ibv_gid *gid)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache *cache;
+	int ret;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	cache = get_port_cache(context, port_num);
+	if (cache && index >= 0 && index < cache->gid_tbl_len) {
+		ret = load_gid(context, port_num, cache, index, GID_ENTRY_GID);
+		if (!ret)
+			*gid = cache->gids[index].gid;
+	} else {
+		ret = __lib_query_gid(context, port_num, index, gid);
+	}
+	pthread_mutex_unlock(&priv->cache_lock);
+	return ret;
+}
+
+int port_cache_query_gid_type(struct ibv_context *context, uint8_t port_num,
+			      unsigned int index, enum ibv_gid_type *type)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache *cache;
+	int ret;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	cache = get_port_cache(context, port_num);
+	if (cache && index < (unsigned int) cache->gid_tbl_len) {
+		ret = load_gid(context, port_num, cache, index, GID_ENTRY_TYPE);
+		if (!ret)
+			*type = cache->gids[index].type;
+	} else {
+		ret = __lib_query_gid_type(context, port_num, index, type);
+	}
+	pthread_mutex_unlock(&priv->cache_lock);
+	return ret;
+}
+
+static int find_gid_direct(struct ibv_context *context, uint8_t port_num,
+			   const union ibv_gid *gid, enum ibv_gid_type type)
+{
+	enum ibv_gid_type sgid_type = 0;
+	union ibv_gid sgid;
+	int i = 0, ret;
+
+	do {
+		ret = __lib_query_gid(context, port_num, i, &sgid);
+		if (!ret) {
+			ret = __lib_query_gid_type(context, port_num, i,
+						   &sgid_type);
+		}
+		i++;
+	} while (!ret && (memcmp(&sgid, gid, sizeof(*gid)) ||
+		 (type != sgid_type)));
+
+	return ret ? ret : i - 1;
+}
+
+int port_cache_find_gid(struct ibv_context *context, uint8_t port_num,
+			const union ibv_gid *gid, enum ibv_gid_type type)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache *cache;
+	struct gid_entry *entry;
+	int i, ret = -1;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	cache = get_port_cache(context, port_num);
+	if (!cache) {
+		ret = find_gid_direct(context, port_num, gid, type);
+		goto out;
+	}
+
+	if (!cache->gids_hashed)
+		hash_gids(context, port_num, cache);
+
+	for (i = cache->gid_hash[hash_gid(cache, gid, type)]; i >= 0;
+	     i = entry->next) {
+		entry = &cache->gids[i];
+		if (entry->type == type &&
+		    !memcmp(&entry->gid, gid, sizeof(*gid))) {
+			ret = i;
+			goto out;
+		}
+	}
+	errno = ENOENT;
+out:
+	pthread_mutex_unlock(&priv->cache_lock);
+	return ret;
+}
+
+static int load_pkey(struct ibv_context *context, uint8_t port_num,
+		     struct port_cache *cache, int index)
+{
+	if (bitmap_test_bit(cache->pkey_map, index))
+		return 0;
+
+	if (__lib_query_pkey(context, port_num, index, &cache->pkeys[index]))
+		return -1;
+	bitmap_set_bit(cache->pkey_map, index);
+	return 0;
+}
+
+int port_cache_query_pkey(struct ibv_context *context, uint8_t port_num,
+			  int index, __be16 *pkey)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache *cache;
+	int ret;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	cache = get_port_cache(context, port_num);
+	if (cache && index >= 0 && index < cache->pkey_tbl_len) {
+		ret = load_pkey(context, port_num, cache, index);
+		if (!ret)
+			*pkey = cache->pkeys[index];
+	} else {
+		ret = __lib_query_pkey(context, port_num, index, pkey);
+	}
+	pthread_mutex_unlock(&priv->cache_lock);
+	return ret;
+}
+
+int port_cache_find_pkey(struct ibv_context *context, uint8_t port_num,
+			 __be16 pkey)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache *cache;
+	__be16 pkey_i;
+	int i, ret;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	cache = get_port_cache(context, port_num);
+	if (!cache) {
+		for (i = 0; ; i++) {
+			ret = __lib_query_pkey(context, port_num, i, &pkey_i);
+			if (ret < 0)
+				goto out;
+			if (pkey == pkey_i)
+				break;
+		}
+		ret = i;
+		goto out;
+	}
+
+	/* The P_Key table is short, so a scan of it in memory is enough */
+	if (!cache->pkeys_loaded) {
+		for (i = 0; i < cache->pkey_tbl_len; i++)
+			load_pkey(context, port_num, cache, i);
+		cache->pkeys_loaded = true;
+	}
+
+	ret = -1;
+	errno = ENOENT;
+	for (i = 0; i < cache->pkey_tbl_len; i++) {
+		if (bitmap_test_bit(cache->pkey_map, i) &&
+		    cache->pkeys[i] == pkey) {
+			ret = i;
+			break;
+		}
+	}
+out:
+	pthread_mutex_unlock(&priv->cache_lock);
+	return ret;
+}
+
+void port_cache_async_reader(struct ibv_context *context)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+
+	if (priv->async_reader)
+		return;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	priv->async_reader = true;
+	pthread_mutex_unlock(&priv->cache_lock);
+}
+
+void port_cache_event(struct ibv_context *context,
+		      const struct ibv_async_event *event)
+{
+	struct verbs_ex_private *priv = get_priv(context);
+	struct port_cache *cache;
+	unsigned int port_num;
+
+	/* The events on which the kernel refreshes its own port cache */
+	switch (event->event_type) {
+	case IBV_EVENT_PORT_ERR:
+	case IBV_EVENT_PORT_ACTIVE:
+	case IBV_EVENT_LID_CHANGE:
+	case IBV_EVENT_PKEY_CHANGE:
+	case IBV_EVENT_CLIENT_REREGISTER:
+	case IBV_EVENT_GID_CHANGE:
+		break;
+	default:
+		return;
+	}
+
+	port_num = event->element.port_num;
+	pthread_mutex_lock(&priv->cache_lock);
+	if (port_num < priv->port_cache_cnt) {
+		cache = priv->port_cache[port_num];
+		if (cache) {
+			drop_gids(cache);
+			drop_pkeys(cache);
+		}
+	}
+	pthread_mutex_unlock(&priv->cache_lock);
+}
+
+void port_cache_free(struct verbs_ex_private *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->port_cache_cnt; i++) {
+		if (priv->port_cache[i])
+			free_port_cache(priv->port_cache[i]);
+	}
+	free(priv->port_cache);
+}
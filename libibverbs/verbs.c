@@ -216,16 +216,25 @@ LATEST_SYMVER_FUNC(ibv_query_port, 1_1, "IBVERBS_1.1",
 				sizeof(*port_attr));
 }
 
-LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
-		   int,
-		   struct ibv_context *context, uint8_t port_num,
-		   int index, union ibv_gid *gid)
+int __lib_query_gid(struct ibv_context *context, uint8_t port_num,
+		    int index, union ibv_gid *gid)
 {
 	struct verbs_device *verbs_device = verbs_get_device(context->device);
 	char attr[41];
 	uint16_t val;
 	int i;
 
+	/* Soft devices have no sysfs, only a link local GID from the GUID */
+	if (verbs_device->sysfs->flags & VSYSFS_SOFT_DEVICE) {
+		if (port_num != 1 || index != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		gid->global.subnet_prefix = htobe64(0xfe80000000000000ULL);
+		gid->global.interface_id = htobe64(verbs_device->sysfs->node_guid);
+		return 0;
+	}
+
 	if (ibv_read_ibdev_sysfs_file(attr, sizeof(attr), verbs_device->sysfs,
 				      "ports/%d/gids/%d", port_num, index) < 0)
 		return -1;
@@ -240,15 +249,30 @@ LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
-LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
+LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_context *context, uint8_t port_num,
-		   int index, __be16 *pkey)
+		   int index, union ibv_gid *gid)
+{
+	return port_cache_query_gid(context, port_num, index, gid);
+}
+
+int __lib_query_pkey(struct ibv_context *context, uint8_t port_num,
+		     int index, __be16 *pkey)
 {
 	struct verbs_device *verbs_device = verbs_get_device(context->device);
 	char attr[8];
 	uint16_t val;
 
+	if (verbs_device->sysfs->flags & VSYSFS_SOFT_DEVICE) {
+		if (port_num != 1 || index != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		*pkey = htobe16(0xffff);
+		return 0;
+	}
+
 	if (ibv_read_ibdev_sysfs_file(attr, sizeof(attr), verbs_device->sysfs,
 				      "ports/%d/pkeys/%d", port_num, index) < 0)
 		return -1;
@@ -260,20 +284,19 @@ LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
+LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
+		   int,
+		   struct ibv_context *context, uint8_t port_num,
+		   int index, __be16 *pkey)
+{
+	return port_cache_query_pkey(context, port_num, index, pkey);
+}
+
 LATEST_SYMVER_FUNC(ibv_get_pkey_index, 1_5, "IBVERBS_1.5",
 		   int,
 		   struct ibv_context *context, uint8_t port_num, __be16 pkey)
 {
-	__be16 pkey_i;
-	int i, ret;
-
-	for (i = 0; ; i++) {
-		ret = ibv_query_pkey(context, port_num, i, &pkey_i);
-		if (ret < 0)
-			return ret;
-		if (pkey == pkey_i)
-			return i;
-	}
+	return port_cache_find_pkey(context, port_num, pkey);
 }
 
 LATEST_SYMVER_FUNC(ibv_alloc_pd, 1_1, "IBVERBS_1.1",
@@ -694,12 +717,17 @@ LATEST_SYMVER_FUNC(ibv_create_ah, 1_1, "IBVERBS_1.1",
  */
 #define V1_TYPE "IB/RoCE v1"
 #define V2_TYPE "RoCE v2"
-int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
-		       unsigned int index, enum ibv_gid_type *type)
+int __lib_query_gid_type(struct ibv_context *context, uint8_t port_num,
+			 unsigned int index, enum ibv_gid_type *type)
 {
 	struct verbs_device *verbs_device = verbs_get_device(context->device);
 	char buff[11];
 
+	if (verbs_device->sysfs->flags & VSYSFS_SOFT_DEVICE) {
+		*type = IBV_GID_TYPE_IB_ROCE_V1;
+		return 0;
+	}
+
 	/* Reset errno so that we can rely on its value upon any error flow in
 	 * ibv_read_sysfs_file.
 	 */
@@ -751,24 +779,16 @@ int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
 	return 0;
 }
 
+int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
+		       unsigned int index, enum ibv_gid_type *type)
+{
+	return port_cache_query_gid_type(context, port_num, index, type);
+}
+
 static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
 			      union ibv_gid *gid, enum ibv_gid_type gid_type)
 {
-	enum ibv_gid_type sgid_type = 0;
-	union ibv_gid sgid;
-	int i = 0, ret;
-
-	do {
-		ret = ibv_query_gid(context, port_num, i, &sgid);
-		if (!ret) {
-			ret = ibv_query_gid_type(context, port_num, i,
-						 &sgid_type);
-		}
-		i++;
-	} while (!ret && (memcmp(&sgid, gid, sizeof(*gid)) ||
-		 (gid_type != sgid_type)));
-
-	return ret ? ret : i - 1;
+	return port_cache_find_gid(context, port_num, gid, gid_type);
 }
 
 static inline void map_ipv4_addr_to_ipv6(__be32 ipv4, struct in6_addr *ipv6)
@@ -1024,6 +1044,13 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	if (err)
 		return err;
 
+	if (!neigh_cache_lookup(sgid.raw, attr->grh.dgid.raw, eth_mac,
+				&ret_vid)) {
+		if (vid)
+			*vid = ret_vid;
+		return 0;
+	}
+
 	err = neigh_init_resources(&neigh_handler,
 				   NEIGH_GET_DEFAULT_TIMEOUT_MS);
 
@@ -1062,12 +1089,11 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	if (process_get_neigh(&neigh_handler))
 		goto free_resources;
 
-	if (vid) {
-		ret_vid = neigh_get_vlan_id_from_dev(&neigh_handler);
+	/* Always needed, as the cached result may be used with a vid */
+	ret_vid = neigh_get_vlan_id_from_dev(&neigh_handler);
 
-		if (ret_vid <= 0xfff)
-			neigh_set_vlan_id(&neigh_handler, ret_vid);
-	}
+	if (ret_vid <= 0xfff)
+		neigh_set_vlan_id(&neigh_handler, ret_vid);
 
 	/* We are using only Ethernet here */
 	ether_len = neigh_get_ll(&neigh_handler,
@@ -1080,6 +1106,8 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	if (vid)
 		*vid = ret_vid;
 
+	neigh_cache_add(&neigh_handler, sgid.raw, attr->grh.dgid.raw, eth_mac,
+			ret_vid);
 	ret = 0;
 
 free_resources:
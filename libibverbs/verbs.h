@@ -2142,7 +2142,7 @@ struct ibv_device **ibv_get_device_list(int *num_devices);
  */
 #ifdef RDMA_STATIC_PROVIDERS
 #define _RDMA_STATIC_PREFIX_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11,     \
-			     _12, _13, _14, _15, _16, _17, ...)                \
+			     _12, _13, _14, _15, _16, _17, _18, ...)           \
 	&verbs_provider_##_1, &verbs_provider_##_2, &verbs_provider_##_3,      \
 		&verbs_provider_##_4, &verbs_provider_##_5,                    \
 		&verbs_provider_##_6, &verbs_provider_##_7,                    \
@@ -2150,11 +2150,12 @@ struct ibv_device **ibv_get_device_list(int *num_devices);
 		&verbs_provider_##_10, &verbs_provider_##_11,                  \
 		&verbs_provider_##_12, &verbs_provider_##_13,                  \
 		&verbs_provider_##_14, &verbs_provider_##_15,                  \
-		&verbs_provider_##_16, &verbs_provider_##_17
+		&verbs_provider_##_16, &verbs_provider_##_17,                  \
+		&verbs_provider_##_18
 #define _RDMA_STATIC_PREFIX(arg)                                               \
 	_RDMA_STATIC_PREFIX_(arg, none, none, none, none, none, none, none,    \
 			     none, none, none, none, none, none, none, none,   \
-			     none)
+			     none, none)
 
 struct verbs_devices_ops;
 extern const struct verbs_device_ops verbs_provider_bnxt_re;
@@ -2171,6 +2172,7 @@ extern const struct verbs_device_ops verbs_provider_ocrdma;
 extern const struct verbs_device_ops verbs_provider_qedr;
 extern const struct verbs_device_ops verbs_provider_rxe;
 extern const struct verbs_device_ops verbs_provider_siw;
+extern const struct verbs_device_ops verbs_provider_softverbs;
 extern const struct verbs_device_ops verbs_provider_vmw_pvrdma;
 extern const struct verbs_device_ops verbs_provider_all;
 extern const struct verbs_device_ops verbs_provider_none;
@@ -3251,6 +3253,47 @@ int ibv_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
  */
 int ibv_fork_init(void);
 
+enum ibv_cmd_trace_type {
+	IBV_CMD_TRACE_IOCTL,
+	IBV_CMD_TRACE_WRITE,
+	IBV_CMD_TRACE_WRITE_EX,
+};
+
+enum {
+	IBV_CMD_TRACE_BUCKETS = 32,
+	IBV_CMD_TRACE_ERRNOS = 4,
+};
+
+struct ibv_cmd_trace_errno {
+	int32_t			err;
+	uint32_t		count;
+};
+
+struct ibv_cmd_trace_entry {
+	uint32_t		type;
+	uint32_t		object_id;
+	uint32_t		method_id;
+	uint32_t		reserved;
+	uint64_t		count;
+	uint64_t		errors;
+	uint64_t		total_ns;
+	uint64_t		min_ns;
+	uint64_t		max_ns;
+	/* Bucket i counts the commands that took [2^i, 2^(i+1)) ns */
+	uint64_t		hist[IBV_CMD_TRACE_BUCKETS];
+	struct ibv_cmd_trace_errno errnos[IBV_CMD_TRACE_ERRNOS];
+};
+
+/**
+ * ibv_query_cmd_trace - Read the latency statistics of the uverbs commands
+ * issued so far.  Only available when RDMAV_CMD_TRACE is set.
+ * @entries: Array to fill
+ * @num_entries: Size of @entries on input, the number of traced commands
+ *   on output
+ */
+int ibv_query_cmd_trace(struct ibv_cmd_trace_entry *entries,
+			size_t *num_entries);
+
 /**
  * ibv_node_type_str - Return string describing node_type enum value
  */
@@ -33,7 +33,10 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -45,11 +48,56 @@
 #include <rdma/rdma_cma.h>
 #include <infiniband/ib.h>
 #include <infiniband/sa.h>
+#include <ccan/list.h>
 
 static pthread_mutex_t acm_lock = PTHREAD_MUTEX_INITIALIZER;
 static int sock = -1;
 static uint16_t server_port;
 
+/*
+ * Resolution cache
+ *
+ * Responses from ibacm are cached for RDMA_ACM_CACHE_TTL seconds, keyed by
+ * the endpoint data of the request, which holds the source and destination
+ * addresses, and any path hint, including its QoS fields.  Entries are
+ * hashed into buckets that are locked separately.  A lookup that hits an
+ * entry in the second half of its lifetime queues the request to be
+ * resolved again by a background thread, so that entries in use are
+ * refreshed before they expire.  The cache is flushed when the rdma_cm
+ * reports an address change or the removal of a device.
+ */
+#define ACM_CACHE_BUCKETS	16
+#define ACM_CACHE_BUCKET_MAX	64
+
+struct acm_cache_entry {
+	struct list_node	entry;
+	uint64_t		expires;
+	uint64_t		refresh;
+	bool			refreshing;
+	uint16_t		key_len;
+	uint8_t			key[ACM_MSG_DATA_LENGTH];
+	struct acm_msg		resp;
+};
+
+struct acm_cache_bucket {
+	pthread_mutex_t		lock;
+	struct list_head	list;
+	int			cnt;
+};
+
+struct acm_refresh_req {
+	struct list_node	entry;
+	struct acm_msg		msg;
+};
+
+static pthread_once_t acm_cache_once = PTHREAD_ONCE_INIT;
+static struct acm_cache_bucket acm_cache[ACM_CACHE_BUCKETS];
+static uint64_t acm_cache_ttl;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(refresh_list);
+static bool refresh_thread;
+
 static int ucma_set_server_port(void)
 {
 	FILE *f;
@@ -64,54 +112,56 @@ static int ucma_set_server_port(void)
 	return server_port;
 }
 
-void ucma_ib_init(void)
+int ucma_ib_open(void)
 {
 	union {
 		struct sockaddr any;
 		struct sockaddr_in inet;
 		struct sockaddr_un unx;
 	} addr;
-	static int init;
-	int ret;
-
-	if (init)
-		return;
-
-	pthread_mutex_lock(&acm_lock);
-	if (init)
-		goto unlock;
+	int fd, ret;
 
 	if (ucma_set_server_port()) {
-		sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
-		if (sock < 0)
-			goto out;
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (fd < 0)
+			return -1;
 
 		memset(&addr, 0, sizeof(addr));
 		addr.any.sa_family = AF_INET;
 		addr.inet.sin_addr.s_addr = htobe32(INADDR_LOOPBACK);
 		addr.inet.sin_port = htobe16(server_port);
-		ret = connect(sock, &addr.any, sizeof(addr.inet));
-		if (ret) {
-			close(sock);
-			sock = -1;
-		}
+		ret = connect(fd, &addr.any, sizeof(addr.inet));
 	} else {
-		sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-		if (sock < 0)
-			goto out;
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
 
 		memset(&addr, 0, sizeof(addr));
 		addr.any.sa_family = AF_UNIX;
 		BUILD_ASSERT(sizeof(IBACM_SERVER_PATH) <=
 			     sizeof(addr.unx.sun_path));
 		strcpy(addr.unx.sun_path, IBACM_SERVER_PATH);
-		ret = connect(sock, &addr.any, sizeof(addr.unx));
-		if (ret) {
-			close(sock);
-			sock = -1;
-		}
+		ret = connect(fd, &addr.any, sizeof(addr.unx));
 	}
-out:
+	if (ret) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void ucma_ib_init(void)
+{
+	static int init;
+
+	if (init)
+		return;
+
+	pthread_mutex_lock(&acm_lock);
+	if (init)
+		goto unlock;
+
+	sock = ucma_ib_open();
 	init = 1;
 unlock:
 	pthread_mutex_unlock(&acm_lock);
@@ -125,6 +175,214 @@ void ucma_ib_cleanup(void)
 	}
 }
 
+static uint64_t acm_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void acm_cache_init(void)
+{
+	char *var;
+	int i;
+
+	for (i = 0; i < ACM_CACHE_BUCKETS; i++) {
+		pthread_mutex_init(&acm_cache[i].lock, NULL);
+		list_head_init(&acm_cache[i].list);
+	}
+
+	var = getenv("RDMA_ACM_CACHE_TTL");
+	if (var)
+		acm_cache_ttl = strtoull(var, NULL, 0) * 1000000000ULL;
+}
+
+static struct acm_cache_bucket *acm_cache_bucket(struct acm_msg *msg)
+{
+	uint8_t *key = (uint8_t *) msg->resolve_data;
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < msg->hdr.length - ACM_MSG_HDR_LENGTH; i++)
+		hash = (hash ^ key[i]) * 16777619;
+	return &acm_cache[hash % ACM_CACHE_BUCKETS];
+}
+
+static struct acm_cache_entry *
+acm_cache_find(struct acm_cache_bucket *bucket, struct acm_msg *msg)
+{
+	struct acm_cache_entry *entry;
+	uint16_t key_len = msg->hdr.length - ACM_MSG_HDR_LENGTH;
+
+	list_for_each(&bucket->list, entry, entry) {
+		if (entry->key_len == key_len &&
+		    !memcmp(entry->key, msg->resolve_data, key_len))
+			return entry;
+	}
+	return NULL;
+}
+
+static void acm_cache_remove(struct acm_cache_bucket *bucket,
+			     struct acm_cache_entry *entry)
+{
+	list_del(&entry->entry);
+	bucket->cnt--;
+	free(entry);
+}
+
+static int ucma_ib_query(struct acm_msg *msg)
+{
+	int ret;
+
+	pthread_mutex_lock(&acm_lock);
+	ret = send(sock, (char *) msg, msg->hdr.length, 0);
+	if (ret != msg->hdr.length) {
+		pthread_mutex_unlock(&acm_lock);
+		return -1;
+	}
+
+	ret = recv(sock, (char *) msg, sizeof *msg, 0);
+	pthread_mutex_unlock(&acm_lock);
+	if (ret < ACM_MSG_HDR_LENGTH || ret != msg->hdr.length || msg->hdr.status)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The request is replaced by the response, so the key is taken from the
+ * copy of the request in req.
+ */
+static void acm_cache_put(struct acm_msg *req, struct acm_msg *resp)
+{
+	struct acm_cache_bucket *bucket;
+	struct acm_cache_entry *entry;
+	uint64_t now;
+
+	bucket = acm_cache_bucket(req);
+	pthread_mutex_lock(&bucket->lock);
+	entry = acm_cache_find(bucket, req);
+	if (!entry) {
+		if (bucket->cnt >= ACM_CACHE_BUCKET_MAX)
+			acm_cache_remove(bucket, list_top(&bucket->list,
+						struct acm_cache_entry, entry));
+
+		entry = malloc(sizeof(*entry));
+		if (!entry)
+			goto out;
+
+		entry->key_len = req->hdr.length - ACM_MSG_HDR_LENGTH;
+		memcpy(entry->key, req->resolve_data, entry->key_len);
+		list_add_tail(&bucket->list, &entry->entry);
+		bucket->cnt++;
+	}
+
+	now = acm_time_ns();
+	entry->expires = now + acm_cache_ttl;
+	entry->refresh = now + acm_cache_ttl / 2;
+	entry->refreshing = false;
+	memcpy(&entry->resp, resp, resp->hdr.length);
+out:
+	pthread_mutex_unlock(&bucket->lock);
+}
+
+static void *acm_refresh_thread(void *arg)
+{
+	struct acm_refresh_req *req;
+	struct acm_msg resp;
+
+	while (1) {
+		pthread_mutex_lock(&refresh_lock);
+		while (!(req = list_pop(&refresh_list, struct acm_refresh_req,
+					entry)))
+			pthread_cond_wait(&refresh_cond, &refresh_lock);
+		pthread_mutex_unlock(&refresh_lock);
+
+		memcpy(&resp, &req->msg, req->msg.hdr.length);
+		if (!ucma_ib_query(&resp))
+			acm_cache_put(&req->msg, &resp);
+		free(req);
+	}
+	return NULL;
+}
+
+static void acm_cache_refresh(struct acm_msg *msg)
+{
+	struct acm_refresh_req *req;
+	pthread_t thread;
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return;
+
+	memcpy(&req->msg, msg, msg->hdr.length);
+	pthread_mutex_lock(&refresh_lock);
+	if (!refresh_thread) {
+		if (pthread_create(&thread, NULL, acm_refresh_thread, NULL)) {
+			pthread_mutex_unlock(&refresh_lock);
+			free(req);
+			return;
+		}
+		pthread_detach(thread);
+		refresh_thread = true;
+	}
+	list_add_tail(&refresh_list, &req->entry);
+	pthread_cond_signal(&refresh_cond);
+	pthread_mutex_unlock(&refresh_lock);
+}
+
+/*
+ * Returns true and replaces the request with the cached response on a hit.
+ */
+static bool acm_cache_get(struct acm_msg *msg)
+{
+	struct acm_cache_bucket *bucket;
+	struct acm_cache_entry *entry;
+	bool hit = false;
+	uint64_t now;
+
+	bucket = acm_cache_bucket(msg);
+	pthread_mutex_lock(&bucket->lock);
+	entry = acm_cache_find(bucket, msg);
+	if (!entry)
+		goto out;
+
+	now = acm_time_ns();
+	if (now >= entry->expires) {
+		acm_cache_remove(bucket, entry);
+		goto out;
+	}
+
+	if (now >= entry->refresh && !entry->refreshing) {
+		entry->refreshing = true;
+		acm_cache_refresh(msg);
+	}
+
+	memcpy(msg, &entry->resp, entry->resp.hdr.length);
+	hit = true;
+out:
+	pthread_mutex_unlock(&bucket->lock);
+	return hit;
+}
+
+void ucma_ib_cache_flush(void)
+{
+	struct acm_cache_entry *entry;
+	int i;
+
+	if (!acm_cache_ttl)
+		return;
+
+	for (i = 0; i < ACM_CACHE_BUCKETS; i++) {
+		pthread_mutex_lock(&acm_cache[i].lock);
+		while ((entry = list_top(&acm_cache[i].list,
+					 struct acm_cache_entry, entry)))
+			acm_cache_remove(&acm_cache[i], entry);
+		pthread_mutex_unlock(&acm_cache[i].lock);
+	}
+}
+
 static int ucma_ib_set_addr(struct rdma_addrinfo *ib_rai,
 			    struct rdma_addrinfo *rai)
 {
@@ -297,6 +555,15 @@ static void ucma_ib_save_resp(struct rdma_addrinfo *rai, struct acm_msg *msg)
 	}
 }
 
+static void ucma_ib_save(struct rdma_addrinfo **rai,
+			 const struct rdma_addrinfo *hints, struct acm_msg *msg)
+{
+	ucma_ib_save_resp(*rai, msg);
+
+	if (af_ib_support && !(hints->ai_flags & RAI_ROUTEONLY) && (*rai)->ai_route_len)
+		ucma_resolve_af_ib(rai);
+}
+
 static void ucma_set_ep_addr(struct acm_ep_addr_data *data, struct sockaddr *addr)
 {
 	if (addr->sa_family == AF_INET) {
@@ -319,42 +586,37 @@ static int ucma_ib_addr(struct sockaddr *addr, socklen_t len)
 	return len && addr && (addr->sa_family == AF_IB);
 }
 
-void ucma_ib_resolve(struct rdma_addrinfo **rai,
-		     const struct rdma_addrinfo *hints)
+static void ucma_ib_build_req(struct rdma_addrinfo *rai,
+			      const struct rdma_addrinfo *hints,
+			      struct acm_msg *msg)
 {
-	struct acm_msg msg;
 	struct acm_ep_addr_data *data;
-	int ret;
-
-	ucma_ib_init();
-	if (sock < 0)
-		return;
 
-	memset(&msg, 0, sizeof msg);
-	msg.hdr.version = ACM_VERSION;
-	msg.hdr.opcode = ACM_OP_RESOLVE;
-	msg.hdr.length = ACM_MSG_HDR_LENGTH;
+	memset(msg, 0, sizeof *msg);
+	msg->hdr.version = ACM_VERSION;
+	msg->hdr.opcode = ACM_OP_RESOLVE;
+	msg->hdr.length = ACM_MSG_HDR_LENGTH;
 
-	data = &msg.resolve_data[0];
-	if (ucma_inet_addr((*rai)->ai_src_addr, (*rai)->ai_src_len)) {
+	data = &msg->resolve_data[0];
+	if (ucma_inet_addr(rai->ai_src_addr, rai->ai_src_len)) {
 		data->flags = ACM_EP_FLAG_SOURCE;
-		ucma_set_ep_addr(data, (*rai)->ai_src_addr);
+		ucma_set_ep_addr(data, rai->ai_src_addr);
 		data++;
-		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg->hdr.length += ACM_MSG_EP_LENGTH;
 	}
 
-	if (ucma_inet_addr((*rai)->ai_dst_addr, (*rai)->ai_dst_len)) {
+	if (ucma_inet_addr(rai->ai_dst_addr, rai->ai_dst_len)) {
 		data->flags = ACM_EP_FLAG_DEST;
 		if (hints->ai_flags & (RAI_NUMERICHOST | RAI_NOROUTE))
 			data->flags |= ACM_FLAGS_NODELAY;
-		ucma_set_ep_addr(data, (*rai)->ai_dst_addr);
+		ucma_set_ep_addr(data, rai->ai_dst_addr);
 		data++;
-		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg->hdr.length += ACM_MSG_EP_LENGTH;
 	}
 
 	if (hints->ai_route_len ||
-	    ucma_ib_addr((*rai)->ai_src_addr, (*rai)->ai_src_len) ||
-	    ucma_ib_addr((*rai)->ai_dst_addr, (*rai)->ai_dst_len)) {
+	    ucma_ib_addr(rai->ai_src_addr, rai->ai_src_len) ||
+	    ucma_ib_addr(rai->ai_dst_addr, rai->ai_dst_len)) {
 		struct ibv_path_record *path;
 
 		if (hints->ai_route_len == sizeof(struct ibv_path_record))
@@ -367,33 +629,120 @@ void ucma_ib_resolve(struct rdma_addrinfo **rai,
 		if (path)
 			memcpy(&data->info.path, path, sizeof(*path));
 
-		if (ucma_ib_addr((*rai)->ai_src_addr, (*rai)->ai_src_len)) {
+		if (ucma_ib_addr(rai->ai_src_addr, rai->ai_src_len)) {
 			memcpy(&data->info.path.sgid,
-			       &((struct sockaddr_ib *) (*rai)->ai_src_addr)->sib_addr, 16);
+			       &((struct sockaddr_ib *) rai->ai_src_addr)->sib_addr, 16);
 		}
-		if (ucma_ib_addr((*rai)->ai_dst_addr, (*rai)->ai_dst_len)) {
+		if (ucma_ib_addr(rai->ai_dst_addr, rai->ai_dst_len)) {
 			memcpy(&data->info.path.dgid,
-			       &((struct sockaddr_ib *) (*rai)->ai_dst_addr)->sib_addr, 16);
+			       &((struct sockaddr_ib *) rai->ai_dst_addr)->sib_addr, 16);
 		}
 		data->type = ACM_EP_INFO_PATH;
 		data++;
-		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg->hdr.length += ACM_MSG_EP_LENGTH;
 	}
+}
 
-	pthread_mutex_lock(&acm_lock);
-	ret = send(sock, (char *) &msg, msg.hdr.length, 0);
-	if (ret != msg.hdr.length) {
-		pthread_mutex_unlock(&acm_lock);
+void ucma_ib_resolve(struct rdma_addrinfo **rai,
+		     const struct rdma_addrinfo *hints)
+{
+	struct acm_msg msg, req;
+
+	ucma_ib_init();
+	if (sock < 0)
 		return;
+
+	pthread_once(&acm_cache_once, acm_cache_init);
+	ucma_ib_build_req(*rai, hints, &msg);
+	if (!acm_cache_ttl || !acm_cache_get(&msg)) {
+		if (acm_cache_ttl)
+			memcpy(&req, &msg, msg.hdr.length);
+
+		if (ucma_ib_query(&msg))
+			return;
+
+		if (acm_cache_ttl)
+			acm_cache_put(&req, &msg);
 	}
 
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	pthread_mutex_unlock(&acm_lock);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != msg.hdr.length || msg.hdr.status)
+	ucma_ib_save(rai, hints, &msg);
+}
+
+static int ucma_ib_recv(int fd, struct acm_msg *msg)
+{
+	ssize_t ret;
+
+	ret = recv(fd, (char *) msg, ACM_MSG_HDR_LENGTH, MSG_WAITALL);
+	if (ret != ACM_MSG_HDR_LENGTH || msg->hdr.length < ACM_MSG_HDR_LENGTH ||
+	    msg->hdr.length > sizeof *msg)
+		return -1;
+
+	if (msg->hdr.length == ACM_MSG_HDR_LENGTH)
+		return 0;
+
+	ret = recv(fd, (char *) msg + ACM_MSG_HDR_LENGTH,
+		   msg->hdr.length - ACM_MSG_HDR_LENGTH, MSG_WAITALL);
+	return ret == msg->hdr.length - ACM_MSG_HDR_LENGTH ? 0 : -1;
+}
+
+/*
+ * Resolve a set of requests over one ibacm connection.  Requests are
+ * identified by their tid, and up to ACM_PIPELINE_DEPTH are outstanding
+ * at a time, which keeps both sides from blocking on a full socket.
+ * Requests left unanswered after an error are not resolved, as when
+ * ibacm is not running.
+ */
+#define ACM_PIPELINE_DEPTH	32
+
+void ucma_ib_resolve_batch(int fd, struct ucma_ib_req *reqs, int cnt)
+{
+	struct acm_msg *msgs, resp;
+	int i, next = 0, outstanding = 0;
+
+	if (fd < 0 || !cnt)
 		return;
 
-	ucma_ib_save_resp(*rai, &msg);
+	msgs = calloc(cnt, sizeof(*msgs));
+	if (!msgs)
+		return;
 
-	if (af_ib_support && !(hints->ai_flags & RAI_ROUTEONLY) && (*rai)->ai_route_len)
-		ucma_resolve_af_ib(rai);
+	pthread_once(&acm_cache_once, acm_cache_init);
+	while (next < cnt || outstanding) {
+		for (; next < cnt && outstanding < ACM_PIPELINE_DEPTH; next++) {
+			ucma_ib_build_req(reqs[next].rai, reqs[next].hints,
+					  &msgs[next]);
+			if (acm_cache_ttl) {
+				memcpy(&resp, &msgs[next], msgs[next].hdr.length);
+				if (acm_cache_get(&resp)) {
+					ucma_ib_save(&reqs[next].rai,
+						     reqs[next].hints, &resp);
+					msgs[next].hdr.opcode = 0;
+					continue;
+				}
+			}
+
+			msgs[next].hdr.tid = next;
+			if (send(fd, (char *) &msgs[next], msgs[next].hdr.length,
+				 0) != msgs[next].hdr.length) {
+				next = cnt;
+				break;
+			}
+			outstanding++;
+		}
+
+		if (!outstanding || ucma_ib_recv(fd, &resp))
+			break;
+
+		outstanding--;
+		i = resp.hdr.tid;
+		if (resp.hdr.tid >= (uint64_t) cnt || !msgs[i].hdr.opcode ||
+		    resp.hdr.status)
+			continue;
+
+		msgs[i].hdr.opcode = 0;
+		if (acm_cache_ttl)
+			acm_cache_put(&msgs[i], &resp);
+		ucma_ib_save(&reqs[i].rai, reqs[i].hints, &resp);
+	}
+	free(msgs);
 }
@@ -36,15 +36,42 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <stdbool.h>
 
 #include "cma.h"
 #include <rdma/rdma_cma.h>
 #include <infiniband/ib.h>
+#include <ccan/list.h>
 
 static struct rdma_addrinfo nohints;
 
+/*
+ * Requests submitted to an addrinfo channel are resolved by a thread per
+ * channel.  The thread takes all pending requests at once, resolves their
+ * addresses, and then resolves their routes through the channel's own
+ * ibacm connection, with the queries pipelined.  Completed requests are
+ * queued for the caller, and the channel's eventfd is signaled while the
+ * queue is not empty.
+ */
+struct ai_work {
+	struct list_node	entry;
+	struct rdma_addrinfo_req *req;
+};
+
+struct ai_channel {
+	struct rdma_addrinfo_channel channel;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	pending;
+	struct list_head	done;
+	int			acm_fd;
+	bool			destroy;
+};
+
 static void ucma_convert_to_ai(struct addrinfo *ai,
 			       const struct rdma_addrinfo *rai)
 {
@@ -234,9 +261,12 @@ static int ucma_getaddrinfo(const char *node, const char *service,
 	return ret;
 }
 
-int rdma_getaddrinfo(const char *node, const char *service,
-		     const struct rdma_addrinfo *hints,
-		     struct rdma_addrinfo **res)
+/*
+ * Resolve everything but the route, which is left to ibacm.
+ */
+static int ucma_addrinfo(const char *node, const char *service,
+			 const struct rdma_addrinfo *hints,
+			 struct rdma_addrinfo **res)
 {
 	struct rdma_addrinfo *rai;
 	int ret;
@@ -277,9 +307,6 @@ int rdma_getaddrinfo(const char *node, const char *service,
 			goto err;
 	}
 
-	if (!(rai->ai_flags & RAI_PASSIVE))
-		ucma_ib_resolve(&rai, hints);
-
 	*res = rai;
 	return 0;
 
@@ -288,6 +315,228 @@ err:
 	return ret;
 }
 
+int rdma_getaddrinfo(const char *node, const char *service,
+		     const struct rdma_addrinfo *hints,
+		     struct rdma_addrinfo **res)
+{
+	struct rdma_addrinfo *rai;
+	int ret;
+
+	ret = ucma_addrinfo(node, service, hints, &rai);
+	if (ret)
+		return ret;
+
+	if (!(rai->ai_flags & RAI_PASSIVE))
+		ucma_ib_resolve(&rai, hints ? hints : &nohints);
+
+	*res = rai;
+	return 0;
+}
+
+static void ucma_resolve_work(struct ai_channel *chan, struct list_head *list)
+{
+	struct ucma_ib_req *ib_reqs;
+	struct rdma_addrinfo_req *req;
+	struct ai_work *work;
+	int cnt = 0, i;
+
+	list_for_each(list, work, entry)
+		cnt++;
+
+	ib_reqs = calloc(cnt, sizeof(*ib_reqs));
+	cnt = 0;
+	list_for_each(list, work, entry) {
+		req = work->req;
+		req->res = NULL;
+		req->err = 0;
+		req->status = ucma_addrinfo(req->node, req->service, req->hints,
+					    &req->res);
+		if (req->status) {
+			req->err = errno;
+			continue;
+		}
+
+		if (ib_reqs && !(req->res->ai_flags & RAI_PASSIVE)) {
+			ib_reqs[cnt].rai = req->res;
+			ib_reqs[cnt].hints = req->hints ? req->hints : &nohints;
+			cnt++;
+		}
+	}
+
+	if (!ib_reqs)
+		return;
+
+	ucma_ib_resolve_batch(chan->acm_fd, ib_reqs, cnt);
+
+	/* Route resolution may prepend an AF_IB entry to the results. */
+	i = 0;
+	list_for_each(list, work, entry) {
+		req = work->req;
+		if (!req->status && !(req->res->ai_flags & RAI_PASSIVE))
+			req->res = ib_reqs[i++].rai;
+	}
+	free(ib_reqs);
+}
+
+static void *ucma_addrinfo_thread(void *arg)
+{
+	struct ai_channel *chan = arg;
+	LIST_HEAD(list);
+	uint64_t val = 1;
+
+	pthread_mutex_lock(&chan->lock);
+	while (!chan->destroy) {
+		if (list_empty(&chan->pending)) {
+			pthread_cond_wait(&chan->cond, &chan->lock);
+			continue;
+		}
+
+		list_append_list(&list, &chan->pending);
+		pthread_mutex_unlock(&chan->lock);
+
+		ucma_resolve_work(chan, &list);
+
+		pthread_mutex_lock(&chan->lock);
+		list_append_list(&chan->done, &list);
+		if (write(chan->channel.fd, &val, sizeof val) != sizeof val)
+			break;
+	}
+	pthread_mutex_unlock(&chan->lock);
+	return NULL;
+}
+
+struct rdma_addrinfo_channel *rdma_create_addrinfo_channel(void)
+{
+	struct ai_channel *chan;
+
+	if (ucma_init())
+		return NULL;
+
+	chan = calloc(1, sizeof(*chan));
+	if (!chan) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list_head_init(&chan->pending);
+	list_head_init(&chan->done);
+	pthread_mutex_init(&chan->lock, NULL);
+	pthread_cond_init(&chan->cond, NULL);
+
+	chan->channel.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (chan->channel.fd < 0)
+		goto err1;
+
+	/* Without ibacm, routes are not resolved, as with rdma_getaddrinfo. */
+	chan->acm_fd = ucma_ib_open();
+
+	errno = pthread_create(&chan->thread, NULL, ucma_addrinfo_thread, chan);
+	if (errno)
+		goto err2;
+
+	return &chan->channel;
+
+err2:
+	if (chan->acm_fd >= 0)
+		close(chan->acm_fd);
+	close(chan->channel.fd);
+err1:
+	pthread_cond_destroy(&chan->cond);
+	pthread_mutex_destroy(&chan->lock);
+	free(chan);
+	return NULL;
+}
+
+void rdma_destroy_addrinfo_channel(struct rdma_addrinfo_channel *channel)
+{
+	struct ai_channel *chan;
+	struct ai_work *work;
+
+	chan = container_of(channel, struct ai_channel, channel);
+	pthread_mutex_lock(&chan->lock);
+	chan->destroy = true;
+	pthread_cond_signal(&chan->cond);
+	pthread_mutex_unlock(&chan->lock);
+	pthread_join(chan->thread, NULL);
+
+	while ((work = list_pop(&chan->pending, struct ai_work, entry)))
+		free(work);
+
+	while ((work = list_pop(&chan->done, struct ai_work, entry))) {
+		if (!work->req->status)
+			rdma_freeaddrinfo(work->req->res);
+		work->req->res = NULL;
+		free(work);
+	}
+
+	if (chan->acm_fd >= 0)
+		close(chan->acm_fd);
+	close(chan->channel.fd);
+	pthread_cond_destroy(&chan->cond);
+	pthread_mutex_destroy(&chan->lock);
+	free(chan);
+}
+
+int rdma_getaddrinfo_submit(struct rdma_addrinfo_channel *channel,
+			    struct rdma_addrinfo_req *reqs, int count)
+{
+	struct ai_channel *chan;
+	struct ai_work *work;
+	LIST_HEAD(list);
+	int i;
+
+	if (!reqs || count <= 0)
+		return ERR(EINVAL);
+
+	for (i = 0; i < count; i++) {
+		work = malloc(sizeof(*work));
+		if (!work) {
+			while ((work = list_pop(&list, struct ai_work, entry)))
+				free(work);
+			return ERR(ENOMEM);
+		}
+		work->req = &reqs[i];
+		list_add_tail(&list, &work->entry);
+	}
+
+	chan = container_of(channel, struct ai_channel, channel);
+	pthread_mutex_lock(&chan->lock);
+	list_append_list(&chan->pending, &list);
+	pthread_cond_signal(&chan->cond);
+	pthread_mutex_unlock(&chan->lock);
+	return 0;
+}
+
+int rdma_getaddrinfo_complete(struct rdma_addrinfo_channel *channel,
+			      struct rdma_addrinfo_req **reqs, int num)
+{
+	struct ai_channel *chan;
+	struct ai_work *work;
+	uint64_t val;
+	int i;
+
+	if (!reqs || num < 0)
+		return ERR(EINVAL);
+
+	chan = container_of(channel, struct ai_channel, channel);
+	pthread_mutex_lock(&chan->lock);
+	for (i = 0; i < num; i++) {
+		work = list_pop(&chan->done, struct ai_work, entry);
+		if (!work)
+			break;
+		reqs[i] = work->req;
+		free(work);
+	}
+
+	/* The eventfd stays readable while completions remain. */
+	if (list_empty(&chan->done) &&
+	    read(chan->channel.fd, &val, sizeof val) < 0 && errno != EAGAIN &&
+	    !i)
+		i = -1;
+	pthread_mutex_unlock(&chan->lock);
+	return i;
+}
+
 void rdma_freeaddrinfo(struct rdma_addrinfo *res)
 {
 	struct rdma_addrinfo *rai;
@@ -0,0 +1,285 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <ccan/bitmap.h>
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include <rdma/rdma_verbs.h>
+#include "arena.h"
+
+/*
+ * Buffer arena
+ *
+ * Buffers are carved from slabs of memory that are registered once with
+ * the protection domain of a device.  Slabs are placed on the NUMA node
+ * of the device and backed by 2MB huge pages when those are available,
+ * falling back to transparent huge pages otherwise.  Each slab is divided
+ * into chunks, and a buffer takes the first run of free chunks that is
+ * large enough to hold it.  The length of each run is recorded at its
+ * first chunk, so buffers are freed by address alone.
+ *
+ * All buffers in a slab share the slab's registration, which only allows
+ * local access.  Buffers that a peer writes into are not taken from the
+ * arena, since a freed chunk would remain writable through the slab's rkey
+ * after it is reused by another connection.  A slab is released once it
+ * is empty, unless it is the only empty slab for the device.  The remaining empty slabs
+ * are released when the protection domain is about to be deallocated.
+ */
+#define ARENA_CHUNK_SIZE	(1 << 12)
+#define ARENA_HUGE_PAGE_SIZE	(1 << 21)
+
+struct arena_slab {
+	struct list_node	entry;
+	struct ibv_pd		*pd;
+	struct ibv_mr		*mr;
+	uint8_t			*addr;
+	size_t			size;
+	unsigned long		nchunks;
+	unsigned long		used;
+	bitmap			*free_map;
+	uint32_t		*run_len;
+};
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(slab_list);
+static size_t arena_size;
+
+void rs_arena_configure(size_t size)
+{
+	arena_size = size;
+}
+
+bool rs_arena_enabled(void)
+{
+	return arena_size != 0;
+}
+
+static int arena_numa_node(struct ibv_pd *pd)
+{
+	char path[IBV_SYSFS_PATH_MAX + 32];
+	FILE *f;
+	int node;
+
+	snprintf(path, sizeof path, "%s/device/numa_node",
+		 pd->context->device->ibdev_path);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+static void arena_bind(void *addr, size_t size, int node)
+{
+	unsigned long mask[4] = {};
+
+	if (node < 0 || node >= (int) (sizeof(mask) * 8))
+		return;
+
+	/* Preferred, rather than bound, so allocation can spill over */
+	mask[node / (sizeof(mask[0]) * 8)] = 1UL << (node % (sizeof(mask[0]) * 8));
+	syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+}
+
+static void *arena_map(size_t size)
+{
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED)
+		return addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	madvise(addr, size, MADV_HUGEPAGE);
+	return addr;
+}
+
+static struct arena_slab *arena_add_slab(struct ibv_pd *pd, size_t size)
+{
+	struct arena_slab *slab;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	slab->size = (max(size, arena_size) + ARENA_HUGE_PAGE_SIZE - 1) &
+		     ~((size_t) ARENA_HUGE_PAGE_SIZE - 1);
+	slab->nchunks = slab->size / ARENA_CHUNK_SIZE;
+	slab->free_map = bitmap_alloc1(slab->nchunks);
+	if (!slab->free_map)
+		goto err1;
+
+	slab->run_len = calloc(slab->nchunks, sizeof(*slab->run_len));
+	if (!slab->run_len)
+		goto err2;
+
+	slab->addr = arena_map(slab->size);
+	if (!slab->addr)
+		goto err3;
+
+	/* Pages are placed when first touched, which registration does */
+	arena_bind(slab->addr, slab->size, arena_numa_node(pd));
+
+	slab->mr = ibv_reg_mr(pd, slab->addr, slab->size, IBV_ACCESS_LOCAL_WRITE);
+	if (!slab->mr)
+		goto err4;
+
+	slab->pd = pd;
+	list_add_tail(&slab_list, &slab->entry);
+	return slab;
+
+err4:
+	munmap(slab->addr, slab->size);
+err3:
+	free(slab->run_len);
+err2:
+	free(slab->free_map);
+err1:
+	free(slab);
+	return NULL;
+}
+
+static void arena_remove_slab(struct arena_slab *slab)
+{
+	list_del(&slab->entry);
+	ibv_dereg_mr(slab->mr);
+	munmap(slab->addr, slab->size);
+	free(slab->run_len);
+	free(slab->free_map);
+	free(slab);
+}
+
+static long arena_find_run(struct arena_slab *slab, unsigned long cnt)
+{
+	unsigned long start, end;
+
+	start = bitmap_ffs(slab->free_map, 0, slab->nchunks);
+	while (start + cnt <= slab->nchunks) {
+		for (end = start; end < start + cnt; end++) {
+			if (!bitmap_test_bit(slab->free_map, end))
+				break;
+		}
+		if (end == start + cnt)
+			return start;
+
+		start = bitmap_ffs(slab->free_map, end, slab->nchunks);
+	}
+	return -1;
+}
+
+void *rs_arena_alloc(struct ibv_pd *pd, size_t size, struct ibv_mr **mr)
+{
+	struct arena_slab *slab;
+	unsigned long cnt;
+	long start = -1;
+	void *buf = NULL;
+
+	if (!arena_size || !size)
+		return NULL;
+
+	cnt = (size + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE;
+
+	pthread_mutex_lock(&arena_lock);
+	list_for_each(&slab_list, slab, entry) {
+		if (slab->pd != pd || slab->nchunks - slab->used < cnt)
+			continue;
+
+		start = arena_find_run(slab, cnt);
+		if (start >= 0)
+			break;
+	}
+
+	if (start < 0) {
+		slab = arena_add_slab(pd, cnt * ARENA_CHUNK_SIZE);
+		if (!slab)
+			goto out;
+		start = 0;
+	}
+
+	bitmap_zero_range(slab->free_map, start, start + cnt);
+	slab->run_len[start] = cnt;
+	slab->used += cnt;
+	buf = slab->addr + start * ARENA_CHUNK_SIZE;
+	if (mr)
+		*mr = slab->mr;
+out:
+	pthread_mutex_unlock(&arena_lock);
+	return buf;
+}
+
+static bool arena_other_empty(struct arena_slab *slab)
+{
+	struct arena_slab *other;
+
+	list_for_each(&slab_list, other, entry) {
+		if (other != slab && !other->used && other->pd == slab->pd)
+			return true;
+	}
+	return false;
+}
+
+bool rs_arena_free(void *buf)
+{
+	struct arena_slab *slab;
+	unsigned long start, cnt;
+	bool found = false;
+
+	if (!arena_size)
+		return false;
+
+	pthread_mutex_lock(&arena_lock);
+	list_for_each(&slab_list, slab, entry) {
+		if ((uint8_t *) buf < slab->addr ||
+		    (uint8_t *) buf >= slab->addr + slab->size)
+			continue;
+
+		start = ((uint8_t *) buf - slab->addr) / ARENA_CHUNK_SIZE;
+		cnt = slab->run_len[start];
+		bitmap_fill_range(slab->free_map, start, start + cnt);
+		slab->used -= cnt;
+		if (!slab->used && arena_other_empty(slab))
+			arena_remove_slab(slab);
+		found = true;
+		break;
+	}
+	pthread_mutex_unlock(&arena_lock);
+	return found;
+}
+
+/*
+ * Releases the empty slabs registered with a protection domain, which would
+ * otherwise keep it from being deallocated.
+ */
+void rs_arena_flush(struct ibv_pd *pd)
+{
+	struct arena_slab *slab, *next;
+
+	if (!arena_size)
+		return;
+
+	pthread_mutex_lock(&arena_lock);
+	list_for_each_safe(&slab_list, slab, next, entry) {
+		if (slab->pd == pd && !slab->used)
+			arena_remove_slab(slab);
+	}
+	pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,17 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#if !defined(ARENA_H)
+#define ARENA_H
+
+#include <config.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <infiniband/verbs.h>
+
+void rs_arena_configure(size_t size);
+bool rs_arena_enabled(void);
+void *rs_arena_alloc(struct ibv_pd *pd, size_t size, struct ibv_mr **mr);
+bool rs_arena_free(void *buf);
+void rs_arena_flush(struct ibv_pd *pd);
+
+#endif /* ARENA_H */
@@ -47,9 +47,11 @@
 #include <netdb.h>
 #include <syslog.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/sysmacros.h>
 
 #include "cma.h"
+#include "arena.h"
 #include "indexer.h"
 #include <infiniband/driver.h>
 #include <infiniband/marshall.h>
@@ -57,6 +59,7 @@
 #include <rdma/rdma_cma_abi.h>
 #include <rdma/rdma_verbs.h>
 #include <infiniband/ib.h>
+#include <util/compiler.h>
 #include <util/util.h>
 #include <util/rdma_nl.h>
 
@@ -104,6 +107,7 @@ struct cma_id_private {
 	uint32_t		handle;
 	struct cma_multicast	*mc_list;
 	struct ibv_qp_init_attr	*qp_init_attr;
+	struct rdma_connect_req	*batch_req;
 	uint8_t			initiator_depth;
 	uint8_t			responder_resources;
 };
@@ -126,6 +130,27 @@ struct cma_event {
 	uint8_t			private_data[RDMA_MAX_PRIVATE_DATA];
 	struct cma_id_private	*id_priv;
 	struct cma_multicast	*mc;
+	struct cma_event_channel *chan;
+	struct cma_event	*next;
+};
+
+/*
+ * Acked events are kept on a per channel free list for reuse.  Each
+ * outstanding event holds a reference on its channel, so that the channel
+ * remains valid until the last event is acked.  Events read by
+ * rdma_connect_batch for rdma_cm_id's outside of the batch are queued on
+ * the channel, and returned by the next calls to rdma_get_cm_event.
+ */
+#define CMA_EVENT_FREE_MAX	64
+
+struct cma_event_channel {
+	struct rdma_event_channel channel;
+	pthread_mutex_t		mut;
+	struct cma_event	*free_list;
+	int			free_cnt;
+	int			refcnt;
+	struct cma_event	*defer_head;
+	struct cma_event	*defer_tail;
 };
 
 static struct cma_device *cma_dev_array;
@@ -427,29 +452,143 @@ void rdma_free_devices(struct ibv_context **list)
 
 struct rdma_event_channel *rdma_create_event_channel(void)
 {
-	struct rdma_event_channel *channel;
+	struct cma_event_channel *chan;
 
 	if (ucma_init())
 		return NULL;
 
-	channel = malloc(sizeof(*channel));
-	if (!channel)
+	chan = calloc(1, sizeof(*chan));
+	if (!chan)
 		return NULL;
 
-	channel->fd = open_cdev(dev_name, dev_cdev);
-	if (channel->fd < 0) {
+	chan->channel.fd = open_cdev(dev_name, dev_cdev);
+	if (chan->channel.fd < 0) {
 		goto err;
 	}
-	return channel;
+	pthread_mutex_init(&chan->mut, NULL);
+	chan->refcnt = 1;
+	return &chan->channel;
 err:
-	free(channel);
+	free(chan);
 	return NULL;
 }
 
+static void ucma_put_channel(struct cma_event_channel *chan)
+{
+	struct cma_event *evt;
+	int refcnt;
+
+	pthread_mutex_lock(&chan->mut);
+	refcnt = --chan->refcnt;
+	pthread_mutex_unlock(&chan->mut);
+	if (refcnt)
+		return;
+
+	while ((evt = chan->free_list)) {
+		chan->free_list = evt->next;
+		free(evt);
+	}
+	pthread_mutex_destroy(&chan->mut);
+	free(chan);
+}
+
+static void ucma_defer_event(struct rdma_event_channel *channel,
+			     struct cma_event *evt)
+{
+	struct cma_event_channel *chan;
+
+	chan = container_of(channel, struct cma_event_channel, channel);
+
+	pthread_mutex_lock(&chan->mut);
+	evt->next = NULL;
+	if (chan->defer_tail)
+		chan->defer_tail->next = evt;
+	else
+		chan->defer_head = evt;
+	chan->defer_tail = evt;
+	pthread_mutex_unlock(&chan->mut);
+}
+
+/*
+ * Removes the oldest deferred event, or, if id_priv is set, the oldest
+ * deferred event reported for that rdma_cm_id.
+ */
+static struct cma_event *ucma_get_deferred(struct rdma_event_channel *channel,
+					   struct cma_id_private *id_priv)
+{
+	struct cma_event_channel *chan;
+	struct cma_event *evt, *prev = NULL;
+
+	chan = container_of(channel, struct cma_event_channel, channel);
+	pthread_mutex_lock(&chan->mut);
+	for (evt = chan->defer_head; evt; prev = evt, evt = evt->next) {
+		if (!id_priv || evt->id_priv == id_priv)
+			break;
+	}
+	if (evt) {
+		if (prev)
+			prev->next = evt->next;
+		else
+			chan->defer_head = evt->next;
+		if (chan->defer_tail == evt)
+			chan->defer_tail = prev;
+	}
+	pthread_mutex_unlock(&chan->mut);
+	return evt;
+}
+
 void rdma_destroy_event_channel(struct rdma_event_channel *channel)
 {
+	struct cma_event *evt;
+
+	while ((evt = ucma_get_deferred(channel, NULL)))
+		rdma_ack_cm_event(&evt->event);
 	close(channel->fd);
-	free(channel);
+	ucma_put_channel(container_of(channel, struct cma_event_channel,
+				      channel));
+}
+
+static struct cma_event *ucma_alloc_event(struct rdma_event_channel *channel)
+{
+	struct cma_event_channel *chan;
+	struct cma_event *evt;
+
+	chan = container_of(channel, struct cma_event_channel, channel);
+	pthread_mutex_lock(&chan->mut);
+	evt = chan->free_list;
+	if (evt) {
+		chan->free_list = evt->next;
+		chan->free_cnt--;
+	}
+	chan->refcnt++;
+	pthread_mutex_unlock(&chan->mut);
+
+	if (!evt) {
+		evt = malloc(sizeof(*evt));
+		if (!evt) {
+			ucma_put_channel(chan);
+			return NULL;
+		}
+	}
+	evt->chan = chan;
+	return evt;
+}
+
+static void ucma_free_event(struct cma_event *evt)
+{
+	struct cma_event_channel *chan = evt->chan;
+
+	pthread_mutex_lock(&chan->mut);
+	if (chan->free_cnt < CMA_EVENT_FREE_MAX) {
+		evt->next = chan->free_list;
+		chan->free_list = evt;
+		chan->free_cnt++;
+		evt = NULL;
+	}
+	pthread_mutex_unlock(&chan->mut);
+
+	free(evt);
+	ucma_put_channel(chan);
 }
 
 static int ucma_get_device(struct cma_id_private *id_priv, __be64 guid)
@@ -489,6 +628,8 @@ static void ucma_put_device(struct cma_device *cma_dev)
 {
 	pthread_mutex_lock(&mut);
 	if (!--cma_dev->refcnt) {
+		rdma_mr_cache_flush(cma_dev->pd);
+		rs_arena_flush(cma_dev->pd);
 		ibv_dealloc_pd(cma_dev->pd);
 		if (cma_dev->xrcd)
 			ibv_close_xrcd(cma_dev->xrcd);
@@ -653,6 +794,7 @@ static int ucma_destroy_kern_id(int fd, uint32_t handle)
 int rdma_destroy_id(struct rdma_cm_id *id)
 {
 	struct cma_id_private *id_priv;
+	struct cma_event *evt;
 	int ret;
 
 	id_priv = container_of(id, struct cma_id_private, id);
@@ -663,6 +805,9 @@ int rdma_destroy_id(struct rdma_cm_id *id)
 	if (id_priv->id.event)
 		rdma_ack_cm_event(id_priv->id.event);
 
+	while ((evt = ucma_get_deferred(id->channel, id_priv)))
+		rdma_ack_cm_event(&evt->event);
+
 	pthread_mutex_lock(&id_priv->mut);
 	while (id_priv->events_completed < ret)
 		pthread_cond_wait(&id_priv->cond, &id_priv->mut);
@@ -1966,7 +2111,21 @@ int rdma_ack_cm_event(struct rdma_cm_event *event)
 		ucma_complete_mc_event(evt->mc);
 	else
 		ucma_complete_event(evt->id_priv);
-	free(evt);
+	ucma_free_event(evt);
+	return 0;
+}
+
+int rdma_ack_cm_events(struct rdma_cm_event **events, int num)
+{
+	int i;
+
+	if (!events || num < 0)
+		return ERR(EINVAL);
+
+	for (i = 0; i < num; i++) {
+		if (rdma_ack_cm_event(events[i]))
+			return -1;
+	}
 	return 0;
 }
 
@@ -2156,33 +2315,25 @@ int rdma_establish(struct rdma_cm_id *id)
 						   id));
 }
 
-int rdma_get_cm_event(struct rdma_event_channel *channel,
-		      struct rdma_cm_event **event)
+/*
+ * The private data of an event is only valid up to its private_data_len,
+ * so it is not cleared when an event is reused.
+ */
+static int ucma_read_event(struct rdma_event_channel *channel,
+			   struct cma_event *evt)
 {
 	struct ucma_abi_event_resp resp;
 	struct ucma_abi_get_event cmd;
-	struct cma_event *evt;
 	int ret;
 
-	ret = ucma_init();
-	if (ret)
-		return ret;
-
-	if (!event)
-		return ERR(EINVAL);
-
-	evt = malloc(sizeof(*evt));
-	if (!evt)
-		return ERR(ENOMEM);
-
 retry:
-	memset(evt, 0, sizeof(*evt));
+	memset(&evt->event, 0, sizeof(evt->event));
+	evt->id_priv = NULL;
+	evt->mc = NULL;
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, GET_EVENT, &resp, sizeof resp);
 	ret = write(channel->fd, &cmd, sizeof cmd);
-	if (ret != sizeof cmd) {
-		free(evt);
+	if (ret != sizeof cmd)
 		return (ret >= 0) ? ERR(ENODATA) : -1;
-	}
 	
 	VALGRIND_MAKE_MEM_DEFINED(&resp, sizeof resp);
 
@@ -2284,6 +2435,11 @@ retry:
 		evt->event.id = &evt->id_priv->id;
 		evt->event.param.ud.private_data = evt->mc->context;
 		break;
+	case RDMA_CM_EVENT_ADDR_CHANGE:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		/* Resolved paths may no longer be valid. */
+		ucma_ib_cache_flush();
+		SWITCH_FALLTHROUGH;
 	default:
 		evt->id_priv = (void *) (uintptr_t) resp.uid;
 		evt->event.id = &evt->id_priv->id;
@@ -2295,10 +2451,97 @@ retry:
 		break;
 	}
 
+	return 0;
+}
+
+int rdma_get_cm_event(struct rdma_event_channel *channel,
+		      struct rdma_cm_event **event)
+{
+	struct cma_event *evt;
+	int ret;
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!event)
+		return ERR(EINVAL);
+
+	evt = ucma_get_deferred(channel, NULL);
+	if (evt) {
+		*event = &evt->event;
+		return 0;
+	}
+
+	evt = ucma_alloc_event(channel);
+	if (!evt)
+		return ERR(ENOMEM);
+
+	ret = ucma_read_event(channel, evt);
+	if (ret) {
+		ucma_free_event(evt);
+		return ret;
+	}
+
 	*event = &evt->event;
 	return 0;
 }
 
+static int ucma_event_ready(struct rdma_event_channel *channel)
+{
+	struct pollfd fds;
+
+	fds.fd = channel->fd;
+	fds.events = POLLIN;
+	return poll(&fds, 1, 0) > 0;
+}
+
+/*
+ * The kernel reports a single event per command, so a batch is built from
+ * as many events as are ready.  Only the first event waits, and a channel
+ * that has been made nonblocking is read until it is empty without
+ * polling it first.  An error after the first event ends the batch, and is
+ * reported by the next call.
+ */
+int rdma_get_cm_events(struct rdma_event_channel *channel,
+		       struct rdma_cm_event **events, int num)
+{
+	struct cma_event *evt;
+	int i, ret, flags;
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!events || num <= 0)
+		return ERR(EINVAL);
+
+	flags = fcntl(channel->fd, F_GETFL);
+	for (i = 0; i < num; i++) {
+		evt = ucma_get_deferred(channel, NULL);
+		if (evt) {
+			events[i] = &evt->event;
+			continue;
+		}
+
+		if (i && (flags < 0 || !(flags & O_NONBLOCK)) &&
+		    !ucma_event_ready(channel))
+			break;
+
+		evt = ucma_alloc_event(channel);
+		if (!evt)
+			return i ? i : ERR(ENOMEM);
+
+		ret = ucma_read_event(channel, evt);
+		if (ret) {
+			ucma_free_event(evt);
+			return i ? i : ret;
+		}
+		events[i] = &evt->event;
+	}
+	return i;
+}
+
 const char *rdma_event_str(enum rdma_cm_event_type event)
 {
 	switch (event) {
@@ -2366,6 +2609,7 @@ int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel)
 	struct ucma_abi_migrate_resp resp;
 	struct ucma_abi_migrate_id cmd;
 	struct cma_id_private *id_priv;
+	struct cma_event *evt;
 	int ret, sync;
 
 	id_priv = container_of(id, struct cma_id_private, id);
@@ -2391,6 +2635,10 @@ int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel)
 
 	VALGRIND_MAKE_MEM_DEFINED(&resp, sizeof resp);
 
+	/* Deferred events follow the id, as those still queued in the kernel */
+	while ((evt = ucma_get_deferred(id->channel, id_priv)))
+		ucma_defer_event(channel, evt);
+
 	if (id_priv->sync) {
 		if (id->event) {
 			rdma_ack_cm_event(id->event);
@@ -2416,6 +2664,153 @@ int rdma_migrate_id(struct rdma_cm_id *id, struct rdma_event_channel *channel)
 	return 0;
 }
 
+static uint64_t ucma_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Batched connections track the start time of the current step in
+ * step_ns, and replace it with the time spent once the step completes.
+ */
+static int ucma_batch_start(struct rdma_connect_req *req, int timeout_ms)
+{
+	int ret;
+
+	req->step_ns[req->step] = ucma_time_ns();
+	switch (req->step) {
+	case RDMA_CONNECT_RESOLVE_ADDR:
+		ret = rdma_resolve_addr(req->id, req->src_addr, req->dst_addr,
+					timeout_ms);
+		break;
+	case RDMA_CONNECT_RESOLVE_ROUTE:
+		ret = rdma_resolve_route(req->id, timeout_ms);
+		break;
+	default:
+		if (req->qp_init_attr && !req->id->qp) {
+			ret = rdma_create_qp(req->id, req->pd,
+					     req->qp_init_attr);
+			if (ret)
+				break;
+		}
+		ret = rdma_connect(req->id, req->conn_param);
+		break;
+	}
+
+	if (ret) {
+		req->step_ns[req->step] = 0;
+		req->status = errno;
+	}
+	return ret;
+}
+
+static int ucma_batch_status(struct rdma_cm_event *event)
+{
+	if (event->event == RDMA_CM_EVENT_REJECTED)
+		return ECONNREFUSED;
+	return event->status < 0 ? -event->status : EIO;
+}
+
+/*
+ * Returns 1 once the request has connected or failed.
+ */
+static int ucma_batch_event(struct rdma_connect_req *req,
+			    struct rdma_cm_event *event, int timeout_ms)
+{
+	static const enum rdma_cm_event_type step_event[] = {
+		[RDMA_CONNECT_RESOLVE_ADDR] = RDMA_CM_EVENT_ADDR_RESOLVED,
+		[RDMA_CONNECT_RESOLVE_ROUTE] = RDMA_CM_EVENT_ROUTE_RESOLVED,
+		[RDMA_CONNECT_CONNECT] = RDMA_CM_EVENT_ESTABLISHED,
+	};
+
+	req->step_ns[req->step] = ucma_time_ns() - req->step_ns[req->step];
+	if (event->event != step_event[req->step] &&
+	    (req->step != RDMA_CONNECT_CONNECT ||
+	     event->event != RDMA_CM_EVENT_CONNECT_RESPONSE)) {
+		req->status = ucma_batch_status(event);
+		return 1;
+	}
+
+	/* Without a QP, the connection is completed on the caller's behalf */
+	if (event->event == RDMA_CM_EVENT_CONNECT_RESPONSE &&
+	    rdma_establish(req->id)) {
+		req->status = errno;
+		return 1;
+	}
+
+	if (++req->step == RDMA_CONNECT_DONE)
+		return 1;
+
+	return ucma_batch_start(req, timeout_ms) ? 1 : 0;
+}
+
+int rdma_connect_batch(struct rdma_event_channel *channel,
+		       struct rdma_connect_req *reqs, int count, int timeout_ms)
+{
+	struct cma_id_private *id_priv;
+	struct rdma_connect_req *req;
+	struct rdma_cm_event *event;
+	int i, pending = 0, connected = 0, ret = 0;
+
+	for (i = 0; i < count; i++) {
+		id_priv = container_of(reqs[i].id, struct cma_id_private, id);
+		if (reqs[i].id->channel != channel || id_priv->sync ||
+		    id_priv->batch_req)
+			return ERR(EINVAL);
+	}
+
+	for (i = 0; i < count; i++) {
+		req = &reqs[i];
+		id_priv = container_of(req->id, struct cma_id_private, id);
+		id_priv->batch_req = req;
+		req->status = 0;
+		req->step = RDMA_CONNECT_RESOLVE_ADDR;
+		memset(req->step_ns, 0, sizeof req->step_ns);
+		if (!ucma_batch_start(req, timeout_ms))
+			pending++;
+	}
+
+	while (pending) {
+		ret = rdma_get_cm_event(channel, &event);
+		if (ret)
+			break;
+
+		id_priv = container_of(event->id, struct cma_id_private, id);
+		req = id_priv->batch_req;
+		if (!req) {
+			ucma_defer_event(channel, container_of(event,
+							struct cma_event, event));
+			continue;
+		}
+
+		if (!req->status) {
+			if (req->step != RDMA_CONNECT_DONE) {
+				pending -= ucma_batch_event(req, event,
+							    timeout_ms);
+			} else if (event->event == RDMA_CM_EVENT_DISCONNECTED ||
+				   event->event == RDMA_CM_EVENT_DEVICE_REMOVAL) {
+				req->status = ECONNRESET;
+			}
+		}
+		rdma_ack_cm_event(event);
+	}
+
+	for (i = 0; i < count; i++) {
+		req = &reqs[i];
+		id_priv = container_of(req->id, struct cma_id_private, id);
+		id_priv->batch_req = NULL;
+		if (ret && !req->status && req->step != RDMA_CONNECT_DONE)
+			req->status = errno;
+		if (!req->status && req->step == RDMA_CONNECT_DONE)
+			connected++;
+	}
+
+	return ret ? ret : connected;
+}
+
 static int ucma_passive_ep(struct rdma_cm_id *id, struct rdma_addrinfo *res,
 			   struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 {
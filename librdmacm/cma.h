@@ -41,6 +41,7 @@
 #include <endian.h>
 #include <semaphore.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 
 #include <rdma/rdma_cma.h>
 #include <infiniband/ib.h>
@@ -72,6 +73,12 @@ static inline void fastlock_acquire(fastlock_t *lock)
 	if (atomic_fetch_add(&lock->cnt, 1) > 0)
 		sem_wait(&lock->sem);
 }
+static inline bool fastlock_tryacquire(fastlock_t *lock)
+{
+	int unlocked = 0;
+
+	return atomic_compare_exchange_strong(&lock->cnt, &unlocked, 1);
+}
 static inline void fastlock_release(fastlock_t *lock)
 {
 	if (atomic_fetch_sub(&lock->cnt, 1) > 1)
@@ -101,6 +108,15 @@ void ucma_ib_init(void);
 void ucma_ib_cleanup(void);
 void ucma_ib_resolve(struct rdma_addrinfo **rai,
 		     const struct rdma_addrinfo *hints);
+void ucma_ib_cache_flush(void);
+
+struct ucma_ib_req {
+	struct rdma_addrinfo		*rai;
+	const struct rdma_addrinfo	*hints;
+};
+
+int ucma_ib_open(void);
+void ucma_ib_resolve_batch(int fd, struct ucma_ib_req *reqs, int cnt);
 
 struct ib_connect_hdr {
 	uint8_t  cma_version;
@@ -52,6 +52,8 @@ static char *dst_addr;
 static char *src_addr;
 static int timeout = 2000;
 static int retries = 2;
+static int batch;
+static int accept_mode;
 
 enum step {
 	STEP_CREATE_ID,
@@ -107,6 +109,8 @@ static volatile int completed[STEP_CNT];
 static struct ibv_qp_init_attr init_qp_attr;
 static struct rdma_conn_param conn_param;
 
+#define EVENT_BATCH	64
+
 #define start_perf(n, s)	gettimeofday(&((n)->times[s][0]), NULL)
 #define end_perf(n, s)		gettimeofday(&((n)->times[s][1]), NULL)
 #define start_time(s)		gettimeofday(&times[s][0], NULL)
@@ -159,15 +163,29 @@ static float diff_us(struct timeval *end, struct timeval *start)
 	return (end->tv_sec - start->tv_sec) * 1000000. + (end->tv_usec - start->tv_usec);
 }
 
+static int cmp_us(const void *a, const void *b)
+{
+	float x = *(const float *) a, y = *(const float *) b;
+
+	return (x > y) - (x < y);
+}
+
 static void show_perf(void)
 {
-	int c, i;
-	float us, max[STEP_CNT], min[STEP_CNT];
+	int c, i, cnt;
+	float us, max[STEP_CNT], min[STEP_CNT], p50[STEP_CNT], p99[STEP_CNT];
+	float *samples;
+
+	samples = calloc(connections, sizeof *samples);
+	if (!samples) {
+		perror("out of memory showing results");
+		return;
+	}
 
 	for (i = 0; i < STEP_CNT; i++) {
 		max[i] = 0;
 		min[i] = 999999999.;
-		for (c = 0; c < connections; c++) {
+		for (c = cnt = 0; c < connections; c++) {
 			if (!zero_time(&nodes[c].times[i][0]) &&
 			    !zero_time(&nodes[c].times[i][1])) {
 				us = diff_us(&nodes[c].times[i][1], &nodes[c].times[i][0]);
@@ -175,18 +193,28 @@ static void show_perf(void)
 					max[i] = us;
 				if (us < min[i])
 					min[i] = us;
+				samples[cnt++] = us;
 			}
 		}
+
+		p50[i] = p99[i] = 0;
+		if (cnt) {
+			qsort(samples, cnt, sizeof *samples, cmp_us);
+			p50[i] = samples[(cnt - 1) * 50 / 100];
+			p99[i] = samples[(cnt - 1) * 99 / 100];
+		}
 	}
+	free(samples);
 
-	printf("step              total ms     max ms     min us  us / conn\n");
+	printf("step              total ms     max ms     min us  us / conn     p50 us     p99 us\n");
 	for (i = 0; i < STEP_CNT; i++) {
-		if (i == STEP_BIND && !src_addr)
+		if (zero_time(&times[i][0]))
 			continue;
 
 		us = diff_us(&times[i][1], &times[i][0]);
-		printf("%-13s: %11.2f%11.2f%11.2f%11.2f\n", step_str[i], us / 1000.,
-			max[i] / 1000., min[i], us / connections);
+		printf("%-13s: %11.2f%11.2f%11.2f%11.2f%11.2f%11.2f\n", step_str[i],
+			us / 1000., max[i] / 1000., min[i], us / connections,
+			p50[i], p99[i]);
 	}
 }
 
@@ -413,6 +441,63 @@ static void *process_events(void *arg)
 	return NULL;
 }
 
+/*
+ * Accept connections directly from the event loop, retrieving events in
+ * batches.  The accept rate is reported after each set of connections.
+ * Disconnected ids can only be destroyed once their events are acked.
+ */
+static int accept_events(void)
+{
+	struct rdma_cm_event *events[EVENT_BATCH];
+	struct rdma_cm_id *disc[EVENT_BATCH];
+	int i, n, ndisc, accepted = 0, calls = 0, cnt = 0;
+	struct timeval start, end;
+	float us;
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		n = rdma_get_cm_events(channel, events, EVENT_BATCH);
+		if (n < 0) {
+			perror("failure in rdma_get_cm_events");
+			return errno;
+		}
+
+		calls++;
+		cnt += n;
+		for (i = ndisc = 0; i < n; i++) {
+			switch (events[i]->event) {
+			case RDMA_CM_EVENT_CONNECT_REQUEST:
+				__req_handler(events[i]->id);
+				accepted++;
+				break;
+			case RDMA_CM_EVENT_DISCONNECTED:
+				rdma_disconnect(events[i]->id);
+				disc[ndisc++] = events[i]->id;
+				break;
+			default:
+				break;
+			}
+		}
+		rdma_ack_cm_events(events, n);
+
+		for (i = 0; i < ndisc; i++) {
+			rdma_destroy_qp(disc[i]);
+			rdma_destroy_id(disc[i]);
+		}
+
+		if (accepted >= connections) {
+			gettimeofday(&end, NULL);
+			us = diff_us(&end, &start);
+			printf("accepted %d connections in %.2f ms: %.0f conn/s, %.2f events / call\n",
+			       accepted, us / 1000., accepted * 1000000. / us,
+			       (float) cnt / calls);
+			accepted = calls = cnt = 0;
+			start = end;
+		}
+	}
+	return 0;
+}
+
 static int run_server(void)
 {
 	pthread_t req_thread, disc_thread;
@@ -481,12 +566,99 @@ static int run_server(void)
 		goto out;
 	}
 
-	process_events(NULL);
+	if (accept_mode)
+		ret = accept_events();
+	else
+		process_events(NULL);
  out:
 	rdma_destroy_id(listen_id);
 	return ret;
 }
 
+static void add_ns(struct timeval *t, uint64_t ns)
+{
+	uint64_t usec = t->tv_usec + ns / 1000;
+
+	t->tv_sec += usec / 1000000;
+	t->tv_usec = usec % 1000000;
+}
+
+/*
+ * The overall time of a step is the span from the first connection
+ * starting the step until the last connection completes it.
+ */
+static void set_step_time(int step)
+{
+	int c;
+
+	for (c = 0; c < connections; c++) {
+		if (zero_time(&nodes[c].times[step][1]))
+			continue;
+		if (zero_time(&times[step][0]) ||
+		    timercmp(&nodes[c].times[step][0], &times[step][0], <))
+			times[step][0] = nodes[c].times[step][0];
+		if (timercmp(&nodes[c].times[step][1], &times[step][1], >))
+			times[step][1] = nodes[c].times[step][1];
+	}
+}
+
+/*
+ * Resolve and connect all connections in parallel.  Each connection
+ * starts its next step as soon as its previous step completes, so the
+ * time of each step is rebuilt from the step durations.
+ */
+static int batch_connect(void)
+{
+	static const int batch_step[RDMA_CONNECT_DONE] = {
+		STEP_RESOLVE_ADDR, STEP_RESOLVE_ROUTE, STEP_CONNECT
+	};
+	struct rdma_connect_req *reqs;
+	struct timeval start, t;
+	int i, s, ret;
+
+	reqs = calloc(connections, sizeof *reqs);
+	if (!reqs)
+		return -ENOMEM;
+
+	for (i = 0; i < connections; i++) {
+		reqs[i].id = nodes[i].id;
+		reqs[i].src_addr = rai->ai_src_addr;
+		reqs[i].dst_addr = rai->ai_dst_addr;
+		reqs[i].qp_init_attr = &init_qp_attr;
+		reqs[i].conn_param = &conn_param;
+	}
+
+	printf("connecting in parallel\n");
+	gettimeofday(&start, NULL);
+	ret = rdma_connect_batch(channel, reqs, connections, timeout);
+	if (ret < 0)
+		perror("failure in batch connect");
+	else
+		ret = 0;
+
+	for (i = 0; i < connections; i++) {
+		t = start;
+		for (s = 0; s < reqs[i].step; s++) {
+			nodes[i].times[batch_step[s]][0] = t;
+			add_ns(&t, reqs[i].step_ns[s]);
+			nodes[i].times[batch_step[s]][1] = t;
+		}
+
+		if (reqs[i].status) {
+			printf("connection %d failed %s, error: %d\n", i,
+			       step_str[batch_step[reqs[i].step]],
+			       reqs[i].status);
+			nodes[i].error = 1;
+		}
+	}
+
+	for (s = 0; s < RDMA_CONNECT_DONE; s++)
+		set_step_time(batch_step[s]);
+
+	free(reqs);
+	return ret;
+}
+
 static int run_client(void)
 {
 	pthread_t event_thread;
@@ -504,12 +676,22 @@ static int run_client(void)
 	conn_param.private_data = rai->ai_connect;
 	conn_param.private_data_len = rai->ai_connect_len;
 
+	/* Batch connect retrieves events itself, ahead of the event thread. */
+	if (batch) {
+		ret = batch_connect();
+		if (ret)
+			return ret;
+	}
+
 	ret = pthread_create(&event_thread, NULL, process_events, NULL);
 	if (ret) {
 		perror("failure creating event thread");
 		return ret;
 	}
 
+	if (batch)
+		goto disconnect;
+
 	if (src_addr) {
 		printf("binding source address\n");
 		start_time(STEP_BIND);
@@ -596,6 +778,7 @@ static int run_client(void)
 	while (started[STEP_CONNECT] != completed[STEP_CONNECT]) sched_yield();
 	end_time(STEP_CONNECT);
 
+disconnect:
 	printf("disconnecting\n");
 	start_time(STEP_DISCONNECT);
 	for (i = 0; i < connections; i++) {
@@ -618,7 +801,7 @@ int main(int argc, char **argv)
 
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
-	while ((op = getopt(argc, argv, "s:b:c:p:r:t:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:c:p:r:t:PA")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -638,6 +821,12 @@ int main(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'P':
+			batch = 1;
+			break;
+		case 'A':
+			accept_mode = 1;
+			break;
 		default:
 			printf("usage: %s\n", argv[0]);
 			printf("\t[-s server_address]\n");
@@ -646,6 +835,8 @@ int main(int argc, char **argv)
 			printf("\t[-p port_number]\n");
 			printf("\t[-r retries]\n");
 			printf("\t[-t timeout_ms]\n");
+			printf("\t[-P parallel connect]\n");
+			printf("\t[-A accept rate test (server)]\n");
 			exit(1);
 		}
 	}
@@ -34,13 +34,16 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
 #include <rdma/rdma_cma.h>
+#include <ccan/minmax.h>
 #include "common.h"
 
 int use_rs = 1;
@@ -125,10 +128,11 @@ int size_to_count(int size)
 		return 100000;
 }
 
+/* Data patterns are tracked per thread, one connection per thread. */
 void format_buf(void *buf, int size)
 {
 	uint8_t *array = buf;
-	static uint8_t data;
+	static __thread uint8_t data;
 	int i;
 
 	for (i = 0; i < size; i++)
@@ -137,9 +141,9 @@ void format_buf(void *buf, int size)
 
 int verify_buf(void *buf, int size)
 {
-	static long long total_bytes;
+	static __thread long long total_bytes;
 	uint8_t *array = buf;
-	static uint8_t data;
+	static __thread uint8_t data;
 	int i;
 
 	for (i = 0; i < size; i++, total_bytes++) {
@@ -175,3 +179,159 @@ struct rdma_event_channel *create_first_event_channel(void)
 	}
 	return channel;
 }
+
+/*
+ * Latency histogram
+ *
+ * Values below HIST_SUB_CNT are counted exactly.  Larger values are
+ * counted in buckets that split each power of two into HIST_SUB_CNT / 2
+ * linear steps, which bounds the error of a reported value to under 2%.
+ */
+static int hist_index(uint64_t val)
+{
+	int shift;
+
+	if (val < HIST_SUB_CNT)
+		return val;
+
+	shift = 63 - __builtin_clzll(val) - (HIST_SUB_BITS - 1);
+	return shift * (HIST_SUB_CNT / 2) + (val >> shift);
+}
+
+static uint64_t hist_upper(int index)
+{
+	int shift;
+
+	if (index < HIST_SUB_CNT)
+		return index;
+
+	shift = index / (HIST_SUB_CNT / 2) - 1;
+	return ((uint64_t) (index - shift * (HIST_SUB_CNT / 2) + 1) << shift) - 1;
+}
+
+void hist_init(struct lat_hist *hist)
+{
+	memset(hist, 0, sizeof *hist);
+	hist->min = UINT64_MAX;
+}
+
+void hist_record(struct lat_hist *hist, uint64_t val)
+{
+	hist->counts[hist_index(val)]++;
+	hist->total++;
+	hist->sum += val;
+	if (val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_CNT; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Returns the largest value that falls in the bucket of the percentile. */
+uint64_t hist_value(const struct lat_hist *hist, double percentile)
+{
+	uint64_t cnt, target;
+	int i;
+
+	if (!hist->total)
+		return 0;
+
+	target = (uint64_t) (hist->total * percentile / 100. + .5);
+	if (!target)
+		target = 1;
+
+	for (i = cnt = 0; i < HIST_CNT; i++) {
+		cnt += hist->counts[i];
+		if (cnt >= target)
+			break;
+	}
+	return min(hist_upper(i), hist->max);
+}
+
+int parse_perf_format(const char *arg, enum perf_format *format)
+{
+	if (!strcasecmp(arg, "text"))
+		*format = fmt_text;
+	else if (!strcasecmp(arg, "csv"))
+		*format = fmt_csv;
+	else if (!strcasecmp(arg, "json"))
+		*format = fmt_json;
+	else
+		return -1;
+	return 0;
+}
+
+void print_perf_header(enum perf_format format)
+{
+	if (format != fmt_csv)
+		return;
+
+	printf("tool,name,bytes,xfers,iters,conns,total_bytes,usec,gbps,"
+	       "usec_xfer,cpu_sec_gb,msg_sec,lat_min_us,lat_mean_us,lat_p50_us,"
+	       "lat_p90_us,lat_p99_us,lat_p999_us,lat_max_us\n");
+}
+
+/*
+ * Reports one test as a CSV row, or as a JSON object on a single line.
+ * Latencies are the time per transfer, measured over each iteration.
+ */
+void print_perf(enum perf_format format, const struct perf_result *res)
+{
+	const struct lat_hist *lat = res->lat;
+	double msgs, gbps, usec_xfer, cpu_gb = 0, mean;
+	double lmin, p50, p90, p99, p999, lmax;
+
+	msgs = (double) res->iters * res->xfers * 2 * res->conns;
+	gbps = (res->bytes * 8) / (1000. * res->usec);
+	usec_xfer = (res->usec / res->iters) / (res->xfers * 2);
+	if (res->cpu_usec >= 0)
+		cpu_gb = (res->cpu_usec / 1000000.) / (res->bytes / 1000000000.);
+
+	mean = lat->total ? lat->sum / lat->total / 1000. : 0;
+	lmin = lat->total ? lat->min / 1000. : 0;
+	p50 = hist_value(lat, 50) / 1000.;
+	p90 = hist_value(lat, 90) / 1000.;
+	p99 = hist_value(lat, 99) / 1000.;
+	p999 = hist_value(lat, 99.9) / 1000.;
+	lmax = lat->max / 1000.;
+
+	if (format == fmt_csv) {
+		printf("%s,%s,%d,%d,%d,%d,%lld,%.0f,%.3f,%.3f,", res->tool,
+		       res->name, res->size, res->xfers, res->iters, res->conns,
+		       res->bytes, res->usec, gbps, usec_xfer);
+		if (res->cpu_usec >= 0)
+			printf("%.3f,%.0f,", cpu_gb, msgs / (res->usec / 1000000.));
+		else
+			printf(",,");
+		printf("%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+		       lmin, mean, p50, p90, p99, p999, lmax);
+	} else {
+		printf("{\"tool\": \"%s\", \"name\": \"%s\", \"bytes\": %d, "
+		       "\"xfers\": %d, \"iters\": %d, \"conns\": %d, "
+		       "\"total_bytes\": %lld, \"usec\": %.0f, \"gbps\": %.3f, "
+		       "\"usec_xfer\": %.3f, ", res->tool, res->name, res->size,
+		       res->xfers, res->iters, res->conns, res->bytes, res->usec,
+		       gbps, usec_xfer);
+		if (res->cpu_usec >= 0)
+			printf("\"cpu_sec_gb\": %.3f, \"msg_sec\": %.0f, ",
+			       cpu_gb, msgs / (res->usec / 1000000.));
+		printf("\"lat_us\": {\"min\": %.3f, \"mean\": %.3f, "
+		       "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+		       "\"p99.9\": %.3f, \"max\": %.3f}}\n",
+		       lmin, mean, p50, p90, p99, p999, lmax);
+	}
+	fflush(stdout);
+}
@@ -104,3 +104,44 @@ void format_buf(void *buf, int size);
 int verify_buf(void *buf, int size);
 int do_poll(struct pollfd *fds, int timeout);
 struct rdma_event_channel *create_first_event_channel(void);
+
+#define HIST_SUB_BITS	7
+#define HIST_SUB_CNT	(1 << HIST_SUB_BITS)
+#define HIST_CNT	((64 - HIST_SUB_BITS + 2) * (HIST_SUB_CNT / 2))
+
+struct lat_hist {
+	uint64_t	counts[HIST_CNT];
+	uint64_t	total;
+	uint64_t	min;
+	uint64_t	max;
+	double		sum;
+};
+
+void hist_init(struct lat_hist *hist);
+void hist_record(struct lat_hist *hist, uint64_t val);
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+uint64_t hist_value(const struct lat_hist *hist, double percentile);
+
+enum perf_format {
+	fmt_text,
+	fmt_csv,
+	fmt_json
+};
+
+struct perf_result {
+	const char		*tool;
+	const char		*name;
+	int			size;
+	int			xfers;
+	int			iters;
+	int			conns;
+	long long		bytes;
+	float			usec;
+	/* Negative if not measured. */
+	float			cpu_usec;
+	const struct lat_hist	*lat;
+};
+
+int parse_perf_format(const char *arg, enum perf_format *format);
+void print_perf_header(enum perf_format format);
+void print_perf(enum perf_format format, const struct perf_result *res);
@@ -42,6 +42,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rsocket.h>
@@ -74,7 +76,11 @@ static struct test_size_param test_size[] = {
 };
 #define TEST_CNT (sizeof test_size / sizeof test_size[0])
 
-static int rs, lrs;
+/* Each connection is driven by its own thread. */
+static __thread int rs;
+static __thread void *buf;
+static __thread volatile uint8_t *poll_byte;
+static int lrs;
 static int use_async;
 static int use_rgai;
 static int verify;
@@ -92,19 +98,49 @@ static const char *port = "7471";
 static char *dst_addr;
 static char *src_addr;
 static struct timeval start, end;
-static void *buf;
-static volatile uint8_t *poll_byte;
 static struct rdma_addrinfo rai_hints;
 static struct addrinfo ai_hints;
+static int conn_cnt = 1;
+static enum perf_format format;
+
+struct conn {
+	int			rs;
+	void			*buf;
+	pthread_t		thread;
+	int			ret;
+	struct timeval		start;
+	struct timeval		end;
+	struct lat_hist		lat;
+};
+
+static struct conn *conns;
+static struct lat_hist lat;
 
 static void show_perf(void)
 {
+	struct perf_result res;
 	char str[32];
 	float usec;
 	long long bytes;
 
 	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
-	bytes = (long long) iterations * transfer_count * transfer_size * 2;
+	bytes = (long long) iterations * transfer_count * transfer_size * 2 *
+		conn_cnt;
+
+	if (format != fmt_text) {
+		res.tool = "riostream";
+		res.name = test_name;
+		res.size = transfer_size;
+		res.xfers = transfer_count;
+		res.iters = iterations;
+		res.conns = conn_cnt;
+		res.bytes = bytes;
+		res.usec = usec;
+		res.cpu_usec = -1;
+		res.lat = &lat;
+		print_perf(format, &res);
+		return;
+	}
 
 	/* name size transfers iterations bytes seconds Gb/sec usec/xfer */
 	printf("%-10s", test_name);
@@ -116,9 +152,11 @@ static void show_perf(void)
 	printf("%-8s", str);
 	size_str(str, sizeof str, bytes);
 	printf("%-8s", str);
-	printf("%8.2fs%10.2f%11.2f\n",
+	printf("%8.2fs%10.2f%11.2f%10.2f%10.2f%10.2f\n",
 		usec / 1000000., (bytes * 8) / (1000. * usec),
-		(usec / iterations) / (transfer_count * 2));
+		(usec / iterations) / (transfer_count * 2),
+		hist_value(&lat, 50) / 1000., hist_value(&lat, 99) / 1000.,
+		lat.max / 1000.);
 }
 
 static void init_latency_test(int size)
@@ -257,12 +295,26 @@ static int sync_test(void)
 	return dst_addr ? recv_msg(16) : send_msg(16);
 }
 
-static int run_test(void)
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Each iteration is timed, and its time per transfer is recorded in the
+ * connection's latency histogram.
+ */
+static int run_conn_test(struct conn *c)
 {
+	uint64_t iter_start;
 	int ret, i, t;
 	off_t offset;
 	uint8_t marker = 0;
 
+	hist_init(&c->lat);
 	poll_byte = buf + transfer_size - 1;
 	*poll_byte = -1;
 	offset = riomap(rs, buf, transfer_size, PROT_WRITE, 0, 0);
@@ -275,8 +327,9 @@ static int run_test(void)
 	if (ret)
 		goto out;
 
-	gettimeofday(&start, NULL);
+	gettimeofday(&c->start, NULL);
 	for (i = 0; i < iterations; i++) {
+		iter_start = time_ns();
 		if (dst_addr) {
 			for (t = 0; t < transfer_count - 1; t++) {
 				ret = send_xfer(transfer_size);
@@ -308,15 +361,68 @@ static int run_test(void)
 		}
 		if (ret)
 			goto out;
+		hist_record(&c->lat, (time_ns() - iter_start) /
+				     (transfer_count * 2));
 	}
-	gettimeofday(&end, NULL);
-	show_perf();
+	gettimeofday(&c->end, NULL);
 	ret = riounmap(rs, buf, transfer_size);
 
 out:
 	return ret;
 }
 
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+
+	rs = c->rs;
+	buf = c->buf;
+	c->ret = run_conn_test(c);
+	return NULL;
+}
+
+/*
+ * A single connection is tested from the calling thread.  Otherwise, all
+ * connections are tested at the same time, and the test spans from the
+ * first connection starting until the last one finishing.
+ */
+static int run_test(void)
+{
+	int i, ret = 0;
+
+	if (conn_cnt == 1) {
+		ret = run_conn_test(&conns[0]);
+	} else {
+		for (i = 0; i < conn_cnt; i++) {
+			if (pthread_create(&conns[i].thread, NULL, conn_thread,
+					   &conns[i])) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		for (i = 0; i < conn_cnt; i++) {
+			pthread_join(conns[i].thread, NULL);
+			if (conns[i].ret)
+				ret = conns[i].ret;
+		}
+	}
+	if (ret)
+		return ret;
+
+	hist_init(&lat);
+	start = conns[0].start;
+	end = conns[0].end;
+	for (i = 0; i < conn_cnt; i++) {
+		hist_merge(&lat, &conns[i].lat);
+		if (timercmp(&conns[i].start, &start, <))
+			start = conns[i].start;
+		if (timercmp(&conns[i].end, &end, >))
+			end = conns[i].end;
+	}
+	show_perf();
+	return 0;
+}
+
 static void set_options(int fd)
 {
 	int val;
@@ -388,7 +494,7 @@ static int server_listen(void)
 		goto close;
 	}
 
-	ret = rlisten(lrs, 1);
+	ret = rlisten(lrs, conn_cnt);
 	if (ret)
 		perror("rlisten");
 
@@ -495,27 +601,88 @@ free:
 	return ret;
 }
 
-static int run(void)
+static int connect_all(void)
 {
-	int i, ret = 0;
+	int i, ret;
 
-	buf = malloc(!custom ? test_size[TEST_CNT - 1].size : transfer_size);
-	if (!buf) {
-		perror("malloc");
+	for (i = 0; i < conn_cnt; i++) {
+		ret = dst_addr ? client_connect() : server_connect();
+		if (ret) {
+			while (i--)
+				rclose(conns[i].rs);
+			return ret;
+		}
+		conns[i].rs = rs;
+	}
+	rs = conns[0].rs;
+	return 0;
+}
+
+static void close_all(void)
+{
+	int i;
+
+	for (i = 0; i < conn_cnt; i++) {
+		rshutdown(conns[i].rs, SHUT_RDWR);
+		rclose(conns[i].rs);
+	}
+}
+
+static int alloc_conns(void)
+{
+	int i, size;
+
+	conns = calloc(conn_cnt, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
 		return -1;
 	}
 
+	size = !custom ? test_size[TEST_CNT - 1].size : transfer_size;
+	for (i = 0; i < conn_cnt; i++) {
+		conns[i].buf = malloc(size);
+		if (!conns[i].buf) {
+			perror("malloc");
+			return -1;
+		}
+	}
+	buf = conns[0].buf;
+	return 0;
+}
+
+static void free_conns(void)
+{
+	int i;
+
+	for (i = 0; i < conn_cnt; i++)
+		free(conns[i].buf);
+	free(conns);
+}
+
+static int run(void)
+{
+	int i, ret = 0;
+
+	ret = alloc_conns();
+	if (ret)
+		goto free;
+
 	if (!dst_addr) {
 		ret = server_listen();
 		if (ret)
 			goto free;
 	}
 
-	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s\n",
-	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec", "usec/xfer");
+	if (format == fmt_text)
+		printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s%10s%10s%10s\n",
+		       "name", "bytes", "xfers", "iters", "total", "time",
+		       "Gb/sec", "usec/xfer", "p50 usec", "p99 usec",
+		       "max usec");
+	else
+		print_perf_header(format);
 	if (!custom) {
 		optimization = opt_latency;
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 
@@ -525,11 +692,10 @@ static int run(void)
 			init_latency_test(test_size[i].size);
 			run_test();
 		}
-		rshutdown(rs, SHUT_RDWR);
-		rclose(rs);
+		close_all();
 
 		optimization = opt_bandwidth;
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 		for (i = 0; i < TEST_CNT; i++) {
@@ -539,17 +705,17 @@ static int run(void)
 			run_test();
 		}
 	} else {
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 
 		ret = run_test();
 	}
 
-	rshutdown(rs, SHUT_RDWR);
-	rclose(rs);
+	close_all();
 free:
-	free(buf);
+	if (conns)
+		free_conns();
 	return ret;
 }
 
@@ -594,7 +760,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:c:O:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -638,6 +804,13 @@ int main(int argc, char **argv)
 		case 'p':
 			port = optarg;
 			break;
+		case 'c':
+			conn_cnt = atoi(optarg);
+			break;
+		case 'O':
+			if (parse_perf_format(optarg, &format))
+				fprintf(stderr, "Warning: unknown output format\n");
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -655,6 +828,9 @@ int main(int argc, char **argv)
 			printf("\t[-C transfer_count]\n");
 			printf("\t[-S transfer_size or all]\n");
 			printf("\t[-p port_number]\n");
+			printf("\t[-c connections]\n");
+			printf("\t[-O output_format]\n");
+			printf("\t    text, csv, or json\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
 			printf("\t    b|blocking - use blocking calls\n");
@@ -667,6 +843,11 @@ int main(int argc, char **argv)
 	if (!(flags & MSG_DONTWAIT))
 		poll_timeout = -1;
 
+	if (conn_cnt < 1) {
+		fprintf(stderr, "Error: invalid number of connections\n");
+		exit(1);
+	}
+
 	ret = run();
 	return ret;
 }
@@ -37,11 +37,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rsocket.h>
@@ -74,7 +77,10 @@ static struct test_size_param test_size[] = {
 };
 #define TEST_CNT (sizeof test_size / sizeof test_size[0])
 
-static int rs, lrs;
+/* Each connection is driven by its own thread. */
+static __thread int rs;
+static __thread void *buf;
+static int lrs;
 static int use_async;
 static int use_rgai;
 static int verify;
@@ -92,23 +98,64 @@ static int buffer_size, inline_size = 64;
 static char test_name[10] = "custom";
 static const char *port = "7471";
 static int keepalive;
+static int zcopy_size;
+static int lockless;
 static char *dst_addr;
 static char *src_addr;
 static struct timeval start, end;
-static void *buf;
+static struct rusage start_usage, end_usage;
 static struct rdma_addrinfo rai_hints;
 static struct addrinfo ai_hints;
+static int conn_cnt = 1;
+static enum perf_format format;
+
+struct conn {
+	int			rs;
+	void			*buf;
+	pthread_t		thread;
+	int			ret;
+	struct timeval		start;
+	struct timeval		end;
+	struct lat_hist		lat;
+};
+
+static struct conn *conns;
+static struct lat_hist lat;
+
+static float cpu_usec(struct rusage *usage)
+{
+	return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000. +
+	       usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
 
 static void show_perf(void)
 {
+	struct perf_result res;
 	char str[32];
-	float usec;
+	float usec, cpu;
 	long long bytes;
 
 	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
-	bytes = (long long) iterations * transfer_count * transfer_size * 2;
+	cpu = cpu_usec(&end_usage) - cpu_usec(&start_usage);
+	bytes = (long long) iterations * transfer_count * transfer_size * 2 *
+		conn_cnt;
+
+	if (format != fmt_text) {
+		res.tool = "rstream";
+		res.name = test_name;
+		res.size = transfer_size;
+		res.xfers = transfer_count;
+		res.iters = iterations;
+		res.conns = conn_cnt;
+		res.bytes = bytes;
+		res.usec = usec;
+		res.cpu_usec = cpu;
+		res.lat = &lat;
+		print_perf(format, &res);
+		return;
+	}
 
-	/* name size transfers iterations bytes seconds Gb/sec usec/xfer */
+	/* name size transfers iterations bytes seconds Gb/sec usec/xfer cpu/GB msg/sec */
 	printf("%-10s", test_name);
 	size_str(str, sizeof str, transfer_size);
 	printf("%-8s", str);
@@ -118,9 +165,13 @@ static void show_perf(void)
 	printf("%-8s", str);
 	size_str(str, sizeof str, bytes);
 	printf("%-8s", str);
-	printf("%8.2fs%10.2f%11.2f\n",
+	printf("%8.2fs%10.2f%11.2f%11.3fs%11.0f%10.2f%10.2f%10.2f\n",
 		usec / 1000000., (bytes * 8) / (1000. * usec),
-		(usec / iterations) / (transfer_count * 2));
+		(usec / iterations) / (transfer_count * 2),
+		(cpu / 1000000.) / (bytes / 1000000000.),
+		(iterations * transfer_count * 2 * conn_cnt) / (usec / 1000000.),
+		hist_value(&lat, 50) / 1000., hist_value(&lat, 99) / 1000.,
+		lat.max / 1000.);
 }
 
 static void init_latency_test(int size)
@@ -223,16 +274,31 @@ static int sync_test(void)
 	return dst_addr ? recv_xfer(16) : send_xfer(16);
 }
 
-static int run_test(void)
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Each iteration is timed, and its time per transfer is recorded in the
+ * connection's latency histogram.
+ */
+static int run_conn_test(struct conn *c)
 {
+	uint64_t iter_start;
 	int ret, i, t;
 
+	hist_init(&c->lat);
 	ret = sync_test();
 	if (ret)
 		goto out;
 
-	gettimeofday(&start, NULL);
+	gettimeofday(&c->start, NULL);
 	for (i = 0; i < iterations; i++) {
+		iter_start = time_ns();
 		for (t = 0; t < transfer_count; t++) {
 			ret = dst_addr ? send_xfer(transfer_size) :
 					 recv_xfer(transfer_size);
@@ -246,15 +312,70 @@ static int run_test(void)
 			if (ret)
 				goto out;
 		}
+		hist_record(&c->lat, (time_ns() - iter_start) /
+				     (transfer_count * 2));
 	}
-	gettimeofday(&end, NULL);
-	show_perf();
+	gettimeofday(&c->end, NULL);
 	ret = 0;
 
 out:
 	return ret;
 }
 
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+
+	rs = c->rs;
+	buf = c->buf;
+	c->ret = run_conn_test(c);
+	return NULL;
+}
+
+/*
+ * A single connection is tested from the calling thread.  Otherwise, all
+ * connections are tested at the same time, and the test spans from the
+ * first connection starting until the last one finishing.
+ */
+static int run_test(void)
+{
+	int i, ret = 0;
+
+	getrusage(RUSAGE_SELF, &start_usage);
+	if (conn_cnt == 1) {
+		ret = run_conn_test(&conns[0]);
+	} else {
+		for (i = 0; i < conn_cnt; i++) {
+			if (pthread_create(&conns[i].thread, NULL, conn_thread,
+					   &conns[i])) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		for (i = 0; i < conn_cnt; i++) {
+			pthread_join(conns[i].thread, NULL);
+			if (conns[i].ret)
+				ret = conns[i].ret;
+		}
+	}
+	getrusage(RUSAGE_SELF, &end_usage);
+	if (ret)
+		return ret;
+
+	hist_init(&lat);
+	start = conns[0].start;
+	end = conns[0].end;
+	for (i = 0; i < conn_cnt; i++) {
+		hist_merge(&lat, &conns[i].lat);
+		if (timercmp(&conns[i].start, &start, <))
+			start = conns[i].start;
+		if (timercmp(&conns[i].end, &end, >))
+			end = conns[i].end;
+	}
+	show_perf();
+	return 0;
+}
+
 static void set_keepalive(int fd)
 {
 	int optval;
@@ -307,6 +428,14 @@ static void set_options(int fd)
 			val = 0;
 			rs_setsockopt(fd, SOL_RDMA, RDMA_INLINE, &val, sizeof val);
 		}
+
+		if (zcopy_size)
+			rs_setsockopt(fd, SOL_RDMA, RDMA_ZEROCOPY, &zcopy_size,
+				      sizeof zcopy_size);
+
+		if (lockless)
+			rs_setsockopt(fd, SOL_RDMA, RDMA_LOCKLESS, &lockless,
+				      sizeof lockless);
 	}
 
 	if (keepalive)
@@ -352,7 +481,7 @@ static int server_listen(void)
 		goto close;
 	}
 
-	ret = rs_listen(lrs, 1);
+	ret = rs_listen(lrs, conn_cnt);
 	if (ret)
 		perror("rlisten");
 
@@ -498,27 +627,89 @@ free:
 	return ret;
 }
 
-static int run(void)
+static int connect_all(void)
 {
-	int i, ret = 0;
+	int i, ret;
+
+	for (i = 0; i < conn_cnt; i++) {
+		ret = dst_addr ? client_connect() : server_connect();
+		if (ret) {
+			while (i--)
+				rs_close(conns[i].rs);
+			return ret;
+		}
+		conns[i].rs = rs;
+	}
+	rs = conns[0].rs;
+	return 0;
+}
+
+static void close_all(void)
+{
+	int i;
+
+	for (i = 0; i < conn_cnt; i++) {
+		if (!fork_pid)
+			rs_shutdown(conns[i].rs, SHUT_RDWR);
+		rs_close(conns[i].rs);
+	}
+}
+
+static int alloc_conns(void)
+{
+	int i, size;
 
-	buf = malloc(!custom ? test_size[TEST_CNT - 1].size : transfer_size);
-	if (!buf) {
-		perror("malloc");
+	conns = calloc(conn_cnt, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
 		return -1;
 	}
 
+	size = !custom ? test_size[TEST_CNT - 1].size : transfer_size;
+	for (i = 0; i < conn_cnt; i++) {
+		conns[i].buf = malloc(size);
+		if (!conns[i].buf) {
+			perror("malloc");
+			return -1;
+		}
+	}
+	buf = conns[0].buf;
+	return 0;
+}
+
+static void free_conns(void)
+{
+	int i;
+
+	for (i = 0; i < conn_cnt; i++)
+		free(conns[i].buf);
+	free(conns);
+}
+
+static int run(void)
+{
+	int i, ret = 0;
+
+	ret = alloc_conns();
+	if (ret)
+		goto free;
+
 	if (!dst_addr) {
 		ret = server_listen();
 		if (ret)
 			goto free;
 	}
 
-	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s\n",
-	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec", "usec/xfer");
+	if (format == fmt_text)
+		printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s%10s%11s%10s%10s%10s\n",
+		       "name", "bytes", "xfers", "iters", "total", "time",
+		       "Gb/sec", "usec/xfer", "cpu/GB", "msg/sec", "p50 usec",
+		       "p99 usec", "max usec");
+	else
+		print_perf_header(format);
 	if (!custom) {
 		optimization = opt_latency;
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 
@@ -530,15 +721,13 @@ static int run(void)
 		}
 		if (fork_pid)
 			waitpid(fork_pid, NULL, 0);
-		else
-			rs_shutdown(rs, SHUT_RDWR);
-		rs_close(rs);
+		close_all();
 
 		if (!dst_addr && use_fork && !fork_pid)
 			goto free;
 
 		optimization = opt_bandwidth;
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 		for (i = 0; i < TEST_CNT && !fork_pid; i++) {
@@ -548,7 +737,7 @@ static int run(void)
 			run_test();
 		}
 	} else {
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 
@@ -558,11 +747,10 @@ static int run(void)
 
 	if (fork_pid)
 		waitpid(fork_pid, NULL, 0);
-	else
-		rs_shutdown(rs, SHUT_RDWR);
-	rs_close(rs);
+	close_all();
 free:
-	free(buf);
+	if (conns)
+		free_conns();
 	return ret;
 }
 
@@ -583,6 +771,9 @@ static int set_test_opt(const char *arg)
 			use_fork = 1;
 			use_rs = 0;
 			break;
+		case 'l':
+			lockless = 1;
+			break;
 		case 'n':
 			flags |= MSG_DONTWAIT;
 			break;
@@ -592,6 +783,9 @@ static int set_test_opt(const char *arg)
 		case 'v':
 			verify = 1;
 			break;
+		case 'z':
+			zcopy_size = 1 << 16;
+			break;
 		default:
 			return -1;
 		}
@@ -611,6 +805,10 @@ static int set_test_opt(const char *arg)
 		} else if (!strncasecmp("fork", arg, 4)) {
 			use_fork = 1;
 			use_rs = 0;
+		} else if (!strncasecmp("lockless", arg, 8)) {
+			lockless = 1;
+		} else if (!strncasecmp("zerocopy", arg, 8)) {
+			zcopy_size = 1 << 16;
 		} else {
 			return -1;
 		}
@@ -624,7 +822,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:c:O:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -671,6 +869,13 @@ int main(int argc, char **argv)
 		case 'k':
 			keepalive = atoi(optarg);
 			break;
+		case 'c':
+			conn_cnt = atoi(optarg);
+			break;
+		case 'O':
+			if (parse_perf_format(optarg, &format))
+				fprintf(stderr, "Warning: unknown output format\n");
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -689,14 +894,19 @@ int main(int argc, char **argv)
 			printf("\t[-S transfer_size or all]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-k keepalive_time]\n");
+			printf("\t[-c connections]\n");
+			printf("\t[-O output_format]\n");
+			printf("\t    text, csv, or json\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
 			printf("\t    b|blocking - use blocking calls\n");
 			printf("\t    f|fork - fork server processing\n");
+			printf("\t    l|lockless - skip rsocket locks (single thread)\n");
 			printf("\t    n|nonblocking - use nonblocking calls\n");
 			printf("\t    r|resolve - use rdma cm to resolve address\n");
 			printf("\t    v|verify - verify data\n");
+			printf("\t    z|zerocopy - send transfers of 64k or more without copying\n");
 			exit(1);
 		}
 	}
@@ -704,6 +914,15 @@ int main(int argc, char **argv)
 	if (!(flags & MSG_DONTWAIT))
 		poll_timeout = -1;
 
+	if (conn_cnt < 1) {
+		fprintf(stderr, "Error: invalid number of connections\n");
+		exit(1);
+	}
+	if (use_fork && conn_cnt > 1) {
+		fprintf(stderr, "Error: fork processing requires a single connection\n");
+		exit(1);
+	}
+
 	ret = run();
 	return ret;
 }
@@ -162,3 +162,13 @@ void *idm_clear(struct index_map *idm, int index)
 	entry[idx_entry_index(index)] = NULL;
 	return item;
 }
+
+void idm_destroy(struct index_map *idm)
+{
+	int i;
+
+	for (i = 0; i < IDX_ARRAY_SIZE; i++) {
+		free(idm->array[i]);
+		idm->array[i] = NULL;
+	}
+}
@@ -87,6 +87,7 @@ struct index_map
 
 int idm_set(struct index_map *idm, int index, void *item);
 void *idm_clear(struct index_map *idm, int index);
+void idm_destroy(struct index_map *idm);
 
 static inline void *idm_at(struct index_map *idm, int index)
 {
@@ -0,0 +1,339 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include <util/cl_qmap.h>
+#include <rdma/rdma_verbs.h>
+
+/*
+ * Memory registration cache
+ *
+ * Registrations are tracked per protection domain in an ordered map of
+ * non-overlapping address ranges, keyed by start address.  Finding the
+ * registration that covers a buffer is a lookup of the range that starts
+ * at or before it.  Registrations are page aligned and merged with the
+ * cached ranges that they overlap.  Registrations that allow remote access
+ * are never cached, so that a key handed to a peer stops working as soon
+ * as the caller releases it.
+ *
+ * Registrations are reference counted.  Unused registrations are kept on
+ * an LRU list, and are released once the size of all cached ranges
+ * exceeds the configured budget.  Ranges that are invalidated, or that are
+ * overlapped by a new registration, are removed from the map, but remain
+ * valid until released by their last user.
+ *
+ * The cache is disabled unless RDMA_MR_CACHE_SIZE is set to the number of
+ * bytes that may be kept registered.
+ */
+#define MRC_LOCAL_ACCESS  (IBV_ACCESS_LOCAL_WRITE)
+
+struct mrc_pd {
+	struct ibv_pd		*pd;
+	cl_qmap_t		range_map;
+	struct list_node	entry;
+};
+
+struct mrc_entry {
+	cl_map_item_t		range_item;
+	cl_map_item_t		mr_item;
+	struct list_node	lru_entry;
+	struct mrc_pd		*mrc_pd;
+	struct ibv_mr		*mr;
+	uintptr_t		start;
+	uintptr_t		end;
+	int			access;
+	int			refcnt;
+	bool			attached;
+};
+
+static pthread_once_t mrc_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(mrc_pd_list);
+static LIST_HEAD(mrc_lru);
+static cl_qmap_t mrc_mr_map;
+static size_t mrc_budget;
+static size_t mrc_size;
+static uintptr_t mrc_page_mask;
+
+static void mrc_init(void)
+{
+	char *var;
+
+	cl_qmap_init(&mrc_mr_map);
+	mrc_page_mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+
+	var = getenv("RDMA_MR_CACHE_SIZE");
+	if (var)
+		mrc_budget = strtoull(var, NULL, 0);
+}
+
+static struct mrc_pd *mrc_find_pd(struct ibv_pd *pd)
+{
+	struct mrc_pd *mpd;
+
+	list_for_each(&mrc_pd_list, mpd, entry) {
+		if (mpd->pd == pd)
+			return mpd;
+	}
+	return NULL;
+}
+
+static struct mrc_pd *mrc_get_pd(struct ibv_pd *pd)
+{
+	struct mrc_pd *mpd;
+
+	mpd = mrc_find_pd(pd);
+	if (mpd)
+		return mpd;
+
+	mpd = calloc(1, sizeof(*mpd));
+	if (!mpd)
+		return NULL;
+
+	mpd->pd = pd;
+	cl_qmap_init(&mpd->range_map);
+	list_add(&mrc_pd_list, &mpd->entry);
+	return mpd;
+}
+
+/*
+ * Return the first cached range that ends after addr.
+ */
+static cl_map_item_t *mrc_first(struct mrc_pd *mpd, uintptr_t addr)
+{
+	cl_map_item_t *item, *prev;
+
+	item = cl_qmap_get_next(&mpd->range_map, addr);
+	prev = (item == cl_qmap_end(&mpd->range_map)) ?
+	       cl_qmap_tail(&mpd->range_map) : cl_qmap_prev(item);
+
+	if (prev != cl_qmap_end(&mpd->range_map) &&
+	    container_of(prev, struct mrc_entry, range_item)->end > addr)
+		return prev;
+	return item;
+}
+
+static struct mrc_entry *mrc_overlap(struct mrc_pd *mpd, cl_map_item_t *item,
+				     uintptr_t end)
+{
+	if (item == cl_qmap_end(&mpd->range_map) || cl_qmap_key(item) >= end)
+		return NULL;
+	return container_of(item, struct mrc_entry, range_item);
+}
+
+static void mrc_free(struct mrc_entry *entry)
+{
+	cl_qmap_remove_item(&mrc_mr_map, &entry->mr_item);
+	ibv_dereg_mr(entry->mr);
+	free(entry);
+}
+
+static void mrc_detach(struct mrc_entry *entry)
+{
+	cl_qmap_remove_item(&entry->mrc_pd->range_map, &entry->range_item);
+	entry->attached = false;
+	mrc_size -= entry->end - entry->start;
+	if (!entry->refcnt) {
+		list_del(&entry->lru_entry);
+		mrc_free(entry);
+	}
+}
+
+static void mrc_detach_range(struct mrc_pd *mpd, uintptr_t start, uintptr_t end)
+{
+	struct mrc_entry *entry;
+	cl_map_item_t *item;
+
+	item = mrc_first(mpd, start);
+	while ((entry = mrc_overlap(mpd, item, end))) {
+		item = cl_qmap_next(item);
+		mrc_detach(entry);
+	}
+}
+
+static void mrc_evict(void)
+{
+	struct mrc_entry *entry;
+
+	while (mrc_size > mrc_budget) {
+		entry = list_top(&mrc_lru, struct mrc_entry, lru_entry);
+		if (!entry)
+			break;
+		mrc_detach(entry);
+	}
+}
+
+static bool mrc_match(struct mrc_entry *entry, uintptr_t start, uintptr_t end,
+		      int access)
+{
+	return entry->start <= start && end <= entry->end &&
+	       (entry->access & access) == access;
+}
+
+static struct ibv_mr *mrc_insert(struct mrc_pd *mpd, uintptr_t start,
+				 uintptr_t end, int access)
+{
+	struct mrc_entry *entry;
+	struct ibv_mr *mr = NULL;
+	uintptr_t merge_start, merge_end;
+	cl_map_item_t *item;
+	int merge_access;
+
+	start &= mrc_page_mask;
+	end = (end + ~mrc_page_mask) & mrc_page_mask;
+
+	merge_start = start;
+	merge_end = end;
+	merge_access = access;
+	item = mrc_first(mpd, start);
+	while ((entry = mrc_overlap(mpd, item, end))) {
+		merge_start = min(merge_start, entry->start);
+		merge_end = max(merge_end, entry->end);
+		merge_access |= entry->access;
+		item = cl_qmap_next(item);
+	}
+
+	if (merge_start != start || merge_end != end ||
+	    merge_access != access) {
+		mr = ibv_reg_mr(mpd->pd, (void *) merge_start,
+				merge_end - merge_start, merge_access);
+		if (mr) {
+			start = merge_start;
+			end = merge_end;
+			access = merge_access;
+		}
+	}
+
+	if (!mr) {
+		mr = ibv_reg_mr(mpd->pd, (void *) start, end - start, access);
+		if (!mr)
+			return NULL;
+	}
+
+	/* Without an entry, the registration is simply not cached. */
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return mr;
+
+	mrc_detach_range(mpd, start, end);
+
+	entry->mrc_pd = mpd;
+	entry->mr = mr;
+	entry->start = start;
+	entry->end = end;
+	entry->access = access;
+	entry->refcnt = 1;
+	entry->attached = true;
+	cl_qmap_insert(&mpd->range_map, start, &entry->range_item);
+	cl_qmap_insert(&mrc_mr_map, (uintptr_t) mr, &entry->mr_item);
+	mrc_size += end - start;
+	mrc_evict();
+	return mr;
+}
+
+struct ibv_mr *rdma_mr_cache_reg(struct ibv_pd *pd, void *addr, size_t length,
+				 int access)
+{
+	struct mrc_entry *entry;
+	struct mrc_pd *mpd;
+	struct ibv_mr *mr;
+	uintptr_t start, end;
+	cl_map_item_t *item;
+
+	pthread_once(&mrc_once, mrc_init);
+	if (!mrc_budget || !length || (access & ~MRC_LOCAL_ACCESS))
+		return ibv_reg_mr(pd, addr, length, access);
+
+	start = (uintptr_t) addr;
+	end = start + length;
+
+	pthread_mutex_lock(&mrc_lock);
+	mpd = mrc_get_pd(pd);
+	if (!mpd) {
+		mr = ibv_reg_mr(pd, addr, length, access);
+		goto out;
+	}
+
+	item = mrc_first(mpd, start);
+	entry = mrc_overlap(mpd, item, end);
+	if (entry && mrc_match(entry, start, end, access)) {
+		if (!entry->refcnt++)
+			list_del(&entry->lru_entry);
+		mr = entry->mr;
+		goto out;
+	}
+
+	mr = mrc_insert(mpd, start, end, access);
+out:
+	pthread_mutex_unlock(&mrc_lock);
+	return mr;
+}
+
+int rdma_mr_cache_dereg(struct ibv_mr *mr)
+{
+	struct mrc_entry *entry;
+	cl_map_item_t *item;
+
+	if (mrc_budget) {
+		pthread_mutex_lock(&mrc_lock);
+		item = cl_qmap_get(&mrc_mr_map, (uintptr_t) mr);
+		if (item != cl_qmap_end(&mrc_mr_map)) {
+			entry = container_of(item, struct mrc_entry, mr_item);
+			if (!--entry->refcnt) {
+				if (entry->attached) {
+					list_add_tail(&mrc_lru, &entry->lru_entry);
+					mrc_evict();
+				} else {
+					mrc_free(entry);
+				}
+			}
+			pthread_mutex_unlock(&mrc_lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&mrc_lock);
+	}
+
+	return rdma_seterrno(ibv_dereg_mr(mr));
+}
+
+void rdma_mr_cache_invalidate(void *addr, size_t length)
+{
+	struct mrc_pd *mpd;
+	uintptr_t start;
+
+	/* Nothing can be cached before the budget has been read. */
+	if (!mrc_budget || !length)
+		return;
+
+	start = (uintptr_t) addr;
+	pthread_mutex_lock(&mrc_lock);
+	list_for_each(&mrc_pd_list, mpd, entry)
+		mrc_detach_range(mpd, start, start + length);
+	pthread_mutex_unlock(&mrc_lock);
+}
+
+void rdma_mr_cache_flush(struct ibv_pd *pd)
+{
+	struct mrc_pd *mpd;
+
+	if (!mrc_budget)
+		return;
+
+	pthread_mutex_lock(&mrc_lock);
+	mpd = mrc_find_pd(pd);
+	if (mpd) {
+		mrc_detach_range(mpd, 0, UINTPTR_MAX);
+		list_del(&mpd->entry);
+		free(mpd);
+	}
+	pthread_mutex_unlock(&mrc_lock);
+}
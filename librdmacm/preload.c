@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <netdb.h>
@@ -50,8 +51,13 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
+#include <inttypes.h>
 
 #include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <ccan/minmax.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
@@ -69,15 +75,31 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
+#ifdef HAVE_EPOLL_PWAIT2
+	int (*epoll_pwait2)(int epfd, struct epoll_event *events, int maxevents,
+			    const struct timespec *timeout,
+			    const sigset_t *sigmask);
+#endif
 	int (*shutdown)(int socket, int how);
 	int (*close)(int socket);
 	int (*getpeername)(int socket, struct sockaddr *addr, socklen_t *addrlen);
@@ -102,10 +124,14 @@ static int sq_size;
 static int rq_size;
 static int sq_inline;
 static int fork_support;
+static size_t sendfile_window = 1 << 20;
+static int stats_signal;
+static sem_t stats_sem;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_repoll
 };
 
 enum fd_fork_state {
@@ -252,35 +278,39 @@ static int intercept_socket(int domain, int type, int protocol)
 	return 0;
 }
 
-static int fd_open(void)
+static int fd_insert(int index)
 {
 	struct fd_info *fdi;
-	int ret, index;
+	int ret;
 
 	fdi = calloc(1, sizeof(*fdi));
 	if (!fdi)
 		return ERR(ENOMEM);
 
-	index = open("/dev/null", O_RDONLY);
-	if (index < 0) {
-		ret = index;
-		goto err1;
-	}
-
 	fdi->dupfd = -1;
 	atomic_store(&fdi->refcnt, 1);
 	pthread_mutex_lock(&mut);
 	ret = idm_set(&idm, index, fdi);
 	pthread_mutex_unlock(&mut);
-	if (ret < 0)
-		goto err2;
+	if (ret < 0) {
+		free(fdi);
+		return ret;
+	}
 
 	return index;
+}
 
-err2:
-	real.close(index);
-err1:
-	free(fdi);
+static int fd_open(void)
+{
+	int ret, index;
+
+	index = open("/dev/null", O_RDONLY);
+	if (index < 0)
+		return index;
+
+	ret = fd_insert(index);
+	if (ret < 0)
+		real.close(index);
 	return ret;
 }
 
@@ -371,6 +401,101 @@ static void getenv_options(void)
 	var = getenv("RDMAV_FORK_SAFE");
 	if (var)
 		fork_support = atoi(var);
+
+	var = getenv("RS_SENDFILE_WINDOW");
+	if (var && strtoul(var, NULL, 0))
+		sendfile_window = strtoul(var, NULL, 0);
+
+	var = getenv("RS_STATS_SIGNAL");
+	if (var) {
+		if (!strncmp(var, "SIG", 3))
+			var += 3;
+		if (!strcmp(var, "USR1"))
+			stats_signal = SIGUSR1;
+		else if (!strcmp(var, "USR2"))
+			stats_signal = SIGUSR2;
+		else
+			stats_signal = atoi(var);
+	}
+}
+
+static void stats_dump(void)
+{
+	struct rsocket_stats stats;
+	struct fd_info *fdi;
+	socklen_t len;
+	int index;
+
+	pthread_mutex_lock(&mut);
+	for (index = 0; index <= IDX_MAX_INDEX; index++) {
+		fdi = idm_lookup(&idm, index);
+		if (!fdi || fdi->type != fd_rsocket)
+			continue;
+
+		len = sizeof stats;
+		if (rs.getsockopt(fdi->fd, SOL_RDMA, RDMA_STATS, &stats, &len))
+			continue;
+
+		fprintf(stderr, "rsocket %d: "
+			"bytes_sent %" PRIu64 " bytes_recv %" PRIu64 " "
+			"msgs_sent %" PRIu64 " msgs_recv %" PRIu64 " "
+			"inline %" PRIu64 " copy %" PRIu64 " zcopy %" PRIu64 " "
+			"dr %" PRIu64 " iomap_writes %" PRIu64 " "
+			"iomap_updates %" PRIu64 " "
+			"sq_waits %" PRIu64 " sq_wait_us %" PRIu64 " "
+			"credit_waits %" PRIu64 " credit_wait_us %" PRIu64 " "
+			"cq_polls %" PRIu64 " cq_events %" PRIu64 "\n",
+			index, stats.bytes_sent, stats.bytes_recv,
+			stats.msgs_sent, stats.msgs_recv, stats.inline_sends,
+			stats.copy_sends, stats.zcopy_sends, stats.dr_sends,
+			stats.iomap_writes, stats.iomap_updates, stats.sq_waits,
+			stats.sq_wait_time, stats.credit_waits,
+			stats.credit_wait_time, stats.cq_polls, stats.cq_events);
+	}
+	pthread_mutex_unlock(&mut);
+}
+
+/*
+ * The signal handler only wakes the dump thread, which is free to take
+ * locks and call into the rsocket library.
+ */
+static void *stats_thread(void *arg)
+{
+	while (1) {
+		if (sem_wait(&stats_sem))
+			continue;
+		stats_dump();
+	}
+	return NULL;
+}
+
+static void stats_handler(int signum)
+{
+	sem_post(&stats_sem);
+}
+
+static void init_stats(void)
+{
+	struct sigaction act;
+	pthread_t thread;
+
+	if (stats_signal <= 0 || stats_signal >= NSIG)
+		return;
+
+	if (sem_init(&stats_sem, 0, 0))
+		return;
+
+	if (pthread_create(&thread, NULL, stats_thread, NULL)) {
+		sem_destroy(&stats_sem);
+		return;
+	}
+	pthread_detach(thread);
+
+	memset(&act, 0, sizeof act);
+	act.sa_handler = stats_handler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	sigaction(stats_signal, &act, NULL);
 }
 
 static void init_preload(void)
@@ -393,14 +518,24 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+#ifdef HAVE_EPOLL_PWAIT2
+	real.epoll_pwait2 = dlsym(RTLD_NEXT, "epoll_pwait2");
+#endif
 	real.shutdown = dlsym(RTLD_NEXT, "shutdown");
 	real.close = dlsym(RTLD_NEXT, "close");
 	real.getpeername = dlsym(RTLD_NEXT, "getpeername");
@@ -420,11 +555,13 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
@@ -438,6 +575,7 @@ static void init_preload(void)
 
 	getenv_options();
 	scan_config();
+	init_stats();
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -809,6 +947,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -848,6 +995,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -992,6 +1147,136 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 	return ret;
 }
 
+/*
+ * All epoll sets are converted into repoll sets, so that rsockets and
+ * normal fds may be monitored together.  The application is given the
+ * kernel epoll fd that backs the repoll set, so calls other than the epoll
+ * calls, or adding the set to another poll set, operate on a real epoll fd.
+ */
+static int epoll_open(int size, int flags)
+{
+	int ret;
+
+	ret = repoll_create(size);
+	if (ret < 0)
+		return ret;
+
+	if (fd_insert(ret) < 0) {
+		rclose(ret);
+		return -1;
+	}
+
+	fd_store(ret, ret, fd_repoll, fd_ready);
+	if (!(flags & EPOLL_CLOEXEC))
+		real.fcntl(ret, F_SETFD, 0);
+	return ret;
+}
+
+int epoll_create(int size)
+{
+	int ret;
+
+	init_preload();
+	ret = epoll_open(size, 0);
+	return (ret < 0 && errno != EINVAL) ? real.epoll_create(size) : ret;
+}
+
+int epoll_create1(int flags)
+{
+	int ret;
+
+	init_preload();
+	if (flags & ~EPOLL_CLOEXEC)
+		return ERR(EINVAL);
+
+	ret = epoll_open(1, flags);
+	return (ret < 0) ? real.epoll_create1(flags) : ret;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_ctl(efd, op, fd_getd(fd), event) :
+		real.epoll_ctl(efd, op, fd_getd(fd), event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_wait(efd, events, maxevents, timeout) :
+		real.epoll_wait(efd, events, maxevents, timeout);
+}
+
+/*
+ * The signal mask is replaced around repoll_wait.  Unlike epoll_pwait, this
+ * is not atomic: a signal that is delivered after the mask is replaced,
+ * but before repoll_wait sleeps, does not interrupt the wait.
+ */
+static int repoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+			int timeout, const sigset_t *sigmask)
+{
+	sigset_t oldmask;
+	int ret, err;
+
+	if (sigmask) {
+		ret = pthread_sigmask(SIG_SETMASK, sigmask, &oldmask);
+		if (ret)
+			return ERR(ret);
+	}
+
+	ret = repoll_wait(epfd, events, maxevents, timeout);
+
+	if (sigmask) {
+		err = errno;
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		errno = err;
+	}
+	return ret;
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_pwait(efd, events, maxevents, timeout, sigmask) :
+		real.epoll_pwait(efd, events, maxevents, timeout, sigmask);
+}
+
+#ifdef HAVE_EPOLL_PWAIT2
+int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents,
+		 const struct timespec *timeout, const sigset_t *sigmask)
+{
+	int64_t msecs;
+	int efd;
+
+	init_preload();
+	if (fd_get(epfd, &efd) != fd_repoll)
+		return real.epoll_pwait2(efd, events, maxevents, timeout,
+					 sigmask);
+
+	if (!timeout) {
+		msecs = -1;
+	} else {
+		if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+		    timeout->tv_nsec >= 1000000000)
+			return ERR(EINVAL);
+		msecs = min_t(int64_t, timeout->tv_sec, INT32_MAX / 1000) * 1000 +
+			(timeout->tv_nsec + 999999) / 1000000;
+		msecs = min_t(int64_t, msecs, INT32_MAX);
+	}
+	return repoll_pwait(efd, events, maxevents, (int) msecs, sigmask);
+}
+#endif
+
 int shutdown(int socket, int how)
 {
 	int fd;
@@ -1019,8 +1304,10 @@ int close(int socket)
 		return 0;
 
 	idm_clear(&idm, socket);
-	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	/* A repoll set's own index is the epoll fd closed by rclose */
+	if (socket != fdi->fd || fdi->type != fd_repoll)
+		real.close(socket);
+	ret = (fdi->type != fd_normal) ? rclose(fdi->fd) : real.close(fdi->fd);
 	free(fdi);
 	return ret;
 }
@@ -1152,26 +1439,120 @@ int dup2(int oldfd, int newfd)
 	return newfd;
 }
 
+/*
+ * The file is sent one window at a time.  Each window is mapped, or read
+ * if the file cannot be mapped.  Readahead of the next window is started
+ * before the current window is written, so that file I/O overlaps with
+ * the RDMA transfer.
+ */
+static ssize_t sendfile_windows(int fd, int in_fd, off_t pos, size_t count)
+{
+	off_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	size_t len, delta, sent = 0;
+	void *map, *buf = NULL;
+	ssize_t ret = 0;
+
+	posix_fadvise(in_fd, pos, min(count, sendfile_window),
+		      POSIX_FADV_WILLNEED);
+	while (sent < count) {
+		len = min(count - sent, sendfile_window);
+		if (count - sent > len)
+			posix_fadvise(in_fd, pos + sent + len,
+				      min(count - sent - len, sendfile_window),
+				      POSIX_FADV_WILLNEED);
+
+		delta = (pos + sent) & page_mask;
+		map = mmap(NULL, len + delta, PROT_READ, MAP_SHARED, in_fd,
+			   pos + sent - delta);
+		if (map != MAP_FAILED) {
+			ret = rwrite(fd, map + delta, len);
+			munmap(map, len + delta);
+		} else {
+			if (!buf) {
+				buf = malloc(sendfile_window);
+				if (!buf) {
+					ret = -1;
+					break;
+				}
+			}
+
+			ret = pread(in_fd, buf, len, pos + sent);
+			if (ret <= 0)
+				break;
+			len = ret;
+			ret = rwrite(fd, buf, len);
+		}
+
+		if (ret <= 0)
+			break;
+		sent += ret;
+		if ((size_t) ret < len)
+			break;
+	}
+
+	free(buf);
+	return sent ? sent : ret;
+}
+
 ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	void *file_addr;
+	struct stat st;
+	off_t pos;
+	ssize_t ret;
 	int fd;
-	size_t ret;
 
 	if (fd_get(out_fd, &fd) != fd_rsocket)
 		return real.sendfile(fd, in_fd, offset, count);
 
-	file_addr = mmap(NULL, count, PROT_READ, 0, in_fd, offset ? *offset : 0);
-	if (file_addr == (void *) -1)
+	pos = offset ? *offset : lseek(in_fd, 0, SEEK_CUR);
+	if (pos < 0)
 		return -1;
 
-	ret = rwrite(fd, file_addr, count);
-	if ((ret > 0) && offset)
-		lseek(in_fd, ret, SEEK_CUR);
-	munmap(file_addr, count);
+	/* Mapping past the end of the file would fault. */
+	if (!fstat(in_fd, &st) && S_ISREG(st.st_mode)) {
+		if (pos >= st.st_size)
+			return 0;
+		if (count > st.st_size - pos)
+			count = st.st_size - pos;
+	}
+
+	ret = sendfile_windows(fd, in_fd, pos, count);
+	if (ret > 0) {
+		if (offset)
+			*offset = pos + ret;
+		else
+			lseek(in_fd, pos + ret, SEEK_SET);
+	}
 	return ret;
 }
 
+/*
+ * Cached memory registrations must not outlive the mappings that they
+ * cover.  These calls may be made before we have been initialized, so
+ * we go directly to the kernel.
+ */
+int munmap(void *addr, size_t length)
+{
+	rdma_mr_cache_invalidate(addr, length);
+	return syscall(SYS_munmap, addr, length);
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+	void *new_address = NULL;
+	va_list args;
+
+	if (flags & MREMAP_FIXED) {
+		va_start(args, flags);
+		new_address = va_arg(args, void *);
+		va_end(args);
+	}
+
+	rdma_mr_cache_invalidate(old_address, old_size);
+	return (void *) syscall(SYS_mremap, old_address, old_size, new_size,
+				flags, new_address);
+}
+
 int __fxstat(int ver, int socket, struct stat *buf)
 {
 	int fd, ret;
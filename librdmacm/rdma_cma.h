@@ -197,6 +197,21 @@ struct rdma_addrinfo {
 	struct rdma_addrinfo	*ai_next;
 };
 
+struct rdma_addrinfo_channel {
+	int			fd;
+};
+
+struct rdma_addrinfo_req {
+	const char			*node;
+	const char			*service;
+	const struct rdma_addrinfo	*hints;
+	void				*context;
+	/* Set on completion. */
+	struct rdma_addrinfo		*res;
+	int				status;
+	int				err;
+};
+
 /* Multicast join compatibility mask attributes */
 enum rdma_cm_join_mc_attr_mask {
 	RDMA_CM_JOIN_MC_ATTR_ADDRESS	= 1 << 0,
@@ -459,6 +474,49 @@ int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param);
  */
 int rdma_establish(struct rdma_cm_id *id);
 
+enum rdma_connect_step {
+	RDMA_CONNECT_RESOLVE_ADDR,
+	RDMA_CONNECT_RESOLVE_ROUTE,
+	RDMA_CONNECT_CONNECT,
+	RDMA_CONNECT_DONE
+};
+
+struct rdma_connect_req {
+	struct rdma_cm_id	*id;
+	struct sockaddr		*src_addr;
+	struct sockaddr		*dst_addr;
+	struct ibv_pd		*pd;
+	struct ibv_qp_init_attr	*qp_init_attr;
+	struct rdma_conn_param	*conn_param;
+	/* Set on return. */
+	int			status;
+	enum rdma_connect_step	step;
+	uint64_t		step_ns[RDMA_CONNECT_DONE];
+};
+
+/**
+ * rdma_connect_batch - Establish a set of connections concurrently.
+ * @channel: Event channel reporting events for all rdma_cm_id's.
+ * @reqs: Array of connection requests.
+ * @count: Number of entries in the request array.
+ * @timeout_ms: Time to wait for address and route resolution to complete.
+ * Description:
+ *   Resolves the address and route of each request, optionally creates a QP,
+ *   and connects, with all requests in flight at once.  Each request
+ *   advances as soon as its own events are reported on the channel.
+ * Notes:
+ *   Each rdma_cm_id must have been created on the specified channel.
+ *   Events for other rdma_cm_id's on the channel are queued and returned
+ *   by later calls to rdma_get_cm_event.  Without a QP, rdma_establish is
+ *   called once the connection response is received.  On return, the status and step of each request indicate
+ *   whether it connected, or the step at which it failed.  The time spent
+ *   in each step is returned in nanoseconds.
+ * See also:
+ *   rdma_resolve_addr, rdma_resolve_route, rdma_create_qp, rdma_connect
+ */
+int rdma_connect_batch(struct rdma_event_channel *channel,
+		       struct rdma_connect_req *reqs, int count, int timeout_ms);
+
 /**
  * rdma_listen - Listen for incoming connection requests.
  * @id: RDMA identifier.
@@ -650,6 +708,36 @@ int rdma_get_cm_event(struct rdma_event_channel *channel,
  */
 int rdma_ack_cm_event(struct rdma_cm_event *event);
 
+/**
+ * rdma_get_cm_events - Retrieves a set of pending communication events.
+ * @channel: Event channel to check for events.
+ * @events: Array to receive the retrieved events.
+ * @num: Maximum number of events to retrieve.
+ * Description:
+ *   Retrieves up to num communication events, and returns the number of
+ *   events retrieved.  If no events are pending, by default, the call will
+ *   block until an event is received.  Events that are not yet pending
+ *   when the call returns are left for a later call.
+ * Notes:
+ *   Each retrieved event must be acknowledged by calling rdma_ack_cm_event
+ *   or rdma_ack_cm_events.
+ * See also:
+ *   rdma_get_cm_event, rdma_ack_cm_events
+ */
+int rdma_get_cm_events(struct rdma_event_channel *channel,
+		       struct rdma_cm_event **events, int num);
+
+/**
+ * rdma_ack_cm_events - Free a set of communication events.
+ * @events: Array of events to be released.
+ * @num: Number of events in the array.
+ * Description:
+ *   Releases each event in the array, as if by rdma_ack_cm_event.
+ * See also:
+ *   rdma_get_cm_events, rdma_ack_cm_event
+ */
+int rdma_ack_cm_events(struct rdma_cm_event **events, int num);
+
 __be16 rdma_get_src_port(struct rdma_cm_id *id);
 __be16 rdma_get_dst_port(struct rdma_cm_id *id);
 
@@ -743,6 +831,56 @@ int rdma_getaddrinfo(const char *node, const char *service,
 
 void rdma_freeaddrinfo(struct rdma_addrinfo *res);
 
+/**
+ * rdma_create_addrinfo_channel - Open a channel for asynchronous resolution.
+ * Description:
+ *   Returns a channel on which rdma_getaddrinfo requests are resolved in
+ *   the background.  The channel's file descriptor is readable while
+ *   completed requests are waiting to be retrieved.
+ * See also:
+ *   rdma_getaddrinfo_submit, rdma_getaddrinfo_complete,
+ *   rdma_destroy_addrinfo_channel
+ */
+struct rdma_addrinfo_channel *rdma_create_addrinfo_channel(void);
+
+/**
+ * rdma_destroy_addrinfo_channel - Close an address resolution channel.
+ * @channel: The channel to destroy.
+ * Description:
+ *   Waits for the resolution in progress to finish, and releases the
+ *   results of all requests that have not been retrieved.
+ */
+void rdma_destroy_addrinfo_channel(struct rdma_addrinfo_channel *channel);
+
+/**
+ * rdma_getaddrinfo_submit - Queue a set of address resolution requests.
+ * @channel: Channel that resolves the requests.
+ * @reqs: Array of requests.
+ * @count: Number of requests in the array.
+ * Description:
+ *   Each request is resolved as if by rdma_getaddrinfo with its node,
+ *   service and hints.  The requests must remain valid until they are
+ *   returned by rdma_getaddrinfo_complete.
+ * See also:
+ *   rdma_getaddrinfo_complete, rdma_getaddrinfo
+ */
+int rdma_getaddrinfo_submit(struct rdma_addrinfo_channel *channel,
+			    struct rdma_addrinfo_req *reqs, int count);
+
+/**
+ * rdma_getaddrinfo_complete - Retrieve completed resolution requests.
+ * @channel: Channel that resolved the requests.
+ * @reqs: Array to receive the completed requests.
+ * @num: Maximum number of requests to retrieve.
+ * Description:
+ *   Returns the number of completed requests stored in reqs, which is 0 if
+ *   none have completed.  The call does not block.
+ * See also:
+ *   rdma_getaddrinfo_submit
+ */
+int rdma_getaddrinfo_complete(struct rdma_addrinfo_channel *channel,
+			      struct rdma_addrinfo_req **reqs, int num);
+
 /**
  * rdma_init_qp_attr - Returns QP attributes.
  * @id: Communication identifier.
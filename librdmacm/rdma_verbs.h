@@ -61,6 +61,15 @@ int rdma_create_srq_ex(struct rdma_cm_id *id, struct ibv_srq_init_attr_ex *attr)
 void rdma_destroy_srq(struct rdma_cm_id *id);
 
 
+/*
+ * Memory registration cache.
+ */
+struct ibv_mr *rdma_mr_cache_reg(struct ibv_pd *pd, void *addr, size_t length,
+				 int access);
+int rdma_mr_cache_dereg(struct ibv_mr *mr);
+void rdma_mr_cache_invalidate(void *addr, size_t length);
+void rdma_mr_cache_flush(struct ibv_pd *pd);
+
 /*
  * Memory registration helpers.
  */
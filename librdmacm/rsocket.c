@@ -47,7 +47,8 @@
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
-#include <search.h>
+#include <sys/syscall.h>
+#include <signal.h>
 #include <time.h>
 #include <byteswap.h>
 #include <util/compiler.h>
@@ -57,6 +58,7 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 #include <rdma/rsocket.h>
+#include "arena.h"
 #include "cma.h"
 #include "indexer.h"
 
@@ -68,7 +70,15 @@
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_MAX_POLL_BATCH 64
+#define RS_MAX_STRIPES 4
+#define RS_STRIPE_MIN_SIZE 8192
+#define RS_STRIPE_PSN 0
+#define RS_DR_SIZE 16
+#define RS_DR_MAX_WRITE (1 << 28)
+#define DS_MMSG_BATCH 16
 static struct index_map idm;
+static struct index_map repoll_idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t svc_mut = PTHREAD_MUTEX_INITIALIZER;
 
@@ -134,8 +144,14 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t max_mem;
+static uint32_t max_wmem;
+static uint32_t arena_size;
 static uint32_t polling_time = 10;
+static uint32_t polling_time_max = 0;
+static uint32_t yield_time_max = 0;
 static int wake_up_interval = 5000;
+static int poll_batch = 32;
 
 /*
  * Immediate data format is determined by the upper bits
@@ -145,28 +161,44 @@ static int wake_up_interval = 5000;
  *
  * for data transfers:
  * bits [28:0]: bytes transferred
+ * with striping, bits [28:17]: sequence number, bits [16:0]: bytes transferred
  * for control messages:
  * SGL, CTRL
  * bits [28-0]: receive credits granted
  * IOMAP_SGL
  * bits [28-16]: reserved, bits [15-0]: index
+ * with striping, bits [28:17]: sequence number
+ *
+ * for direct-receive transfers (DRA, DRA_MORE):
+ * same as data transfers.  The data was written into the receive buffer
+ * posted by the peer, which is complete unless more data is available.
  */
 
 enum {
 	RS_OP_DATA,
 	RS_OP_RSVD_DATA_MORE,
-	RS_OP_WRITE, /* opcode is not transmitted over the network */
-	RS_OP_RSVD_DRA_MORE,
+	RS_OP_DRA,
+	RS_OP_DRA_MORE,
 	RS_OP_SGL,
 	RS_OP_RSVD,
 	RS_OP_IOMAP_SGL,
 	RS_OP_CTRL
 };
+/* Direct writes have no immediate data and reuse the DRA opcode locally */
+#define RS_OP_WRITE RS_OP_DRA
+
 #define rs_msg_set(op, data)  ((op << 29) | (uint32_t) (data))
 #define rs_msg_op(imm_data)   (imm_data >> 29)
 #define rs_msg_data(imm_data) (imm_data & 0x1FFFFFFF)
 #define RS_MSG_SIZE	      sizeof(uint32_t)
 
+#define RS_SEQ_BITS	      12
+#define RS_SEQ_SHIFT	      17
+#define RS_SEQ_MASK	      ((1 << RS_SEQ_BITS) - 1)
+#define rs_msg_tag(seq)	      (((uint32_t) (seq) & RS_SEQ_MASK) << RS_SEQ_SHIFT)
+#define rs_msg_seq(imm_data)  ((rs_msg_data(imm_data) >> RS_SEQ_SHIFT) & RS_SEQ_MASK)
+#define rs_msg_len(imm_data)  (imm_data & ((1 << RS_SEQ_SHIFT) - 1))
+
 #define RS_WR_ID_FLAG_RECV (((uint64_t) 1) << 63)
 #define RS_WR_ID_FLAG_MSG_SEND (((uint64_t) 1) << 62) /* See RS_OPT_MSG_SEND */
 #define rs_send_wr_id(data) ((uint64_t) data)
@@ -178,7 +210,10 @@ enum {
 enum {
 	RS_CTRL_DISCONNECT,
 	RS_CTRL_KEEPALIVE,
-	RS_CTRL_SHUTDOWN
+	RS_CTRL_SHUTDOWN,
+	RS_CTRL_STRIPE,
+	RS_CTRL_DR,
+	RS_CTRL_GROW
 };
 
 struct rs_msg {
@@ -211,6 +246,8 @@ struct rs_iomap {
 
 struct rs_iomap_mr {
 	uint64_t offset;
+	void *addr;
+	size_t length;
 	struct ibv_mr *mr;
 	dlist_entry entry;
 	_Atomic(int) refcnt;
@@ -221,6 +258,9 @@ struct rs_iomap_mr {
 #define rs_host_is_net()   (__BYTE_ORDER == __BIG_ENDIAN)
 #define RS_CONN_FLAG_NET   (1 << 0)
 #define RS_CONN_FLAG_IOMAP (1 << 1)
+#define RS_CONN_FLAG_STRIPE (1 << 2)
+#define RS_CONN_FLAG_DR    (1 << 3)
+#define RS_CONN_FLAG_TUNE  (1 << 4)
 
 struct rs_conn_data {
 	uint8_t		  version;
@@ -230,6 +270,31 @@ struct rs_conn_data {
 	uint8_t		  target_iomap_size;
 	struct rs_sge	  target_sgl;
 	struct rs_sge	  data_buf;
+	__be32		  stripe_qpn[RS_MAX_STRIPES];
+};
+
+/*
+ * Additional QPs that carry large data transfers of a stream rsocket.
+ * Stripes share the completion channel of the primary QP, but use their
+ * own CQ, each on a different completion vector.
+ */
+struct rs_stripe {
+	struct ibv_cq	  *cq;
+	struct ibv_qp	  *qp;
+};
+
+/*
+ * Receive buffers posted by the application through rpostrecv.  The peer
+ * writes data directly into these buffers, which are filled in the order
+ * that they were posted.
+ */
+struct rs_dr {
+	void		  *buf;
+	struct ibv_mr	  *mr;
+	uint32_t	  len;
+	uint32_t	  bytes;
+	uint16_t	  msgs;
+	int		  rmsg_mark;
 };
 
 struct rs_conn_private_data {
@@ -273,6 +338,20 @@ enum rs_state {
 #define RS_OPT_KEEPALIVE  (1 << 3)
 #define RS_OPT_CM_SVC	  (1 << 4)
 
+/*
+ * Buffer auto-tuning.  Stream rsockets start with the default buffer sizes,
+ * and grow their buffers up to mem_max and wmem_max while the buffers limit
+ * the transfer rate.  The send buffer limits the rate when sends wait for
+ * buffer space with send queue entries available.  The receive buffer
+ * limits the rate when the peer runs out of credits while the application
+ * keeps up with received data, which the peer reports with RS_CTRL_GROW.
+ * Buffers return to their default sizes after the rsocket has been idle.
+ */
+#define RS_TUNE_RBUF	  (1 << 0)
+#define RS_TUNE_SBUF	  (1 << 1)
+#define RS_TUNE_PEER	  (1 << 2) /* peer grows its rbuf on RS_CTRL_GROW */
+#define RS_TUNE_IDLE_TIME 1000000
+
 union socket_addr {
 	struct sockaddr		sa;
 	struct sockaddr_in	sin;
@@ -302,6 +381,51 @@ struct ds_dest {
 	uint32_t	   qpn;
 };
 
+/*
+ * Destinations are kept in an open addressing hash table.  Lookups do not
+ * take map_lock.  Entries are only added or removed under map_lock, and
+ * are published with release stores.  Growing the table publishes a new
+ * copy, and the old copy is kept until the rsocket is freed, since other
+ * threads may still be searching it.
+ */
+#define DS_DEST_MIN_SIZE 64
+#define DS_DEST_REMOVED ((struct ds_dest *) 1)
+
+struct ds_dest_table {
+	struct ds_dest_table *prev;
+	uint32_t	  mask;
+	uint32_t	  cnt;
+	uint32_t	  used;		/* entries plus removed slots */
+	_Atomic(struct ds_dest *) slot[];
+};
+
+/*
+ * Address handles are shared by all destinations that resolve to the same
+ * address vector on the same protection domain, including destinations
+ * reached through different ds_qps.
+ */
+struct ds_ah {
+	struct ds_ah	  *next;
+	struct ibv_pd	  *pd;
+	struct ibv_ah	  *ah;
+	struct ibv_ah_attr attr;
+	int		  refcnt;
+};
+
+/*
+ * Each thread remembers the last destination that it looked up, which
+ * avoids searching the table when sending to the same peer repeatedly.
+ * The generation number distinguishes rsockets that reuse the memory of
+ * a closed rsocket.
+ */
+static __thread struct {
+	struct rsocket	*rs;
+	uint32_t	gen;
+	struct ds_dest	*dest;
+} ds_last_dest;
+
+static _Atomic(uint32_t) ds_dest_gen;
+
 struct ds_qp {
 	dlist_entry	  list;
 	struct rsocket	  *rs;
@@ -343,6 +467,7 @@ struct rsocket {
 			int		  remote_sge;
 			struct rs_sge	  remote_sgl;
 			struct rs_sge	  remote_iomap;
+			struct rs_sge	  remote_dr;
 
 			struct ibv_mr	  *target_mr;
 			int		  target_sge;
@@ -350,6 +475,17 @@ struct rsocket {
 			void		  *target_buffer_list;
 			volatile struct rs_sge	  *target_sgl;
 			struct rs_iomap   *target_iomap;
+			volatile struct rs_sge	  *target_dr;
+			uint32_t	  target_dr_offset;
+			uint16_t	  target_dr_no;
+			uint16_t	  target_dr_max;
+
+			struct rs_dr	  *dr;
+			uint16_t	  dr_post_no;
+			uint16_t	  dr_fill_no;
+			uint16_t	  dr_reap_no;
+			/* Messages without a posted buffer, under cq_lock */
+			uint16_t	  dr_drop_no;
 
 			int		  rbuf_msg_index;
 			int		  rbuf_bytes_avail;
@@ -357,16 +493,35 @@ struct rsocket {
 			int		  rbuf_offset;
 			struct ibv_mr	  *rmr;
 			uint8_t		  *rbuf;
+			uint32_t	  rbuf_target;
+			struct ibv_mr	  *rmr_next;
+			uint8_t		  *rbuf_next;
+			uint32_t	  rbuf_next_size;
 
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+			uint32_t	  zcopy_size;
+			uint8_t		  tune;
+			uint8_t		  tune_hint;
+			uint64_t	  last_send;
+
+			struct rs_stripe  *stripes;
+			uint32_t	  *stripe_win;
+			uint8_t		  stripe_cnt;
+			uint8_t		  nstripes;
+			uint8_t		  stripe_next;
+			uint8_t		  stripe_ready;
+			uint8_t		  stripe_fence;
+			uint16_t	  rseq_tag;
 		};
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			_Atomic(struct ds_dest_table *) dest_table;
+			struct ds_ah	  *ah_list;
 			struct ds_dest    *conn_dest;
+			uint32_t	  dest_gen;
 
 			int		  udp_sock;
 			int		  epfd;
@@ -376,6 +531,8 @@ struct rsocket {
 	};
 
 	int		  opts;
+	int		  lockless;
+	pthread_t	  owner;
 	int		  fd_flags;
 	uint64_t	  so_opts;
 	uint64_t	  ipv6_opts;
@@ -406,8 +563,62 @@ struct rsocket {
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
 	int		  unack_cqe;
+
+	uint64_t	  last_arrival;
+	uint32_t	  arrival_time;
+
+	struct rsocket_stats stats;
 };
 
+/*
+ * An rsocket used by a single thread may skip the locks that serialize
+ * its calls.  The keepalive service sends from its own thread, so the
+ * locks are kept while keepalives are enabled.  Debug builds always take
+ * the locks, and stop eliding them once a thread other than the owner
+ * uses the rsocket.
+ *
+ * Lockless mode and keepalives may be toggled while another thread holds
+ * a lock, so rs_lock reports whether it took the lock and the caller
+ * passes that back to rs_unlock rather than evaluating the mode again.
+ */
+static inline int rs_lockless(struct rsocket *rs)
+{
+	if (!rs->lockless || (rs->opts & RS_OPT_KEEPALIVE))
+		return 0;
+#ifdef NDEBUG
+	return 1;
+#else
+	if (!pthread_equal(rs->owner, pthread_self()))
+		rs->lockless = 0;
+	return 0;
+#endif
+}
+
+static inline bool rs_lock(struct rsocket *rs, fastlock_t *lock)
+{
+	if (rs_lockless(rs))
+		return false;
+	fastlock_acquire(lock);
+	return true;
+}
+
+/*
+ * Returns false if the lock is held by another thread.  Otherwise, *locked
+ * is set as by rs_lock.
+ */
+static inline bool rs_trylock(struct rsocket *rs, fastlock_t *lock,
+			      bool *locked)
+{
+	*locked = !rs_lockless(rs);
+	return !*locked || fastlock_tryacquire(lock);
+}
+
+static inline void rs_unlock(fastlock_t *lock, bool locked)
+{
+	if (locked)
+		fastlock_release(lock);
+}
+
 #define DS_UDP_TAG 0x55555555
 
 struct ds_udp_header {
@@ -450,6 +661,34 @@ static uint64_t rs_time_us(void)
 	return now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
+/*
+ * Statistics are updated under the lock that serializes the operation
+ * being counted, and are read without locking.
+ */
+static void rs_stat_send(struct rsocket *rs, uint32_t length, int flags,
+			 int copied)
+{
+	rs->stats.msgs_sent++;
+	rs->stats.bytes_sent += length;
+	if (flags & IBV_SEND_INLINE)
+		rs->stats.inline_sends++;
+	else if (copied)
+		rs->stats.copy_sends++;
+	else
+		rs->stats.zcopy_sends++;
+}
+
+static void rs_stat_wait(struct rsocket *rs, int sq_wait, uint64_t start_time)
+{
+	if (sq_wait) {
+		rs->stats.sq_waits++;
+		rs->stats.sq_wait_time += rs_time_us() - start_time;
+	} else {
+		rs->stats.credit_waits++;
+		rs->stats.credit_wait_time += rs_time_us() - start_time;
+	}
+}
+
 static void ds_insert_qp(struct rsocket *rs, struct ds_qp *qp)
 {
 	if (!rs->qp_list)
@@ -518,6 +757,193 @@ static int ds_compare_addr(const void *dst1, const void *dst2)
 	return memcmp(dst1, dst2, len);
 }
 
+static uint32_t ds_hash_addr(const struct sockaddr *addr)
+{
+	const struct sockaddr_in6 *sin6;
+	const struct sockaddr_in *sin;
+	uint32_t hash, key[4];
+	int i, n;
+
+	if (addr->sa_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *) addr;
+		memcpy(key, &sin6->sin6_addr, sizeof key);
+		hash = sin6->sin6_port;
+		n = 4;
+	} else {
+		sin = (const struct sockaddr_in *) addr;
+		key[0] = sin->sin_addr.s_addr;
+		hash = sin->sin_port;
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++)
+		hash = (hash ^ key[i]) * 0x9e3779b1;
+	return hash ^ (hash >> 16);
+}
+
+static struct ds_dest *ds_find_dest(struct rsocket *rs,
+				    const struct sockaddr *addr)
+{
+	struct ds_dest_table *table;
+	struct ds_dest *dest;
+	uint32_t i;
+
+	table = atomic_load_explicit(&rs->dest_table, memory_order_acquire);
+	if (!table)
+		return NULL;
+
+	for (i = ds_hash_addr(addr); ; i++) {
+		dest = atomic_load_explicit(&table->slot[i & table->mask],
+					    memory_order_acquire);
+		if (!dest)
+			return NULL;
+		if (dest != DS_DEST_REMOVED && !ds_compare_addr(addr, &dest->addr))
+			return dest;
+	}
+}
+
+static void ds_add_dest_slot(struct ds_dest_table *table, struct ds_dest *dest)
+{
+	struct ds_dest *cur;
+	uint32_t i;
+
+	for (i = ds_hash_addr(&dest->addr.sa); ; i++) {
+		cur = atomic_load_explicit(&table->slot[i & table->mask],
+					   memory_order_relaxed);
+		if (!cur || cur == DS_DEST_REMOVED)
+			break;
+	}
+
+	if (!cur)
+		table->used++;
+	table->cnt++;
+	atomic_store_explicit(&table->slot[i & table->mask], dest,
+			      memory_order_release);
+}
+
+/* Called with map_lock held. */
+static int ds_grow_dest_table(struct rsocket *rs)
+{
+	struct ds_dest_table *table, *old;
+	struct ds_dest *dest;
+	uint32_t i, size;
+
+	old = atomic_load_explicit(&rs->dest_table, memory_order_relaxed);
+	size = old ? roundup_pow_of_two((old->cnt + 1) * 4) : DS_DEST_MIN_SIZE;
+	if (size < DS_DEST_MIN_SIZE)
+		size = DS_DEST_MIN_SIZE;
+
+	table = calloc(1, sizeof(*table) + size * sizeof(table->slot[0]));
+	if (!table)
+		return ERR(ENOMEM);
+
+	table->mask = size - 1;
+	table->prev = old;
+	for (i = 0; old && i <= old->mask; i++) {
+		dest = atomic_load_explicit(&old->slot[i], memory_order_relaxed);
+		if (dest && dest != DS_DEST_REMOVED)
+			ds_add_dest_slot(table, dest);
+	}
+
+	atomic_store_explicit(&rs->dest_table, table, memory_order_release);
+	return 0;
+}
+
+/* Called with map_lock held. */
+static int ds_insert_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest_table *table;
+	int ret;
+
+	if (ds_find_dest(rs, &dest->addr.sa))
+		return 0;
+
+	table = atomic_load_explicit(&rs->dest_table, memory_order_relaxed);
+	if (!table || (table->used + 1) * 2 > table->mask + 1) {
+		ret = ds_grow_dest_table(rs);
+		if (ret)
+			return ret;
+		table = atomic_load_explicit(&rs->dest_table,
+					     memory_order_relaxed);
+	}
+
+	ds_add_dest_slot(table, dest);
+	return 0;
+}
+
+/* Called with map_lock held. */
+static void ds_remove_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest_table *table;
+	struct ds_dest *cur;
+	uint32_t i;
+
+	table = atomic_load_explicit(&rs->dest_table, memory_order_relaxed);
+	if (!table)
+		return;
+
+	for (i = ds_hash_addr(&dest->addr.sa); ; i++) {
+		cur = atomic_load_explicit(&table->slot[i & table->mask],
+					   memory_order_relaxed);
+		if (!cur)
+			return;
+		if (cur == dest)
+			break;
+	}
+
+	table->cnt--;
+	atomic_store_explicit(&table->slot[i & table->mask], DS_DEST_REMOVED,
+			      memory_order_release);
+}
+
+/* Called with map_lock held. */
+static struct ibv_ah *ds_get_ah(struct rsocket *rs, struct ibv_pd *pd,
+				struct ibv_ah_attr *attr)
+{
+	struct ds_ah *ah;
+
+	for (ah = rs->ah_list; ah; ah = ah->next) {
+		if (ah->pd == pd && !memcmp(&ah->attr, attr, sizeof *attr)) {
+			ah->refcnt++;
+			return ah->ah;
+		}
+	}
+
+	ah = calloc(1, sizeof(*ah));
+	if (!ah)
+		return NULL;
+
+	ah->ah = ibv_create_ah(pd, attr);
+	if (!ah->ah) {
+		free(ah);
+		return NULL;
+	}
+
+	ah->pd = pd;
+	ah->attr = *attr;
+	ah->refcnt = 1;
+	ah->next = rs->ah_list;
+	rs->ah_list = ah;
+	return ah->ah;
+}
+
+/* Called with map_lock held. */
+static void ds_put_ah(struct rsocket *rs, struct ibv_ah *ibah)
+{
+	struct ds_ah **ah, *cur;
+
+	for (ah = &rs->ah_list; (cur = *ah); ah = &cur->next) {
+		if (cur->ah == ibah) {
+			if (!--cur->refcnt) {
+				*ah = cur->next;
+				ibv_destroy_ah(cur->ah);
+				free(cur);
+			}
+			return;
+		}
+	}
+}
+
 static int rs_value_to_scale(int value, int bits)
 {
 	return value <= (1 << (bits - 1)) ?
@@ -560,11 +986,32 @@ static void rs_configure(void)
 		fclose(f);
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/polling_time_max", "r"))) {
+		failable_fscanf(f, "%u", &polling_time_max);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/yield_time_max", "r"))) {
+		failable_fscanf(f, "%u", &yield_time_max);
+		fclose(f);
+	}
+
 	f = fopen(RS_CONF_DIR "/wake_up_interval", "r");
 	if (f) {
 		failable_fscanf(f, "%d", &wake_up_interval);
 		fclose(f);
 	}
+
+	if ((f = fopen(RS_CONF_DIR "/poll_batch", "r"))) {
+		failable_fscanf(f, "%d", &poll_batch);
+		fclose(f);
+		if (poll_batch < 1)
+			poll_batch = 1;
+		else if (poll_batch > RS_MAX_POLL_BATCH)
+			poll_batch = RS_MAX_POLL_BATCH;
+	}
+
+
 	if ((f = fopen(RS_CONF_DIR "/inline_default", "r"))) {
 		failable_fscanf(f, "%hu", &def_inline);
 		fclose(f);
@@ -595,6 +1042,22 @@ static void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/mem_max", "r"))) {
+		failable_fscanf(f, "%u", &max_mem);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/wmem_max", "r"))) {
+		failable_fscanf(f, "%u", &max_wmem);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/arena_size", "r"))) {
+		failable_fscanf(f, "%u", &arena_size);
+		fclose(f);
+		rs_arena_configure(arena_size);
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		failable_fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -648,6 +1111,9 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->zcopy_size = inherited_rs->zcopy_size;
+			rs->stripe_cnt = inherited_rs->stripe_cnt;
+			rs->tune = inherited_rs->tune;
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -658,6 +1124,10 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			if (max_mem > def_mem)
+				rs->tune |= RS_TUNE_RBUF;
+			if (max_wmem > def_wmem)
+				rs->tune |= RS_TUNE_SBUF;
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -737,28 +1207,79 @@ static void ds_set_qp_size(struct rsocket *rs)
 		rs->sbuf_size = rs->sq_size * RS_SNDLOWAT;
 }
 
+/*
+ * Locally accessed buffers come from the arena when one is configured,
+ * sharing the registration of the slab that holds them.  Otherwise each
+ * buffer is allocated from the heap and registered by itself.  Buffers
+ * that the peer writes into are always registered by themselves for
+ * remote write access, so that their rkey dies with the buffer.
+ */
+static void *rs_get_buf(struct rsocket *rs, size_t size, bool remote,
+			struct ibv_mr **mr)
+{
+	void *buf;
+
+	if (!remote) {
+		buf = rs_arena_alloc(rs->cm_id->pd, size, mr);
+		if (buf) {
+			memset(buf, 0, size);
+			return buf;
+		}
+	}
+
+	buf = calloc(size, 1);
+	if (!buf) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (!mr)
+		return buf;
+
+	if (remote)
+		*mr = rdma_reg_write(rs->cm_id, buf, size);
+	else
+		*mr = rdma_reg_msgs(rs->cm_id, buf, size);
+	if (!*mr) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void rs_put_buf(void *buf, struct ibv_mr *mr)
+{
+	if (rs_arena_free(buf))
+		return;
+
+	if (mr) {
+		rdma_dereg_mr(mr);
+		free(buf);
+	} else {
+		free(buf);
+	}
+}
+
 static int rs_init_bufs(struct rsocket *rs)
 {
 	uint32_t total_rbuf_size, total_sbuf_size;
 	size_t len;
 
-	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
+	rs->rmsg = rs_get_buf(rs, (rs->rq_size + 1) * sizeof(*rs->rmsg),
+			      false, NULL);
 	if (!rs->rmsg)
-		return ERR(ENOMEM);
+		return -1;
 
 	total_sbuf_size = rs->sbuf_size;
 	if (rs->sq_inline < RS_MAX_CTRL_MSG)
 		total_sbuf_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
-	rs->sbuf = calloc(total_sbuf_size, 1);
+	rs->sbuf = rs_get_buf(rs, total_sbuf_size, false, &rs->smr);
 	if (!rs->sbuf)
-		return ERR(ENOMEM);
-
-	rs->smr = rdma_reg_msgs(rs->cm_id, rs->sbuf, total_sbuf_size);
-	if (!rs->smr)
 		return -1;
 
 	len = sizeof(*rs->target_sgl) * RS_SGL_SIZE +
-	      sizeof(*rs->target_iomap) * rs->target_iomap_size;
+	      sizeof(*rs->target_iomap) * rs->target_iomap_size +
+	      sizeof(*rs->target_dr) * RS_DR_SIZE;
 	rs->target_buffer_list = malloc(len);
 	if (!rs->target_buffer_list)
 		return ERR(ENOMEM);
@@ -771,16 +1292,14 @@ static int rs_init_bufs(struct rsocket *rs)
 	rs->target_sgl = rs->target_buffer_list;
 	if (rs->target_iomap_size)
 		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
+	rs->target_dr = (struct rs_sge *) ((struct rs_iomap *)
+			(rs->target_sgl + RS_SGL_SIZE) + rs->target_iomap_size);
 
 	total_rbuf_size = rs->rbuf_size;
 	if (rs->opts & RS_OPT_MSG_SEND)
 		total_rbuf_size += rs->rq_size * RS_MSG_SIZE;
-	rs->rbuf = calloc(total_rbuf_size, 1);
+	rs->rbuf = rs_get_buf(rs, total_rbuf_size, true, &rs->rmr);
 	if (!rs->rbuf)
-		return ERR(ENOMEM);
-
-	rs->rmr = rdma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
-	if (!rs->rmr)
 		return -1;
 
 	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
@@ -789,6 +1308,10 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	rs->rbuf_free_offset = rs->rbuf_size >> 1;
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->rbuf_target = rs->rbuf_size;
+	/* Receives for iWarp messages are posted into the receive buffer */
+	if (rs->opts & RS_OPT_MSG_SEND)
+		rs->tune &= ~RS_TUNE_RBUF;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
 	return 0;
@@ -847,30 +1370,44 @@ err1:
 	return -1;
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+/*
+ * Post cnt receives as a single chain, so that replenishing the receive
+ * queue after processing a batch of completions takes a single call
+ * into the provider.
+ */
+static int rs_post_recvs(struct rsocket *rs, struct ibv_qp *qp, int cnt)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge;
+	struct ibv_recv_wr wr[RS_MAX_POLL_BATCH], *bad;
+	struct ibv_sge sge[RS_MAX_POLL_BATCH];
+	int i, ret = 0;
 
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	while (cnt && !ret) {
+		for (i = 0; i < cnt && i < RS_MAX_POLL_BATCH; i++) {
+			wr[i].next = &wr[i + 1];
+			if (!(rs->opts & RS_OPT_MSG_SEND)) {
+				wr[i].wr_id = rs_recv_wr_id(0);
+				wr[i].sg_list = NULL;
+				wr[i].num_sge = 0;
+			} else {
+				wr[i].wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
+				sge[i].addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+					      (rs->rbuf_msg_index * RS_MSG_SIZE);
+				sge[i].length = RS_MSG_SIZE;
+				sge[i].lkey = rs->rmr->lkey;
+
+				wr[i].sg_list = &sge[i];
+				wr[i].num_sge = 1;
+				if(++rs->rbuf_msg_index == rs->rq_size)
+					rs->rbuf_msg_index = 0;
+			}
+		}
+		wr[i - 1].next = NULL;
+		cnt -= i;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
+		ret = rdma_seterrno(ibv_post_recv(qp, wr, &bad));
 	}
 
-	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+	return ret;
 }
 
 static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
@@ -893,10 +1430,131 @@ static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t of
 	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
 }
 
+static void rs_free_stripes(struct rsocket *rs, int cnt)
+{
+	struct rs_stripe *stripe;
+
+	while (rs->nstripes > cnt) {
+		stripe = &rs->stripes[--rs->nstripes];
+		if (stripe->qp)
+			ibv_destroy_qp(stripe->qp);
+		if (stripe->cq)
+			ibv_destroy_cq(stripe->cq);
+	}
+
+	if (!cnt) {
+		free(rs->stripes);
+		rs->stripes = NULL;
+		free(rs->stripe_win);
+		rs->stripe_win = NULL;
+	}
+}
+
+/*
+ * Stripes are only used over IB and RoCE, where we can connect the
+ * additional QPs ourselves using the path of the primary connection.
+ * Striping is an optimization, so failing to set up the stripes is
+ * not an error.
+ */
+static int rs_create_stripes(struct rsocket *rs)
+{
+	struct ibv_qp_init_attr qp_attr;
+	struct ibv_qp_attr attr;
+	struct rs_stripe *stripe;
+	int i, vectors, mask;
+
+	if (!rs->stripe_cnt ||
+	    rs->cm_id->verbs->device->transport_type != IBV_TRANSPORT_IB ||
+	    rs->rq_size > RS_SEQ_MASK)
+		return 0;
+
+	rs->stripes = calloc(rs->stripe_cnt, sizeof(*rs->stripes));
+	rs->stripe_win = calloc(1 << RS_SEQ_BITS, sizeof(*rs->stripe_win));
+	if (!rs->stripes || !rs->stripe_win)
+		goto err;
+
+	vectors = max(rs->cm_id->verbs->num_comp_vectors, 1);
+	for (i = 0; i < rs->stripe_cnt; i++) {
+		stripe = &rs->stripes[rs->nstripes++];
+		stripe->cq = ibv_create_cq(rs->cm_id->verbs,
+					   rs->sq_size + rs->rq_size, rs->cm_id,
+					   rs->cm_id->recv_cq_channel,
+					   (i + 1) % vectors);
+		if (!stripe->cq)
+			goto err;
+		ibv_req_notify_cq(stripe->cq, 0);
+
+		memset(&qp_attr, 0, sizeof qp_attr);
+		qp_attr.qp_context = rs;
+		qp_attr.send_cq = stripe->cq;
+		qp_attr.recv_cq = stripe->cq;
+		qp_attr.qp_type = IBV_QPT_RC;
+		qp_attr.sq_sig_all = 1;
+		qp_attr.cap.max_send_wr = rs->sq_size;
+		qp_attr.cap.max_recv_wr = rs->rq_size;
+		qp_attr.cap.max_send_sge = 2;
+		qp_attr.cap.max_recv_sge = 1;
+		stripe->qp = ibv_create_qp(rs->cm_id->pd, &qp_attr);
+		if (!stripe->qp)
+			goto err;
+
+		attr.qp_state = IBV_QPS_INIT;
+		if (rdma_init_qp_attr(rs->cm_id, &attr, &mask))
+			goto err;
+		attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+				       IBV_ACCESS_REMOTE_WRITE;
+		if (ibv_modify_qp(stripe->qp, &attr, mask | IBV_QP_ACCESS_FLAGS))
+			goto err;
+
+		if (rs_post_recvs(rs, stripe->qp, rs->rq_size))
+			goto err;
+	}
+	return 0;
+
+err:
+	rs_free_stripes(rs, 0);
+	return 0;
+}
+
+/*
+ * Connect as many stripes as both sides created, to the QPs reported in
+ * the peer's connection data.  The stripes reuse the attributes of the
+ * primary connection.
+ */
+static int rs_connect_stripes(struct rsocket *rs, struct rs_conn_data *conn)
+{
+	struct ibv_qp_attr attr;
+	int i, mask, cnt = 0;
+
+	if (conn->flags & RS_CONN_FLAG_STRIPE) {
+		while (cnt < rs->nstripes && conn->stripe_qpn[cnt])
+			cnt++;
+	}
+	rs_free_stripes(rs, cnt);
+
+	for (i = 0; i < rs->nstripes; i++) {
+		attr.qp_state = IBV_QPS_RTR;
+		if (rdma_init_qp_attr(rs->cm_id, &attr, &mask))
+			return -1;
+		attr.dest_qp_num = be32toh(conn->stripe_qpn[i]);
+		attr.rq_psn = RS_STRIPE_PSN;
+		if (rdma_seterrno(ibv_modify_qp(rs->stripes[i].qp, &attr, mask)))
+			return -1;
+
+		attr.qp_state = IBV_QPS_RTS;
+		if (rdma_init_qp_attr(rs->cm_id, &attr, &mask))
+			return -1;
+		attr.sq_psn = RS_STRIPE_PSN;
+		if (rdma_seterrno(ibv_modify_qp(rs->stripes[i].qp, &attr, mask)))
+			return -1;
+	}
+	return 0;
+}
+
 static int rs_create_ep(struct rsocket *rs)
 {
 	struct ibv_qp_init_attr qp_attr;
-	int i, ret;
+	int ret;
 
 	rs_set_qp_size(rs);
 	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
@@ -929,12 +1587,11 @@ static int rs_create_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
-	for (i = 0; i < rs->rq_size; i++) {
-		ret = rs_post_recv(rs);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	ret = rs_post_recvs(rs, rs->cm_id->qp, rs->rq_size);
+	if (ret)
+		return ret;
+
+	return rs_create_stripes(rs);
 }
 
 static void rs_release_iomap_mr(struct rs_iomap_mr *iomr)
@@ -957,12 +1614,12 @@ static void rs_free_iomappings(struct rsocket *rs)
 	while (!dlist_empty(&rs->iomap_list)) {
 		iomr = container_of(rs->iomap_list.next,
 				    struct rs_iomap_mr, entry);
-		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
+		riounmap(rs->index, iomr->addr, iomr->length);
 	}
 	while (!dlist_empty(&rs->iomap_queue)) {
 		iomr = container_of(rs->iomap_queue.next,
 				    struct rs_iomap_mr, entry);
-		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
+		riounmap(rs->index, iomr->addr, iomr->length);
 	}
 }
 
@@ -979,7 +1636,9 @@ static void ds_free_qp(struct ds_qp *qp)
 
 	if (qp->cm_id) {
 		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+			ds_remove_dest(qp->rs, &qp->dest);
+			if (qp->dest.ah)
+				ds_put_ah(qp->rs, qp->dest.ah);
 			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
 				  qp->cm_id->recv_cq_channel->fd, NULL);
 			rdma_destroy_qp(qp->cm_id);
@@ -990,9 +1649,33 @@ static void ds_free_qp(struct ds_qp *qp)
 	free(qp);
 }
 
-static void ds_free(struct rsocket *rs)
+/*
+ * Release the destinations that are not embedded in a ds_qp.  Their address
+ * handles must be destroyed before the ds_qps release the devices.
+ */
+static void ds_free_dests(struct rsocket *rs)
 {
-	struct ds_qp *qp;
+	struct ds_dest_table *table;
+	struct ds_dest *dest;
+	uint32_t i;
+
+	table = atomic_load_explicit(&rs->dest_table, memory_order_relaxed);
+	for (i = 0; table && i <= table->mask; i++) {
+		dest = atomic_load_explicit(&table->slot[i], memory_order_relaxed);
+		if (!dest || dest == DS_DEST_REMOVED || dest == &dest->qp->dest)
+			continue;
+
+		ds_remove_dest(rs, dest);
+		if (dest->ah)
+			ds_put_ah(rs, dest->ah);
+		free(dest);
+	}
+}
+
+static void ds_free(struct rsocket *rs)
+{
+	struct ds_dest_table *table;
+	struct ds_qp *qp;
 
 	if (rs->udp_sock >= 0)
 		close(rs->udp_sock);
@@ -1003,6 +1686,7 @@ static void ds_free(struct rsocket *rs)
 	if (rs->dmsg)
 		free(rs->dmsg);
 
+	ds_free_dests(rs);
 	while ((qp = rs->qp_list)) {
 		ds_remove_qp(rs, qp);
 		ds_free_qp(qp);
@@ -1014,7 +1698,10 @@ static void ds_free(struct rsocket *rs)
 	if (rs->sbuf)
 		free(rs->sbuf);
 
-	tdestroy(rs->dest_map, free);
+	while ((table = rs->dest_table)) {
+		rs->dest_table = table->prev;
+		free(table);
+	}
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -1031,19 +1718,22 @@ static void rs_free(struct rsocket *rs)
 	}
 
 	if (rs->rmsg)
-		free(rs->rmsg);
+		rs_put_buf(rs->rmsg, NULL);
 
-	if (rs->sbuf) {
-		if (rs->smr)
-			rdma_dereg_mr(rs->smr);
-		free(rs->sbuf);
+	if (rs->dr) {
+		while (rs->dr_reap_no != rs->dr_post_no)
+			ibv_dereg_mr(rs->dr[rs->dr_reap_no++ % RS_DR_SIZE].mr);
+		free(rs->dr);
 	}
 
-	if (rs->rbuf) {
-		if (rs->rmr)
-			rdma_dereg_mr(rs->rmr);
-		free(rs->rbuf);
-	}
+	if (rs->sbuf)
+		rs_put_buf(rs->sbuf, rs->smr);
+
+	if (rs->rbuf)
+		rs_put_buf(rs->rbuf, rs->rmr);
+
+	if (rs->rbuf_next)
+		rs_put_buf(rs->rbuf_next, rs->rmr_next);
 
 	if (rs->target_buffer_list) {
 		if (rs->target_mr)
@@ -1056,6 +1746,7 @@ static void rs_free(struct rsocket *rs)
 
 	if (rs->cm_id) {
 		rs_free_iomappings(rs);
+		rs_free_stripes(rs, 0);
 		if (rs->cm_id->qp) {
 			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rdma_destroy_qp(rs->cm_id);
@@ -1084,9 +1775,13 @@ static size_t rs_conn_data_offset(struct rsocket *rs)
 
 static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 {
+	int i;
+
 	conn->version = 1;
-	conn->flags = RS_CONN_FLAG_IOMAP |
+	conn->flags = RS_CONN_FLAG_IOMAP | RS_CONN_FLAG_DR |
 		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
+	if (rs->tune & RS_TUNE_RBUF)
+		conn->flags |= RS_CONN_FLAG_TUNE;
 	conn->credits = htobe16(rs->rq_size);
 	memset(conn->reserved, 0, sizeof conn->reserved);
 	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
@@ -1098,6 +1793,12 @@ static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	conn->data_buf.addr = (__force uint64_t)htobe64((uintptr_t) rs->rbuf);
 	conn->data_buf.length = (__force uint32_t)htobe32(rs->rbuf_size >> 1);
 	conn->data_buf.key = (__force uint32_t)htobe32(rs->rmr->rkey);
+
+	memset(conn->stripe_qpn, 0, sizeof conn->stripe_qpn);
+	for (i = 0; i < rs->nstripes; i++)
+		conn->stripe_qpn[i] = htobe32(rs->stripes[i].qp->qp_num);
+	if (rs->nstripes)
+		conn->flags |= RS_CONN_FLAG_STRIPE;
 }
 
 static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
@@ -1110,11 +1811,21 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	    (!rs_host_is_net() && (conn->flags & RS_CONN_FLAG_NET)))
 		rs->opts = RS_OPT_SWAP_SGL;
 
+	if (conn->flags & RS_CONN_FLAG_TUNE)
+		rs->tune |= RS_TUNE_PEER;
+
 	if (conn->flags & RS_CONN_FLAG_IOMAP) {
 		rs->remote_iomap.addr = rs->remote_sgl.addr +
 					sizeof(rs->remote_sgl) * rs->remote_sgl.length;
 		rs->remote_iomap.length = rs_scale_to_value(conn->target_iomap_size, 8);
 		rs->remote_iomap.key = rs->remote_sgl.key;
+
+		if (conn->flags & RS_CONN_FLAG_DR) {
+			rs->remote_dr.addr = rs->remote_iomap.addr +
+				sizeof(struct rs_iomap) * rs->remote_iomap.length;
+			rs->remote_dr.length = RS_DR_SIZE;
+			rs->remote_dr.key = rs->remote_sgl.key;
+		}
 	}
 
 	rs->target_sgl[0].addr = be64toh((__force __be64)conn->data_buf.addr);
@@ -1124,13 +1835,37 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	rs->sseq_comp = be16toh(conn->credits);
 }
 
+/*
+ * The preload library converts epoll sets into repoll sets, which must not
+ * happen to the sets that we use internally.  The epoll fd of a repoll set
+ * is also the fd that the application sees, so calls on it must not be
+ * redirected back to the set either.
+ */
+static int rs_epoll_create(int flags)
+{
+	return syscall(SYS_epoll_create1, flags);
+}
+
+static int rs_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	return syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+static int rs_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+			 int timeout)
+{
+	return syscall(SYS_epoll_pwait, epfd, events, maxevents, timeout,
+		       NULL, _NSIG / 8);
+}
+
 static int ds_init(struct rsocket *rs, int domain)
 {
+	rs->dest_gen = atomic_fetch_add(&ds_dest_gen, 1) + 1;
 	rs->udp_sock = socket(domain, SOCK_DGRAM, 0);
 	if (rs->udp_sock < 0)
 		return rs->udp_sock;
 
-	rs->epfd = epoll_create(2);
+	rs->epfd = rs_epoll_create(0);
 	if (rs->epfd < 0)
 		return rs->epfd;
 
@@ -1306,6 +2041,10 @@ static void rs_accept(struct rsocket *rs)
 		goto err;
 
 	rs_save_conn_data(new_rs, creq);
+	ret = rs_connect_stripes(new_rs, creq);
+	if (ret)
+		goto err;
+
 	param = new_rs->cm_id->event->param.conn;
 	rs_format_conn_data(new_rs, &cresp);
 	param.private_data = &cresp;
@@ -1348,14 +2087,29 @@ int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 	return new_rs->index;
 }
 
+static int rs_post_msg(struct rsocket *rs, uint32_t msg);
+
+/*
+ * The passive side connects its stripes before accepting, so the active
+ * side may use them as soon as its own stripes are connected.  It then
+ * tells the passive side that it may start striping as well.
+ */
+static void rs_start_stripes(struct rsocket *rs)
+{
+	rs->stripe_ready = 1;
+	rs->ctrl_seqno++;
+	rs_post_msg(rs, rs_msg_set(RS_OP_CTRL, RS_CTRL_STRIPE));
+}
+
 static int rs_do_connect(struct rsocket *rs)
 {
 	struct rdma_conn_param param;
 	struct rs_conn_private_data cdata;
 	struct rs_conn_data *creq, *cresp;
 	int to, ret;
+	bool slocked;
 
-	fastlock_acquire(&rs->slock);
+	slocked = rs_lock(rs, &rs->slock);
 	switch (rs->state) {
 	case rs_init:
 	case rs_bound:
@@ -1441,7 +2195,13 @@ connected:
 		}
 
 		rs_save_conn_data(rs, cresp);
+		ret = rs_connect_stripes(rs, cresp);
+		if (ret)
+			break;
+
 		rs->state = rs_connect_rdwr;
+		if (rs->nstripes)
+			rs_start_stripes(rs);
 		break;
 	case rs_accepting:
 		if (!(rs->fd_flags & O_NONBLOCK))
@@ -1466,7 +2226,7 @@ connected:
 			rs->err = errno;
 		}
 	}
-	fastlock_release(&rs->slock);
+	rs_unlock(&rs->slock, slocked);
 	return ret;
 }
 
@@ -1544,11 +2304,10 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	memset(&attr, 0, sizeof attr);
 	attr.dlid = port_attr.lid;
 	attr.port_num = qp->cm_id->port_num;
-	qp->dest.ah = ibv_create_ah(qp->cm_id->pd, &attr);
+	qp->dest.ah = ds_get_ah(qp->rs, qp->cm_id->pd, &attr);
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
 	return 0;
 }
 
@@ -1604,7 +2363,7 @@ static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
 
 	event.events = EPOLLIN;
 	event.data.ptr = qp;
-	ret = epoll_ctl(rs->epfd,  EPOLL_CTL_ADD,
+	ret = rs_epoll_ctl(rs->epfd,  EPOLL_CTL_ADD,
 			qp->cm_id->recv_cq_channel->fd, &event);
 	if (ret)
 		goto err;
@@ -1615,6 +2374,10 @@ static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
 			goto err;
 	}
 
+	ret = ds_insert_dest(rs, &qp->dest);
+	if (ret)
+		goto err;
+
 	ds_insert_qp(rs, qp);
 	*new_qp = qp;
 	return 0;
@@ -1646,14 +2409,24 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	union socket_addr src_addr;
 	socklen_t src_len;
 	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
+	struct ds_dest *new_dest;
 	int ret = 0;
 
-	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (tdest)
+	if (ds_last_dest.rs == rs && ds_last_dest.gen == rs->dest_gen &&
+	    !ds_compare_addr(addr, &ds_last_dest.dest->addr)) {
+		*dest = ds_last_dest.dest;
+		return 0;
+	}
+
+	new_dest = ds_find_dest(rs, addr);
+	if (new_dest)
 		goto found;
 
+	fastlock_acquire(&rs->map_lock);
+	new_dest = ds_find_dest(rs, addr);
+	if (new_dest)
+		goto unlock;
+
 	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
 	if (ret)
 		goto out;
@@ -1662,8 +2435,8 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	if (ret)
 		goto out;
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (!tdest) {
+	new_dest = ds_find_dest(rs, addr);
+	if (!new_dest) {
 		new_dest = calloc(1, sizeof(*new_dest));
 		if (!new_dest) {
 			ret = ERR(ENOMEM);
@@ -1672,11 +2445,21 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 
 		memcpy(&new_dest->addr, addr, addrlen);
 		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
+		ret = ds_insert_dest(rs, new_dest);
+		if (ret) {
+			free(new_dest);
+			goto out;
+		}
 	}
 
+unlock:
+	fastlock_release(&rs->map_lock);
 found:
-	*dest = *tdest;
+	ds_last_dest.rs = rs;
+	ds_last_dest.gen = rs->dest_gen;
+	ds_last_dest.dest = new_dest;
+	*dest = new_dest;
+	return 0;
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -1686,6 +2469,7 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 {
 	struct rsocket *rs;
 	int ret, save_errno;
+	bool slocked;
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
@@ -1706,11 +2490,11 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 				return ret;
 		}
 
-		fastlock_acquire(&rs->slock);
+		slocked = rs_lock(rs, &rs->slock);
 		ret = connect(rs->udp_sock, addr, addrlen);
 		if (!ret)
 			ret = ds_get_dest(rs, addr, addrlen, &rs->conn_dest);
-		fastlock_release(&rs->slock);
+		rs_unlock(&rs->slock, slocked);
 	}
 	return ret;
 }
@@ -1766,6 +2550,49 @@ static int rs_post_write(struct rsocket *rs,
 	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
 }
 
+/*
+ * On a striped connection, data and iomap messages are tagged with the
+ * low bits of their sequence number, which the receiver uses to restore
+ * the order of messages that were sent over different QPs.
+ */
+static uint32_t rs_stripe_tag(struct rsocket *rs, uint32_t msg)
+{
+	if (!rs->nstripes || rs_msg_op(msg) == RS_OP_SGL ||
+	    rs_msg_op(msg) == RS_OP_CTRL)
+		return msg;
+
+	return msg | rs_msg_tag(rs->sseq_no - 1);
+}
+
+/*
+ * Large data transfers are spread round-robin over the primary QP and
+ * its stripes, once the peer is ready to receive on the stripes.  The
+ * first data transfer after a direct write is sent on the primary QP,
+ * so that it cannot be seen by the peer ahead of the write.
+ *
+ * Space in the send buffer is reused in the order that it was filled, which
+ * is only safe while its sends complete in that order.  Transfers copied
+ * into the send buffer therefore stay on the primary QP, and only
+ * transfers made directly from the user's buffer are striped.
+ */
+static struct ibv_qp *rs_stripe_qp(struct rsocket *rs, struct ibv_sge *sgl,
+				   uint32_t msg)
+{
+	int i;
+
+	if (!rs->stripe_ready || rs->stripe_fence ||
+	    rs_msg_op(msg) != RS_OP_DATA || sgl->lkey == rs->smr->lkey ||
+	    rs_msg_data(msg) < RS_STRIPE_MIN_SIZE) {
+		if (rs_msg_op(msg) == RS_OP_DATA)
+			rs->stripe_fence = 0;
+		return rs->cm_id->qp;
+	}
+
+	i = rs->stripe_next;
+	rs->stripe_next = (i == rs->nstripes) ? 0 : i + 1;
+	return i ? rs->stripes[i - 1].qp : rs->cm_id->qp;
+}
+
 static int rs_post_write_msg(struct rsocket *rs,
 			 struct ibv_sge *sgl, int nsge,
 			 uint32_t msg, int flags,
@@ -1782,11 +2609,11 @@ static int rs_post_write_msg(struct rsocket *rs,
 		wr.num_sge = nsge;
 		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
 		wr.send_flags = flags;
-		wr.imm_data = htobe32(msg);
+		wr.imm_data = htobe32(rs_stripe_tag(rs, msg));
 		wr.wr.rdma.remote_addr = addr;
 		wr.wr.rdma.rkey = rkey;
 
-		return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+		return rdma_seterrno(ibv_post_send(rs_stripe_qp(rs, sgl, msg), &wr, &bad));
 	} else {
 		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
 		if (!ret) {
@@ -1806,10 +2633,19 @@ static int rs_post_write_msg(struct rsocket *rs,
 	}
 }
 
+static void ds_stat_send(struct rsocket *rs, struct ibv_send_wr *wr)
+{
+	struct ds_header *hdr;
+
+	hdr = (struct ds_header *) (uintptr_t) wr->sg_list->addr;
+	rs_stat_send(rs, wr->sg_list->length - hdr->length, wr->send_flags, 1);
+}
+
 static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 			uint32_t wr_data)
 {
 	struct ibv_send_wr wr, *bad;
+	int ret;
 
 	wr.wr_id = rs_send_wr_id(wr_data);
 	wr.next = NULL;
@@ -1821,7 +2657,29 @@ static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 	wr.wr.ud.remote_qpn = rs->conn_dest->qpn;
 	wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
 
-	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
+	ret = rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
+	if (!ret)
+		ds_stat_send(rs, &wr);
+	return ret;
+}
+
+/*
+ * While the peer has receive buffers posted, data is written directly
+ * into those, rather than into the peer's receive buffer.
+ */
+static int rs_dr_ready(struct rsocket *rs)
+{
+	return rs->target_dr_no != rs->target_dr_max;
+}
+
+static uint32_t rs_target_left(struct rsocket *rs)
+{
+	if (rs_dr_ready(rs))
+		return min_t(uint32_t, RS_DR_MAX_WRITE,
+			     rs->target_dr[rs->target_dr_no % RS_DR_SIZE].length -
+			     rs->target_dr_offset);
+
+	return rs->target_sgl[rs->target_sge].length;
 }
 
 /*
@@ -1830,16 +2688,37 @@ static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
  */
 static int rs_write_data(struct rsocket *rs,
 			 struct ibv_sge *sgl, int nsge,
-			 uint32_t length, int flags)
+			 uint32_t length, int more, int flags)
 {
+	volatile struct rs_sge *dr;
 	uint64_t addr;
 	uint32_t rkey;
+	int op;
 
 	rs->sseq_no++;
 	rs->sqe_avail--;
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs_stat_send(rs, length, flags, sgl->lkey == rs->smr->lkey);
+
+	if (rs_dr_ready(rs)) {
+		rs->stats.dr_sends++;
+		dr = &rs->target_dr[rs->target_dr_no % RS_DR_SIZE];
+		addr = dr->addr + rs->target_dr_offset;
+		rkey = dr->key;
+
+		rs->target_dr_offset += length;
+		if (more && rs->target_dr_offset < dr->length) {
+			op = RS_OP_DRA_MORE;
+		} else {
+			op = RS_OP_DRA;
+			rs->target_dr_offset = 0;
+			rs->target_dr_no++;
+		}
+		return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(op, length),
+					 flags, addr, rkey);
+	}
 
 	addr = rs->target_sgl[rs->target_sge].addr;
 	rkey = rs->target_sgl[rs->target_sge].key;
@@ -1863,8 +2742,12 @@ static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t of
 
 	rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs_stat_send(rs, length, flags, sgl->lkey == rs->smr->lkey);
+	rs->stats.iomap_writes++;
 
 	addr = iom->sge.addr + offset - iom->offset;
+	if (rs->nstripes)
+		rs->stripe_fence = 1;
 	return rs_post_write(rs, sgl, nsge, rs_msg_set(RS_OP_WRITE, length),
 			     flags, addr, iom->sge.key);
 }
@@ -1879,6 +2762,7 @@ static int rs_write_iomap(struct rsocket *rs, struct rs_iomap_mr *iomr,
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= sizeof(struct rs_iomap);
+	rs->stats.iomap_updates++;
 
 	addr = rs->remote_iomap.addr + iomr->index * sizeof(struct rs_iomap);
 	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_IOMAP_SGL, iomr->index),
@@ -1891,6 +2775,25 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
+/*
+ * While a new receive buffer is pending, the current buffer is not granted
+ * past its end, so that it drains before the new buffer is used.
+ */
+static int rs_can_grant(struct rsocket *rs)
+{
+	return (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) &&
+	       (rs->rbuf_free_offset || !rs->rbuf_next);
+}
+
+/*
+ * Messages consumed by the application, plus direct receive messages that
+ * were dropped because no buffer was posted for them.
+ */
+static uint16_t rs_rseq_done(struct rsocket *rs)
+{
+	return rs->rseq_no + rs->dr_drop_no;
+}
+
 static void rs_send_credits(struct rsocket *rs)
 {
 	struct ibv_sge ibsge;
@@ -1898,8 +2801,8 @@ static void rs_send_credits(struct rsocket *rs)
 	int flags;
 
 	rs->ctrl_seqno++;
-	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
+	rs->rseq_comp = rs_rseq_done(rs) + (rs->rq_size >> 1);
+	if (rs_can_grant(rs)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
 
@@ -1927,7 +2830,7 @@ static void rs_send_credits(struct rsocket *rs)
 		ibsge.length = sizeof(sge);
 
 		rs_post_write_msg(rs, &ibsge, 1,
-			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size), flags,
+			rs_msg_set(RS_OP_SGL, rs_rseq_done(rs) + rs->rq_size), flags,
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
 
@@ -1938,7 +2841,7 @@ static void rs_send_credits(struct rsocket *rs)
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
 	} else {
-		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
+		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs_rseq_done(rs) + rs->rq_size));
 	}
 }
 
@@ -1956,108 +2859,375 @@ static inline int rs_2ctrl_avail(struct rsocket *rs)
 static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+		return (rs_can_grant(rs) ||
+			((short) ((short) rs_rseq_done(rs) - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+		return (rs_can_grant(rs) ||
+			((short) ((short) rs_rseq_done(rs) - (short) rs->rseq_comp) >= 0)) &&
 		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
 	}
 }
 
+static int rs_have_rdata(struct rsocket *rs);
+
+static void rs_alloc_rbuf_next(struct rsocket *rs)
+{
+	rs->rbuf_next = rs_get_buf(rs, rs->rbuf_target, true, &rs->rmr_next);
+	if (!rs->rbuf_next) {
+		rs->rbuf_target = rs->rbuf_size;
+		return;
+	}
+
+	rs->rbuf_next_size = rs->rbuf_target;
+}
+
+/*
+ * The receive buffer is replaced once all data granted to the peer has
+ * been consumed.  The reader releases each message only after copying its
+ * data out, so no reader is accessing the buffer at that point.
+ */
+static void rs_switch_rbuf(struct rsocket *rs)
+{
+	rs_put_buf(rs->rbuf, rs->rmr);
+
+	rs->rbuf = rs->rbuf_next;
+	rs->rmr = rs->rmr_next;
+	rs->rbuf_size = rs->rbuf_next_size;
+	rs->rbuf_next = NULL;
+	rs->rmr_next = NULL;
+
+	rs->rbuf_offset = 0;
+	rs->rbuf_free_offset = 0;
+	rs->rbuf_bytes_avail = rs->rbuf_size;
+}
+
+static void rs_tune_rbuf(struct rsocket *rs)
+{
+	if (rs->rbuf_target != rs->rbuf_size && !rs->rbuf_next)
+		rs_alloc_rbuf_next(rs);
+
+	if (rs->rbuf_next && !rs->rbuf_free_offset &&
+	    rs->rbuf_bytes_avail == rs->rbuf_size && !rs_have_rdata(rs))
+		rs_switch_rbuf(rs);
+}
+
+/*
+ * Checked whenever the CQ is processed, including by rpoll, so that the
+ * receive buffer of an rsocket that stopped receiving is shrunk without
+ * waiting for more data to arrive.
+ */
+static void rs_tune_idle(struct rsocket *rs)
+{
+	if (rs->rbuf_size > def_mem && rs->last_arrival &&
+	    rs_time_us() - rs->last_arrival > RS_TUNE_IDLE_TIME)
+		rs->rbuf_target = def_mem;
+}
+
 static void rs_update_credits(struct rsocket *rs)
 {
+	if (rs->state & rs_connected) {
+		if (rs->tune & RS_TUNE_RBUF) {
+			rs_tune_idle(rs);
+			rs_tune_rbuf(rs);
+		}
+
+		if (rs->tune_hint && rs_ctrl_avail(rs)) {
+			rs->tune_hint = 0;
+			rs->ctrl_seqno++;
+			rs_post_msg(rs, rs_msg_set(RS_OP_CTRL, RS_CTRL_GROW));
+		}
+	}
+
 	if (rs_give_credits(rs))
 		rs_send_credits(rs);
 }
 
-static int rs_poll_cq(struct rsocket *rs)
+/*
+ * Track the average time between receives, used to size the time that
+ * we poll an rsocket before blocking.
+ */
+static void rs_poll_arrival(struct rsocket *rs)
 {
-	struct ibv_wc wc;
-	uint32_t msg;
-	int ret, rcnt = 0;
+	uint64_t now, interval;
 
-	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
-		if (rs_wr_is_recv(wc.wr_id)) {
-			if (wc.status != IBV_WC_SUCCESS)
-				continue;
-			rcnt++;
+	now = rs_time_us();
+	if (rs->last_arrival) {
+		interval = min_t(uint64_t, now - rs->last_arrival, UINT32_MAX);
+		if (rs->arrival_time)
+			interval = (7 * (uint64_t) rs->arrival_time + interval) / 8;
+		rs->arrival_time = (uint32_t) max_t(uint64_t, interval, 1);
+	}
+	rs->last_arrival = now;
+}
 
-			if (wc.wc_flags & IBV_WC_WITH_IMM) {
-				msg = be32toh(wc.imm_data);
-			} else {
-				msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
-					[rs_wr_data(wc.wr_id)];
+/*
+ * We try to poll for twice the expected time until the next receive.  The
+ * first polling_time_max usec are spent busy polling, after which we yield
+ * the CPU between polls for up to yield_time_max usec.  An rsocket that has
+ * been quiet for longer than its average is treated based on how long it
+ * has been quiet, so that idle rsockets go directly to sleep.  Rsockets
+ * without any history, or with adaptive polling disabled (the default),
+ * busy poll for polling_time.
+ *
+ * The budget is computed by each caller from the receive history, which is
+ * only updated under cq_lock, so that rsend, rrecv and rpoll may compute
+ * it concurrently.
+ */
+static void rs_poll_budget(struct rsocket *rs, uint64_t now,
+			   struct rsocket_polling *budget)
+{
+	uint64_t target, last_arrival;
+	bool cq_locked;
 
-			}
-			switch (rs_msg_op(msg)) {
-			case RS_OP_SGL:
-				rs->sseq_comp = (uint16_t) rs_msg_data(msg);
-				break;
-			case RS_OP_IOMAP_SGL:
-				/* The iomap was updated, that's nice to know. */
-				break;
-			case RS_OP_CTRL:
-				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
-					rs->state = rs_disconnected;
-					return 0;
-				} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
-					if (rs->state & rs_writable) {
-						rs->state &= ~rs_readable;
-					} else {
+	cq_locked = rs_lock(rs, &rs->cq_lock);
+	budget->arrival_time = rs->arrival_time;
+	last_arrival = rs->last_arrival;
+	rs_unlock(&rs->cq_lock, cq_locked);
+
+	if (!polling_time_max || !budget->arrival_time) {
+		budget->spin_time = polling_time;
+		budget->yield_time = 0;
+		return;
+	}
+
+	target = 2 * max_t(uint64_t, budget->arrival_time, now - last_arrival);
+	if (target > (uint64_t) polling_time_max + yield_time_max) {
+		budget->spin_time = 0;
+		budget->yield_time = 0;
+	} else {
+		budget->spin_time = min_t(uint64_t, target, polling_time_max);
+		budget->yield_time = (uint32_t) target - budget->spin_time;
+	}
+}
+
+/*
+ * Account for data written into the oldest receive buffer posted by the
+ * application.  The buffer is complete once the peer indicates that no
+ * more data follows.  Its position in the stream is recorded as the end of
+ * the messages received ahead of it, which rrecv must consume before the
+ * buffer is returned.  A message for which no buffer is posted, such as one
+ * that arrives after the posted buffers were returned at shutdown, is
+ * dropped, but still returns its credit to the peer.
+ */
+static void rs_dr_recv(struct rsocket *rs, uint32_t op, uint32_t length,
+		       int tail)
+{
+	struct rs_dr *dr;
+
+	if (rs->dr_fill_no == rs->dr_post_no) {
+		rs->dr_drop_no++;
+		return;
+	}
+
+	dr = &rs->dr[rs->dr_fill_no % RS_DR_SIZE];
+	dr->bytes += length;
+	dr->msgs++;
+	if (op == RS_OP_DRA) {
+		dr->rmsg_mark = tail;
+		rs->dr_fill_no++;
+	}
+}
+
+/*
+ * Messages received on a striped connection are released in the order
+ * that they were sent.  Messages that arrive ahead of one sent before
+ * them are held in the window until the gap has been filled.
+ */
+static int rs_stripe_recv(struct rsocket *rs, uint32_t msg, int tail)
+{
+	rs->stripe_win[rs_msg_seq(msg)] = msg;
+	while ((msg = rs->stripe_win[rs->rseq_tag])) {
+		rs->stripe_win[rs->rseq_tag] = 0;
+		rs->rseq_tag = (rs->rseq_tag + 1) & RS_SEQ_MASK;
+		if (rs_msg_op(msg) == RS_OP_DATA) {
+			rs->rmsg[tail].op = RS_OP_DATA;
+			rs->rmsg[tail].data = rs_msg_len(msg);
+			if (++tail == rs->rq_size + 1)
+				tail = 0;
+		} else if (rs_msg_op(msg) != RS_OP_IOMAP_SGL) {
+			rs_dr_recv(rs, rs_msg_op(msg), rs_msg_len(msg), tail);
+		}
+	}
+	return tail;
+}
+
+/*
+ * Growing the receive buffer only helps if the application is keeping up
+ * with the data that it has already received.
+ */
+static void rs_tune_grow(struct rsocket *rs)
+{
+	if ((rs->tune & RS_TUNE_RBUF) && rs->rbuf_target == rs->rbuf_size &&
+	    rs->rbuf_size < max_mem && !rs_have_rdata(rs))
+		rs->rbuf_target = min_t(uint32_t, rs->rbuf_size << 1, max_mem);
+}
+
+static void rs_stat_recv(struct rsocket *rs, uint32_t msg)
+{
+	switch (rs_msg_op(msg)) {
+	case RS_OP_DATA:
+	case RS_OP_DRA:
+	case RS_OP_DRA_MORE:
+		rs->stats.msgs_recv++;
+		rs->stats.bytes_recv += rs->stripe_win ? rs_msg_len(msg) :
+							 rs_msg_data(msg);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Completions are retrieved in batches of up to poll_batch entries.  Receives
+ * consumed by a batch are reposted together once the batch has been
+ * processed, and credit updates are deferred until the CQ has been drained.
+ * A disconnect ends polling only after the whole batch has been processed,
+ * so that no send or receive completion taken from the CQ is lost.
+ */
+static int rs_poll_cq_qp(struct rsocket *rs, struct ibv_cq *cq,
+			 struct ibv_qp *qp)
+{
+	struct ibv_wc wcs[RS_MAX_POLL_BATCH], *wc;
+	bool closed = false;
+	uint32_t msg;
+	int i, ret, rcnt, tail;
+
+	rs->stats.cq_polls++;
+	while ((ret = ibv_poll_cq(cq, poll_batch, wcs)) > 0) {
+		tail = rs->rmsg_tail;
+		for (i = 0, rcnt = 0, wc = wcs; i < ret; i++, wc++) {
+			if (rs_wr_is_recv(wc->wr_id)) {
+				if (wc->status != IBV_WC_SUCCESS)
+					continue;
+				rcnt++;
+
+				if (wc->wc_flags & IBV_WC_WITH_IMM) {
+					msg = be32toh(wc->imm_data);
+				} else {
+					msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
+						[rs_wr_data(wc->wr_id)];
+
+				}
+				rs_stat_recv(rs, msg);
+				switch (rs_msg_op(msg)) {
+				case RS_OP_SGL:
+					rs->sseq_comp = (uint16_t) rs_msg_data(msg);
+					break;
+				case RS_OP_IOMAP_SGL:
+					/* The iomap was updated, that's nice to know. */
+					if (rs->stripe_win)
+						tail = rs_stripe_recv(rs, msg, tail);
+					break;
+				case RS_OP_CTRL:
+					if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
 						rs->state = rs_disconnected;
-						return 0;
+						closed = true;
+					} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
+						if (rs->state & rs_writable) {
+							rs->state &= ~rs_readable;
+						} else {
+							rs->state = rs_disconnected;
+							closed = true;
+						}
+					} else if (rs_msg_data(msg) == RS_CTRL_STRIPE) {
+						rs->stripe_ready = 1;
+					} else if (rs_msg_data(msg) == RS_CTRL_DR) {
+						rs->target_dr_max++;
+					} else if (rs_msg_data(msg) == RS_CTRL_GROW) {
+						rs_tune_grow(rs);
+					}
+					break;
+				case RS_OP_DRA:
+				case RS_OP_DRA_MORE:
+					if (rs->stripe_win)
+						tail = rs_stripe_recv(rs, msg, tail);
+					else
+						rs_dr_recv(rs, rs_msg_op(msg),
+							   rs_msg_data(msg), tail);
+					break;
+				default:
+					if (rs->stripe_win) {
+						tail = rs_stripe_recv(rs, msg, tail);
+						break;
 					}
+					rs->rmsg[tail].op = rs_msg_op(msg);
+					rs->rmsg[tail].data = rs_msg_data(msg);
+					if (++tail == rs->rq_size + 1)
+						tail = 0;
+					break;
+				}
+			} else {
+				switch  (rs_msg_op(rs_wr_data(wc->wr_id))) {
+				case RS_OP_SGL:
+					rs->ctrl_max_seqno++;
+					break;
+				case RS_OP_CTRL:
+					rs->ctrl_max_seqno++;
+					if (rs_msg_data(rs_wr_data(wc->wr_id)) == RS_CTRL_DISCONNECT)
+						rs->state = rs_disconnected;
+					break;
+				case RS_OP_IOMAP_SGL:
+					rs->sqe_avail++;
+					if (!rs_wr_is_msg_send(wc->wr_id))
+						rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
+					break;
+				default:
+					rs->sqe_avail++;
+					rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc->wr_id));
+					break;
+				}
+				if (wc->status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
+					rs->state = rs_error;
+					rs->err = EIO;
 				}
-				break;
-			case RS_OP_WRITE:
-				/* We really shouldn't be here. */
-				break;
-			default:
-				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
-				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
-				if (++rs->rmsg_tail == rs->rq_size + 1)
-					rs->rmsg_tail = 0;
-				break;
-			}
-		} else {
-			switch  (rs_msg_op(rs_wr_data(wc.wr_id))) {
-			case RS_OP_SGL:
-				rs->ctrl_max_seqno++;
-				break;
-			case RS_OP_CTRL:
-				rs->ctrl_max_seqno++;
-				if (rs_msg_data(rs_wr_data(wc.wr_id)) == RS_CTRL_DISCONNECT)
-					rs->state = rs_disconnected;
-				break;
-			case RS_OP_IOMAP_SGL:
-				rs->sqe_avail++;
-				if (!rs_wr_is_msg_send(wc.wr_id))
-					rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
-				break;
-			default:
-				rs->sqe_avail++;
-				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
-				break;
 			}
-			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
+		}
+		rs->rmsg_tail = tail;
+		if (rcnt)
+			rs_poll_arrival(rs);
+
+		if (rcnt && (rs->state & rs_connected)) {
+			ret = rs_post_recvs(rs, qp, rcnt);
+			if (ret) {
 				rs->state = rs_error;
-				rs->err = EIO;
+				rs->err = errno;
+				return ret;
 			}
 		}
+
+		if (closed)
+			return 0;
 	}
 
-	if (rs->state & rs_connected) {
-		while (!ret && rcnt--)
-			ret = rs_post_recv(rs);
+	return ret;
+}
 
-		if (ret) {
-			rs->state = rs_error;
-			rs->err = errno;
-		}
+/*
+ * The stripes are polled ahead of the primary QP.  A control message is only
+ * sent on the primary QP once all data sent on the stripes has completed, so
+ * that data has been processed by the time the control message is seen.
+ */
+static int rs_poll_cq(struct rsocket *rs)
+{
+	int i, ret;
+
+	for (i = 0; i < rs->nstripes; i++) {
+		ret = rs_poll_cq_qp(rs, rs->stripes[i].cq, rs->stripes[i].qp);
+		if (ret || !(rs->state & rs_connected))
+			return ret;
 	}
-	return ret;
+
+	return rs_poll_cq_qp(rs, rs->cm_id->recv_cq, rs->cm_id->qp);
+}
+
+static void rs_req_notify_cqs(struct rsocket *rs)
+{
+	int i;
+
+	for (i = 0; i < rs->nstripes; i++)
+		ibv_req_notify_cq(rs->stripes[i].cq, 0);
+	ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
 }
 
 static int rs_get_cq_event(struct rsocket *rs)
@@ -2071,7 +3241,10 @@ static int rs_get_cq_event(struct rsocket *rs)
 
 	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
-		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
+		rs->stats.cq_events++;
+		if (cq != rs->cm_id->recv_cq) {
+			ibv_ack_cq_events(cq, 1);
+		} else if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
 			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rs->unack_cqe = 0;
 		}
@@ -2100,8 +3273,9 @@ static int rs_get_cq_event(struct rsocket *rs)
 static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	int ret;
+	bool cq_locked, wait_locked;
 
-	fastlock_acquire(&rs->cq_lock);
+	cq_locked = rs_lock(rs, &rs->cq_lock);
 	do {
 		rs_update_credits(rs);
 		ret = rs_poll_cq(rs);
@@ -2113,26 +3287,27 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 		} else if (nonblock) {
 			ret = ERR(EWOULDBLOCK);
 		} else if (!rs->cq_armed) {
-			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+			rs_req_notify_cqs(rs);
 			rs->cq_armed = 1;
 		} else {
 			rs_update_credits(rs);
-			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
+			wait_locked = rs_lock(rs, &rs->cq_wait_lock);
+			rs_unlock(&rs->cq_lock, cq_locked);
 
 			ret = rs_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+			rs_unlock(&rs->cq_wait_lock, wait_locked);
+			cq_locked = rs_lock(rs, &rs->cq_lock);
 		}
 	} while (!ret);
 
 	rs_update_credits(rs);
-	fastlock_release(&rs->cq_lock);
+	rs_unlock(&rs->cq_lock, cq_locked);
 	return ret;
 }
 
 static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
+	struct rsocket_polling budget;
 	uint64_t start_time = 0;
 	uint32_t poll_time;
 	int ret;
@@ -2142,11 +3317,15 @@ static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsoc
 		if (!ret || nonblock || errno != EWOULDBLOCK)
 			return ret;
 
-		if (!start_time)
+		if (!start_time) {
 			start_time = rs_time_us();
+			rs_poll_budget(rs, start_time, &budget);
+		}
 
 		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+		if (poll_time > budget.spin_time)
+			sched_yield();
+	} while (poll_time <= budget.spin_time + budget.yield_time);
 
 	ret = rs_process_cq(rs, 0, test);
 	return ret;
@@ -2180,6 +3359,7 @@ static void ds_poll_cqs(struct rsocket *rs)
 	if (!(qp = rs->qp_list))
 		return;
 
+	rs->stats.cq_polls++;
 	do {
 		cnt = 0;
 		do {
@@ -2192,11 +3372,15 @@ static void ds_poll_cqs(struct rsocket *rs)
 			if (rs_wr_is_recv(wc.wr_id)) {
 				if (rs->rqe_avail && wc.status == IBV_WC_SUCCESS &&
 				    ds_valid_recv(qp, &wc)) {
+					rs_poll_arrival(rs);
 					rs->rqe_avail--;
 					rmsg = &rs->dmsg[rs->rmsg_tail];
 					rmsg->qp = qp;
 					rmsg->offset = rs_wr_data(wc.wr_id);
 					rmsg->length = wc.byte_len - sizeof(struct ibv_grh);
+					rs->stats.msgs_recv++;
+					rs->stats.bytes_recv += rmsg->length -
+						((struct ds_header *) (qp->rbuf + rmsg->offset))->length;
 					if (++rs->rmsg_tail == rs->rq_size + 1)
 						rs->rmsg_tail = 0;
 				} else {
@@ -2246,13 +3430,14 @@ static int ds_get_cq_event(struct rsocket *rs)
 	if (!rs->cq_armed)
 		return 0;
 
-	ret = epoll_wait(rs->epfd, &event, 1, -1);
+	ret = rs_epoll_wait(rs->epfd, &event, 1, -1);
 	if (ret <= 0)
 		return ret;
 
 	qp = event.data.ptr;
 	ret = ibv_get_cq_event(qp->cm_id->recv_cq_channel, &cq, &context);
 	if (!ret) {
+		rs->stats.cq_events++;
 		ibv_ack_cq_events(qp->cm_id->recv_cq, 1);
 		qp->cq_armed = 0;
 		rs->cq_armed = 0;
@@ -2264,8 +3449,9 @@ static int ds_get_cq_event(struct rsocket *rs)
 static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	int ret = 0;
+	bool cq_locked, wait_locked;
 
-	fastlock_acquire(&rs->cq_lock);
+	cq_locked = rs_lock(rs, &rs->cq_lock);
 	do {
 		ds_poll_cqs(rs);
 		if (test(rs)) {
@@ -2277,21 +3463,22 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 			ds_req_notify_cqs(rs);
 			rs->cq_armed = 1;
 		} else {
-			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
+			wait_locked = rs_lock(rs, &rs->cq_wait_lock);
+			rs_unlock(&rs->cq_lock, cq_locked);
 
 			ret = ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+			rs_unlock(&rs->cq_wait_lock, wait_locked);
+			cq_locked = rs_lock(rs, &rs->cq_lock);
 		}
 	} while (!ret);
 
-	fastlock_release(&rs->cq_lock);
+	rs_unlock(&rs->cq_lock, cq_locked);
 	return ret;
 }
 
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
+	struct rsocket_polling budget;
 	uint64_t start_time = 0;
 	uint32_t poll_time;
 	int ret;
@@ -2301,11 +3488,15 @@ static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsoc
 		if (!ret || nonblock || errno != EWOULDBLOCK)
 			return ret;
 
-		if (!start_time)
+		if (!start_time) {
 			start_time = rs_time_us();
+			rs_poll_budget(rs, start_time, &budget);
+		}
 
 		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+		if (poll_time > budget.spin_time)
+			sched_yield();
+	} while (poll_time <= budget.spin_time + budget.yield_time);
 
 	ret = ds_process_cqs(rs, 0, test);
 	return ret;
@@ -2335,17 +3526,18 @@ static int rs_poll_all(struct rsocket *rs)
  * Be careful with race conditions in the check below.  The target SGL
  * may be updated by a remote RDMA write.
  */
+static int rs_sq_avail(struct rsocket *rs)
+{
+	if (!(rs->opts & RS_OPT_MSG_SEND))
+		return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT);
+	else
+		return (rs->sqe_avail >= 2) && (rs->sbuf_bytes_avail >= RS_SNDLOWAT);
+}
+
 static int rs_can_send(struct rsocket *rs)
 {
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
-		       (rs->sseq_no != rs->sseq_comp) &&
-		       (rs->target_sgl[rs->target_sge].length != 0);
-	} else {
-		return (rs->sqe_avail >= 2) && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
-		       (rs->sseq_no != rs->sseq_comp) &&
-		       (rs->target_sgl[rs->target_sge].length != 0);
-	}
+	return rs_sq_avail(rs) && (rs->sseq_no != rs->sseq_comp) &&
+	       rs_target_left(rs);
 }
 
 static int ds_can_send(struct rsocket *rs)
@@ -2378,17 +3570,160 @@ static int rs_conn_have_rdata(struct rsocket *rs)
 	return rs_have_rdata(rs) || !(rs->state & rs_readable);
 }
 
-static int rs_conn_all_sends_done(struct rsocket *rs)
+static int rs_have_dr(struct rsocket *rs)
 {
-	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
-		rs->sqe_avail == rs->sq_size) ||
-	       !(rs->state & rs_connected);
+	return rs->dr_fill_no != rs->dr_reap_no;
 }
 
-static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
-		       struct ds_header *hdr)
+static int rs_conn_have_dr(struct rsocket *rs)
 {
-	union socket_addr sa;
+	return rs_have_dr(rs) || !(rs->state & rs_readable);
+}
+
+/*
+ * Data that arrived after a completed direct receive buffer is not
+ * returned by rrecv until rgetrecv has returned the buffer.
+ */
+static int rs_rmsg_end(struct rsocket *rs)
+{
+	return rs_have_dr(rs) ? rs->dr[rs->dr_reap_no % RS_DR_SIZE].rmsg_mark :
+				rs->rmsg_tail;
+}
+
+static int rs_have_rrecv_data(struct rsocket *rs)
+{
+	return rs->rmsg_head != rs_rmsg_end(rs);
+}
+
+static int rs_conn_have_rrecv_data(struct rsocket *rs)
+{
+	return rs_conn_have_rdata(rs) || rs_have_dr(rs);
+}
+
+static int rs_conn_all_sends_done(struct rsocket *rs)
+{
+	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
+		rs->sqe_avail == rs->sq_size) ||
+	       !(rs->state & rs_connected);
+}
+
+/*
+ * The send buffer can only be replaced while no sends are outstanding.
+ * Credit updates sent while polling may use the control messages at the
+ * end of the buffer, so the switch is made under the cq_lock.
+ */
+static void rs_resize_sbuf(struct rsocket *rs, uint32_t size)
+{
+	struct ibv_mr *smr, *old_smr;
+	uint8_t *sbuf, *old_sbuf;
+	uint32_t total_sbuf_size;
+	bool cq_locked;
+
+	total_sbuf_size = size;
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		total_sbuf_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	sbuf = rs_get_buf(rs, total_sbuf_size, false, &smr);
+	if (!sbuf)
+		return;
+
+	cq_locked = rs_lock(rs, &rs->cq_lock);
+	if ((rs->state & rs_connected) && rs_conn_all_sends_done(rs)) {
+		old_sbuf = rs->sbuf;
+		old_smr = rs->smr;
+		rs->sbuf = sbuf;
+		rs->smr = smr;
+		rs->sbuf_size = size;
+		rs->sbuf_bytes_avail = size;
+		rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) sbuf;
+		rs->ssgl[0].lkey = rs->ssgl[1].lkey = smr->lkey;
+		sbuf = old_sbuf;
+		smr = old_smr;
+	}
+	rs_unlock(&rs->cq_lock, cq_locked);
+
+	rs_put_buf(sbuf, smr);
+}
+
+static void rs_grow_sbuf(struct rsocket *rs, int flags)
+{
+	if (rs_get_comp(rs, rs_nonblocking(rs, flags), rs_conn_all_sends_done))
+		return;
+
+	rs_resize_sbuf(rs, min_t(uint32_t, rs->sbuf_size << 1, max_wmem));
+}
+
+static void rs_tune_sbuf(struct rsocket *rs)
+{
+	uint64_t now;
+
+	now = rs_time_us();
+	if (rs->sbuf_size > def_wmem && rs->last_send &&
+	    now - rs->last_send > RS_TUNE_IDLE_TIME &&
+	    rs_conn_all_sends_done(rs))
+		rs_resize_sbuf(rs, def_wmem);
+	rs->last_send = now;
+}
+
+/*
+ * Called by rpoll, so that the send buffer of an rsocket that stopped
+ * sending is shrunk without waiting for the next send.  The buffer is left
+ * alone if a send is in progress.
+ */
+static void rs_tune_sbuf_idle(struct rsocket *rs)
+{
+	bool slocked;
+
+	if (rs->sbuf_size <= def_wmem || !rs->last_send ||
+	    !rs_trylock(rs, &rs->slock, &slocked))
+		return;
+
+	if (rs->sbuf_size > def_wmem &&
+	    rs_time_us() - rs->last_send > RS_TUNE_IDLE_TIME &&
+	    rs_conn_all_sends_done(rs))
+		rs_resize_sbuf(rs, def_wmem);
+	rs_unlock(&rs->slock, slocked);
+}
+
+/*
+ * A send that cannot be posted is waiting either for local resources,
+ * released by send completions, or for credits granted by the peer.
+ * Waiting for send buffer space while send queue entries are available
+ * means that the send buffer is too small, and running out of target
+ * buffer space means that the peer's receive buffer is.
+ */
+static int rs_get_send_comp(struct rsocket *rs, int flags)
+{
+	uint64_t start_time;
+	int ret, sq_wait;
+
+	sq_wait = !rs_sq_avail(rs);
+	start_time = rs_time_us();
+	if (sq_wait && (rs->tune & RS_TUNE_SBUF) && rs->sbuf_size < max_wmem &&
+	    rs->sbuf_bytes_avail < RS_SNDLOWAT && rs->sqe_avail > 1)
+		rs_grow_sbuf(rs, flags);
+	else if (!sq_wait && (rs->tune & RS_TUNE_PEER) && !rs_target_left(rs))
+		rs->tune_hint = 1;
+
+	ret = rs_get_comp(rs, rs_nonblocking(rs, flags), rs_conn_can_send);
+	rs_stat_wait(rs, sq_wait, start_time);
+	return ret;
+}
+
+static int ds_get_send_comp(struct rsocket *rs, int flags)
+{
+	uint64_t start_time;
+	int ret;
+
+	start_time = rs_time_us();
+	ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+	rs_stat_wait(rs, 1, start_time);
+	return ret;
+}
+
+static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
+		       struct ds_header *hdr)
+{
+	union socket_addr sa;
 
 	memset(&sa, 0, sizeof sa);
 	if (hdr->version == 4) {
@@ -2410,6 +3745,14 @@ static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
 	memcpy(addr, &sa, *addrlen);
 }
 
+static void ds_free_rmsg(struct rsocket *rs, struct ds_rmsg *rmsg)
+{
+	ds_post_recv(rs, rmsg->qp, rmsg->offset);
+	if (++rs->rmsg_head == rs->rq_size + 1)
+		rs->rmsg_head = 0;
+	rs->rqe_avail++;
+}
+
 static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 			   struct sockaddr *src_addr, socklen_t *addrlen)
 {
@@ -2436,16 +3779,65 @@ static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 	if (addrlen)
 		ds_set_src(src_addr, addrlen, hdr);
 
-	if (!(flags & MSG_PEEK)) {
-		ds_post_recv(rs, rmsg->qp, rmsg->offset);
-		if (++rs->rmsg_head == rs->rq_size + 1)
-			rs->rmsg_head = 0;
-		rs->rqe_avail++;
-	}
+	if (!(flags & MSG_PEEK))
+		ds_free_rmsg(rs, rmsg);
 
 	return len;
 }
 
+/*
+ * Datagrams that have already arrived are returned together.  Only the
+ * first datagram is waited for, as if MSG_WAITFORONE were set.
+ */
+static int ds_recvmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
+{
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	struct msghdr *msg;
+	size_t i, j, len, size;
+	void *data;
+	int ret;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	for (i = 0; i < vlen; i++) {
+		if (!rs_have_rdata(rs)) {
+			ret = ds_get_comp(rs, i || rs_nonblocking(rs, flags),
+					  rs_have_rdata);
+			if (ret)
+				return i ? i : ret;
+		}
+
+		msg = &msgvec[i].msg_hdr;
+		rmsg = &rs->dmsg[rs->rmsg_head];
+		hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+		data = (void *) hdr + hdr->length;
+		len = rmsg->length - hdr->length;
+
+		msgvec[i].msg_len = 0;
+		for (j = 0; len && j < msg->msg_iovlen; j++) {
+			size = min_t(size_t, len, msg->msg_iov[j].iov_len);
+			memcpy(msg->msg_iov[j].iov_base, data, size);
+			msgvec[i].msg_len += size;
+			data += size;
+			len -= size;
+		}
+
+		msg->msg_flags = len ? MSG_TRUNC : 0;
+		msg->msg_controllen = 0;
+		if (msg->msg_name)
+			ds_set_src(msg->msg_name, &msg->msg_namelen, hdr);
+
+		if (flags & MSG_PEEK)
+			return 1;
+		ds_free_rmsg(rs, rmsg);
+	}
+
+	return i;
+}
+
 static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 {
 	size_t left = len;
@@ -2455,7 +3847,7 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
 
-	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
+	for (; left && (rmsg_head != rs_rmsg_end(rs)); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
 			rsize = left;
 		} else {
@@ -2488,15 +3880,16 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 	struct rsocket *rs;
 	size_t left = len;
 	uint32_t end_size, rsize;
-	int ret = 0;
+	int ret = 0, msg_done;
+	bool rlocked;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
 	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
+		rlocked = rs_lock(rs, &rs->rlock);
 		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
-		fastlock_release(&rs->rlock);
+		rs_unlock(&rs->rlock, rlocked);
 		return ret;
 	}
 
@@ -2508,29 +3901,34 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			return ret;
 		}
 	}
-	fastlock_acquire(&rs->rlock);
+	rlocked = rs_lock(rs, &rs->rlock);
 	do {
-		if (!rs_have_rdata(rs)) {
+		if (!rs_have_rrecv_data(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_have_rdata);
+					  rs_conn_have_rrecv_data);
 			if (ret)
 				break;
 		}
 
+		/* The next data must be taken with rgetrecv first */
+		if (!rs_have_rrecv_data(rs) && rs_have_dr(rs)) {
+			ret = ERR(EAGAIN);
+			break;
+		}
+
 		if (flags & MSG_PEEK) {
 			left = len - rs_peek(rs, buf, left);
 			break;
 		}
 
-		for (; left && rs_have_rdata(rs); left -= rsize) {
+		for (; left && rs_have_rrecv_data(rs); left -= rsize) {
 			if (left < rs->rmsg[rs->rmsg_head].data) {
 				rsize = left;
 				rs->rmsg[rs->rmsg_head].data -= left;
+				msg_done = 0;
 			} else {
-				rs->rseq_no++;
 				rsize = rs->rmsg[rs->rmsg_head].data;
-				if (++rs->rmsg_head == rs->rq_size + 1)
-					rs->rmsg_head = 0;
+				msg_done = 1;
 			}
 
 			end_size = rs->rbuf_size - rs->rbuf_offset;
@@ -2546,11 +3944,18 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			rs->rbuf_offset += rsize;
 			buf += rsize;
 			rs->rbuf_bytes_avail += rsize;
+
+			/* See rs_switch_rbuf */
+			if (msg_done) {
+				rs->rseq_no++;
+				if (++rs->rmsg_head == rs->rq_size + 1)
+					rs->rmsg_head = 0;
+			}
 		}
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
-	fastlock_release(&rs->rlock);
+	rs_unlock(&rs->rlock, rlocked);
 	return (ret && left == len) ? ret : len - left;
 }
 
@@ -2559,14 +3964,15 @@ ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 {
 	struct rsocket *rs;
 	int ret;
+	bool rlocked;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
 	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
+		rlocked = rs_lock(rs, &rs->rlock);
 		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
-		fastlock_release(&rs->rlock);
+		rs_unlock(&rs->rlock, rlocked);
 		return ret;
 	}
 
@@ -2594,6 +4000,63 @@ ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
 	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
 }
 
+/*
+ * Only the first message is waited for, for at most the timeout if one is
+ * given, after which messages that are immediately available are returned.
+ */
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct rsocket *rs;
+	struct pollfd fds;
+	unsigned int i;
+	ssize_t ret;
+	bool rlocked;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+
+	if (timeout) {
+		if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+		    timeout->tv_nsec >= 1000000000)
+			return ERR(EINVAL);
+
+		if (!rs_nonblocking(rs, flags)) {
+			fds.fd = socket;
+			fds.events = POLLIN;
+			fds.revents = 0;
+			ret = rpoll(&fds, 1, (int) min_t(uint64_t, INT32_MAX,
+				    timeout->tv_sec * 1000ULL +
+				    (timeout->tv_nsec + 999999) / 1000000));
+			if (ret < 0)
+				return ret;
+			if (!ret)
+				return ERR(EAGAIN);
+			flags |= MSG_DONTWAIT;
+		}
+	}
+	if (rs->type == SOCK_DGRAM) {
+		rlocked = rs_lock(rs, &rs->rlock);
+		ret = ds_recvmmsg(rs, msgvec, vlen, flags);
+		rs_unlock(&rs->rlock, rlocked);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rrecvv(socket, msgvec[i].msg_hdr.msg_iov,
+			     (int) msgvec[i].msg_hdr.msg_iovlen,
+			     i ? flags | MSG_DONTWAIT : flags);
+		if (ret < 0)
+			return i ? i : ret;
+
+		msgvec[i].msg_len = ret;
+		if (!ret)
+			return i + 1;
+	}
+	return i;
+}
+
 ssize_t rread(int socket, void *buf, size_t count)
 {
 	return rrecv(socket, buf, count, 0);
@@ -2614,8 +4077,7 @@ static int rs_send_iomaps(struct rsocket *rs, int flags)
 	fastlock_acquire(&rs->map_lock);
 	while (!dlist_empty(&rs->iomap_queue)) {
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_get_send_comp(rs, flags);
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -2733,7 +4195,7 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 		return ds_send_udp(rs, buf, len, flags, RS_OP_DATA);
 
 	if (!ds_can_send(rs)) {
-		ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+		ret = ds_get_send_comp(rs, flags);
 		if (ret)
 			return ret;
 	}
@@ -2757,43 +4219,16 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
  * We overlap sending the data, by posting a small work request immediately,
  * then increasing the size of the send on each iteration.
  */
-ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+static int rs_send_copy(struct rsocket *rs, const void *buf, size_t *left,
+			int flags)
 {
-	struct rsocket *rs;
 	struct ibv_sge sge;
-	size_t left = len;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
 	int ret = 0;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->slock);
-		ret = dsend(rs, buf, len, flags);
-		fastlock_release(&rs->slock);
-		return ret;
-	}
-
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
-		}
-	}
-
-	fastlock_acquire(&rs->slock);
-	if (rs->iomap_pending) {
-		ret = rs_send_iomaps(rs, flags);
-		if (ret)
-			goto out;
-	}
-	for (; left; left -= xfer_size, buf += xfer_size) {
+	for (; *left; *left -= xfer_size, buf += xfer_size) {
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_get_send_comp(rs, flags);
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -2802,28 +4237,30 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			}
 		}
 
-		if (olen < left) {
+		if (olen < *left) {
 			xfer_size = olen;
 			if (olen < RS_MAX_TRANSFER)
 				olen <<= 1;
 		} else {
-			xfer_size = left;
+			xfer_size = *left;
 		}
 
 		if (xfer_size > rs->sbuf_bytes_avail)
 			xfer_size = rs->sbuf_bytes_avail;
-		if (xfer_size > rs->target_sgl[rs->target_sge].length)
-			xfer_size = rs->target_sgl[rs->target_sge].length;
+		if (xfer_size > rs_target_left(rs))
+			xfer_size = rs_target_left(rs);
 
 		if (xfer_size <= rs->sq_inline) {
 			sge.addr = (uintptr_t) buf;
 			sge.length = xfer_size;
 			sge.lkey = 0;
-			ret = rs_write_data(rs, &sge, 1, xfer_size, IBV_SEND_INLINE);
+			ret = rs_write_data(rs, &sge, 1, xfer_size,
+					    xfer_size < *left, IBV_SEND_INLINE);
 		} else if (xfer_size <= rs_sbuf_left(rs)) {
 			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
 			rs->ssgl[0].length = xfer_size;
-			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size, 0);
+			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size,
+					    xfer_size < *left, 0);
 			if (xfer_size < rs_sbuf_left(rs))
 				rs->ssgl[0].addr += xfer_size;
 			else
@@ -2834,14 +4271,164 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 				rs->ssgl[0].length);
 			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
 			memcpy(rs->sbuf, buf + rs->ssgl[0].length, rs->ssgl[1].length);
-			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size, 0);
+			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size,
+					    xfer_size < *left, 0);
 			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
 		}
 		if (ret)
 			break;
 	}
+
+	return ret;
+}
+
+static int rs_use_zcopy(struct rsocket *rs, size_t len)
+{
+	return rs->zcopy_size && len >= rs->zcopy_size;
+}
+
+static int rs_conn_sends_done(struct rsocket *rs)
+{
+	return (rs->sbuf_bytes_avail == rs->sbuf_size) ||
+	       !(rs->state & rs_connected);
+}
+
+/*
+ * Look for an iomapping on the local iomap list that covers the user's
+ * buffer, so that we can send from it without registering the memory again.
+ */
+static struct rs_iomap_mr *rs_find_iomap_mr(struct rsocket *rs,
+					    const void *buf, size_t len)
+{
+	struct rs_iomap_mr *iomr;
+	dlist_entry *entry;
+
+	fastlock_acquire(&rs->map_lock);
+	for (entry = rs->iomap_list.next; entry != &rs->iomap_list;
+	     entry = entry->next) {
+		iomr = container_of(entry, struct rs_iomap_mr, entry);
+		if (iomr->mr->addr <= buf &&
+		    buf + len <= iomr->mr->addr + iomr->mr->length) {
+			atomic_fetch_add(&iomr->refcnt, 1);
+			goto out;
+		}
+	}
+	iomr = NULL;
+out:
+	fastlock_release(&rs->map_lock);
+	return iomr;
+}
+
+/*
+ * Zero-copy sends transfer data directly from the user's buffer, avoiding
+ * the copy into the send buffer.  Transfers are still accounted against
+ * the send buffer space, so flow control is unchanged.  Because the
+ * caller may reuse its buffer as soon as we return, we wait for all
+ * posted writes to complete before releasing the registration.  This
+ * holds even for nonblocking calls, which only avoid waiting for send
+ * credits.
+ */
+static int rs_send_zcopy(struct rsocket *rs, const void *buf, size_t *left,
+			 int flags)
+{
+	struct rs_iomap_mr *iomr;
+	struct ibv_mr *mr;
+	struct ibv_sge sge;
+	uint32_t xfer_size;
+	int ret = 0, posted = 0, err;
+
+	iomr = rs_find_iomap_mr(rs, buf, *left);
+	if (iomr) {
+		mr = iomr->mr;
+	} else {
+		mr = rdma_mr_cache_reg(rs->cm_id->pd, (void *) buf, *left, 0);
+		if (!mr)
+			return rs_send_copy(rs, buf, left, flags);
+	}
+
+	sge.lkey = mr->lkey;
+	for (; *left; *left -= xfer_size, buf += xfer_size) {
+		if (!rs_can_send(rs)) {
+			ret = rs_get_send_comp(rs, flags);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		xfer_size = min_t(size_t, *left, rs->sbuf_bytes_avail);
+		if (xfer_size > rs_target_left(rs))
+			xfer_size = rs_target_left(rs);
+		/* Striped transfers must fit in the length field of the tag */
+		if (rs->nstripes && xfer_size > RS_MAX_TRANSFER)
+			xfer_size = RS_MAX_TRANSFER;
+
+		sge.addr = (uintptr_t) buf;
+		sge.length = xfer_size;
+		ret = rs_write_data(rs, &sge, 1, xfer_size, xfer_size < *left, 0);
+		if (ret)
+			break;
+		posted = 1;
+	}
+
+	if (posted) {
+		err = errno;
+		rs_get_comp(rs, 0, rs_conn_sends_done);
+		errno = err;
+	}
+
+	if (iomr) {
+		fastlock_acquire(&rs->map_lock);
+		rs_release_iomap_mr(iomr);
+		fastlock_release(&rs->map_lock);
+	} else {
+		rdma_mr_cache_dereg(mr);
+	}
+	return ret;
+}
+
+ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	size_t left = len;
+	int ret = 0;
+	bool slocked;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		slocked = rs_lock(rs, &rs->slock);
+		ret = dsend(rs, buf, len, flags);
+		rs_unlock(&rs->slock, slocked);
+		return ret;
+	}
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	slocked = rs_lock(rs, &rs->slock);
+	if (rs->tune & RS_TUNE_SBUF)
+		rs_tune_sbuf(rs);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, flags);
+		if (ret)
+			goto out;
+	}
+	if (rs_use_zcopy(rs, len))
+		ret = rs_send_zcopy(rs, buf, &left, flags);
+	else
+		ret = rs_send_copy(rs, buf, &left, flags);
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(&rs->slock, slocked);
 
 	return (ret && left == len) ? ret : len - left;
 }
@@ -2851,6 +4438,7 @@ ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 {
 	struct rsocket *rs;
 	int ret;
+	bool slocked;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
@@ -2868,7 +4456,7 @@ ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 			return ret;
 	}
 
-	fastlock_acquire(&rs->slock);
+	slocked = rs_lock(rs, &rs->slock);
 	if (!rs->conn_dest || ds_compare_addr(dest_addr, &rs->conn_dest->addr)) {
 		ret = ds_get_dest(rs, dest_addr, addrlen, &rs->conn_dest);
 		if (ret)
@@ -2877,7 +4465,7 @@ ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 
 	ret = dsend(rs, buf, len, flags);
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(&rs->slock, slocked);
 	return ret;
 }
 
@@ -2901,14 +4489,37 @@ static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, siz
 	}
 }
 
-static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
+/*
+ * When zero-copy is enabled, large iov entries are sent directly from the
+ * user's buffers, while small entries are copied.
+ */
+static int rs_sendv_zcopy(struct rsocket *rs, const struct iovec *iov,
+			  int iovcnt, size_t *left, int flags)
 {
-	struct rsocket *rs;
-	const struct iovec *cur_iov;
-	size_t left, len, offset = 0;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	size_t iov_left;
 	int i, ret = 0;
 
+	for (i = 0; i < iovcnt && !ret; i++) {
+		iov_left = iov[i].iov_len;
+		if (rs_use_zcopy(rs, iov_left))
+			ret = rs_send_zcopy(rs, iov[i].iov_base, &iov_left, flags);
+		else
+			ret = rs_send_copy(rs, iov[i].iov_base, &iov_left, flags);
+		*left -= iov[i].iov_len - iov_left;
+	}
+
+	return ret;
+}
+
+static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
+{
+	struct rsocket *rs;
+	const struct iovec *cur_iov;
+	size_t left, len, offset = 0;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	int i, zcopy, ret = 0;
+	bool slocked;
+
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
@@ -2923,20 +4534,28 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 
 	cur_iov = iov;
 	len = iov[0].iov_len;
-	for (i = 1; i < iovcnt; i++)
+	zcopy = rs_use_zcopy(rs, iov[0].iov_len);
+	for (i = 1; i < iovcnt; i++) {
 		len += iov[i].iov_len;
+		zcopy |= rs_use_zcopy(rs, iov[i].iov_len);
+	}
 	left = len;
 
-	fastlock_acquire(&rs->slock);
+	slocked = rs_lock(rs, &rs->slock);
+	if (rs->tune & RS_TUNE_SBUF)
+		rs_tune_sbuf(rs);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
 			goto out;
 	}
+	if (zcopy) {
+		ret = rs_sendv_zcopy(rs, iov, iovcnt, &left, flags);
+		goto out;
+	}
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_get_send_comp(rs, flags);
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -2955,14 +4574,14 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 
 		if (xfer_size > rs->sbuf_bytes_avail)
 			xfer_size = rs->sbuf_bytes_avail;
-		if (xfer_size > rs->target_sgl[rs->target_sge].length)
-			xfer_size = rs->target_sgl[rs->target_sge].length;
+		if (xfer_size > rs_target_left(rs))
+			xfer_size = rs_target_left(rs);
 
 		if (xfer_size <= rs_sbuf_left(rs)) {
 			rs_copy_iov((void *) (uintptr_t) rs->ssgl[0].addr,
 				    &cur_iov, &offset, xfer_size);
 			rs->ssgl[0].length = xfer_size;
-			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size,
+			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size, xfer_size < left,
 					    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
 			if (xfer_size < rs_sbuf_left(rs))
 				rs->ssgl[0].addr += xfer_size;
@@ -2974,7 +4593,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 				    &offset, rs->ssgl[0].length);
 			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
 			rs_copy_iov(rs->sbuf, &cur_iov, &offset, rs->ssgl[1].length);
-			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size,
+			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size, xfer_size < left,
 					    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
 			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
 		}
@@ -2982,7 +4601,7 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 			break;
 	}
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(&rs->slock, slocked);
 
 	return (ret && left == len) ? ret : len - left;
 }
@@ -2995,6 +4614,189 @@ ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
 
+/*
+ * Returns the number of work requests posted.  Send buffers of requests
+ * that were not posted are returned to the free list, and msg_len is only
+ * set for messages that were posted.
+ */
+static int ds_post_send_list(struct rsocket *rs, struct ds_qp *qp,
+			     struct ibv_send_wr *wr, int cnt,
+			     struct mmsghdr *msgvec)
+{
+	struct ibv_send_wr *bad = NULL;
+	struct ds_smsg *smsg;
+	int i, posted, ret;
+
+	if (!cnt)
+		return 0;
+
+	wr[cnt - 1].next = NULL;
+	ret = ibv_post_send(qp->cm_id->qp, wr, &bad);
+	if (!ret)
+		bad = NULL;
+	else if (bad < wr || bad >= &wr[cnt])
+		bad = wr;
+
+	for (i = 0; i < cnt && &wr[i] != bad; i++) {
+		ds_stat_send(rs, &wr[i]);
+		msgvec[i].msg_len = wr[i].sg_list->length - qp->hdr.length;
+	}
+	posted = i;
+
+	for (; i < cnt; i++) {
+		smsg = (struct ds_smsg *) (uintptr_t) wr[i].sg_list->addr;
+		smsg->next = rs->smsg_free;
+		rs->smsg_free = smsg;
+		rs->sqe_avail++;
+	}
+	if (ret)
+		rdma_seterrno(ret);
+	return posted;
+}
+
+/*
+ * Messages are copied into send buffers and posted as a list of work
+ * requests, so that a single doorbell covers many datagrams.  The list is
+ * posted before waiting for send buffers, and whenever the next message
+ * goes out through a different QP or through the UDP socket.
+ */
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
+{
+	struct ibv_send_wr wr[DS_MMSG_BATCH];
+	struct ibv_sge sge[DS_MMSG_BATCH];
+	const struct iovec *iov;
+	struct ds_qp *qp = NULL;
+	struct ds_smsg *smsg;
+	struct msghdr *msg;
+	size_t i, len, offset;
+	int cnt = 0, sent = 0, posted, ret = 0;
+
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
+		}
+
+		for (len = 0, offset = 0; offset < msg->msg_iovlen; offset++)
+			len += msg->msg_iov[offset].iov_len;
+		if (len > RS_SNDLOWAT - rs->conn_dest->qp->hdr.length) {
+			ret = ERR(EMSGSIZE);
+			break;
+		}
+
+		if (cnt && (cnt == DS_MMSG_BATCH || qp != rs->conn_dest->qp ||
+			    !rs->conn_dest->ah || !ds_can_send(rs))) {
+			posted = ds_post_send_list(rs, qp, wr, cnt,
+						   &msgvec[i - cnt]);
+			sent += posted;
+			if (posted < cnt) {
+				ret = -1;
+				cnt = 0;
+				break;
+			}
+			cnt = 0;
+		}
+
+		if (!rs->conn_dest->ah) {
+			ret = ds_sendv_udp(rs, msg->msg_iov, (int) msg->msg_iovlen,
+					   flags, RS_OP_DATA);
+			if (ret < 0)
+				break;
+			msgvec[i].msg_len = ret;
+			sent++;
+			continue;
+		}
+
+		if (!ds_can_send(rs)) {
+			ret = ds_get_send_comp(rs, flags);
+			if (ret)
+				break;
+		}
+
+		qp = rs->conn_dest->qp;
+		smsg = rs->smsg_free;
+		rs->smsg_free = smsg->next;
+		rs->sqe_avail--;
+
+		memcpy((void *) smsg, &qp->hdr, qp->hdr.length);
+		iov = msg->msg_iov;
+		offset = 0;
+		rs_copy_iov((void *) smsg + qp->hdr.length, &iov, &offset, len);
+		offset = (uint8_t *) smsg - rs->sbuf;
+
+		sge[cnt].addr = (uintptr_t) smsg;
+		sge[cnt].length = qp->hdr.length + len;
+		sge[cnt].lkey = qp->smr->lkey;
+		wr[cnt].wr_id = rs_send_wr_id(offset);
+		wr[cnt].next = &wr[cnt + 1];
+		wr[cnt].sg_list = &sge[cnt];
+		wr[cnt].num_sge = 1;
+		wr[cnt].opcode = IBV_WR_SEND;
+		wr[cnt].send_flags = (sge[cnt].length <= rs->sq_inline) ?
+				     IBV_SEND_INLINE : 0;
+		wr[cnt].wr.ud.ah = rs->conn_dest->ah;
+		wr[cnt].wr.ud.remote_qpn = rs->conn_dest->qpn;
+		wr[cnt].wr.ud.remote_qkey = RDMA_UDP_QKEY;
+		cnt++;
+	}
+
+	if (cnt) {
+		posted = ds_post_send_list(rs, qp, wr, cnt, &msgvec[i - cnt]);
+		sent += posted;
+		if (posted < cnt)
+			ret = -1;
+	}
+
+	return sent ? sent : ret;
+}
+
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret;
+	bool slocked;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+
+		slocked = rs_lock(rs, &rs->slock);
+		ret = ds_sendmmsg(rs, msgvec, vlen, flags);
+		rs_unlock(&rs->slock, slocked);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : ret;
+		msgvec[i].msg_len = ret;
+	}
+	return i;
+}
+
 ssize_t rwrite(int socket, const void *buf, size_t count)
 {
 	return rsend(socket, buf, count, 0);
@@ -3167,9 +4969,12 @@ check_cq:
 	if ((rs->type == SOCK_STREAM) && ((rs->state & rs_connected) ||
 	     (rs->state == rs_disconnected) || (rs->state & rs_error))) {
 		rs_process_cq(rs, nonblock, test);
+		if (rs->tune & RS_TUNE_SBUF)
+			rs_tune_sbuf_idle(rs);
 
 		revents = 0;
-		if ((events & POLLIN) && rs_conn_have_rdata(rs))
+		if ((events & POLLIN) &&
+		    (rs_conn_have_rdata(rs) || rs_have_dr(rs)))
 			revents |= POLLIN;
 		if ((events & POLLOUT) && rs_can_send(rs))
 			revents |= POLLOUT;
@@ -3220,113 +5025,603 @@ check_cq:
 		return revents;
 	}
 
-	return 0;
+	return 0;
+}
+
+static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs)
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		else
+			poll(&fds[i], 1, 0);
+
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
+}
+
+/* We poll for as long as the most active rsocket being polled needs. */
+static void rs_poll_budgets(struct pollfd *fds, nfds_t nfds, uint64_t now,
+			    uint32_t *spin_time, uint32_t *yield_time)
+{
+	struct rsocket_polling budget;
+	struct rsocket *rs;
+	int i;
+
+	*spin_time = 0;
+	*yield_time = 0;
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (!rs)
+			continue;
+
+		rs_poll_budget(rs, now, &budget);
+		if (budget.spin_time > *spin_time)
+			*spin_time = budget.spin_time;
+		if (budget.yield_time > *yield_time)
+			*yield_time = budget.yield_time;
+	}
+}
+
+static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
+			if (fds[i].revents)
+				return 1;
+
+			if (rs->type == SOCK_STREAM) {
+				if (rs->state >= rs_connected)
+					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
+				else
+					rfds[i].fd = rs->cm_id->channel->fd;
+			} else {
+				rfds[i].fd = rs->epfd;
+			}
+			rfds[i].events = POLLIN;
+		} else {
+			rfds[i].fd = fds[i].fd;
+			rfds[i].events = fds[i].events;
+		}
+		rfds[i].revents = 0;
+	}
+	return 0;
+}
+
+static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i, cnt = 0;
+	bool wait_locked;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			if (rfds[i].revents) {
+				wait_locked = rs_lock(rs, &rs->cq_wait_lock);
+				if (rs->type == SOCK_STREAM)
+					rs_get_cq_event(rs);
+				else
+					ds_get_cq_event(rs);
+				rs_unlock(&rs->cq_wait_lock, wait_locked);
+			}
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		} else {
+			fds[i].revents = rfds[i].revents;
+		}
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
+}
+
+/*
+ * We need to poll *all* fd's that the user specifies at least once.
+ * Note that we may receive events on an rsocket that may not be reported
+ * to the user (e.g. connection events or credit updates).  Process those
+ * events, then return to polling until we find ones of interest.
+ */
+int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct pollfd *rfds;
+	uint64_t start_time = 0;
+	uint32_t poll_time, spin_time, yield_time;
+	int pollsleep, ret;
+
+	do {
+		ret = rs_poll_check(fds, nfds);
+		if (ret || !timeout)
+			return ret;
+
+		if (!start_time) {
+			start_time = rs_time_us();
+			rs_poll_budgets(fds, nfds, start_time,
+					&spin_time, &yield_time);
+		}
+
+		poll_time = (uint32_t) (rs_time_us() - start_time);
+		if (poll_time > spin_time)
+			sched_yield();
+	} while (poll_time <= spin_time + yield_time);
+
+	rfds = rs_fds_alloc(nfds);
+	if (!rfds)
+		return ERR(ENOMEM);
+
+	do {
+		ret = rs_poll_arm(rfds, fds, nfds);
+		if (ret)
+			break;
+
+		if (rs_poll_enter())
+			continue;
+
+		if (timeout >= 0) {
+			timeout -= (int) ((rs_time_us() - start_time) / 1000);
+			if (timeout <= 0)
+				return 0;
+			pollsleep = min(timeout, wake_up_interval);
+		} else {
+			pollsleep = wake_up_interval;
+		}
+
+		ret = poll(rfds, nfds + 1, pollsleep);
+		if (ret < 0) {
+			rs_poll_exit();
+			break;
+		}
+
+		ret = rs_poll_events(rfds, fds, nfds);
+		rs_poll_stop();
+	} while (!ret);
+
+	return ret;
+}
+
+/*
+ * A repoll set is the persistent form of rpoll, modeled after epoll.  Each
+ * set is backed by an epoll fd, which monitors the same fd that rpoll would
+ * wait on for each member.  Events on normal fds are reported directly by
+ * the kernel.  An event on the fd of an rsocket only indicates that its
+ * state needs to be checked.  Rsockets that have reported an event, or that
+ * are not yet connected or listening, are kept on a check list, which is
+ * processed on every call.  All other rsockets have their CQ armed, so that
+ * the cost of repoll_wait depends on the number of active rsockets, rather
+ * than the size of the set.
+ *
+ * Rsockets are always reported as level-triggered.  EPOLLONESHOT disables
+ * an rsocket after it has been reported, until it is rearmed with
+ * EPOLL_CTL_MOD.
+ *
+ * The epoll fd is also the fd of the set, so that it may be nested in
+ * other poll sets.  An rsocket with data already received is not signaled
+ * by the kernel, so after repoll_wait reports events, the set's eventfd
+ * keeps the epoll fd readable until a later call finds no events.
+ */
+#define REPOLL_SIGNAL ((uint64_t) -1)
+#define REPOLL_FLAGS (EPOLLET | EPOLLONESHOT | EPOLLWAKEUP | EPOLLEXCLUSIVE)
+
+struct repoll_item {
+	dlist_entry	  entry;
+	dlist_entry	  check_entry;
+	struct rsocket	  *rs;
+	int		  fd;
+	int		  rfd;
+	uint32_t	  events;
+	epoll_data_t	  data;
+	bool		  checking;
+	bool		  disabled;
+};
+
+struct repoll {
+	fastlock_t	  lock;
+	int		  epfd;
+	int		  sigfd;
+	bool		  signaled;
+	struct index_map  items;
+	dlist_entry	  item_list;
+	dlist_entry	  check_list;
+};
+
+static bool rs_poll_settled(struct rsocket *rs)
+{
+	return (rs->type == SOCK_DGRAM) || (rs->state == rs_listening) ||
+	       (rs->state & rs_connected);
+}
+
+static int rs_poll_fd(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+	if (rs->state == rs_listening)
+		return rs->accept_queue[0];
+	if (rs->state >= rs_connected)
+		return rs->cm_id->recv_cq_channel->fd;
+	return rs->cm_id->channel->fd;
+}
+
+static int repoll_kctl(struct repoll *set, struct repoll_item *item, int op)
+{
+	struct epoll_event event;
+
+	event.events = item->rs ? EPOLLIN : item->events;
+	event.data.u64 = (uint64_t) item->fd;
+	return rs_epoll_ctl(set->epfd, op, item->rfd, &event);
+}
+
+static void repoll_check(struct repoll *set, struct repoll_item *item)
+{
+	if (!item->checking && !item->disabled) {
+		dlist_insert_tail(&item->check_entry, &set->check_list);
+		item->checking = true;
+	}
+}
+
+static void repoll_uncheck(struct repoll_item *item)
+{
+	if (item->checking) {
+		dlist_remove(&item->check_entry);
+		item->checking = false;
+	}
+}
+
+/*
+ * The fd that we monitor for an rsocket changes with its state.  It is
+ * removed from the kernel set while the rsocket is disabled, to avoid
+ * reporting events that we will ignore.
+ */
+static void repoll_update_fd(struct repoll *set, struct repoll_item *item)
+{
+	int rfd;
+
+	rfd = item->disabled ? -1 : rs_poll_fd(item->rs);
+	if (rfd == item->rfd)
+		return;
+
+	if (item->rfd >= 0)
+		repoll_kctl(set, item, EPOLL_CTL_DEL);
+	item->rfd = rfd;
+	if (item->rfd >= 0 && repoll_kctl(set, item, EPOLL_CTL_ADD))
+		item->rfd = -1;
+}
+
+/* A closed rsocket is removed from the set, the same as a closed fd. */
+static bool repoll_valid(struct repoll_item *item)
+{
+	return !item->rs || idm_lookup(&idm, item->fd) == item->rs;
+}
+
+static int repoll_del(struct repoll *set, struct repoll_item *item)
+{
+	int ret = 0;
+
+	repoll_uncheck(item);
+	dlist_remove(&item->entry);
+	idm_clear(&set->items, item->fd);
+	if (item->rfd >= 0) {
+		ret = repoll_kctl(set, item, EPOLL_CTL_DEL);
+		if (item->rs)
+			ret = 0;
+	}
+	free(item);
+	return ret;
+}
+
+static int repoll_add(struct repoll *set, int fd, struct epoll_event *event)
+{
+	struct repoll_item *item;
+	int ret;
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
+
+	item->fd = fd;
+	item->rs = idm_lookup(&idm, fd);
+	item->rfd = item->rs ? rs_poll_fd(item->rs) : fd;
+	item->events = event->events;
+	item->data = event->data;
+
+	ret = repoll_kctl(set, item, EPOLL_CTL_ADD);
+	if (ret)
+		goto err1;
+
+	ret = idm_set(&set->items, fd, item);
+	if (ret < 0)
+		goto err2;
+
+	dlist_insert_tail(&item->entry, &set->item_list);
+	if (item->rs)
+		repoll_check(set, item);
+	return 0;
+
+err2:
+	repoll_kctl(set, item, EPOLL_CTL_DEL);
+err1:
+	free(item);
+	return ret;
+}
+
+static int repoll_mod(struct repoll *set, struct repoll_item *item,
+		      struct epoll_event *event)
+{
+	item->events = event->events;
+	item->data = event->data;
+	if (!item->rs)
+		return repoll_kctl(set, item, EPOLL_CTL_MOD);
+
+	item->disabled = false;
+	repoll_update_fd(set, item);
+	repoll_check(set, item);
+	return 0;
+}
+
+static int repoll_close(struct repoll *set)
+{
+	struct repoll_item *item;
+
+	pthread_mutex_lock(&mut);
+	idm_clear(&repoll_idm, set->epfd);
+	pthread_mutex_unlock(&mut);
+
+	while (!dlist_empty(&set->item_list)) {
+		item = container_of(set->item_list.next, struct repoll_item, entry);
+		dlist_remove(&item->entry);
+		idm_clear(&set->items, item->fd);
+		free(item);
+	}
+	idm_destroy(&set->items);
+
+	close(set->sigfd);
+	close(set->epfd);
+	fastlock_destroy(&set->lock);
+	free(set);
+	return 0;
+}
+
+int repoll_create(int size)
+{
+	struct epoll_event event;
+	struct repoll *set;
+	int ret;
+
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	if (rs_pollinit())
+		return -1;
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return ERR(ENOMEM);
+
+	fastlock_init(&set->lock);
+	dlist_init(&set->item_list);
+	dlist_init(&set->check_list);
+
+	set->epfd = rs_epoll_create(EPOLL_CLOEXEC);
+	if (set->epfd < 0) {
+		ret = set->epfd;
+		goto err1;
+	}
+
+	set->sigfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (set->sigfd < 0) {
+		ret = set->sigfd;
+		goto err2;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u64 = REPOLL_SIGNAL;
+	ret = rs_epoll_ctl(set->epfd, EPOLL_CTL_ADD, pollsignal, &event);
+	if (!ret)
+		ret = rs_epoll_ctl(set->epfd, EPOLL_CTL_ADD, set->sigfd, &event);
+	if (ret)
+		goto err3;
+
+	pthread_mutex_lock(&mut);
+	ret = idm_set(&repoll_idm, set->epfd, set);
+	pthread_mutex_unlock(&mut);
+	if (ret < 0)
+		goto err3;
+
+	return set->epfd;
+
+err3:
+	close(set->sigfd);
+err2:
+	close(set->epfd);
+err1:
+	fastlock_destroy(&set->lock);
+	free(set);
+	return ret;
 }
 
-static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-	struct rsocket *rs;
-	int i, cnt = 0;
+	struct repoll_item *item;
+	struct repoll *set;
+	int ret;
 
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs)
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		else
-			poll(&fds[i], 1, 0);
+	set = idm_lookup(&repoll_idm, epfd);
+	if (!set)
+		return ERR(EBADF);
 
-		if (fds[i].revents)
-			cnt++;
+	if (fd == epfd)
+		return ERR(EINVAL);
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	fastlock_acquire(&set->lock);
+	item = idm_lookup(&set->items, fd);
+	if (item && !repoll_valid(item)) {
+		repoll_del(set, item);
+		item = NULL;
+	}
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		/* The fd may have been closed and reopened */
+		if (item && !item->rs && repoll_kctl(set, item, EPOLL_CTL_MOD) &&
+		    errno == ENOENT) {
+			repoll_del(set, item);
+			item = NULL;
+		}
+		ret = item ? ERR(EEXIST) : repoll_add(set, fd, event);
+		break;
+	case EPOLL_CTL_MOD:
+		ret = item ? repoll_mod(set, item, event) : ERR(ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		ret = item ? repoll_del(set, item) : ERR(ENOENT);
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
 	}
-	return cnt;
+	fastlock_release(&set->lock);
+	return ret;
 }
 
-static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
-{
-	struct rsocket *rs;
-	int i;
-
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
-			if (fds[i].revents)
-				return 1;
+/*
+ * Check the state of all rsockets on the check list, appending any events
+ * after the cnt events that have already been found.  Rsockets without
+ * events have their CQ armed and are taken off the list once they are
+ * settled.  The list is rotated, so that the rsockets that are left
+ * unchecked when the caller's array fills are checked first next time.
+ */
+static int repoll_check_items(struct repoll *set, struct epoll_event *events,
+			      int cnt, int maxevents)
+{
+	struct repoll_item *item;
+	dlist_entry *entry, *next;
+	int revents;
+
+	for (entry = set->check_list.next;
+	     entry != &set->check_list && cnt < maxevents; entry = next) {
+		next = entry->next;
+		item = container_of(entry, struct repoll_item, check_entry);
+		if (!repoll_valid(item)) {
+			repoll_del(set, item);
+			continue;
+		}
 
-			if (rs->type == SOCK_STREAM) {
-				if (rs->state >= rs_connected)
-					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
-				else
-					rfds[i].fd = rs->cm_id->channel->fd;
-			} else {
-				rfds[i].fd = rs->epfd;
+		revents = rs_poll_rs(item->rs, item->events & ~REPOLL_FLAGS,
+				     1, rs_poll_all);
+		if (!revents && rs_poll_settled(item->rs))
+			revents = rs_poll_rs(item->rs, item->events & ~REPOLL_FLAGS,
+					     0, rs_is_cq_armed);
+
+		if (revents) {
+			events[cnt].events = revents;
+			events[cnt++].data = item->data;
+			if (item->events & EPOLLONESHOT) {
+				repoll_uncheck(item);
+				item->disabled = true;
 			}
-			rfds[i].events = POLLIN;
-		} else {
-			rfds[i].fd = fds[i].fd;
-			rfds[i].events = fds[i].events;
+		} else if (rs_poll_settled(item->rs)) {
+			repoll_uncheck(item);
 		}
-		rfds[i].revents = 0;
+		repoll_update_fd(set, item);
 	}
-	return 0;
+
+	if (entry != &set->check_list && entry != set->check_list.next) {
+		dlist_remove(&set->check_list);
+		dlist_insert_before(&set->check_list, entry);
+	}
+	return cnt;
 }
 
-static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+/*
+ * Translate the events returned by the kernel in place.  Events on normal
+ * fds are returned, while rsockets with events are queued to be checked.
+ */
+static int repoll_events(struct repoll *set, struct epoll_event *events,
+			 int nevents, int maxevents)
 {
+	struct repoll_item *item;
 	struct rsocket *rs;
 	int i, cnt = 0;
+	bool wait_locked;
 
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			if (rfds[i].revents) {
-				fastlock_acquire(&rs->cq_wait_lock);
-				if (rs->type == SOCK_STREAM)
-					rs_get_cq_event(rs);
-				else
-					ds_get_cq_event(rs);
-				fastlock_release(&rs->cq_wait_lock);
-			}
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		} else {
-			fds[i].revents = rfds[i].revents;
+	for (i = 0; i < nevents; i++) {
+		if (events[i].data.u64 == REPOLL_SIGNAL)
+			continue;
+
+		item = idm_lookup(&set->items, (int) events[i].data.u64);
+		if (!item)
+			continue;
+
+		if (!item->rs) {
+			events[cnt].events = events[i].events;
+			events[cnt++].data = item->data;
+			continue;
 		}
-		if (fds[i].revents)
-			cnt++;
+
+		if (!repoll_valid(item)) {
+			repoll_del(set, item);
+			continue;
+		}
+
+		rs = item->rs;
+		wait_locked = rs_lock(rs, &rs->cq_wait_lock);
+		if (rs->type == SOCK_STREAM)
+			rs_get_cq_event(rs);
+		else
+			ds_get_cq_event(rs);
+		rs_unlock(&rs->cq_wait_lock, wait_locked);
+		repoll_check(set, item);
 	}
-	return cnt;
+
+	return repoll_check_items(set, events, cnt, maxevents);
 }
 
-/*
- * We need to poll *all* fd's that the user specifies at least once.
- * Note that we may receive events on an rsocket that may not be reported
- * to the user (e.g. connection events or credit updates).  Process those
- * events, then return to polling until we find ones of interest.
- */
-int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+static void repoll_signal(struct repoll *set, bool signal)
 {
-	struct pollfd *rfds;
-	uint64_t start_time = 0;
-	uint32_t poll_time;
-	int pollsleep, ret;
+	uint64_t c = 1;
 
-	do {
-		ret = rs_poll_check(fds, nfds);
-		if (ret || !timeout)
-			return ret;
+	if (set->signaled == signal)
+		return;
 
-		if (!start_time)
-			start_time = rs_time_us();
+	if (signal) {
+		if (write(set->sigfd, &c, sizeof(c)) != sizeof(c))
+			return;
+	} else {
+		if (read(set->sigfd, &c, sizeof(c)) != sizeof(c))
+			return;
+	}
+	set->signaled = signal;
+}
 
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	struct repoll *set;
+	uint64_t start_time;
+	int pollsleep, ret;
 
-	rfds = rs_fds_alloc(nfds);
-	if (!rfds)
-		return ERR(ENOMEM);
+	set = idm_lookup(&repoll_idm, epfd);
+	if (!set)
+		return ERR(EBADF);
+	if (maxevents <= 0)
+		return ERR(EINVAL);
 
+	start_time = rs_time_us();
 	do {
-		ret = rs_poll_arm(rfds, fds, nfds);
+		fastlock_acquire(&set->lock);
+		ret = repoll_check_items(set, events, 0, maxevents);
+		repoll_signal(set, ret > 0);
+		fastlock_release(&set->lock);
 		if (ret)
 			break;
 
@@ -3334,23 +5629,29 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 			continue;
 
 		if (timeout >= 0) {
-			timeout -= (int) ((rs_time_us() - start_time) / 1000);
-			if (timeout <= 0)
-				return 0;
-			pollsleep = min(timeout, wake_up_interval);
+			pollsleep = timeout -
+				    (int) ((rs_time_us() - start_time) / 1000);
+			if (pollsleep < 0)
+				pollsleep = 0;
+			else if (pollsleep > wake_up_interval)
+				pollsleep = wake_up_interval;
 		} else {
 			pollsleep = wake_up_interval;
 		}
 
-		ret = poll(rfds, nfds + 1, pollsleep);
+		ret = rs_epoll_wait(set->epfd, events, maxevents, pollsleep);
 		if (ret < 0) {
 			rs_poll_exit();
 			break;
 		}
 
-		ret = rs_poll_events(rfds, fds, nfds);
+		fastlock_acquire(&set->lock);
+		ret = repoll_events(set, events, ret, maxevents);
+		repoll_signal(set, ret > 0);
+		fastlock_release(&set->lock);
 		rs_poll_stop();
-	} while (!ret);
+	} while (!ret && (timeout < 0 ||
+		 (int) ((rs_time_us() - start_time) / 1000) < timeout));
 
 	return ret;
 }
@@ -3477,6 +5778,18 @@ int rshutdown(int socket, int how)
 				goto out;
 			ctrl = RS_CTRL_DISCONNECT;
 		}
+
+		/*
+		 * The peer acts on the control message as soon as it arrives
+		 * on the primary QP, so data still in flight on the stripes
+		 * would be lost.  Wait for it to be delivered first.
+		 */
+		if (rs->nstripes) {
+			ret = rs_process_cq(rs, 0, rs_conn_all_sends_done);
+			if (ret)
+				goto out;
+		}
+
 		if (!rs_ctrl_avail(rs)) {
 			ret = rs_process_cq(rs, 0, rs_conn_can_send_ctrl);
 			if (ret)
@@ -3522,11 +5835,14 @@ static void ds_shutdown(struct rsocket *rs)
 
 int rclose(int socket)
 {
+	struct repoll *set;
 	struct rsocket *rs;
 
 	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return EBADF;
+	if (!rs) {
+		set = idm_lookup(&repoll_idm, socket);
+		return set ? repoll_close(set) : EBADF;
+	}
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
@@ -3652,6 +5968,9 @@ int rsetsockopt(int socket, int level, int optname,
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
 			    (rs->type == SOCK_DGRAM && !rs->qp_list))
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+			/* A size set by the application is not tuned */
+			if (rs->type == SOCK_STREAM && !rs->rbuf)
+				rs->tune &= ~RS_TUNE_RBUF;
 			ret = 0;
 			break;
 		case SO_SNDBUF:
@@ -3659,6 +5978,8 @@ int rsetsockopt(int socket, int level, int optname,
 				rs->sbuf_size = (*(uint32_t *) optval) << 1;
 			if (rs->sbuf_size < RS_SNDLOWAT)
 				rs->sbuf_size = RS_SNDLOWAT << 1;
+			if (rs->type == SOCK_STREAM && !rs->sbuf)
+				rs->tune &= ~RS_TUNE_SBUF;
 			ret = 0;
 			break;
 		case SO_LINGER:
@@ -3721,7 +6042,8 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
-		if (rs->state >= rs_opening) {
+		if (rs->state >= rs_opening && optname != RDMA_ZEROCOPY &&
+		    optname != RDMA_LOCKLESS) {
 			ret = ERR(EINVAL);
 			break;
 		}
@@ -3756,6 +6078,26 @@ int rsetsockopt(int socket, int level, int optname,
 				ret = ERR(ENOMEM);
 			}
 			break;
+		case RDMA_ZEROCOPY:
+			if (rs->type == SOCK_STREAM) {
+				rs->zcopy_size = *(uint32_t *) optval;
+				ret = 0;
+			}
+			break;
+		case RDMA_STRIPES:
+			if (rs->type == SOCK_STREAM) {
+				rs->stripe_cnt = (uint8_t) min_t(uint32_t,
+					*(uint32_t *) optval, RS_MAX_STRIPES);
+				ret = 0;
+			}
+			break;
+		case RDMA_LOCKLESS:
+			if (rs->type == SOCK_STREAM) {
+				rs->lockless = *(int *) optval ? 1 : 0;
+				rs->owner = pthread_self();
+				ret = 0;
+			}
+			break;
 		default:
 			break;
 		}
@@ -3928,6 +6270,43 @@ int rgetsockopt(int socket, int level, int optname,
 				}
 			}
 			break;
+		case RDMA_ZEROCOPY:
+			if (rs->type == SOCK_STREAM) {
+				*((int *) optval) = rs->zcopy_size;
+				*optlen = sizeof(int);
+			} else {
+				ret = ENOTSUP;
+			}
+			break;
+		case RDMA_STRIPES:
+			if (rs->type == SOCK_STREAM) {
+				*((int *) optval) = (rs->state & rs_connected) ?
+						    rs->nstripes : rs->stripe_cnt;
+				*optlen = sizeof(int);
+			} else {
+				ret = ENOTSUP;
+			}
+			break;
+		case RDMA_LOCKLESS:
+			*((int *) optval) = rs->lockless;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_STATS:
+			if (*optlen < sizeof(struct rsocket_stats)) {
+				ret = EINVAL;
+			} else {
+				memcpy(optval, &rs->stats, sizeof(struct rsocket_stats));
+				*optlen = sizeof(struct rsocket_stats);
+			}
+			break;
+		case RDMA_POLLING:
+			if (*optlen < sizeof(struct rsocket_polling)) {
+				ret = EINVAL;
+			} else {
+				rs_poll_budget(rs, rs_time_us(), optval);
+				*optlen = sizeof(struct rsocket_polling);
+			}
+			break;
 		default:
 			ret = ENOTSUP;
 			break;
@@ -4034,6 +6413,8 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 	if (offset == -1)
 		offset = (uintptr_t) buf;
 	iomr->offset = offset;
+	iomr->addr = buf;
+	iomr->length = len;
 	atomic_store(&iomr->refcnt, 1);
 
 	if (iomr->index >= 0) {
@@ -4062,7 +6443,7 @@ int riounmap(int socket, void *buf, size_t len)
 	for (entry = rs->iomap_list.next; entry != &rs->iomap_list;
 	     entry = entry->next) {
 		iomr = container_of(entry, struct rs_iomap_mr, entry);
-		if (iomr->mr->addr == buf && iomr->mr->length == len) {
+		if (iomr->addr == buf && iomr->length == len) {
 			rs_release_iomap_mr(iomr);
 			goto out;
 		}
@@ -4071,7 +6452,7 @@ int riounmap(int socket, void *buf, size_t len)
 	for (entry = rs->iomap_queue.next; entry != &rs->iomap_queue;
 	     entry = entry->next) {
 		iomr = container_of(entry, struct rs_iomap_mr, entry);
-		if (iomr->mr->addr == buf && iomr->mr->length == len) {
+		if (iomr->addr == buf && iomr->length == len) {
 			rs_release_iomap_mr(iomr);
 			goto out;
 		}
@@ -4102,11 +6483,12 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 	size_t left = count;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
 	int ret = 0;
+	bool slocked;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
-	fastlock_acquire(&rs->slock);
+	slocked = rs_lock(rs, &rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
@@ -4120,8 +6502,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		}
 
 		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+			ret = rs_get_send_comp(rs, flags);
 			if (ret)
 				break;
 			if (!(rs->state & rs_writable)) {
@@ -4170,11 +6551,199 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 			break;
 	}
 out:
-	fastlock_release(&rs->slock);
+	rs_unlock(&rs->slock, slocked);
 
 	return (ret && left == count) ? ret : count - left;
 }
 
+static int rs_dr_ctrl_avail(struct rsocket *rs)
+{
+	return (rs->opts & RS_OPT_MSG_SEND) ? rs_2ctrl_avail(rs) :
+					      rs_ctrl_avail(rs);
+}
+
+static int rs_conn_can_post_dr(struct rsocket *rs)
+{
+	return rs_dr_ctrl_avail(rs) || !(rs->state & rs_connected);
+}
+
+/*
+ * Write the SGE of a posted buffer into the peer's table of receive
+ * buffers.  The peer fills the buffers in the order that they are posted.
+ */
+static int rs_send_dr(struct rsocket *rs, struct rs_dr *dr)
+{
+	struct ibv_sge ibsge;
+	struct rs_sge sge, *sge_buf;
+	int flags;
+
+	rs->ctrl_seqno++;
+	if (rs->opts & RS_OPT_MSG_SEND)
+		rs->ctrl_seqno++;
+
+	if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+		sge.addr = (uintptr_t) dr->buf;
+		sge.key = dr->mr->rkey;
+		sge.length = dr->len;
+	} else {
+		sge.addr = bswap_64((uintptr_t) dr->buf);
+		sge.key = bswap_32(dr->mr->rkey);
+		sge.length = bswap_32(dr->len);
+	}
+
+	if (rs->sq_inline < sizeof sge) {
+		sge_buf = rs_get_ctrl_buf(rs);
+		memcpy(sge_buf, &sge, sizeof sge);
+		ibsge.addr = (uintptr_t) sge_buf;
+		ibsge.lkey = rs->smr->lkey;
+		flags = 0;
+	} else {
+		ibsge.addr = (uintptr_t) &sge;
+		ibsge.lkey = 0;
+		flags = IBV_SEND_INLINE;
+	}
+	ibsge.length = sizeof(sge);
+
+	return rs_post_write_msg(rs, &ibsge, 1,
+		rs_msg_set(RS_OP_CTRL, RS_CTRL_DR), flags,
+		rs->remote_dr.addr + (rs->dr_post_no % RS_DR_SIZE) *
+				     sizeof(struct rs_sge),
+		rs->remote_dr.key);
+}
+
+/*
+ * Post an application buffer to receive data directly.  Data sent by the
+ * peer after it sees the buffer is written into it, instead of into the
+ * rsocket's receive buffer.  Completed buffers are returned by rgetrecv.
+ */
+int rpostrecv(int socket, void *buf, size_t len)
+{
+	struct rsocket *rs;
+	struct rs_dr *dr;
+	int ret = 0;
+	bool rlocked, cq_locked;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM || !(rs->state & rs_readable))
+		return ERR(ENOTCONN);
+	if (!rs->remote_dr.length)
+		return ERR(ENOTSUP);
+	if (!len || len > UINT32_MAX)
+		return ERR(EINVAL);
+
+	rlocked = rs_lock(rs, &rs->rlock);
+	if (!rs->dr) {
+		rs->dr = calloc(RS_DR_SIZE, sizeof(*rs->dr));
+		if (!rs->dr) {
+			ret = ERR(ENOMEM);
+			goto out;
+		}
+	}
+
+	if ((uint16_t) (rs->dr_post_no - rs->dr_reap_no) == RS_DR_SIZE) {
+		ret = ERR(ENOBUFS);
+		goto out;
+	}
+
+	dr = &rs->dr[rs->dr_post_no % RS_DR_SIZE];
+	dr->mr = ibv_reg_mr(rs->cm_id->pd, buf, len,
+			    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	if (!dr->mr) {
+		ret = -1;
+		goto out;
+	}
+	dr->buf = buf;
+	dr->len = (uint32_t) len;
+	dr->bytes = 0;
+	dr->msgs = 0;
+
+	do {
+		if (!rs_dr_ctrl_avail(rs)) {
+			ret = rs_process_cq(rs, rs_nonblocking(rs, 0),
+					    rs_conn_can_post_dr);
+			if (ret)
+				break;
+		}
+
+		cq_locked = rs_lock(rs, &rs->cq_lock);
+		if (!(rs->state & rs_connected)) {
+			ret = ERR(ECONNRESET);
+		} else if (rs_dr_ctrl_avail(rs)) {
+			ret = rs_send_dr(rs, dr);
+			if (!ret)
+				rs->dr_post_no++;
+			rs_unlock(&rs->cq_lock, cq_locked);
+			break;
+		}
+		rs_unlock(&rs->cq_lock, cq_locked);
+	} while (!ret);
+
+	if (ret)
+		ibv_dereg_mr(dr->mr);
+out:
+	rs_unlock(&rs->rlock, rlocked);
+	return ret;
+}
+
+/*
+ * Return buffers that were filled by the peer, in the order that they
+ * were posted.  A buffer is only returned once rrecv has consumed the data
+ * received ahead of it, and its memory is deregistered first, so that the
+ * peer can no longer write into it.  Once no more data can be received,
+ * buffers that are still posted are returned with the data received so far.
+ */
+int rgetrecv(int socket, struct rsocket_recv *recv, int nrecv, int flags)
+{
+	struct rsocket *rs;
+	struct rs_dr *dr;
+	int ret = 0, cnt = 0;
+	bool rlocked, cq_locked;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(ENOTSUP);
+
+	rlocked = rs_lock(rs, &rs->rlock);
+	if (!rs->dr || rs->dr_post_no == rs->dr_reap_no)
+		goto out;
+
+	if (!rs_have_dr(rs)) {
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_conn_have_dr);
+		if (ret)
+			goto out;
+	}
+
+	if (!(rs->state & rs_readable)) {
+		cq_locked = rs_lock(rs, &rs->cq_lock);
+		for (; rs->dr_fill_no != rs->dr_post_no; rs->dr_fill_no++)
+			rs->dr[rs->dr_fill_no % RS_DR_SIZE].rmsg_mark =
+				rs->rmsg_tail;
+		rs_unlock(&rs->cq_lock, cq_locked);
+	}
+
+	for (; cnt < nrecv && rs_have_dr(rs); cnt++) {
+		dr = &rs->dr[rs->dr_reap_no % RS_DR_SIZE];
+		if (rs->rmsg_head != dr->rmsg_mark)
+			break;
+
+		rs->dr_reap_no++;
+		recv[cnt].buf = dr->buf;
+		recv[cnt].len = dr->bytes;
+		rs->rseq_no += dr->msgs;
+		ibv_dereg_mr(dr->mr);
+	}
+	if (!cnt && rs_have_dr(rs))
+		ret = ERR(EAGAIN);
+out:
+	rs_unlock(&rs->rlock, rlocked);
+	return ret ? ret : cnt;
+}
+
 /****************************************************************************
  * Service Processing Threads
  ****************************************************************************/
@@ -4305,12 +6874,15 @@ static void udp_svc_create_ah(struct rsocket *rs, struct ds_dest *dest, uint32_t
 	struct rdma_cm_id *id;
 	struct ibv_ah_attr attr;
 	int ret;
+	bool slocked;
 
 	if (dest->ah) {
-		fastlock_acquire(&rs->slock);
-		ibv_destroy_ah(dest->ah);
+		slocked = rs_lock(rs, &rs->slock);
+		fastlock_acquire(&rs->map_lock);
+		ds_put_ah(rs, dest->ah);
+		fastlock_release(&rs->map_lock);
 		dest->ah = NULL;
-		fastlock_release(&rs->slock);
+		rs_unlock(&rs->slock, slocked);
 	}
 
 	ret = rdma_create_id(NULL, &id, NULL, dest->qp->cm_id->ps);
@@ -4346,10 +6918,12 @@ static void udp_svc_create_ah(struct rsocket *rs, struct ds_dest *dest, uint32_t
 	attr.static_rate = id->route.path_rec->rate;
 	attr.port_num  = id->port_num;
 
-	fastlock_acquire(&rs->slock);
+	slocked = rs_lock(rs, &rs->slock);
 	dest->qpn = qpn;
-	dest->ah = ibv_create_ah(dest->qp->cm_id->pd, &attr);
-	fastlock_release(&rs->slock);
+	fastlock_acquire(&rs->map_lock);
+	dest->ah = ds_get_ah(rs, dest->qp->cm_id->pd, &attr);
+	fastlock_release(&rs->map_lock);
+	rs_unlock(&rs->slock, slocked);
 out:
 	rdma_destroy_id(id);
 }
@@ -4401,6 +6975,7 @@ static void udp_svc_process_rs(struct rsocket *rs)
 	socklen_t addrlen = sizeof addr;
 	int len, ret;
 	uint32_t qpn;
+	bool slocked;
 
 	ret = recvfrom(rs->udp_sock, buf, sizeof buf, 0, &addr.sa, &addrlen);
 	if (ret < DS_UDP_IPV4_HDR_LEN)
@@ -4421,12 +6996,12 @@ static void udp_svc_process_rs(struct rsocket *rs)
 		return;
 
 	if (udp_hdr->op == RS_OP_DATA) {
-		fastlock_acquire(&rs->slock);
+		slocked = rs_lock(rs, &rs->slock);
 		cur_dest = rs->conn_dest;
 		rs->conn_dest = dest;
 		ds_send_udp(rs, NULL, 0, 0, RS_OP_CTRL);
 		rs->conn_dest = cur_dest;
-		fastlock_release(&rs->slock);
+		rs_unlock(&rs->slock, slocked);
 	}
 
 	if (!dest->ah || (dest->qpn != qpn))
@@ -4434,12 +7009,12 @@ static void udp_svc_process_rs(struct rsocket *rs)
 
 	/* to do: handle when dest local ip address doesn't match udp ip */
 	if (udp_hdr->op == RS_OP_DATA) {
-		fastlock_acquire(&rs->slock);
+		slocked = rs_lock(rs, &rs->slock);
 		cur_dest = rs->conn_dest;
 		rs->conn_dest = &dest->qp->dest;
 		udp_svc_forward(rs, buf + udp_hdr->length, len, &addr);
 		rs->conn_dest = cur_dest;
-		fastlock_release(&rs->slock);
+		rs_unlock(&rs->slock, slocked);
 	}
 }
 
@@ -4526,14 +7101,16 @@ static void tcp_svc_process_sock(struct rs_svc *svc)
  */
 static void tcp_svc_send_keepalive(struct rsocket *rs)
 {
-	fastlock_acquire(&rs->cq_lock);
+	bool cq_locked;
+
+	cq_locked = rs_lock(rs, &rs->cq_lock);
 	if (rs_ctrl_avail(rs) && (rs->state & rs_connected)) {
 		rs->ctrl_seqno++;
 		rs_post_write(rs, NULL, 0, rs_msg_set(RS_OP_CTRL, RS_CTRL_KEEPALIVE),
 			      0, (uintptr_t) NULL, (uintptr_t) NULL);
 	}
-	fastlock_release(&rs->cq_lock);
-}	
+	rs_unlock(&rs->cq_lock, cq_locked);
+}
 
 static void *tcp_svc_run(void *arg)
 {
@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 
 #ifdef __cplusplus
@@ -61,6 +62,11 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags);
 ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 		const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags);
+struct mmsghdr;
+struct timespec;
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
 ssize_t rread(int socket, void *buf, size_t count);
 ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt);
 ssize_t rwrite(int socket, const void *buf, size_t count);
@@ -70,6 +76,10 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
 	    fd_set *exceptfds, struct timeval *timeout);
 
+int repoll_create(int size);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
 int rgetpeername(int socket, struct sockaddr *addr, socklen_t *addrlen);
 int rgetsockname(int socket, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -79,7 +89,39 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_ZEROCOPY,
+	RDMA_POLLING,
+	RDMA_STRIPES,
+	RDMA_LOCKLESS,
+	RDMA_STATS
+};
+
+/* Times in microseconds */
+struct rsocket_polling {
+	uint32_t arrival_time;	/* average time between receives */
+	uint32_t spin_time;	/* busy polling before blocking */
+	uint32_t yield_time;	/* polling with sched_yield after spinning */
+};
+
+/* Times in microseconds */
+struct rsocket_stats {
+	uint64_t bytes_sent;
+	uint64_t bytes_recv;
+	uint64_t msgs_sent;
+	uint64_t msgs_recv;
+	uint64_t inline_sends;		/* data carried in the work request */
+	uint64_t copy_sends;		/* data copied into the send buffer */
+	uint64_t zcopy_sends;		/* data sent from the user's buffer */
+	uint64_t dr_sends;		/* writes into buffers posted by rpostrecv */
+	uint64_t iomap_writes;		/* riowrite transfers */
+	uint64_t iomap_updates;		/* iomap entries sent to the peer */
+	uint64_t sq_waits;		/* waits for send queue or send buffer */
+	uint64_t sq_wait_time;
+	uint64_t credit_waits;		/* waits for credits from the peer */
+	uint64_t credit_wait_time;
+	uint64_t cq_polls;
+	uint64_t cq_events;
 };
 
 int rsetsockopt(int socket, int level, int optname,
@@ -92,6 +134,14 @@ off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offse
 int riounmap(int socket, void *buf, size_t len);
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags);
 
+struct rsocket_recv {
+	void	*buf;
+	size_t	len;		/* bytes received into buf */
+};
+
+int rpostrecv(int socket, void *buf, size_t len);
+int rgetrecv(int socket, struct rsocket_recv *recv, int nrecv, int flags);
+
 #ifdef __cplusplus
 }
 #endif
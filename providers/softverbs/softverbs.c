@@ -0,0 +1,1930 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ccan/minmax.h>
+
+#include "softverbs.h"
+
+/*
+ * softverbs is a provider that does not need any kernel or hardware
+ * support.  Devices are created by setting RDMAV_SOFTVERBS, and every
+ * process that uses a device of the same name can reach the QPs of the
+ * others through shared memory.
+ *
+ * Data is copied by the processes themselves.  A SEND or RDMA WRITE copies
+ * the data into the ring of the destination QP, and completes once it is
+ * queued there.  The owner of the destination QP copies the data out of its
+ * ring when it polls one of the CQs of the QP, or from a progress thread
+ * that serves the QPs which the application does not poll.  An RDMA READ
+ * is answered the same way by the owner of the target QP.
+ */
+#define SV_PROGRESS_IDLE_US	100
+
+static _Atomic(uint32_t) sv_qpn_seq;
+
+static int sv_query_device(struct ibv_context *ibctx,
+			   struct ibv_device_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	strcpy(attr->fw_ver, "1.0.0");
+	attr->node_guid = ibv_get_device_guid(ibctx->device);
+	attr->sys_image_guid = attr->node_guid;
+	attr->max_mr_size = UINT32_MAX;
+	attr->page_size_cap = sysconf(_SC_PAGESIZE);
+	attr->max_qp = SV_MAX_QP;
+	attr->max_qp_wr = SV_MAX_WR;
+	attr->max_sge = SV_MAX_SGE;
+	attr->max_sge_rd = SV_MAX_SGE;
+	attr->max_cq = SV_MAX_QP;
+	attr->max_cqe = SV_MAX_CQE;
+	attr->max_mr = SV_MAX_MR;
+	attr->max_pd = SV_MAX_QP;
+	attr->max_qp_rd_atom = SV_MAX_RD_ATOM;
+	attr->max_qp_init_rd_atom = SV_MAX_RD_ATOM;
+	attr->max_res_rd_atom = SV_MAX_RD_ATOM * SV_MAX_QP;
+	attr->atomic_cap = IBV_ATOMIC_NONE;
+	attr->max_ah = SV_MAX_QP;
+	attr->max_srq = SV_MAX_QP;
+	attr->max_srq_wr = SV_MAX_WR;
+	attr->max_srq_sge = SV_MAX_SGE;
+	attr->max_pkeys = 1;
+	attr->phys_port_cnt = 1;
+	return 0;
+}
+
+static int sv_query_port(struct ibv_context *ibctx, uint8_t port,
+			 struct ibv_port_attr *attr)
+{
+	if (port != 1)
+		return EINVAL;
+
+	memset(attr, 0, sizeof(*attr));
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->gid_tbl_len = 1;
+	attr->max_msg_sz = UINT32_MAX;
+	attr->pkey_tbl_len = 1;
+	attr->lid = 1;
+	attr->sm_lid = 1;
+	/* 4X EDR, link up */
+	attr->active_width = 2;
+	attr->active_speed = 32;
+	attr->phys_state = 5;
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+static struct ibv_pd *sv_alloc_pd(struct ibv_context *ibctx)
+{
+	return calloc(1, sizeof(struct ibv_pd));
+}
+
+static int sv_dealloc_pd(struct ibv_pd *pd)
+{
+	free(pd);
+	return 0;
+}
+
+/*
+ * Memory keys index the MR table of the context.  The low byte changes
+ * each time a key is handed out, so a stale key does not find the next MR
+ * that is given the same slot.
+ */
+static struct ibv_mr *sv_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+				uint64_t hca_va, int access)
+{
+	struct sv_context *ctx = to_svctx(pd->context);
+	struct sv_mr *mr;
+	uint32_t i, idx;
+
+	if (length > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mr = calloc(1, sizeof(*mr));
+	if (!mr)
+		return NULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (i = 0; i < SV_MAX_MR; i++) {
+		idx = (ctx->mr_next + i) % SV_MAX_MR;
+		if (!ctx->mr_table[idx])
+			break;
+	}
+	if (i == SV_MAX_MR) {
+		pthread_mutex_unlock(&ctx->lock);
+		free(mr);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	mr->start = (uintptr_t) addr;
+	mr->iova = hca_va;
+	mr->length = length;
+	mr->vmr.mr_type = IBV_MR_TYPE_MR;
+	mr->vmr.access = access;
+	mr->vmr.ibv_mr.pd = pd;
+	mr->vmr.ibv_mr.handle = idx;
+	mr->vmr.ibv_mr.lkey = idx << 8 | ctx->mr_gen++;
+	mr->vmr.ibv_mr.rkey = mr->vmr.ibv_mr.lkey;
+	ctx->mr_table[idx] = mr;
+	ctx->mr_next = idx + 1;
+	pthread_mutex_unlock(&ctx->lock);
+
+	return &mr->vmr.ibv_mr;
+}
+
+static int sv_dereg_mr(struct verbs_mr *vmr)
+{
+	struct sv_context *ctx = to_svctx(vmr->ibv_mr.context);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->mr_table[vmr->ibv_mr.handle] = NULL;
+	pthread_mutex_unlock(&ctx->lock);
+
+	free(to_svmr(vmr));
+	return 0;
+}
+
+static struct sv_mr *sv_find_mr(struct sv_context *ctx, struct ibv_pd *pd,
+				uint32_t key, int access)
+{
+	struct sv_mr *mr;
+
+	if ((key >> 8) >= SV_MAX_MR)
+		return NULL;
+
+	mr = ctx->mr_table[key >> 8];
+	if (!mr || mr->vmr.ibv_mr.lkey != key || mr->vmr.ibv_mr.pd != pd ||
+	    (mr->vmr.access & access) != access)
+		return NULL;
+	return mr;
+}
+
+static bool sv_check_sge(struct sv_context *ctx, struct ibv_pd *pd,
+			 const struct ibv_sge *sge, int access)
+{
+	struct sv_mr *mr;
+
+	if (!sge->length)
+		return true;
+
+	mr = sv_find_mr(ctx, pd, sge->lkey, access);
+	return mr && sge->addr >= mr->start &&
+	       sge->addr - mr->start <= mr->length &&
+	       sge->length <= mr->length - (sge->addr - mr->start);
+}
+
+/* Translate the target of an RDMA operation into a local address */
+static void *sv_remote_addr(struct sv_qp *qp, uint32_t rkey, uint64_t raddr,
+			    uint64_t length, int access)
+{
+	struct sv_context *ctx = to_svctx(qp->vqp.qp.context);
+	struct sv_mr *mr;
+
+	if ((qp->access & access) != access)
+		return NULL;
+
+	mr = sv_find_mr(ctx, qp->vqp.qp.pd, rkey, access);
+	if (!mr || raddr < mr->iova || raddr - mr->iova > mr->length ||
+	    length > mr->length - (raddr - mr->iova))
+		return NULL;
+	return (void *) (uintptr_t) (mr->start + (raddr - mr->iova));
+}
+
+static void sv_copy_from_sge(void *dst, const struct ibv_sge *sge,
+			     uint32_t off, uint32_t len)
+{
+	uint8_t *p = dst;
+	uint32_t n;
+
+	for (; len; sge++) {
+		if (off >= sge->length) {
+			off -= sge->length;
+			continue;
+		}
+		n = min(sge->length - off, len);
+		memcpy(p, (void *) (uintptr_t) (sge->addr + off), n);
+		p += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+static void sv_copy_to_sge(const struct ibv_sge *sge, uint32_t off,
+			   const void *src, uint32_t len)
+{
+	const uint8_t *p = src;
+	uint32_t n;
+
+	for (; len; sge++) {
+		if (off >= sge->length) {
+			off -= sge->length;
+			continue;
+		}
+		n = min(sge->length - off, len);
+		memcpy((void *) (uintptr_t) (sge->addr + off), p, n);
+		p += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+static struct ibv_cq *sv_create_cq(struct ibv_context *ibctx, int cqe,
+				   struct ibv_comp_channel *channel,
+				   int comp_vector)
+{
+	struct sv_cq *cq;
+
+	/* There are no completion events without a kernel */
+	if (channel) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if (cqe < 1 || cqe > SV_MAX_CQE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+
+	cq->size = cqe;
+	cq->wc = calloc(cq->size, sizeof(*cq->wc));
+	if (!cq->wc) {
+		free(cq);
+		return NULL;
+	}
+
+	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	pthread_mutex_init(&cq->qp_lock, NULL);
+	list_head_init(&cq->send_qps);
+	list_head_init(&cq->recv_qps);
+	cq->ibv_cq.cqe = cqe;
+	return &cq->ibv_cq;
+}
+
+static int sv_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct sv_cq *cq = to_svcq(ibcq);
+
+	if (!list_empty(&cq->send_qps) || !list_empty(&cq->recv_qps))
+		return EBUSY;
+
+	pthread_mutex_destroy(&cq->qp_lock);
+	pthread_spin_destroy(&cq->lock);
+	free(cq->wc);
+	free(cq);
+	return 0;
+}
+
+static int sv_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	return EOPNOTSUPP;
+}
+
+/* Returns false if the CQ is full, the caller retries later */
+static bool sv_cq_push(struct sv_cq *cq, const struct ibv_wc *wc)
+{
+	pthread_spin_lock(&cq->lock);
+	if (cq->tail - cq->head == cq->size) {
+		pthread_spin_unlock(&cq->lock);
+		return false;
+	}
+	cq->wc[cq->tail++ % cq->size] = *wc;
+	pthread_spin_unlock(&cq->lock);
+	return true;
+}
+
+static int sv_init_wq(struct sv_wq *wq, uint32_t max_wr, size_t stride)
+{
+	wq->max_wr = max_wr;
+	wq->stride = (stride + 7) & ~7UL;
+	wq->head = 0;
+	wq->tail = 0;
+	if (!max_wr)
+		return 0;
+
+	wq->buf = calloc(max_wr, wq->stride);
+	return wq->buf ? 0 : ENOMEM;
+}
+
+static struct sv_send_wqe *sv_send_wqe(struct sv_qp *qp, uint32_t idx)
+{
+	return qp->sq.buf + (idx % qp->sq.max_wr) * qp->sq.stride;
+}
+
+static struct sv_recv_wqe *sv_recv_wqe(struct sv_wq *rq, uint32_t idx)
+{
+	return rq->buf + (idx % rq->max_wr) * rq->stride;
+}
+
+static uint8_t *sv_inline_buf(struct sv_qp *qp, struct sv_send_wqe *wqe)
+{
+	return (uint8_t *) &wqe->sge[max(qp->sq.max_sge, 1U)];
+}
+
+static int sv_post_recv_wq(struct sv_context *ctx, struct ibv_pd *pd,
+			   struct sv_wq *rq, struct ibv_recv_wr *wr,
+			   struct ibv_recv_wr **bad_wr)
+{
+	struct sv_recv_wqe *wqe;
+	uint64_t length;
+	int i, ret = 0;
+
+	for (; wr; wr = wr->next) {
+		if (rq->tail - rq->head >= rq->max_wr) {
+			ret = ENOMEM;
+			break;
+		}
+		if (wr->num_sge < 0 || wr->num_sge > rq->max_sge) {
+			ret = EINVAL;
+			break;
+		}
+
+		wqe = sv_recv_wqe(rq, rq->tail);
+		length = 0;
+		for (i = 0; i < wr->num_sge; i++) {
+			if (!sv_check_sge(ctx, pd, &wr->sg_list[i],
+					  IBV_ACCESS_LOCAL_WRITE)) {
+				ret = EINVAL;
+				goto out;
+			}
+			wqe->sge[i] = wr->sg_list[i];
+			length += wr->sg_list[i].length;
+		}
+		if (length > UINT32_MAX) {
+			ret = EINVAL;
+			break;
+		}
+
+		wqe->wr_id = wr->wr_id;
+		wqe->num_sge = wr->num_sge;
+		wqe->length = length;
+		rq->tail++;
+	}
+out:
+	if (ret)
+		*bad_wr = wr;
+	return ret;
+}
+
+static struct ibv_srq *sv_create_srq(struct ibv_pd *pd,
+				     struct ibv_srq_init_attr *attr)
+{
+	struct sv_srq *srq;
+
+	if (!attr->attr.max_wr || attr->attr.max_wr > SV_MAX_WR ||
+	    attr->attr.max_sge > SV_MAX_SGE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq)
+		return NULL;
+
+	srq->rq.max_sge = max(attr->attr.max_sge, 1U);
+	if (sv_init_wq(&srq->rq, attr->attr.max_wr,
+		       sizeof(struct sv_recv_wqe) +
+		       srq->rq.max_sge * sizeof(struct ibv_sge))) {
+		free(srq);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_spin_init(&srq->lock, PTHREAD_PROCESS_PRIVATE);
+	srq->srq_limit = attr->attr.srq_limit;
+	attr->attr.max_sge = srq->rq.max_sge;
+	return &srq->ibv_srq;
+}
+
+static int sv_modify_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr,
+			 int attr_mask)
+{
+	struct sv_srq *srq = to_svsrq(ibsrq);
+
+	if (attr_mask & IBV_SRQ_MAX_WR)
+		return EINVAL;
+
+	if (attr_mask & IBV_SRQ_LIMIT)
+		srq->srq_limit = attr->srq_limit;
+	return 0;
+}
+
+static int sv_query_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr)
+{
+	struct sv_srq *srq = to_svsrq(ibsrq);
+
+	attr->max_wr = srq->rq.max_wr;
+	attr->max_sge = srq->rq.max_sge;
+	attr->srq_limit = srq->srq_limit;
+	return 0;
+}
+
+static int sv_destroy_srq(struct ibv_srq *ibsrq)
+{
+	struct sv_srq *srq = to_svsrq(ibsrq);
+
+	pthread_spin_destroy(&srq->lock);
+	free(srq->rq.buf);
+	free(srq);
+	return 0;
+}
+
+static int sv_post_srq_recv(struct ibv_srq *ibsrq, struct ibv_recv_wr *wr,
+			    struct ibv_recv_wr **bad_wr)
+{
+	struct sv_srq *srq = to_svsrq(ibsrq);
+	int ret;
+
+	pthread_spin_lock(&srq->lock);
+	ret = sv_post_recv_wq(to_svctx(ibsrq->context), ibsrq->pd, &srq->rq,
+			      wr, bad_wr);
+	pthread_spin_unlock(&srq->lock);
+	return ret;
+}
+
+static struct ibv_ah *sv_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
+{
+	struct sv_ah *ah;
+
+	if (attr->port_num != 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ah = calloc(1, sizeof(*ah));
+	if (!ah)
+		return NULL;
+	return &ah->ibv_ah;
+}
+
+static int sv_destroy_ah(struct ibv_ah *ibah)
+{
+	free(to_svah(ibah));
+	return 0;
+}
+
+static void sv_shm_name(char *name, size_t len, struct sv_context *ctx,
+			uint32_t qpn)
+{
+	snprintf(name, len, "/%s.qp%u", ctx->ibv_ctx.context.device->name,
+		 qpn);
+}
+
+/* Remove the ring of a QP whose process exited without destroying it */
+static void sv_reap_ring(const char *name)
+{
+	struct sv_ring *ring;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return;
+
+	if (ring->magic == SV_RING_MAGIC && kill(ring->pid, 0) &&
+	    errno == ESRCH)
+		shm_unlink(name);
+	munmap(ring, sizeof(*ring));
+}
+
+static int sv_create_ring(struct sv_context *ctx, struct sv_qp *qp)
+{
+	struct sv_ring *ring;
+	uint32_t qpn;
+	int fd, i;
+
+	qp->ring_size = sizeof(*ring) + SV_RING_SLOTS * sizeof(struct sv_slot);
+
+	for (i = 0; i < 1024; i++) {
+		qpn = ((uint32_t) getpid() * 4096 +
+		       atomic_fetch_add(&sv_qpn_seq, 1)) & 0xffffff;
+		if (qpn < 2)
+			continue;
+
+		sv_shm_name(qp->shm_name, sizeof(qp->shm_name), ctx, qpn);
+		fd = shm_open(qp->shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+			      0600);
+		if (fd >= 0)
+			break;
+		if (errno != EEXIST)
+			return errno;
+		sv_reap_ring(qp->shm_name);
+	}
+	if (i == 1024)
+		return EBUSY;
+
+	if (ftruncate(fd, qp->ring_size))
+		goto err;
+
+	ring = mmap(NULL, qp->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (ring == MAP_FAILED)
+		goto err;
+	close(fd);
+
+	ring->qpn = qpn;
+	ring->nslots = SV_RING_SLOTS;
+	ring->pid = getpid();
+	atomic_thread_fence(memory_order_release);
+	ring->magic = SV_RING_MAGIC;
+
+	qp->ring = ring;
+	qp->vqp.qp.qp_num = qpn;
+	return 0;
+
+err:
+	close(fd);
+	shm_unlink(qp->shm_name);
+	return errno;
+}
+
+static void sv_destroy_ring(struct sv_qp *qp)
+{
+	atomic_store(&qp->ring->dead, 1);
+	munmap(qp->ring, qp->ring_size);
+	shm_unlink(qp->shm_name);
+}
+
+static struct sv_peer *sv_open_peer(struct sv_context *ctx, uint32_t qpn)
+{
+	struct sv_peer *peer;
+	struct sv_ring *ring;
+	struct stat st;
+	char name[IBV_SYSFS_NAME_MAX + 16];
+	int fd;
+
+	sv_shm_name(name, sizeof(name), ctx, qpn);
+	fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*ring)) {
+		close(fd);
+		return NULL;
+	}
+
+	ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return NULL;
+
+	if (ring->magic != SV_RING_MAGIC || ring->qpn != qpn ||
+	    !ring->nslots || atomic_load(&ring->dead) ||
+	    sizeof(*ring) + (size_t) ring->nslots * sizeof(struct sv_slot) >
+		    (size_t) st.st_size)
+		goto err;
+
+	peer = calloc(1, sizeof(*peer));
+	if (!peer)
+		goto err;
+
+	peer->ring = ring;
+	peer->size = st.st_size;
+	peer->qpn = qpn;
+	return peer;
+
+err:
+	munmap(ring, st.st_size);
+	return NULL;
+}
+
+static void sv_close_peer(struct sv_peer *peer)
+{
+	munmap(peer->ring, peer->size);
+	free(peer);
+}
+
+/* Return the ring of a UD destination, called with the peer_lock held */
+static struct sv_peer *sv_ud_peer(struct sv_context *ctx, uint32_t qpn)
+{
+	struct sv_peer *peer, *tmp;
+
+	list_for_each_safe(&ctx->peer_list, peer, tmp, entry) {
+		if (peer->qpn != qpn)
+			continue;
+		if (!atomic_load(&peer->ring->dead))
+			return peer;
+
+		/* The QP is gone, its number may have been reused */
+		list_del(&peer->entry);
+		sv_close_peer(peer);
+		break;
+	}
+
+	peer = sv_open_peer(ctx, qpn);
+	if (peer)
+		list_add(&ctx->peer_list, &peer->entry);
+	return peer;
+}
+
+/*
+ * Producers reserve a slot by advancing the tail, and publish it by setting
+ * its sequence number.  The consumer only takes a slot once it has been
+ * published, so slots are consumed in the order they were reserved.
+ */
+static struct sv_slot *sv_ring_reserve(struct sv_ring *ring, uint64_t *pos)
+{
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	do {
+		if (tail - atomic_load_explicit(&ring->head,
+						memory_order_acquire) >=
+		    ring->nslots)
+			return NULL;
+	} while (!atomic_compare_exchange_weak_explicit(
+		&ring->tail, &tail, tail + 1, memory_order_relaxed,
+		memory_order_relaxed));
+
+	*pos = tail;
+	return &ring->slots[tail % ring->nslots];
+}
+
+static void sv_ring_publish(struct sv_slot *slot, uint64_t pos)
+{
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static struct sv_slot *sv_ring_peek(struct sv_ring *ring)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct sv_slot *slot = &ring->slots[head % ring->nslots];
+
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+		return NULL;
+	return slot;
+}
+
+static void sv_ring_consume(struct sv_ring *ring)
+{
+	atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+static enum ibv_wc_opcode sv_wc_opcode(uint32_t opcode)
+{
+	switch (opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return IBV_WC_RDMA_WRITE;
+	case IBV_WR_RDMA_READ:
+		return IBV_WC_RDMA_READ;
+	default:
+		return IBV_WC_SEND;
+	}
+}
+
+static void sv_ud_transmit(struct sv_qp *qp, struct sv_send_wqe *wqe)
+{
+	struct sv_context *ctx = to_svctx(qp->vqp.qp.context);
+	struct sv_peer *peer;
+	struct sv_slot *slot;
+	uint64_t pos;
+
+	/* Datagrams that find no room are dropped, as on a wire */
+	pthread_mutex_lock(&ctx->peer_lock);
+	peer = sv_ud_peer(ctx, wqe->remote_qpn);
+	slot = peer ? sv_ring_reserve(peer->ring, &pos) : NULL;
+	if (slot) {
+		memset(&slot->hdr, 0, sizeof(slot->hdr));
+		slot->hdr.opcode = SV_OP_SEND;
+		slot->hdr.flags = SV_PKT_FIRST | SV_PKT_LAST;
+		if (wqe->opcode == IBV_WR_SEND_WITH_IMM)
+			slot->hdr.flags |= SV_PKT_IMM;
+		slot->hdr.src_qpn = qp->vqp.qp.qp_num;
+		slot->hdr.qkey = wqe->remote_qkey & 0x80000000 ?
+					 qp->qkey : wqe->remote_qkey;
+		slot->hdr.len = wqe->length;
+		slot->hdr.msg_len = wqe->length;
+		slot->hdr.imm = wqe->imm;
+		sv_copy_from_sge(slot->data, wqe->sge, 0, wqe->length);
+		sv_ring_publish(slot, pos);
+	}
+	pthread_mutex_unlock(&ctx->peer_lock);
+
+	wqe->state = SV_WQE_DONE;
+}
+
+/* Returns false if the WQE has to wait for room in the destination ring */
+static bool sv_rc_transmit(struct sv_qp *qp, struct sv_send_wqe *wqe)
+{
+	struct sv_ring *ring = qp->peer->ring;
+	struct sv_slot *slot;
+	uint32_t chunk;
+	uint64_t pos;
+
+	if (atomic_load(&ring->dead)) {
+		wqe->status = IBV_WC_RETRY_EXC_ERR;
+		wqe->state = SV_WQE_DONE;
+		return true;
+	}
+
+	do {
+		slot = sv_ring_reserve(ring, &pos);
+		if (!slot)
+			return false;
+
+		chunk = min_t(uint32_t, wqe->length - wqe->done_len, SV_MTU);
+		memset(&slot->hdr, 0, sizeof(slot->hdr));
+		slot->hdr.src_qpn = qp->vqp.qp.qp_num;
+		slot->hdr.msg_len = wqe->length;
+		slot->hdr.rkey = wqe->rkey;
+
+		if (wqe->opcode == IBV_WR_RDMA_READ) {
+			slot->hdr.opcode = SV_OP_READ_REQ;
+			slot->hdr.flags = SV_PKT_FIRST | SV_PKT_LAST;
+			slot->hdr.raddr = wqe->raddr;
+			slot->hdr.tag = qp->sq_next;
+			sv_ring_publish(slot, pos);
+			wqe->state = SV_WQE_WAIT;
+			return true;
+		}
+
+		if (wqe->opcode == IBV_WR_RDMA_WRITE ||
+		    wqe->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+			slot->hdr.opcode = SV_OP_WRITE;
+		else
+			slot->hdr.opcode = SV_OP_SEND;
+		if (!wqe->done_len)
+			slot->hdr.flags |= SV_PKT_FIRST;
+		if (wqe->done_len + chunk == wqe->length) {
+			slot->hdr.flags |= SV_PKT_LAST;
+			if (wqe->opcode == IBV_WR_SEND_WITH_IMM ||
+			    wqe->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+				slot->hdr.flags |= SV_PKT_IMM;
+		}
+		slot->hdr.len = chunk;
+		slot->hdr.imm = wqe->imm;
+		slot->hdr.raddr = wqe->raddr + wqe->done_len;
+		sv_copy_from_sge(slot->data, wqe->sge, wqe->done_len, chunk);
+		sv_ring_publish(slot, pos);
+		wqe->done_len += chunk;
+	} while (wqe->done_len < wqe->length);
+
+	wqe->state = SV_WQE_DONE;
+	return true;
+}
+
+static void sv_transmit(struct sv_qp *qp)
+{
+	struct sv_send_wqe *wqe;
+
+	for (; qp->sq_next != qp->sq.tail; qp->sq_next++) {
+		wqe = sv_send_wqe(qp, qp->sq_next);
+		if (qp->vqp.qp.qp_type == IBV_QPT_UD)
+			sv_ud_transmit(qp, wqe);
+		else if (!sv_rc_transmit(qp, wqe))
+			break;
+	}
+}
+
+static void sv_complete_sq(struct sv_qp *qp)
+{
+	struct sv_cq *cq = to_svcq(qp->vqp.qp.send_cq);
+	struct sv_send_wqe *wqe;
+	struct ibv_wc wc = {};
+
+	while (qp->sq.head != qp->sq_next) {
+		wqe = sv_send_wqe(qp, qp->sq.head);
+		if (wqe->state != SV_WQE_DONE)
+			break;
+
+		if ((wqe->send_flags & IBV_SEND_SIGNALED) ||
+		    wqe->status != IBV_WC_SUCCESS) {
+			wc.wr_id = wqe->wr_id;
+			wc.status = wqe->status;
+			wc.opcode = sv_wc_opcode(wqe->opcode);
+			wc.byte_len = wqe->length;
+			wc.qp_num = qp->vqp.qp.qp_num;
+			if (!sv_cq_push(cq, &wc))
+				break;
+		}
+		if (wqe->status != IBV_WC_SUCCESS &&
+		    wqe->status != IBV_WC_WR_FLUSH_ERR)
+			qp->vqp.qp.state = IBV_QPS_ERR;
+		qp->sq.head++;
+	}
+}
+
+static bool sv_get_recv(struct sv_qp *qp)
+{
+	struct sv_srq *srq = NULL;
+	struct sv_wq *rq = &qp->rq;
+	bool ret = false;
+
+	if (qp->vqp.qp.srq) {
+		srq = to_svsrq(qp->vqp.qp.srq);
+		rq = &srq->rq;
+		pthread_spin_lock(&srq->lock);
+	}
+
+	if (rq->head != rq->tail) {
+		memcpy(qp->cur_recv, sv_recv_wqe(rq, rq->head), rq->stride);
+		rq->head++;
+		qp->cur_recv_valid = true;
+		qp->recv_off = 0;
+		ret = true;
+	}
+
+	if (srq)
+		pthread_spin_unlock(&srq->lock);
+	return ret;
+}
+
+/* Report a failed request to the requester, and stop the QP */
+static bool sv_send_nak(struct sv_qp *qp, const struct sv_pkt_hdr *req,
+			enum ibv_wc_status status)
+{
+	struct sv_slot *slot;
+	uint64_t pos;
+
+	slot = sv_ring_reserve(qp->peer->ring, &pos);
+	if (!slot)
+		return false;
+
+	memset(&slot->hdr, 0, sizeof(slot->hdr));
+	slot->hdr.opcode = req->opcode == SV_OP_READ_REQ ? SV_OP_READ_RESP :
+							   SV_OP_NAK;
+	slot->hdr.flags = SV_PKT_FIRST | SV_PKT_LAST;
+	slot->hdr.status = status;
+	slot->hdr.src_qpn = qp->vqp.qp.qp_num;
+	slot->hdr.tag = req->tag;
+	sv_ring_publish(slot, pos);
+
+	qp->vqp.qp.state = IBV_QPS_ERR;
+	return true;
+}
+
+static bool sv_recv_send(struct sv_qp *qp, const struct sv_pkt_hdr *hdr,
+			 const uint8_t *data)
+{
+	struct sv_cq *cq = to_svcq(qp->vqp.qp.recv_cq);
+	bool ud = qp->vqp.qp.qp_type == IBV_QPT_UD;
+	uint32_t off = ud ? SV_GRH_LEN : 0;
+	struct ibv_wc wc = {};
+
+	if (ud && hdr->qkey != qp->qkey)
+		return true;
+
+	if (!qp->cur_recv_valid) {
+		/* The rest of a message that was dropped */
+		if (!(hdr->flags & SV_PKT_FIRST))
+			return true;
+		/* RC waits for a receive to be posted, UD drops */
+		if (!sv_get_recv(qp))
+			return ud;
+	}
+
+	wc.wr_id = qp->cur_recv->wr_id;
+	wc.qp_num = qp->vqp.qp.qp_num;
+	wc.opcode = IBV_WC_RECV;
+
+	if (off + qp->recv_off + hdr->len > qp->cur_recv->length) {
+		/* RC fails the requester too, which also stops this QP */
+		if (!ud && !sv_send_nak(qp, hdr, IBV_WC_REM_INV_REQ_ERR))
+			return false;
+		wc.status = IBV_WC_LOC_LEN_ERR;
+		if (!sv_cq_push(cq, &wc))
+			return false;
+		qp->cur_recv_valid = false;
+		return true;
+	}
+
+	sv_copy_to_sge(qp->cur_recv->sge, off + qp->recv_off, data, hdr->len);
+	if (!(hdr->flags & SV_PKT_LAST)) {
+		qp->recv_off += hdr->len;
+		return true;
+	}
+
+	wc.byte_len = off + qp->recv_off + hdr->len;
+	wc.src_qp = hdr->src_qpn;
+	if (hdr->flags & SV_PKT_IMM) {
+		wc.wc_flags = IBV_WC_WITH_IMM;
+		wc.imm_data = hdr->imm;
+	}
+	if (!sv_cq_push(cq, &wc))
+		return false;
+
+	qp->cur_recv_valid = false;
+	return true;
+}
+
+static bool sv_recv_write(struct sv_qp *qp, const struct sv_pkt_hdr *hdr,
+			  const uint8_t *data)
+{
+	struct ibv_wc wc = {};
+	void *addr;
+
+	addr = sv_remote_addr(qp, hdr->rkey, hdr->raddr, hdr->len,
+			      IBV_ACCESS_REMOTE_WRITE);
+	if (!addr)
+		return sv_send_nak(qp, hdr, IBV_WC_REM_ACCESS_ERR);
+
+	if (!(hdr->flags & SV_PKT_IMM)) {
+		memcpy(addr, data, hdr->len);
+		return true;
+	}
+
+	/* The immediate data consumes a receive */
+	if (!qp->cur_recv_valid && !sv_get_recv(qp))
+		return false;
+
+	memcpy(addr, data, hdr->len);
+	wc.wr_id = qp->cur_recv->wr_id;
+	wc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+	wc.byte_len = hdr->msg_len;
+	wc.qp_num = qp->vqp.qp.qp_num;
+	wc.src_qp = hdr->src_qpn;
+	wc.wc_flags = IBV_WC_WITH_IMM;
+	wc.imm_data = hdr->imm;
+	if (!sv_cq_push(to_svcq(qp->vqp.qp.recv_cq), &wc))
+		return false;
+
+	qp->cur_recv_valid = false;
+	return true;
+}
+
+static bool sv_recv_read_req(struct sv_qp *qp, const struct sv_pkt_hdr *hdr)
+{
+	struct sv_slot *slot;
+	uint32_t chunk;
+	uint64_t pos;
+	uint8_t *addr;
+
+	addr = sv_remote_addr(qp, hdr->rkey, hdr->raddr, hdr->msg_len,
+			      IBV_ACCESS_REMOTE_READ);
+	if (!addr)
+		return sv_send_nak(qp, hdr, IBV_WC_REM_ACCESS_ERR);
+
+	do {
+		slot = sv_ring_reserve(qp->peer->ring, &pos);
+		if (!slot)
+			return false;
+
+		chunk = min_t(uint32_t, hdr->msg_len - qp->read_off, SV_MTU);
+		memset(&slot->hdr, 0, sizeof(slot->hdr));
+		slot->hdr.opcode = SV_OP_READ_RESP;
+		if (qp->read_off + chunk == hdr->msg_len)
+			slot->hdr.flags = SV_PKT_LAST;
+		slot->hdr.src_qpn = qp->vqp.qp.qp_num;
+		slot->hdr.len = chunk;
+		slot->hdr.tag = hdr->tag;
+		slot->hdr.offset = qp->read_off;
+		memcpy(slot->data, addr + qp->read_off, chunk);
+		sv_ring_publish(slot, pos);
+		qp->read_off += chunk;
+	} while (qp->read_off < hdr->msg_len);
+
+	qp->read_off = 0;
+	return true;
+}
+
+static void sv_recv_read_resp(struct sv_qp *qp, const struct sv_pkt_hdr *hdr,
+			      const uint8_t *data)
+{
+	struct sv_send_wqe *wqe;
+
+	/* Only READs that were sent and are not complete take responses */
+	if (hdr->tag - qp->sq.head >= qp->sq_next - qp->sq.head)
+		return;
+
+	wqe = sv_send_wqe(qp, hdr->tag);
+	if (wqe->state != SV_WQE_WAIT)
+		return;
+
+	if (hdr->status) {
+		wqe->status = hdr->status;
+		wqe->state = SV_WQE_DONE;
+		return;
+	}
+
+	if (hdr->offset > wqe->length || hdr->len > wqe->length - hdr->offset)
+		return;
+
+	sv_copy_to_sge(wqe->sge, hdr->offset, data, hdr->len);
+	if (hdr->flags & SV_PKT_LAST)
+		wqe->state = SV_WQE_DONE;
+}
+
+/* Returns false if the packet has to stay in the ring for now */
+static bool sv_recv_pkt(struct sv_qp *qp, const struct sv_pkt_hdr *hdr,
+			const uint8_t *data)
+{
+	bool ud = qp->vqp.qp.qp_type == IBV_QPT_UD;
+
+	if (hdr->len > SV_MTU)
+		return true;
+
+	switch (hdr->opcode) {
+	case SV_OP_READ_RESP:
+		if (!ud)
+			sv_recv_read_resp(qp, hdr, data);
+		return true;
+	case SV_OP_NAK:
+		qp->vqp.qp.state = IBV_QPS_ERR;
+		return true;
+	case SV_OP_SEND:
+		return sv_recv_send(qp, hdr, data);
+	case SV_OP_WRITE:
+		return ud || sv_recv_write(qp, hdr, data);
+	case SV_OP_READ_REQ:
+		return ud || sv_recv_read_req(qp, hdr);
+	}
+	return true;
+}
+
+static void sv_receive(struct sv_qp *qp)
+{
+	struct sv_slot *slot;
+
+	while ((slot = sv_ring_peek(qp->ring))) {
+		if (qp->vqp.qp.state != IBV_QPS_ERR &&
+		    !sv_recv_pkt(qp, &slot->hdr, slot->data))
+			break;
+		sv_ring_consume(qp->ring);
+	}
+}
+
+static void sv_flush(struct sv_qp *qp)
+{
+	struct sv_cq *cq = to_svcq(qp->vqp.qp.recv_cq);
+	struct ibv_wc wc = {
+		.status = IBV_WC_WR_FLUSH_ERR,
+		.opcode = IBV_WC_RECV,
+		.qp_num = qp->vqp.qp.qp_num,
+	};
+	struct sv_send_wqe *wqe;
+	uint32_t i;
+
+	for (i = qp->sq.head; i != qp->sq.tail; i++) {
+		wqe = sv_send_wqe(qp, i);
+		if (wqe->state != SV_WQE_DONE) {
+			wqe->status = IBV_WC_WR_FLUSH_ERR;
+			wqe->state = SV_WQE_DONE;
+		}
+	}
+	qp->sq_next = qp->sq.tail;
+
+	if (qp->cur_recv_valid) {
+		wc.wr_id = qp->cur_recv->wr_id;
+		if (!sv_cq_push(cq, &wc))
+			return;
+		qp->cur_recv_valid = false;
+	}
+
+	while (qp->rq.head != qp->rq.tail) {
+		wc.wr_id = sv_recv_wqe(&qp->rq, qp->rq.head)->wr_id;
+		if (!sv_cq_push(cq, &wc))
+			return;
+		qp->rq.head++;
+	}
+}
+
+/* Called with the QP lock held, returns true if anything was done */
+static bool sv_progress_qp(struct sv_qp *qp)
+{
+	uint64_t ring_head = atomic_load_explicit(&qp->ring->head,
+						  memory_order_relaxed);
+	uint32_t sq_head = qp->sq.head;
+	uint32_t sq_next = qp->sq_next;
+
+	if (qp->vqp.qp.state == IBV_QPS_RESET ||
+	    qp->vqp.qp.state == IBV_QPS_INIT)
+		return false;
+
+	sv_receive(qp);
+	if (qp->vqp.qp.state == IBV_QPS_RTS)
+		sv_transmit(qp);
+	sv_complete_sq(qp);
+	if (qp->vqp.qp.state == IBV_QPS_ERR) {
+		sv_flush(qp);
+		sv_complete_sq(qp);
+	}
+
+	return ring_head != atomic_load_explicit(&qp->ring->head,
+						 memory_order_relaxed) ||
+	       sq_head != qp->sq.head || sq_next != qp->sq_next;
+}
+
+static void sv_try_progress(struct sv_qp *qp)
+{
+	if (pthread_spin_trylock(&qp->lock))
+		return;
+	sv_progress_qp(qp);
+	qp->polled = true;
+	pthread_spin_unlock(&qp->lock);
+}
+
+static int sv_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	struct sv_cq *cq = to_svcq(ibcq);
+	struct sv_qp *qp;
+	int npolled = 0;
+
+	if (cq->tail - cq->head < (uint32_t) ne) {
+		pthread_mutex_lock(&cq->qp_lock);
+		list_for_each(&cq->send_qps, qp, send_cq_entry)
+			sv_try_progress(qp);
+		list_for_each(&cq->recv_qps, qp, recv_cq_entry)
+			sv_try_progress(qp);
+		pthread_mutex_unlock(&cq->qp_lock);
+	}
+
+	pthread_spin_lock(&cq->lock);
+	while (npolled < ne && cq->head != cq->tail)
+		wc[npolled++] = cq->wc[cq->head++ % cq->size];
+	pthread_spin_unlock(&cq->lock);
+
+	return npolled;
+}
+
+/*
+ * Serves the QPs of the context that the application does not progress by
+ * polling their CQs, such as the target of RDMA WRITEs.
+ */
+static void *sv_progress_thread(void *arg)
+{
+	struct sv_context *ctx = arg;
+	struct sv_qp *qp;
+	bool busy;
+
+	while (!atomic_load(&ctx->progress_stop)) {
+		busy = false;
+		pthread_mutex_lock(&ctx->lock);
+		list_for_each(&ctx->qp_list, qp, entry) {
+			if (pthread_spin_trylock(&qp->lock))
+				continue;
+			if (qp->polled)
+				qp->polled = false;
+			else
+				busy |= sv_progress_qp(qp);
+			pthread_spin_unlock(&qp->lock);
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (!busy)
+			usleep(SV_PROGRESS_IDLE_US);
+	}
+	return NULL;
+}
+
+static bool sv_opcode_supported(struct sv_qp *qp, enum ibv_wr_opcode opcode)
+{
+	switch (opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		return true;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+	case IBV_WR_RDMA_READ:
+		return qp->vqp.qp.qp_type == IBV_QPT_RC;
+	default:
+		return false;
+	}
+}
+
+static bool sv_can_post_send(struct sv_qp *qp)
+{
+	return qp->vqp.qp.state == IBV_QPS_RTS ||
+	       qp->vqp.qp.state == IBV_QPS_ERR;
+}
+
+/* Start the send WQE at index idx of the send queue */
+static int sv_wqe_init(struct sv_qp *qp, uint32_t idx, uint64_t wr_id,
+		       enum ibv_wr_opcode opcode, unsigned int send_flags,
+		       struct sv_send_wqe **wqep)
+{
+	struct sv_send_wqe *wqe;
+
+	if (idx - qp->sq.head >= qp->sq.max_wr)
+		return ENOMEM;
+	if (!sv_opcode_supported(qp, opcode))
+		return EINVAL;
+
+	wqe = sv_send_wqe(qp, idx);
+	memset(wqe, 0, sizeof(*wqe));
+	wqe->wr_id = wr_id;
+	wqe->opcode = opcode;
+	wqe->send_flags = send_flags;
+	if (qp->sq_sig_all)
+		wqe->send_flags |= IBV_SEND_SIGNALED;
+	wqe->state = SV_WQE_POSTED;
+	wqe->status = IBV_WC_SUCCESS;
+	*wqep = wqe;
+	return 0;
+}
+
+static int sv_wqe_set_sge_list(struct sv_qp *qp, struct sv_send_wqe *wqe,
+			       size_t num_sge, const struct ibv_sge *sg_list)
+{
+	struct sv_context *ctx = to_svctx(qp->vqp.qp.context);
+	int access = wqe->opcode == IBV_WR_RDMA_READ ? IBV_ACCESS_LOCAL_WRITE :
+						       0;
+	uint64_t length = 0;
+	size_t i;
+
+	if (num_sge > qp->sq.max_sge)
+		return EINVAL;
+
+	for (i = 0; i < num_sge; i++) {
+		if (!sv_check_sge(ctx, qp->vqp.qp.pd, &sg_list[i], access))
+			return EINVAL;
+		wqe->sge[i] = sg_list[i];
+		length += sg_list[i].length;
+	}
+
+	if (length > UINT32_MAX ||
+	    (qp->vqp.qp.qp_type == IBV_QPT_UD && length > SV_MTU))
+		return EINVAL;
+
+	wqe->num_sge = num_sge;
+	wqe->length = length;
+	return 0;
+}
+
+/* Inline data is copied into the WQE and described by its first SGE */
+static int sv_wqe_add_inline(struct sv_qp *qp, struct sv_send_wqe *wqe,
+			     const void *addr, size_t length)
+{
+	uint8_t *buf = sv_inline_buf(qp, wqe);
+
+	if (wqe->opcode == IBV_WR_RDMA_READ ||
+	    length > qp->max_inline - wqe->length)
+		return EINVAL;
+
+	memcpy(buf + wqe->length, addr, length);
+	wqe->length += length;
+	wqe->num_sge = 1;
+	wqe->sge[0].addr = (uintptr_t) buf;
+	wqe->sge[0].length = wqe->length;
+	wqe->sge[0].lkey = 0;
+	return 0;
+}
+
+static int sv_post_one(struct sv_qp *qp, struct ibv_send_wr *wr)
+{
+	struct sv_send_wqe *wqe;
+	int i, ret;
+
+	ret = sv_wqe_init(qp, qp->sq.tail, wr->wr_id, wr->opcode,
+			  wr->send_flags, &wqe);
+	if (ret)
+		return ret;
+	if (wr->num_sge < 0)
+		return EINVAL;
+
+	if (wr->opcode == IBV_WR_SEND_WITH_IMM ||
+	    wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+		wqe->imm = wr->imm_data;
+
+	if (qp->vqp.qp.qp_type == IBV_QPT_UD) {
+		if (!wr->wr.ud.ah)
+			return EINVAL;
+		wqe->remote_qpn = wr->wr.ud.remote_qpn;
+		wqe->remote_qkey = wr->wr.ud.remote_qkey;
+	} else if (wr->opcode != IBV_WR_SEND &&
+		   wr->opcode != IBV_WR_SEND_WITH_IMM) {
+		wqe->rkey = wr->wr.rdma.rkey;
+		wqe->raddr = wr->wr.rdma.remote_addr;
+	}
+
+	if (!(wr->send_flags & IBV_SEND_INLINE))
+		return sv_wqe_set_sge_list(qp, wqe, wr->num_sge, wr->sg_list);
+
+	for (i = 0; i < wr->num_sge; i++) {
+		ret = sv_wqe_add_inline(qp, wqe,
+					(void *) (uintptr_t) wr->sg_list[i].addr,
+					wr->sg_list[i].length);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int sv_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			struct ibv_send_wr **bad_wr)
+{
+	struct sv_qp *qp = to_svqp(ibqp);
+	int ret = 0;
+
+	pthread_spin_lock(&qp->lock);
+	if (!sv_can_post_send(qp))
+		ret = EINVAL;
+
+	for (; wr && !ret; wr = wr->next) {
+		ret = sv_post_one(qp, wr);
+		if (ret)
+			break;
+		qp->sq.tail++;
+	}
+	if (ret)
+		*bad_wr = wr;
+
+	sv_progress_qp(qp);
+	pthread_spin_unlock(&qp->lock);
+	return ret;
+}
+
+static int sv_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+			struct ibv_recv_wr **bad_wr)
+{
+	struct sv_qp *qp = to_svqp(ibqp);
+	int ret;
+
+	if (ibqp->srq || ibqp->state == IBV_QPS_RESET) {
+		*bad_wr = wr;
+		return EINVAL;
+	}
+
+	pthread_spin_lock(&qp->lock);
+	ret = sv_post_recv_wq(to_svctx(ibqp->context), ibqp->pd, &qp->rq, wr,
+			      bad_wr);
+	pthread_spin_unlock(&qp->lock);
+	return ret;
+}
+
+static void sv_wr_start(struct ibv_qp_ex *ibqpx)
+{
+	struct sv_qp *qp = to_svqp_ex(ibqpx);
+
+	pthread_spin_lock(&qp->lock);
+	qp->wr_tail = qp->sq.tail;
+	qp->wr_cur = NULL;
+	qp->wr_err = sv_can_post_send(qp) ? 0 : EINVAL;
+}
+
+static int sv_wr_complete(struct ibv_qp_ex *ibqpx)
+{
+	struct sv_qp *qp = to_svqp_ex(ibqpx);
+	int ret = qp->wr_err;
+
+	if (!ret) {
+		qp->sq.tail = qp->wr_tail;
+		sv_progress_qp(qp);
+	}
+	pthread_spin_unlock(&qp->lock);
+	return ret;
+}
+
+static void sv_wr_abort(struct ibv_qp_ex *ibqpx)
+{
+	struct sv_qp *qp = to_svqp_ex(ibqpx);
+
+	pthread_spin_unlock(&qp->lock);
+}
+
+static struct sv_send_wqe *sv_wr_new(struct sv_qp *qp,
+				     enum ibv_wr_opcode opcode)
+{
+	struct ibv_qp_ex *ibqpx = &qp->vqp.qp_ex;
+	struct sv_send_wqe *wqe;
+	int ret;
+
+	if (qp->wr_err)
+		return NULL;
+
+	ret = sv_wqe_init(qp, qp->wr_tail, ibqpx->wr_id, opcode,
+			  ibqpx->wr_flags, &wqe);
+	if (ret) {
+		qp->wr_err = ret;
+		return NULL;
+	}
+
+	qp->wr_tail++;
+	qp->wr_cur = wqe;
+	return wqe;
+}
+
+static void sv_wr_send(struct ibv_qp_ex *ibqpx)
+{
+	sv_wr_new(to_svqp_ex(ibqpx), IBV_WR_SEND);
+}
+
+static void sv_wr_send_imm(struct ibv_qp_ex *ibqpx, __be32 imm_data)
+{
+	struct sv_send_wqe *wqe;
+
+	wqe = sv_wr_new(to_svqp_ex(ibqpx), IBV_WR_SEND_WITH_IMM);
+	if (wqe)
+		wqe->imm = imm_data;
+}
+
+static void sv_wr_rdma(struct ibv_qp_ex *ibqpx, enum ibv_wr_opcode opcode,
+		       uint32_t rkey, uint64_t remote_addr, __be32 imm_data)
+{
+	struct sv_send_wqe *wqe;
+
+	wqe = sv_wr_new(to_svqp_ex(ibqpx), opcode);
+	if (!wqe)
+		return;
+
+	wqe->rkey = rkey;
+	wqe->raddr = remote_addr;
+	wqe->imm = imm_data;
+}
+
+static void sv_wr_rdma_write(struct ibv_qp_ex *ibqpx, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	sv_wr_rdma(ibqpx, IBV_WR_RDMA_WRITE, rkey, remote_addr, 0);
+}
+
+static void sv_wr_rdma_write_imm(struct ibv_qp_ex *ibqpx, uint32_t rkey,
+				 uint64_t remote_addr, __be32 imm_data)
+{
+	sv_wr_rdma(ibqpx, IBV_WR_RDMA_WRITE_WITH_IMM, rkey, remote_addr,
+		   imm_data);
+}
+
+static void sv_wr_rdma_read(struct ibv_qp_ex *ibqpx, uint32_t rkey,
+			    uint64_t remote_addr)
+{
+	sv_wr_rdma(ibqpx, IBV_WR_RDMA_READ, rkey, remote_addr, 0);
+}
+
+static void sv_wr_set_sge_list(struct ibv_qp_ex *ibqpx, size_t num_sge,
+			       const struct ibv_sge *sg_list)
+{
+	struct sv_qp *qp = to_svqp_ex(ibqpx);
+
+	if (qp->wr_err || !qp->wr_cur)
+		return;
+
+	qp->wr_err = sv_wqe_set_sge_list(qp, qp->wr_cur, num_sge, sg_list);
+}
+
+static void sv_wr_set_sge(struct ibv_qp_ex *ibqpx, uint32_t lkey,
+			  uint64_t addr, uint32_t length)
+{
+	struct ibv_sge sge = {
+		.addr = addr,
+		.length = length,
+		.lkey = lkey,
+	};
+
+	sv_wr_set_sge_list(ibqpx, 1, &sge);
+}
+
+static void sv_wr_set_inline_data_list(struct ibv_qp_ex *ibqpx,
+				       size_t num_buf,
+				       const struct ibv_data_buf *buf_list)
+{
+	struct sv_qp *qp = to_svqp_ex(ibqpx);
+	size_t i;
+
+	if (qp->wr_err || !qp->wr_cur)
+		return;
+
+	for (i = 0; i < num_buf && !qp->wr_err; i++)
+		qp->wr_err = sv_wqe_add_inline(qp, qp->wr_cur,
+					       buf_list[i].addr,
+					       buf_list[i].length);
+}
+
+static void sv_wr_set_inline_data(struct ibv_qp_ex *ibqpx, void *addr,
+				  size_t length)
+{
+	struct ibv_data_buf buf = {
+		.addr = addr,
+		.length = length,
+	};
+
+	sv_wr_set_inline_data_list(ibqpx, 1, &buf);
+}
+
+static void sv_wr_set_ud_addr(struct ibv_qp_ex *ibqpx, struct ibv_ah *ah,
+			      uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct sv_qp *qp = to_svqp_ex(ibqpx);
+
+	if (qp->wr_err || !qp->wr_cur)
+		return;
+
+	qp->wr_cur->remote_qpn = remote_qpn;
+	qp->wr_cur->remote_qkey = remote_qkey;
+}
+
+static void sv_qp_fill_wr_pfns(struct ibv_qp_ex *ibqpx)
+{
+	ibqpx->wr_start = sv_wr_start;
+	ibqpx->wr_complete = sv_wr_complete;
+	ibqpx->wr_abort = sv_wr_abort;
+	ibqpx->wr_send = sv_wr_send;
+	ibqpx->wr_send_imm = sv_wr_send_imm;
+	ibqpx->wr_rdma_write = sv_wr_rdma_write;
+	ibqpx->wr_rdma_write_imm = sv_wr_rdma_write_imm;
+	ibqpx->wr_rdma_read = sv_wr_rdma_read;
+	ibqpx->wr_set_sge = sv_wr_set_sge;
+	ibqpx->wr_set_sge_list = sv_wr_set_sge_list;
+	ibqpx->wr_set_inline_data = sv_wr_set_inline_data;
+	ibqpx->wr_set_inline_data_list = sv_wr_set_inline_data_list;
+	ibqpx->wr_set_ud_addr = sv_wr_set_ud_addr;
+}
+
+enum {
+	SV_CREATE_QP_SUP_COMP_MASK = IBV_QP_INIT_ATTR_PD |
+				     IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
+	SV_SEND_OPS_FLAGS_UD = IBV_QP_EX_WITH_SEND |
+			       IBV_QP_EX_WITH_SEND_WITH_IMM,
+	SV_SEND_OPS_FLAGS_RC = SV_SEND_OPS_FLAGS_UD |
+			       IBV_QP_EX_WITH_RDMA_WRITE |
+			       IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+			       IBV_QP_EX_WITH_RDMA_READ,
+};
+
+static int sv_check_qp_attr(struct ibv_qp_init_attr_ex *attr)
+{
+	uint64_t send_ops = attr->qp_type == IBV_QPT_UD ? SV_SEND_OPS_FLAGS_UD :
+							  SV_SEND_OPS_FLAGS_RC;
+
+	if (attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UD)
+		return EOPNOTSUPP;
+
+	if (!check_comp_mask(attr->comp_mask, SV_CREATE_QP_SUP_COMP_MASK) ||
+	    !(attr->comp_mask & IBV_QP_INIT_ATTR_PD) || !attr->send_cq ||
+	    !attr->recv_cq)
+		return EINVAL;
+
+	if ((attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) &&
+	    !check_comp_mask(attr->send_ops_flags, send_ops))
+		return EOPNOTSUPP;
+
+	if (!attr->cap.max_send_wr || attr->cap.max_send_wr > SV_MAX_WR ||
+	    attr->cap.max_recv_wr > SV_MAX_WR ||
+	    attr->cap.max_send_sge > SV_MAX_SGE ||
+	    attr->cap.max_recv_sge > SV_MAX_SGE ||
+	    attr->cap.max_inline_data > SV_MAX_INLINE)
+		return EINVAL;
+
+	if (!attr->srq && !attr->cap.max_recv_wr)
+		return EINVAL;
+	return 0;
+}
+
+static void sv_free_qp(struct sv_qp *qp)
+{
+	free(qp->cur_recv);
+	free(qp->rq.buf);
+	free(qp->sq.buf);
+	free(qp);
+}
+
+static struct ibv_qp *sv_create_qp_ex(struct ibv_context *ibctx,
+				      struct ibv_qp_init_attr_ex *attr)
+{
+	struct sv_context *ctx = to_svctx(ibctx);
+	struct sv_cq *send_cq, *recv_cq;
+	struct ibv_qp *ibqp;
+	struct sv_qp *qp;
+	int ret;
+
+	ret = sv_check_qp_attr(attr);
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	qp->sq.max_sge = max(attr->cap.max_send_sge, 1U);
+	qp->max_inline = attr->cap.max_inline_data;
+	if (sv_init_wq(&qp->sq, attr->cap.max_send_wr,
+		       sizeof(struct sv_send_wqe) +
+		       qp->sq.max_sge * sizeof(struct ibv_sge) +
+		       qp->max_inline))
+		goto err;
+
+	if (!attr->srq) {
+		qp->rq.max_sge = max(attr->cap.max_recv_sge, 1U);
+		if (sv_init_wq(&qp->rq, attr->cap.max_recv_wr,
+			       sizeof(struct sv_recv_wqe) +
+			       qp->rq.max_sge * sizeof(struct ibv_sge)))
+			goto err;
+	}
+
+	qp->cur_recv = calloc(1, sizeof(struct sv_recv_wqe) +
+				 SV_MAX_SGE * sizeof(struct ibv_sge));
+	if (!qp->cur_recv)
+		goto err;
+
+	ret = sv_create_ring(ctx, qp);
+	if (ret) {
+		errno = ret;
+		goto err;
+	}
+
+	pthread_spin_init(&qp->lock, PTHREAD_PROCESS_PRIVATE);
+	qp->sq_sig_all = attr->sq_sig_all;
+
+	ibqp = &qp->vqp.qp;
+	ibqp->context = ibctx;
+	ibqp->qp_context = attr->qp_context;
+	ibqp->pd = attr->pd;
+	ibqp->send_cq = attr->send_cq;
+	ibqp->recv_cq = attr->recv_cq;
+	ibqp->srq = attr->srq;
+	ibqp->qp_type = attr->qp_type;
+	ibqp->state = IBV_QPS_RESET;
+	ibqp->events_completed = 0;
+	pthread_mutex_init(&ibqp->mutex, NULL);
+	pthread_cond_init(&ibqp->cond, NULL);
+
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		sv_qp_fill_wr_pfns(&qp->vqp.qp_ex);
+		qp->vqp.comp_mask |= VERBS_QP_EX;
+	}
+
+	attr->cap.max_send_sge = qp->sq.max_sge;
+	attr->cap.max_recv_sge = qp->rq.max_sge;
+
+	send_cq = to_svcq(attr->send_cq);
+	recv_cq = to_svcq(attr->recv_cq);
+	pthread_mutex_lock(&send_cq->qp_lock);
+	list_add_tail(&send_cq->send_qps, &qp->send_cq_entry);
+	pthread_mutex_unlock(&send_cq->qp_lock);
+	if (recv_cq != send_cq) {
+		pthread_mutex_lock(&recv_cq->qp_lock);
+		list_add_tail(&recv_cq->recv_qps, &qp->recv_cq_entry);
+		pthread_mutex_unlock(&recv_cq->qp_lock);
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	list_add_tail(&ctx->qp_list, &qp->entry);
+	if (!ctx->progress_running &&
+	    !pthread_create(&ctx->progress_thread, NULL, sv_progress_thread,
+			    ctx))
+		ctx->progress_running = true;
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ibqp;
+
+err:
+	sv_free_qp(qp);
+	return NULL;
+}
+
+static struct ibv_qp *sv_create_qp(struct ibv_pd *pd,
+				   struct ibv_qp_init_attr *attr)
+{
+	struct ibv_qp_init_attr_ex attr_ex = {};
+	struct ibv_qp *qp;
+
+	memcpy(&attr_ex, attr, sizeof(*attr));
+	attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD;
+	attr_ex.pd = pd;
+
+	qp = sv_create_qp_ex(pd->context, &attr_ex);
+	if (qp)
+		memcpy(attr, &attr_ex, sizeof(*attr));
+	return qp;
+}
+
+static int sv_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct sv_context *ctx = to_svctx(ibqp->context);
+	struct sv_cq *send_cq = to_svcq(ibqp->send_cq);
+	struct sv_cq *recv_cq = to_svcq(ibqp->recv_cq);
+	struct sv_qp *qp = to_svqp(ibqp);
+
+	pthread_mutex_lock(&ctx->lock);
+	list_del(&qp->entry);
+	pthread_mutex_unlock(&ctx->lock);
+
+	pthread_mutex_lock(&send_cq->qp_lock);
+	list_del(&qp->send_cq_entry);
+	pthread_mutex_unlock(&send_cq->qp_lock);
+	if (recv_cq != send_cq) {
+		pthread_mutex_lock(&recv_cq->qp_lock);
+		list_del(&qp->recv_cq_entry);
+		pthread_mutex_unlock(&recv_cq->qp_lock);
+	}
+
+	if (qp->peer)
+		sv_close_peer(qp->peer);
+	sv_destroy_ring(qp);
+	pthread_spin_destroy(&qp->lock);
+	sv_free_qp(qp);
+	return 0;
+}
+
+static void sv_reset_qp(struct sv_qp *qp)
+{
+	while (sv_ring_peek(qp->ring))
+		sv_ring_consume(qp->ring);
+
+	qp->sq.head = qp->sq.tail = qp->sq_next = 0;
+	qp->rq.head = qp->rq.tail = 0;
+	qp->cur_recv_valid = false;
+	qp->recv_off = 0;
+	qp->read_off = 0;
+	if (qp->peer) {
+		sv_close_peer(qp->peer);
+		qp->peer = NULL;
+	}
+}
+
+static int sv_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+			int attr_mask)
+{
+	struct sv_context *ctx = to_svctx(ibqp->context);
+	struct sv_qp *qp = to_svqp(ibqp);
+	int ret = 0;
+
+	pthread_spin_lock(&qp->lock);
+	if (attr_mask & IBV_QP_QKEY)
+		qp->qkey = attr->qkey;
+	if (attr_mask & IBV_QP_ACCESS_FLAGS)
+		qp->access = attr->qp_access_flags;
+	if (attr_mask & IBV_QP_DEST_QPN)
+		qp->dest_qpn = attr->dest_qp_num;
+
+	if (!(attr_mask & IBV_QP_STATE))
+		goto out;
+
+	switch (attr->qp_state) {
+	case IBV_QPS_RESET:
+		sv_reset_qp(qp);
+		break;
+	case IBV_QPS_RTR:
+		if (ibqp->qp_type != IBV_QPT_RC || qp->peer)
+			break;
+		qp->peer = sv_open_peer(ctx, qp->dest_qpn);
+		if (!qp->peer)
+			ret = EINVAL;
+		break;
+	case IBV_QPS_INIT:
+	case IBV_QPS_RTS:
+	case IBV_QPS_ERR:
+		break;
+	default:
+		ret = EOPNOTSUPP;
+		break;
+	}
+
+	if (!ret)
+		ibqp->state = attr->qp_state;
+out:
+	pthread_spin_unlock(&qp->lock);
+	return ret;
+}
+
+static int sv_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+		       int attr_mask, struct ibv_qp_init_attr *init_attr)
+{
+	struct sv_qp *qp = to_svqp(ibqp);
+
+	memset(attr, 0, sizeof(*attr));
+	memset(init_attr, 0, sizeof(*init_attr));
+
+	attr->qp_state = ibqp->state;
+	attr->cur_qp_state = ibqp->state;
+	attr->path_mtu = IBV_MTU_4096;
+	attr->qkey = qp->qkey;
+	attr->dest_qp_num = qp->dest_qpn;
+	attr->qp_access_flags = qp->access;
+	attr->cap.max_send_wr = qp->sq.max_wr;
+	attr->cap.max_recv_wr = qp->rq.max_wr;
+	attr->cap.max_send_sge = qp->sq.max_sge;
+	attr->cap.max_recv_sge = qp->rq.max_sge;
+	attr->cap.max_inline_data = qp->max_inline;
+	attr->port_num = 1;
+
+	init_attr->qp_context = ibqp->qp_context;
+	init_attr->send_cq = ibqp->send_cq;
+	init_attr->recv_cq = ibqp->recv_cq;
+	init_attr->srq = ibqp->srq;
+	init_attr->cap = attr->cap;
+	init_attr->qp_type = ibqp->qp_type;
+	init_attr->sq_sig_all = qp->sq_sig_all;
+	return 0;
+}
+
+static void sv_free_context(struct ibv_context *ibctx);
+
+static const struct verbs_context_ops sv_context_ops = {
+	.alloc_pd = sv_alloc_pd,
+	.create_ah = sv_create_ah,
+	.create_cq = sv_create_cq,
+	.create_qp = sv_create_qp,
+	.create_qp_ex = sv_create_qp_ex,
+	.create_srq = sv_create_srq,
+	.dealloc_pd = sv_dealloc_pd,
+	.dereg_mr = sv_dereg_mr,
+	.destroy_ah = sv_destroy_ah,
+	.destroy_cq = sv_destroy_cq,
+	.destroy_qp = sv_destroy_qp,
+	.destroy_srq = sv_destroy_srq,
+	.free_context = sv_free_context,
+	.modify_qp = sv_modify_qp,
+	.modify_srq = sv_modify_srq,
+	.poll_cq = sv_poll_cq,
+	.post_recv = sv_post_recv,
+	.post_send = sv_post_send,
+	.post_srq_recv = sv_post_srq_recv,
+	.query_device = sv_query_device,
+	.query_port = sv_query_port,
+	.query_qp = sv_query_qp,
+	.query_srq = sv_query_srq,
+	.reg_mr = sv_reg_mr,
+	.req_notify_cq = sv_req_notify_cq,
+};
+
+static struct verbs_context *sv_alloc_context(struct ibv_device *ibdev,
+					      int cmd_fd, void *private_data)
+{
+	struct sv_context *ctx;
+
+	ctx = verbs_init_and_alloc_context(ibdev, cmd_fd, ctx, ibv_ctx,
+					   RDMA_DRIVER_UNKNOWN);
+	if (!ctx)
+		return NULL;
+
+	ctx->mr_table = calloc(SV_MAX_MR, sizeof(*ctx->mr_table));
+	if (!ctx->mr_table) {
+		verbs_uninit_context(&ctx->ibv_ctx);
+		free(ctx);
+		return NULL;
+	}
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	list_head_init(&ctx->qp_list);
+	pthread_mutex_init(&ctx->peer_lock, NULL);
+	list_head_init(&ctx->peer_list);
+	verbs_set_ops(&ctx->ibv_ctx, &sv_context_ops);
+
+	return &ctx->ibv_ctx;
+}
+
+static void sv_free_context(struct ibv_context *ibctx)
+{
+	struct sv_context *ctx = to_svctx(ibctx);
+	struct sv_peer *peer, *tmp;
+
+	if (ctx->progress_running) {
+		atomic_store(&ctx->progress_stop, true);
+		pthread_join(ctx->progress_thread, NULL);
+	}
+
+	list_for_each_safe(&ctx->peer_list, peer, tmp, entry) {
+		list_del(&peer->entry);
+		sv_close_peer(peer);
+	}
+
+	pthread_mutex_destroy(&ctx->peer_lock);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->mr_table);
+	verbs_uninit_context(&ctx->ibv_ctx);
+	free(ctx);
+}
+
+static bool sv_match_device(struct verbs_sysfs_dev *sysfs_dev)
+{
+	return sysfs_dev->flags & VSYSFS_SOFT_DEVICE;
+}
+
+static struct verbs_device *sv_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
+{
+	struct sv_device *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	return &dev->ibv_dev;
+}
+
+static void sv_uninit_device(struct verbs_device *verbs_device)
+{
+	free(to_svdev(&verbs_device->device));
+}
+
+static const struct verbs_device_ops sv_dev_ops = {
+	.name = "softverbs",
+	.match_device = sv_match_device,
+	.alloc_device = sv_device_alloc,
+	.uninit_device = sv_uninit_device,
+	.alloc_context = sv_alloc_context,
+};
+PROVIDER_DRIVER(softverbs, sv_dev_ops);
@@ -0,0 +1,258 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#ifndef SOFTVERBS_H
+#define SOFTVERBS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <infiniband/driver.h>
+#include <ccan/list.h>
+
+/*
+ * Every QP owns a ring of packets in a POSIX shared memory object, named
+ * after its device and QP number.  Any process that sends to the QP maps
+ * the ring and reserves slots in it, so a ring has many producers and a
+ * single consumer: the process that owns the QP.
+ */
+#define SV_MTU			4096
+#define SV_RING_SLOTS		64
+#define SV_GRH_LEN		40
+
+#define SV_MAX_QP		(1 << 16)
+#define SV_MAX_WR		16384
+#define SV_MAX_SGE		16
+#define SV_MAX_INLINE		512
+#define SV_MAX_CQE		(1 << 20)
+#define SV_MAX_MR		16384
+#define SV_MAX_RD_ATOM		16
+
+#define SV_RING_MAGIC		0x73767267
+
+enum sv_opcode {
+	SV_OP_SEND,
+	SV_OP_WRITE,
+	SV_OP_READ_REQ,
+	SV_OP_READ_RESP,
+	SV_OP_NAK,
+};
+
+enum {
+	SV_PKT_FIRST = 1 << 0,
+	SV_PKT_LAST = 1 << 1,
+	SV_PKT_IMM = 1 << 2,
+};
+
+struct sv_pkt_hdr {
+	uint8_t			opcode;
+	uint8_t			flags;
+	/* enum ibv_wc_status of a READ response or NAK */
+	uint8_t			status;
+	uint8_t			rsvd;
+	uint32_t		src_qpn;
+	uint32_t		qkey;
+	uint32_t		len;
+	uint32_t		msg_len;
+	uint32_t		imm;
+	uint32_t		rkey;
+	/* Send queue index of the RDMA READ a response belongs to */
+	uint32_t		tag;
+	uint64_t		raddr;
+	/* Offset of a READ response within the data read */
+	uint64_t		offset;
+};
+
+struct sv_slot {
+	_Atomic(uint64_t)	seq;
+	struct sv_pkt_hdr	hdr;
+	uint8_t			data[SV_MTU] __attribute__((aligned(64)));
+};
+
+struct sv_ring {
+	uint32_t		magic;
+	uint32_t		qpn;
+	uint32_t		nslots;
+	int32_t			pid;
+	_Atomic(uint32_t)	dead;
+	_Atomic(uint64_t)	tail __attribute__((aligned(64)));
+	_Atomic(uint64_t)	head __attribute__((aligned(64)));
+	struct sv_slot		slots[] __attribute__((aligned(64)));
+};
+
+/* A ring of another QP, mapped for sending */
+struct sv_peer {
+	struct list_node	entry;
+	struct sv_ring		*ring;
+	size_t			size;
+	uint32_t		qpn;
+};
+
+struct sv_device {
+	struct verbs_device	ibv_dev;
+};
+
+struct sv_context {
+	struct verbs_context	ibv_ctx;
+	/* Protects qp_list, the MR table and starting the progress thread */
+	pthread_mutex_t		lock;
+	struct list_head	qp_list;
+	struct sv_mr		**mr_table;
+	uint32_t		mr_next;
+	uint8_t			mr_gen;
+	pthread_mutex_t		peer_lock;
+	struct list_head	peer_list;
+	pthread_t		progress_thread;
+	bool			progress_running;
+	atomic_bool		progress_stop;
+};
+
+struct sv_mr {
+	struct verbs_mr		vmr;
+	uint64_t		start;
+	uint64_t		iova;
+	uint64_t		length;
+};
+
+struct sv_cq {
+	struct ibv_cq		ibv_cq;
+	pthread_spinlock_t	lock;
+	struct ibv_wc		*wc;
+	uint32_t		size;
+	uint32_t		head;
+	uint32_t		tail;
+	/* Protects the lists of QPs that complete to this CQ */
+	pthread_mutex_t		qp_lock;
+	struct list_head	send_qps;
+	struct list_head	recv_qps;
+};
+
+/* Head and tail are free running, the index of an entry is modulo max_wr */
+struct sv_wq {
+	void			*buf;
+	size_t			stride;
+	uint32_t		max_wr;
+	uint32_t		max_sge;
+	uint32_t		head;
+	uint32_t		tail;
+};
+
+struct sv_recv_wqe {
+	uint64_t		wr_id;
+	uint32_t		num_sge;
+	uint32_t		length;
+	struct ibv_sge		sge[];
+};
+
+enum {
+	SV_WQE_POSTED,
+	SV_WQE_WAIT,
+	SV_WQE_DONE,
+};
+
+struct sv_send_wqe {
+	uint64_t		wr_id;
+	uint32_t		opcode;
+	uint32_t		send_flags;
+	uint32_t		imm;
+	uint32_t		rkey;
+	uint64_t		raddr;
+	uint32_t		remote_qpn;
+	uint32_t		remote_qkey;
+	uint32_t		length;
+	uint32_t		done_len;
+	uint8_t			state;
+	uint8_t			status;
+	uint32_t		num_sge;
+	/* Followed by max_sge entries and then the inline data buffer */
+	struct ibv_sge		sge[];
+};
+
+struct sv_srq {
+	struct ibv_srq		ibv_srq;
+	pthread_spinlock_t	lock;
+	struct sv_wq		rq;
+	uint32_t		srq_limit;
+};
+
+struct sv_ah {
+	struct ibv_ah		ibv_ah;
+};
+
+struct sv_qp {
+	struct verbs_qp		vqp;
+	pthread_spinlock_t	lock;
+	struct list_node	entry;
+	struct list_node	send_cq_entry;
+	struct list_node	recv_cq_entry;
+	struct sv_ring		*ring;
+	size_t			ring_size;
+	/* The ring of the connected QP of an RC QP */
+	struct sv_peer		*peer;
+	struct sv_wq		sq;
+	/* Index of the next send WQE to transmit */
+	uint32_t		sq_next;
+	struct sv_wq		rq;
+	uint32_t		max_inline;
+	bool			sq_sig_all;
+	uint32_t		qkey;
+	uint32_t		dest_qpn;
+	int			access;
+	/* The receive WQE being filled by an incoming message */
+	struct sv_recv_wqe	*cur_recv;
+	bool			cur_recv_valid;
+	uint32_t		recv_off;
+	/* Progress of the RDMA READ being answered */
+	uint32_t		read_off;
+	/* Set when the application progressed the QP itself */
+	bool			polled;
+	/* State of the ibv_wr_* interface between wr_start and wr_complete */
+	struct sv_send_wqe	*wr_cur;
+	uint32_t		wr_tail;
+	int			wr_err;
+	char			shm_name[IBV_SYSFS_NAME_MAX + 16];
+};
+
+#define to_svxxx(xxx, type) container_of(ib##xxx, struct sv_##type, ibv_##xxx)
+
+static inline struct sv_context *to_svctx(struct ibv_context *ibctx)
+{
+	return container_of(ibctx, struct sv_context, ibv_ctx.context);
+}
+
+static inline struct sv_device *to_svdev(struct ibv_device *ibdev)
+{
+	return container_of(ibdev, struct sv_device, ibv_dev.device);
+}
+
+static inline struct sv_cq *to_svcq(struct ibv_cq *ibcq)
+{
+	return to_svxxx(cq, cq);
+}
+
+static inline struct sv_srq *to_svsrq(struct ibv_srq *ibsrq)
+{
+	return to_svxxx(srq, srq);
+}
+
+static inline struct sv_ah *to_svah(struct ibv_ah *ibah)
+{
+	return to_svxxx(ah, ah);
+}
+
+static inline struct sv_qp *to_svqp(struct ibv_qp *ibqp)
+{
+	return container_of(ibqp, struct sv_qp, vqp.qp);
+}
+
+static inline struct sv_qp *to_svqp_ex(struct ibv_qp_ex *ibqpx)
+{
+	return container_of(ibqpx, struct sv_qp, vqp.qp_ex);
+}
+
+static inline struct sv_mr *to_svmr(struct verbs_mr *vmr)
+{
+	return container_of(vmr, struct sv_mr, vmr);
+}
+
+#endif /* SOFTVERBS_H */
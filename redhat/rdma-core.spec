@@ -185,6 +185,7 @@ Device-specific plug-in ibverbs userspace drivers are included:
 - libqedr: QLogic QL4xxx RoCE HCA
 - librxe: A software implementation of the RoCE protocol
 - libsiw: A software implementation of the iWarp protocol
+- libsoftverbs: A userspace loopback provider for benchmarking
 - libvmw_pvrdma: VMware paravirtual RDMA device
 
 %package -n libibverbs-utils
@@ -428,6 +429,7 @@ rm -f %{buildroot}/%{_sbindir}/srp_daemon.sh
 %{_sbindir}/rdma-ndd
 %{_unitdir}/rdma-ndd.service
 %{_mandir}/man7/rxe*
+%{_mandir}/man7/softverbs*
 %{_mandir}/man8/rdma-ndd.*
 %license COPYING.*
 
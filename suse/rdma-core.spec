@@ -222,6 +222,7 @@ Device-specific plug-in ibverbs userspace drivers are included:
 - libqedr: QLogic QL4xxx RoCE HCA
 - librxe: A software implementation of the RoCE protocol
 - libsiw: A software implementation of the iWarp protocol
+- libsoftverbs: A userspace loopback provider for benchmarking
 - libvmw_pvrdma: VMware paravirtual RDMA device
 
 %package -n %verbs_lname
@@ -658,6 +659,7 @@ rm -rf %{buildroot}/%{_sbindir}/srp_daemon.sh
 %doc %{_docdir}/%{name}-%{version}/rxe.md
 %doc %{_docdir}/%{name}-%{version}/tag_matching.md
 %{_mandir}/man7/rxe*
+%{_mandir}/man7/softverbs*
 
 %files -n libibnetdisc%{ibnetdisc_major}
 %defattr(-, root, root)